@@ -0,0 +1,315 @@
+#ifndef _ADMISSION_H
+#define _ADMISSION_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include "global.h"
+#include "constants.h"
+
+/*
+	Admission control of heavy phases of sessions on the server, set with -A phase=n (0 is unlimited):
+	archive : zipping resources of GETs and syncs (default: one per core)
+	hash    : md5 of archives, built or received (default: one per core)
+	send    : archives being sent (default unlimited, see shaper.h for bandwidth)
+	extract : unzipping received archives (default: one per core)
+	Past the limit, sessions wait in a queue of the phase, by priority and then first come first served, so an
+	overloaded server runs a phase at it's best concurrency instead of thrashing disks and page cache with all
+	of them at once.
+
+	Queue lives in memory shared by every process of the server (a session's archive may be built by a child,
+	see filerail_archive_job), entries of processes which died are dropped. A queued session's heartbeats (see
+	deadline.h) carry it's position in queue, as frames whose size has QUEUED_FRAME set; receivers skip them like
+	heartbeats, and hand position to the queued callback of the session receiving them (see filerail_io_queued).
+*/
+
+enum ADMISSION_PHASE {
+	ADMIT_ARCHIVE,
+	ADMIT_HASH,
+	ADMIT_SEND,
+	ADMIT_EXTRACT,
+	ADMIT_PHASES
+};
+
+// a session waiting for, or running, a phase (slot is free unless used)
+typedef struct _filerail_admission_entry {
+	bool used;
+	bool admitted;
+	int phase;
+	int priority; // higher is admitted first
+	uint64_t seq; // order of arrival
+	pid_t pid; // process holding entry, entry is dropped if it dies
+	pid_t owner; // process owning session's connection, and session's id in it
+	unsigned int sid;
+} filerail_admission_entry;
+
+// state shared by every process of the server
+typedef struct _filerail_admission {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int limits[ADMIT_PHASES];
+	uint64_t seq;
+	filerail_admission_entry entries[ADMISSION_MAX_ENTRIES];
+} filerail_admission;
+
+// entry of a session in a phase, index is -1 if it isn't tracked
+typedef struct _filerail_admission_ticket {
+	int index;
+} filerail_admission_ticket;
+
+// receiver's callback for positions in server's queue
+typedef void (*filerail_queued_fn)(void *arg, unsigned int position);
+
+// process wide, limits are set by main() before filerail_admission_init (0 is unlimited, -1 is one per core)
+extern int admission_limits[ADMIT_PHASES];
+extern filerail_admission *admission;
+
+int filerail_admission_set(const char *option);
+int filerail_admission_init(void);
+bool filerail_admission_try(filerail_admission_ticket *t, int phase, int priority, pid_t owner, unsigned int sid);
+void filerail_admission_wait(filerail_admission_ticket *t);
+void filerail_admission_release(filerail_admission_ticket *t);
+unsigned int filerail_admission_position(pid_t owner, unsigned int sid);
+
+#ifdef FILERAIL_IMPLEMENTATION
+
+int admission_limits[ADMIT_PHASES] = {-1, -1, 0, -1};
+filerail_admission *admission = NULL;
+
+// parse "phase=n" of -A, -1 if phase is unknown or n is bad
+int filerail_admission_set(const char *option) {
+	static const char *names[ADMIT_PHASES] = {"archive", "hash", "send", "extract"};
+	const char *value;
+	char *end;
+	long n;
+	int i;
+
+	if ((value = strchr(option, '=')) == NULL) {
+		return -1;
+	}
+	value++;
+	errno = 0;
+	n = strtol(value, &end, 10);
+	if (*value == '\0' || *end != '\0' || errno != 0 || n < 0 || n > ADMISSION_MAX_ENTRIES) {
+		return -1;
+	}
+	for (i = 0; i < ADMIT_PHASES; i++) {
+		if (strncmp(option, names[i], value - 1 - option) == 0 && strlen(names[i]) == (size_t)(value - 1 - option)) {
+			admission_limits[i] = (int)n;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+// lock shared state, made consistent again if it's owner died holding it
+static void filerail_admission_lock(void) {
+	if (pthread_mutex_lock(&admission->lock) == EOWNERDEAD) {
+		pthread_mutex_consistent(&admission->lock);
+	}
+}
+
+static void filerail_admission_unlock(void) {
+	pthread_mutex_unlock(&admission->lock);
+}
+
+// create shared queues (before any process serving clients is forked)
+int filerail_admission_init(void) {
+	int i;
+	long ncores;
+	pthread_mutexattr_t mattr;
+	pthread_condattr_t cattr;
+	filerail_admission *a;
+
+	a = mmap(NULL, sizeof(filerail_admission), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (a == MAP_FAILED) {
+		LOG(LOG_USER | LOG_ERR, "admission.h filerail_admission_init mmap\n");
+		return -1;
+	}
+	memset(a, 0, sizeof(filerail_admission));
+	pthread_mutexattr_init(&mattr);
+	pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&a->lock, &mattr);
+	pthread_mutexattr_destroy(&mattr);
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&a->cond, &cattr);
+	pthread_condattr_destroy(&cattr);
+
+	ncores = sysconf(_SC_NPROCESSORS_ONLN);
+	for (i = 0; i < ADMIT_PHASES; i++) {
+		a->limits[i] = admission_limits[i] == -1 ? (unsigned int)max(ncores, 2L) : (unsigned int)admission_limits[i];
+	}
+	admission = a;
+	return 0;
+}
+
+// true if entry a is ahead of entry b in queue of their phase
+static bool filerail_admission_ahead(filerail_admission_entry *a, filerail_admission_entry *b) {
+	return a->priority > b->priority || (a->priority == b->priority && a->seq < b->seq);
+}
+
+// drop entries of dead processes (locked), true if any was dropped
+static bool filerail_admission_reap(void) {
+	int i;
+	bool reaped;
+
+	reaped = false;
+	for (i = 0; i < ADMISSION_MAX_ENTRIES; i++) {
+		if (admission->entries[i].used && kill(admission->entries[i].pid, 0) == -1 && errno == ESRCH) {
+			admission->entries[i].used = false;
+			reaped = true;
+		}
+	}
+	return reaped;
+}
+
+// admit entry if it's phase has room for it, counting waiting entries ahead of it (locked)
+static bool filerail_admission_admit(int index) {
+	int i;
+	unsigned int running, ahead;
+	filerail_admission_entry *e, *o;
+
+	e = &admission->entries[index];
+	running = ahead = 0;
+	for (i = 0; i < ADMISSION_MAX_ENTRIES; i++) {
+		o = &admission->entries[i];
+		if (i == index || !o->used || o->phase != e->phase) {
+			continue;
+		}
+		if (o->admitted) {
+			running++;
+		} else if (filerail_admission_ahead(o, e)) {
+			ahead++;
+		}
+	}
+	if (running + ahead < admission->limits[e->phase]) {
+		e->admitted = true;
+	}
+	return e->admitted;
+}
+
+/*
+	Enter queue of phase, true if session was admitted right away. Otherwise it must wait for it's turn with
+	filerail_admission_wait (while it's peer gets heartbeats with it's position). Untracked (always admitted)
+	without admission control, if phase is unlimited, or if queue is full.
+*/
+bool filerail_admission_try(filerail_admission_ticket *t, int phase, int priority, pid_t owner, unsigned int sid) {
+	int i;
+	filerail_admission_entry *e;
+
+	t->index = -1;
+	if (admission == NULL || admission->limits[phase] == 0) {
+		return true;
+	}
+	filerail_admission_lock();
+	for (i = 0; i < ADMISSION_MAX_ENTRIES && admission->entries[i].used; i++) {
+		;
+	}
+	if (i == ADMISSION_MAX_ENTRIES) {
+		filerail_admission_unlock();
+		LOG(LOG_USER | LOG_ERR, "admission.h filerail_admission_try queue is full\n");
+		return true;
+	}
+	e = &admission->entries[i];
+	e->used = true;
+	e->admitted = false;
+	e->phase = phase;
+	e->priority = priority;
+	e->seq = admission->seq++;
+	e->pid = getpid();
+	e->owner = owner;
+	e->sid = sid;
+	t->index = i;
+	filerail_admission_admit(i);
+	filerail_admission_unlock();
+	return e->admitted;
+}
+
+/*
+	Wait until entry of ticket is admitted. A process which died holding a slot never releases it, so dead entries
+	are looked for every ADMISSION_POLL_INTERVAL seconds, by an absolute deadline: wakeups for releases elsewhere
+	in the queue don't put it off.
+*/
+void filerail_admission_wait(filerail_admission_ticket *t) {
+	int ret;
+	struct timespec now, reap_at;
+
+	if (t->index == -1) {
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &reap_at);
+	reap_at.tv_sec += ADMISSION_POLL_INTERVAL;
+	filerail_admission_lock();
+	while (!filerail_admission_admit(t->index)) {
+		ret = pthread_cond_timedwait(&admission->cond, &admission->lock, &reap_at);
+		if (ret == EOWNERDEAD) {
+			pthread_mutex_consistent(&admission->lock);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (now.tv_sec > reap_at.tv_sec || (now.tv_sec == reap_at.tv_sec && now.tv_nsec >= reap_at.tv_nsec)) {
+			if (filerail_admission_reap()) {
+				pthread_cond_broadcast(&admission->cond);
+			}
+			reap_at = now;
+			reap_at.tv_sec += ADMISSION_POLL_INTERVAL;
+		}
+	}
+	filerail_admission_unlock();
+}
+
+// leave phase (or it's queue), next sessions in queue are woken up
+void filerail_admission_release(filerail_admission_ticket *t) {
+	if (t->index == -1) {
+		return;
+	}
+	filerail_admission_lock();
+	admission->entries[t->index].used = false;
+	pthread_cond_broadcast(&admission->cond);
+	filerail_admission_unlock();
+	t->index = -1;
+}
+
+// position (from 1) of session in queue of a phase, 0 if it isn't waiting
+unsigned int filerail_admission_position(pid_t owner, unsigned int sid) {
+	int i, j;
+	unsigned int position;
+	filerail_admission_entry *e, *o;
+
+	if (admission == NULL) {
+		return 0;
+	}
+	position = 0;
+	filerail_admission_lock();
+	for (i = 0; i < ADMISSION_MAX_ENTRIES && position == 0; i++) {
+		e = &admission->entries[i];
+		if (!e->used || e->admitted || e->owner != owner || e->sid != sid) {
+			continue;
+		}
+		position = 1;
+		for (j = 0; j < ADMISSION_MAX_ENTRIES; j++) {
+			o = &admission->entries[j];
+			if (j != i && o->used && !o->admitted && o->phase == e->phase && filerail_admission_ahead(o, e)) {
+				position++;
+			}
+		}
+	}
+	filerail_admission_unlock();
+	return position;
+}
+
+#endif /* FILERAIL_IMPLEMENTATION */
+
+#endif
@@ -0,0 +1,382 @@
+#ifndef _ARCHIVE_CACHE_H
+#define _ARCHIVE_CACHE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <openssl/md5.h>
+
+#include "global.h"
+#include "constants.h"
+#include "crypto.h"
+#include "manifest.h"
+
+/*
+	Server side cache of prepared (zipped) resources, so repeated GETs of same resource skip zip + md5.
+	Lives in checkpoints directory and is shared by all forked servers.
+
+	Entry is a single file "<key>_<fingerprint>_<zip md5>.zip":
+	key         : md5 of resource path
+	fingerprint : md5 over path, type, size, mtime, ctime and inode of every entry of resource tree
+	zip md5     : hash advertised to receiver, so a hit goes straight to sending
+
+	Entries are immutable and published with rename, so a reader never sees a partial archive.
+	A reader hard links the entry to a private ref file before sending, so eviction (unlink) never pulls
+	the archive out from under it. LRU: hits bump mtime of the entry, eviction removes oldest first.
+
+	Misses are single flight: the session which creates "<key>.<fingerprint>.lock" (O_EXCL, holds it's pid) builds
+	the archive, concurrent GETs of the same tree wait for the lock to go and take the published entry. A lock
+	whose owner died is broken by it's waiters.
+*/
+
+// cached archive with its bookkeeping
+typedef struct _filerail_cache_entry {
+	char name[MAX_RESOURCE_LENGTH];
+	uint64_t size;
+	time_t last_used;
+} filerail_cache_entry;
+
+int filerail_cache_init(const char *ckpt_path, char *cache_path);
+int filerail_cache_fingerprint(const char *resource_path, uint8_t *fingerprint);
+bool filerail_cache_lookup(const char *cache_path, const char *resource_path, const uint8_t *fingerprint,
+	unsigned int session_id, char *ref_path, uint8_t *hash);
+int filerail_cache_insert(const char *cache_path, const char *resource_path, const uint8_t *fingerprint,
+	const char *tmp_path, const uint8_t *hash);
+void filerail_cache_tmp_path(const char *cache_path, const char *resource_path, unsigned int session_id, char *tmp_path);
+void filerail_cache_ref_path(const char *cache_path, const char *resource_path, unsigned int session_id, char *ref_path);
+int filerail_cache_evict(const char *cache_path, uint64_t budget);
+bool filerail_cache_lock(const char *cache_path, const char *resource_path, const uint8_t *fingerprint, char *lock_path);
+void filerail_cache_wait(const char *lock_path);
+void filerail_cache_unlock(const char *lock_path);
+
+#ifdef FILERAIL_IMPLEMENTATION
+
+// create the cache inside checkpoints directory (if it doesn't exist)
+int filerail_cache_init(const char *ckpt_path, char *cache_path) {
+	snprintf(cache_path, MAX_PATH_LENGTH, "%s/%s", ckpt_path, ARCHIVE_CACHE_DIR);
+	if (mkdir(cache_path, 0777) == -1 && errno != EEXIST) {
+		LOG(LOG_USER | LOG_ERR, "archive_cache.h filerail_cache_init mkdir\n");
+		return -1;
+	}
+	return 0;
+}
+
+// key of resource is md5 of it's path
+static void filerail_cache_key(const char *resource_path, char *key) {
+	uint8_t hash[MD5_HASH_LENGTH];
+
+	MD5((const uint8_t*)resource_path, strlen(resource_path), hash);
+	filerail_hash_to_str(hash, key);
+}
+
+// entries are walked in parallel (see walk.h), in no particular order, so their digests are summed
+typedef struct _filerail_cache_fingerprinter {
+	uint64_t sum[2]; // updated atomically
+	uint64_t count;
+} filerail_cache_fingerprinter;
+
+// add digest of path and attributes of an entry
+static void filerail_cache_fingerprint_entry(filerail_cache_fingerprinter *f, const char *path, struct stat *s) {
+	MD5_CTX ctx;
+	uint64_t attrs[5], digest[2];
+
+	// ctime catches changes which preserve mtime (touch -r, rsync -t)
+	attrs[0] = s->st_mode;
+	attrs[1] = s->st_size;
+	attrs[2] = filerail_mtime_ns(s);
+	attrs[3] = (uint64_t)s->st_ctim.tv_sec * 1000000000ULL + s->st_ctim.tv_nsec;
+	attrs[4] = s->st_ino;
+	MD5_Init(&ctx);
+	MD5_Update(&ctx, path, strlen(path) + 1);
+	MD5_Update(&ctx, attrs, sizeof(attrs));
+	MD5_Final((uint8_t*)digest, &ctx);
+	__atomic_fetch_add(&f->sum[0], digest[0], __ATOMIC_RELAXED);
+	__atomic_fetch_add(&f->sum[1], digest[1], __ATOMIC_RELAXED);
+	__atomic_fetch_add(&f->count, 1, __ATOMIC_RELAXED);
+}
+
+static int filerail_cache_fingerprint_visit(filerail_walk_entry *entry, void *arg) {
+	filerail_cache_fingerprint_entry(arg, entry->path, entry->stat);
+	return 0;
+}
+
+// fingerprint of resource tree (one lstat per entry, no file is read)
+int filerail_cache_fingerprint(const char *resource_path, uint8_t *fingerprint) {
+	struct stat s;
+	filerail_cache_fingerprinter f;
+
+	memset(&f, 0, sizeof(f));
+	if (lstat(resource_path, &s) == -1) {
+		LOG(LOG_USER | LOG_ERR, "archive_cache.h filerail_cache_fingerprint lstat\n");
+		return -1;
+	}
+	filerail_cache_fingerprint_entry(&f, resource_path, &s);
+	if (
+		S_ISDIR(s.st_mode) &&
+		filerail_walk(resource_path, WALK_STAT, WALK_THREADS, filerail_cache_fingerprint_visit, NULL, &f) == -1
+	) {
+		LOG(LOG_USER | LOG_ERR, "archive_cache.h filerail_cache_fingerprint\n");
+		return -1;
+	}
+	MD5((const uint8_t*)&f, sizeof(f), fingerprint);
+	return 0;
+}
+
+// convert hex string of md5 back to bytes
+static bool filerail_cache_parse_hash(const char *hex_str, uint8_t *hash) {
+	int i;
+	unsigned int byte;
+
+	for (i = 0; i < MD5_HASH_LENGTH; i++) {
+		if (sscanf(hex_str + 2 * i, "%2x", &byte) != 1) {
+			return false;
+		}
+		hash[i] = byte;
+	}
+	return true;
+}
+
+/*
+	If an archive of resource with same fingerprint is cached, link it to ref_path (caller unlinks it after sending)
+	and return it's md5 in hash.
+*/
+bool filerail_cache_lookup(const char *cache_path, const char *resource_path, const uint8_t *fingerprint,
+	unsigned int session_id, char *ref_path, uint8_t *hash)
+{
+	DIR *dir;
+	struct dirent *de;
+	bool hit;
+	char key[MD5_HASH_STR_LENGTH], fp_str[MD5_HASH_STR_LENGTH], prefix[2 * MD5_HASH_STR_LENGTH + 1];
+	char entry_path[MAX_PATH_LENGTH];
+	size_t prefix_len;
+
+	hit = false;
+	filerail_cache_key(resource_path, key);
+	filerail_hash_to_str(fingerprint, fp_str);
+	prefix_len = snprintf(prefix, sizeof(prefix), "%s_%s_", key, fp_str);
+
+	if ((dir = opendir(cache_path)) == NULL) {
+		LOG(LOG_USER | LOG_ERR, "archive_cache.h filerail_cache_lookup opendir\n");
+		return false;
+	}
+	while ((de = readdir(dir)) != NULL) {
+		if (
+			strncmp(de->d_name, prefix, prefix_len) != 0 ||
+			strlen(de->d_name) != prefix_len + 2 * MD5_HASH_LENGTH + strlen(".zip") ||
+			!filerail_cache_parse_hash(de->d_name + prefix_len, hash)
+		) {
+			continue;
+		}
+		snprintf(entry_path, sizeof(entry_path), "%s/%s", cache_path, de->d_name);
+		filerail_cache_ref_path(cache_path, resource_path, session_id, ref_path);
+		unlink(ref_path);
+		// entry may have been evicted since readdir, which is just a miss
+		if (link(entry_path, ref_path) == 0) {
+			utimensat(AT_FDCWD, entry_path, NULL, 0);
+			hit = true;
+		}
+		break;
+	}
+	closedir(dir);
+	return hit;
+}
+
+// where a miss builds the archive (private to the session)
+void filerail_cache_tmp_path(const char *cache_path, const char *resource_path, unsigned int session_id, char *tmp_path) {
+	char key[MD5_HASH_STR_LENGTH];
+
+	filerail_cache_key(resource_path, key);
+	snprintf(tmp_path, MAX_PATH_LENGTH, "%s/%s.%d.%u.tmp", cache_path, key, (int)getpid(), session_id);
+}
+
+// private link to an archive being sent
+void filerail_cache_ref_path(const char *cache_path, const char *resource_path, unsigned int session_id, char *ref_path) {
+	char key[MD5_HASH_STR_LENGTH];
+
+	filerail_cache_key(resource_path, key);
+	snprintf(ref_path, MAX_PATH_LENGTH, "%s/%s.%d.%u.ref", cache_path, key, (int)getpid(), session_id);
+}
+
+// publish archive built at tmp_path, older versions of same resource are dropped
+int filerail_cache_insert(const char *cache_path, const char *resource_path, const uint8_t *fingerprint,
+	const char *tmp_path, const uint8_t *hash)
+{
+	DIR *dir;
+	struct dirent *de;
+	char key[MD5_HASH_STR_LENGTH], fp_str[MD5_HASH_STR_LENGTH], hash_str[MD5_HASH_STR_LENGTH];
+	char entry_path[MAX_PATH_LENGTH], name[MAX_RESOURCE_LENGTH];
+	size_t key_len;
+
+	filerail_cache_key(resource_path, key);
+	filerail_hash_to_str(fingerprint, fp_str);
+	filerail_hash_to_str(hash, hash_str);
+	snprintf(name, sizeof(name), "%s_%s_%s.zip", key, fp_str, hash_str);
+
+	// stale versions can never be hit again
+	key_len = strlen(key);
+	if ((dir = opendir(cache_path)) != NULL) {
+		while ((de = readdir(dir)) != NULL) {
+			if (strncmp(de->d_name, key, key_len) == 0 && de->d_name[key_len] == '_' && strcmp(de->d_name, name) != 0) {
+				snprintf(entry_path, sizeof(entry_path), "%s/%s", cache_path, de->d_name);
+				unlink(entry_path);
+			}
+		}
+		closedir(dir);
+	}
+
+	snprintf(entry_path, sizeof(entry_path), "%s/%s", cache_path, name);
+	if (rename(tmp_path, entry_path) == -1) {
+		LOG(LOG_USER | LOG_ERR, "archive_cache.h filerail_cache_insert rename\n");
+		return -1;
+	}
+	return 0;
+}
+
+// take the build of archive of resource at fingerprint, false if another session is building it (lock_path is set)
+bool filerail_cache_lock(const char *cache_path, const char *resource_path, const uint8_t *fingerprint, char *lock_path) {
+	int fd;
+	char key[MD5_HASH_STR_LENGTH], fp_str[MD5_HASH_STR_LENGTH], pid_str[16];
+
+	filerail_cache_key(resource_path, key);
+	filerail_hash_to_str(fingerprint, fp_str);
+	snprintf(lock_path, MAX_PATH_LENGTH, "%s/%s.%s.lock", cache_path, key, fp_str);
+	if ((fd = open(lock_path, O_WRONLY | O_CREAT | O_EXCL, 0644)) == -1) {
+		if (errno != EEXIST) {
+			// builds without a lock, like before single flight
+			LOG(LOG_USER | LOG_ERR, "archive_cache.h filerail_cache_lock open\n");
+			lock_path[0] = '\0';
+			return true;
+		}
+		return false;
+	}
+	snprintf(pid_str, sizeof(pid_str), "%d", (int)getpid());
+	if (write(fd, pid_str, strlen(pid_str)) == -1) {
+		LOG(LOG_USER | LOG_ERR, "archive_cache.h filerail_cache_lock write\n");
+	}
+	close(fd);
+	return true;
+}
+
+// wait until lock is gone (it's owner published archive, or gave up), breaks lock of a dead owner
+void filerail_cache_wait(const char *lock_path) {
+	int fd, pid;
+	ssize_t n;
+	char pid_str[16];
+	struct timespec ts;
+
+	ts.tv_sec = 0;
+	ts.tv_nsec = ARCHIVE_CACHE_LOCK_POLL * 1000000L;
+	while ((fd = open(lock_path, O_RDONLY)) != -1) {
+		n = read(fd, pid_str, sizeof(pid_str) - 1);
+		close(fd);
+		// owner may not have written it's pid yet
+		if (n > 0) {
+			pid_str[n] = '\0';
+			if (sscanf(pid_str, "%d", &pid) == 1 && kill(pid, 0) == -1 && errno == ESRCH) {
+				unlink(lock_path);
+				return;
+			}
+		}
+		nanosleep(&ts, NULL);
+	}
+}
+
+void filerail_cache_unlock(const char *lock_path) {
+	if (lock_path[0] != '\0') {
+		unlink(lock_path);
+	}
+}
+
+static int filerail_cache_entry_cmp(const void *a, const void *b) {
+	const filerail_cache_entry *x = a, *y = b;
+
+	return (x->last_used > y->last_used) - (x->last_used < y->last_used);
+}
+
+// ref and tmp files carry pid of their owner, remove the ones left behind by dead servers
+static void filerail_cache_reap(const char *cache_path, const char *name) {
+	const char *dot;
+	char path[MAX_PATH_LENGTH];
+	int pid;
+
+	if ((dot = strchr(name, '.')) == NULL || sscanf(dot, ".%d.", &pid) != 1) {
+		return;
+	}
+	if (kill(pid, 0) == -1 && errno == ESRCH) {
+		snprintf(path, sizeof(path), "%s/%s", cache_path, name);
+		unlink(path);
+	}
+}
+
+// remove least recently used archives until total size fits in budget
+int filerail_cache_evict(const char *cache_path, uint64_t budget) {
+	DIR *dir;
+	struct dirent *de;
+	struct stat s;
+	filerail_cache_entry *entries, *tmp;
+	size_t count, capacity, i, len;
+	uint64_t total;
+	char path[MAX_PATH_LENGTH];
+
+	if ((dir = opendir(cache_path)) == NULL) {
+		LOG(LOG_USER | LOG_ERR, "archive_cache.h filerail_cache_evict opendir\n");
+		return -1;
+	}
+	entries = NULL;
+	count = capacity = 0;
+	total = 0;
+	while ((de = readdir(dir)) != NULL) {
+		len = strlen(de->d_name);
+		if (len > 4 && (strcmp(de->d_name + len - 4, ".ref") == 0 || strcmp(de->d_name + len - 4, ".tmp") == 0)) {
+			filerail_cache_reap(cache_path, de->d_name);
+			continue;
+		}
+		if (len < 4 || strcmp(de->d_name + len - 4, ".zip") != 0 || len >= MAX_RESOURCE_LENGTH) {
+			continue;
+		}
+		snprintf(path, sizeof(path), "%s/%s", cache_path, de->d_name);
+		if (stat(path, &s) == -1) {
+			continue;
+		}
+		if (count == capacity) {
+			capacity = capacity == 0 ? 64 : 2 * capacity;
+			if ((tmp = realloc(entries, capacity * sizeof(filerail_cache_entry))) == NULL) {
+				LOG(LOG_USER | LOG_ERR, "archive_cache.h filerail_cache_evict realloc\n");
+				free(entries);
+				closedir(dir);
+				return -1;
+			}
+			entries = tmp;
+		}
+		strcpy(entries[count].name, de->d_name);
+		entries[count].size = s.st_size;
+		entries[count].last_used = s.st_mtime;
+		total += s.st_size;
+		count++;
+	}
+	closedir(dir);
+
+	qsort(entries, count, sizeof(filerail_cache_entry), filerail_cache_entry_cmp);
+	for (i = 0; i < count && total > budget; i++) {
+		snprintf(path, sizeof(path), "%s/%s", cache_path, entries[i].name);
+		// another server may be evicting too
+		if (unlink(path) == 0 || errno == ENOENT) {
+			total -= entries[i].size;
+		}
+	}
+	free(entries);
+	return 0;
+}
+
+#endif /* FILERAIL_IMPLEMENTATION */
+
+#endif
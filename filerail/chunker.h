@@ -0,0 +1,285 @@
+#ifndef _CHUNKER_H
+#define _CHUNKER_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <openssl/md5.h>
+
+#include "global.h"
+#include "constants.h"
+
+/*
+	Content defined chunking (FastCDC).
+	A rolling gear hash is computed over the stream, and chunk ends where top bits of the hash are zero.
+	Since boundaries depend only on content, an insertion or deletion moves boundaries only around the edit,
+	rest of the chunks (and their fingerprints) stay same across versions of a resource.
+
+	Normalized chunking: a stricter mask is used before CDC_AVG_CHUNK_SIZE and a looser one after it,
+	which keeps chunk sizes close to average. Nothing before CDC_MIN_CHUNK_SIZE is hashed (cut-point skipping).
+*/
+
+// chunk of a stream, fingerprint is md5 of chunk content
+typedef struct _filerail_chunk {
+	uint64_t offset;
+	uint64_t length;
+	uint8_t hash[MD5_HASH_LENGTH];
+} filerail_chunk;
+
+// growable list of chunks
+typedef struct _filerail_chunk_list {
+	filerail_chunk *chunks;
+	size_t count;
+	size_t capacity;
+} filerail_chunk_list;
+
+// open addressing set of fingerprints (used to dedup chunks within a stream)
+typedef struct _filerail_chunk_set {
+	uint8_t (*slots)[MD5_HASH_LENGTH];
+	bool *used;
+	size_t count;
+	size_t size;
+} filerail_chunk_set;
+
+void filerail_gear_init(void);
+size_t filerail_cdc_cut(const uint8_t *buf, size_t len);
+void filerail_chunk_list_init(filerail_chunk_list *list);
+void filerail_chunk_list_free(filerail_chunk_list *list);
+filerail_chunk *filerail_chunk_list_add(filerail_chunk_list *list);
+int filerail_chunk_buffer(const uint8_t *buf, size_t len, filerail_chunk_list *list);
+int filerail_chunk_file(const char *filename, filerail_chunk_list *list);
+void filerail_chunk_set_init(filerail_chunk_set *set);
+void filerail_chunk_set_free(filerail_chunk_set *set);
+bool filerail_chunk_set_contains(filerail_chunk_set *set, const uint8_t *hash);
+int filerail_chunk_set_insert(filerail_chunk_set *set, const uint8_t *hash);
+
+#ifdef FILERAIL_IMPLEMENTATION
+
+// random value for every byte, generated with splitmix64 from a fixed seed (so that every host cuts same way)
+static uint64_t filerail_gear[256];
+static pthread_once_t filerail_gear_once = PTHREAD_ONCE_INIT;
+
+static void filerail_gear_fill(void) {
+	int i;
+	uint64_t seed, z;
+
+	seed = CDC_GEAR_SEED;
+	for (i = 0; i < 256; i++) {
+		seed += 0x9e3779b97f4a7c15ULL;
+		z = seed;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		filerail_gear[i] = z ^ (z >> 31);
+	}
+}
+
+// fill gear table once, whichever session chunks first
+void filerail_gear_init(void) {
+	pthread_once(&filerail_gear_once, filerail_gear_fill);
+}
+
+// returns length of the chunk starting at buf
+size_t filerail_cdc_cut(const uint8_t *buf, size_t len) {
+	size_t i, normal;
+	uint64_t h;
+
+	if (len <= CDC_MIN_CHUNK_SIZE) {
+		return len;
+	}
+	if (len > CDC_MAX_CHUNK_SIZE) {
+		len = CDC_MAX_CHUNK_SIZE;
+	}
+	normal = min(len, CDC_AVG_CHUNK_SIZE);
+
+	h = 0;
+	for (i = CDC_MIN_CHUNK_SIZE; i < normal; i++) {
+		h = (h << 1) + filerail_gear[buf[i]];
+		if (!(h & CDC_MASK_S)) {
+			return i + 1;
+		}
+	}
+	for (; i < len; i++) {
+		h = (h << 1) + filerail_gear[buf[i]];
+		if (!(h & CDC_MASK_L)) {
+			return i + 1;
+		}
+	}
+	return len;
+}
+
+void filerail_chunk_list_init(filerail_chunk_list *list) {
+	memset(list, 0, sizeof(filerail_chunk_list));
+}
+
+void filerail_chunk_list_free(filerail_chunk_list *list) {
+	free(list->chunks);
+	filerail_chunk_list_init(list);
+}
+
+// append a zeroed chunk
+filerail_chunk *filerail_chunk_list_add(filerail_chunk_list *list) {
+	size_t capacity;
+	filerail_chunk *chunks;
+
+	if (list->count == list->capacity) {
+		capacity = list->capacity == 0 ? CHUNK_LIST_INITIAL_CAPACITY : 2 * list->capacity;
+		chunks = realloc(list->chunks, capacity * sizeof(filerail_chunk));
+		if (chunks == NULL) {
+			LOG(LOG_USER | LOG_ERR, "chunker.h filerail_chunk_list_add realloc\n");
+			return NULL;
+		}
+		list->chunks = chunks;
+		list->capacity = capacity;
+	}
+	memset(&list->chunks[list->count], 0, sizeof(filerail_chunk));
+	return &list->chunks[list->count++];
+}
+
+// chunk an in-memory buffer (appends to list)
+int filerail_chunk_buffer(const uint8_t *buf, size_t len, filerail_chunk_list *list) {
+	size_t offset, cut;
+	filerail_chunk *chunk;
+
+	filerail_gear_init();
+	offset = 0;
+	while (offset < len) {
+		cut = filerail_cdc_cut(buf + offset, len - offset);
+		if ((chunk = filerail_chunk_list_add(list)) == NULL) {
+			return -1;
+		}
+		chunk->offset = offset;
+		chunk->length = cut;
+		MD5(buf + offset, cut, chunk->hash);
+		offset += cut;
+	}
+	return 0;
+}
+
+// chunk a file, reading CDC_MAX_CHUNK_SIZE window at a time
+int filerail_chunk_file(const char *filename, filerail_chunk_list *list) {
+	int exit_status;
+	size_t fill, nbytes, cut;
+	uint64_t offset;
+	uint8_t *buf;
+	FILE *fp;
+	filerail_chunk *chunk;
+
+	exit_status = 0;
+	filerail_gear_init();
+	buf = malloc(CDC_MAX_CHUNK_SIZE);
+	if (buf == NULL) {
+		LOG(LOG_USER | LOG_ERR, "chunker.h filerail_chunk_file malloc\n");
+		return -1;
+	}
+	if ((fp = fopen(filename, "rb")) == NULL) {
+		LOG(LOG_USER | LOG_ERR, "chunker.h filerail_chunk_file fopen\n");
+		exit_status = -1;
+		goto clean_up;
+	}
+
+	fill = 0;
+	offset = 0;
+	while (true) {
+		// top up the window
+		nbytes = fread(buf + fill, 1, CDC_MAX_CHUNK_SIZE - fill, fp);
+		if (nbytes == 0 && ferror(fp)) {
+			LOG(LOG_USER | LOG_ERR, "chunker.h filerail_chunk_file fread\n");
+			exit_status = -1;
+			goto clean_up;
+		}
+		fill += nbytes;
+		if (fill == 0) {
+			break;
+		}
+
+		cut = filerail_cdc_cut(buf, fill);
+		if ((chunk = filerail_chunk_list_add(list)) == NULL) {
+			exit_status = -1;
+			goto clean_up;
+		}
+		chunk->offset = offset;
+		chunk->length = cut;
+		MD5(buf, cut, chunk->hash);
+
+		// keep the rest of the window for next chunk
+		memmove(buf, buf + cut, fill - cut);
+		fill -= cut;
+		offset += cut;
+	}
+
+	clean_up:
+	if (fp != NULL) {
+		fclose(fp);
+	}
+	free(buf);
+	return exit_status;
+}
+
+void filerail_chunk_set_init(filerail_chunk_set *set) {
+	memset(set, 0, sizeof(filerail_chunk_set));
+}
+
+void filerail_chunk_set_free(filerail_chunk_set *set) {
+	free(set->slots);
+	free(set->used);
+	filerail_chunk_set_init(set);
+}
+
+// md5 is already uniformly distributed, so first 8 bytes are used as hash
+static size_t filerail_chunk_set_slot(filerail_chunk_set *set, const uint8_t *hash) {
+	size_t slot;
+	uint64_t h;
+
+	memcpy(&h, hash, sizeof(h));
+	slot = h & (set->size - 1);
+	while (set->used[slot] && memcmp(set->slots[slot], hash, MD5_HASH_LENGTH) != 0) {
+		slot = (slot + 1) & (set->size - 1);
+	}
+	return slot;
+}
+
+bool filerail_chunk_set_contains(filerail_chunk_set *set, const uint8_t *hash) {
+	return set->size != 0 && set->used[filerail_chunk_set_slot(set, hash)];
+}
+
+int filerail_chunk_set_insert(filerail_chunk_set *set, const uint8_t *hash) {
+	size_t i, slot;
+	filerail_chunk_set old;
+
+	// keep load factor below 0.5
+	if (2 * (set->count + 1) > set->size) {
+		old = *set;
+		set->size = old.size == 0 ? CHUNK_LIST_INITIAL_CAPACITY : 2 * old.size;
+		set->count = 0;
+		set->slots = malloc(set->size * MD5_HASH_LENGTH);
+		set->used = calloc(set->size, sizeof(bool));
+		if (set->slots == NULL || set->used == NULL) {
+			LOG(LOG_USER | LOG_ERR, "chunker.h filerail_chunk_set_insert malloc\n");
+			free(set->slots);
+			free(set->used);
+			*set = old;
+			return -1;
+		}
+		for (i = 0; i < old.size; i++) {
+			if (old.used[i]) {
+				filerail_chunk_set_insert(set, old.slots[i]);
+			}
+		}
+		filerail_chunk_set_free(&old);
+	}
+
+	slot = filerail_chunk_set_slot(set, hash);
+	if (!set->used[slot]) {
+		memcpy(set->slots[slot], hash, MD5_HASH_LENGTH);
+		set->used[slot] = true;
+		set->count++;
+	}
+	return 0;
+}
+
+#endif /* FILERAIL_IMPLEMENTATION */
+
+#endif
@@ -0,0 +1,272 @@
+#ifndef _CHUNKSTORE_H
+#define _CHUNKSTORE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include "global.h"
+#include "constants.h"
+#include "crypto.h"
+#include "utils.h"
+
+/*
+	Content addressed chunk store, lives in checkpoints directory and is shared by all transfers.
+	Chunk with md5 "ab12..." is stored at <store>/ab/ab12..., so no directory grows too large.
+	Chunks are written to a tmp file and renamed, so concurrent receivers never see a partial chunk.
+
+	Store is kept within a size budget (-S on server). Lookups bump mtime of chunks they find, and once total size
+	is over budget least recently used chunks are removed first. Chunks used in the last CHUNK_STORE_GRACE seconds
+	are never removed, a receiver which found them may not have rebuilt it's archive yet.
+*/
+
+// chunk with it's bookkeeping, name is "<shard>/<md5>"
+typedef struct _filerail_chunkstore_entry {
+	char name[MD5_HASH_STR_LENGTH + 3];
+	uint64_t size;
+	time_t last_used;
+} filerail_chunkstore_entry;
+
+// process wide, set by main() (0 is unlimited)
+extern uint64_t chunkstore_budget;
+
+int filerail_chunkstore_init(const char *ckpt_path, char *store_path);
+void filerail_chunkstore_path(const char *store_path, const uint8_t *hash, char *chunk_path);
+bool filerail_chunkstore_has(const char *store_path, const uint8_t *hash);
+int filerail_chunkstore_put(const char *store_path, const uint8_t *hash, const uint8_t *data, size_t len,
+	unsigned int session_id);
+int filerail_chunkstore_get(const char *store_path, const uint8_t *hash, uint8_t *data, size_t len);
+int filerail_chunkstore_evict(const char *store_path, uint64_t budget);
+
+#ifdef FILERAIL_IMPLEMENTATION
+
+uint64_t chunkstore_budget = (uint64_t)CHUNK_STORE_BUDGET << 20;
+
+// create the store inside checkpoints directory (if it doesn't exist), -1 if it's path leaves no room for chunks
+int filerail_chunkstore_init(const char *ckpt_path, char *store_path) {
+	if (
+		(size_t)snprintf(store_path, MAX_PATH_LENGTH, "%s/%s", ckpt_path, CHUNK_STORE_DIR) >=
+		MAX_PATH_LENGTH - CHUNK_STORE_NAME_LENGTH
+	) {
+		LOG(LOG_USER | LOG_ERR, "chunkstore.h filerail_chunkstore_init path too long\n");
+		return -1;
+	}
+	if (mkdir(store_path, 0777) == -1 && errno != EEXIST) {
+		LOG(LOG_USER | LOG_ERR, "chunkstore.h filerail_chunkstore_init mkdir\n");
+		return -1;
+	}
+	return 0;
+}
+
+void filerail_chunkstore_path(const char *store_path, const uint8_t *hash, char *chunk_path) {
+	char hex_str[MD5_HASH_STR_LENGTH];
+
+	filerail_hash_to_str(hash, hex_str);
+	// store_path fits (see filerail_chunkstore_init)
+	snprintf(chunk_path, MAX_PATH_LENGTH, "%.*s/%.2s/%.32s", MAX_PATH_LENGTH - CHUNK_STORE_NAME_LENGTH, store_path,
+		hex_str, hex_str);
+}
+
+// true if store has chunk, which is marked as used
+bool filerail_chunkstore_has(const char *store_path, const uint8_t *hash) {
+	char chunk_path[MAX_PATH_LENGTH];
+
+	filerail_chunkstore_path(store_path, hash, chunk_path);
+	return utimes(chunk_path, NULL) == 0;
+}
+
+// store a chunk (caller has already verified data matches hash)
+int filerail_chunkstore_put(const char *store_path, const uint8_t *hash, const uint8_t *data, size_t len,
+	unsigned int session_id)
+{
+	int exit_status;
+	char chunk_path[MAX_PATH_LENGTH], tmp_chunk_path[MAX_PATH_LENGTH], shard_path[MAX_PATH_LENGTH];
+	char *slash;
+	FILE *fp;
+
+	exit_status = 0;
+	fp = NULL;
+	filerail_chunkstore_path(store_path, hash, chunk_path);
+
+	// create the shard directory
+	strcpy(shard_path, chunk_path);
+	slash = strrchr(shard_path, '/');
+	*slash = '\0';
+	if (mkdir(shard_path, 0777) == -1 && errno != EEXIST) {
+		LOG(LOG_USER | LOG_ERR, "chunkstore.h filerail_chunkstore_put mkdir\n");
+		exit_status = -1;
+		goto clean_up;
+	}
+
+	// pid and session in tmp name, because concurrent sessions may receive same chunk at the same time
+	if (
+		(size_t)snprintf(tmp_chunk_path, sizeof(tmp_chunk_path), "%s.%d.%u.tmp", chunk_path, (int)getpid(),
+			session_id) >= sizeof(tmp_chunk_path) ||
+		(fp = fopen(tmp_chunk_path, "wb")) == NULL
+	) {
+		LOG(LOG_USER | LOG_ERR, "chunkstore.h filerail_chunkstore_put fopen\n");
+		exit_status = -1;
+		goto clean_up;
+	}
+	if (fwrite(data, 1, len, fp) != len) {
+		LOG(LOG_USER | LOG_ERR, "chunkstore.h filerail_chunkstore_put fwrite\n");
+		exit_status = -1;
+		goto clean_up;
+	}
+	fflush(fp);
+	fclose(fp);
+	fp = NULL;
+
+	if (rename(tmp_chunk_path, chunk_path) == -1) {
+		LOG(LOG_USER | LOG_ERR, "chunkstore.h filerail_chunkstore_put rename\n");
+		exit_status = -1;
+	}
+
+	clean_up:
+	if (fp != NULL) {
+		fclose(fp);
+		unlink(tmp_chunk_path);
+	}
+	return exit_status;
+}
+
+// read a chunk of len bytes
+int filerail_chunkstore_get(const char *store_path, const uint8_t *hash, uint8_t *data, size_t len) {
+	int exit_status;
+	char chunk_path[MAX_PATH_LENGTH];
+	FILE *fp;
+
+	exit_status = 0;
+	filerail_chunkstore_path(store_path, hash, chunk_path);
+	if ((fp = fopen(chunk_path, "rb")) == NULL) {
+		LOG(LOG_USER | LOG_ERR, "chunkstore.h filerail_chunkstore_get fopen\n");
+		return -1;
+	}
+	if (fread(data, 1, len, fp) != len) {
+		LOG(LOG_USER | LOG_ERR, "chunkstore.h filerail_chunkstore_get fread\n");
+		exit_status = -1;
+	}
+	fclose(fp);
+	return exit_status;
+}
+
+static int filerail_chunkstore_entry_cmp(const void *a, const void *b) {
+	const filerail_chunkstore_entry *x = a, *y = b;
+
+	return (x->last_used > y->last_used) - (x->last_used < y->last_used);
+}
+
+// tmp chunks carry pid of their receiver, remove the ones left behind by dead servers
+static void filerail_chunkstore_reap(const char *path) {
+	const char *dot;
+	int pid;
+
+	if ((dot = strchr(strrchr(path, '/'), '.')) == NULL || sscanf(dot, ".%d.", &pid) != 1) {
+		return;
+	}
+	if (kill(pid, 0) == -1 && errno == ESRCH) {
+		unlink(path);
+	}
+}
+
+/*
+	Remove least recently used chunks until store fits in budget (0 is unlimited). Walks the whole store, so it
+	runs at most once per CHUNK_STORE_GC_INTERVAL (mtime of "<store>/.gc" tells when it last ran, across servers).
+*/
+int filerail_chunkstore_evict(const char *store_path, uint64_t budget) {
+	int fd;
+	DIR *dir, *shard;
+	struct dirent *de, *ce;
+	struct stat st;
+	filerail_chunkstore_entry *entries, *tmp;
+	size_t count, capacity, i, len;
+	uint64_t total;
+	time_t now;
+	char path[MAX_PATH_LENGTH];
+
+	if (budget == 0) {
+		return 0;
+	}
+	now = time(NULL);
+	snprintf(path, sizeof(path), "%s/.gc", store_path);
+	if (stat(path, &st) == 0 && now - st.st_mtime < CHUNK_STORE_GC_INTERVAL) {
+		return 0;
+	}
+	if ((fd = open(path, O_WRONLY | O_CREAT, 0644)) != -1) {
+		close(fd);
+	}
+	utimes(path, NULL);
+
+	if ((dir = opendir(store_path)) == NULL) {
+		LOG(LOG_USER | LOG_ERR, "chunkstore.h filerail_chunkstore_evict opendir\n");
+		return -1;
+	}
+	entries = NULL;
+	count = capacity = 0;
+	total = 0;
+	while ((de = readdir(dir)) != NULL) {
+		if (strlen(de->d_name) != 2 || de->d_name[0] == '.') {
+			continue;
+		}
+		snprintf(path, sizeof(path), "%s/%s", store_path, de->d_name);
+		if ((shard = opendir(path)) == NULL) {
+			continue;
+		}
+		while ((ce = readdir(shard)) != NULL) {
+			len = strlen(ce->d_name);
+			snprintf(path, sizeof(path), "%s/%s/%s", store_path, de->d_name, ce->d_name);
+			if (len > 4 && strcmp(ce->d_name + len - 4, ".tmp") == 0) {
+				filerail_chunkstore_reap(path);
+				continue;
+			}
+			if (len != MD5_HASH_STR_LENGTH - 1 || stat(path, &st) == -1) {
+				continue;
+			}
+			if (count == capacity) {
+				capacity = capacity == 0 ? 1024 : 2 * capacity;
+				if ((tmp = realloc(entries, capacity * sizeof(filerail_chunkstore_entry))) == NULL) {
+					LOG(LOG_USER | LOG_ERR, "chunkstore.h filerail_chunkstore_evict realloc\n");
+					free(entries);
+					closedir(shard);
+					closedir(dir);
+					return -1;
+				}
+				entries = tmp;
+			}
+			// lengths of both were checked above
+			snprintf(entries[count].name, sizeof(entries[count].name), "%.2s/%.32s", de->d_name, ce->d_name);
+			entries[count].size = st.st_size;
+			entries[count].last_used = st.st_mtime;
+			total += st.st_size;
+			count++;
+		}
+		closedir(shard);
+	}
+	closedir(dir);
+
+	qsort(entries, count, sizeof(filerail_chunkstore_entry), filerail_chunkstore_entry_cmp);
+	for (i = 0; i < count && total > budget && now - entries[i].last_used >= CHUNK_STORE_GRACE; i++) {
+		snprintf(path, sizeof(path), "%s/%s", store_path, entries[i].name);
+		// another server may be evicting too
+		if (unlink(path) == 0 || errno == ENOENT) {
+			total -= entries[i].size;
+		}
+	}
+	free(entries);
+	return 0;
+}
+
+#endif /* FILERAIL_IMPLEMENTATION */
+
+#endif
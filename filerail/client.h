@@ -0,0 +1,1007 @@
+#ifndef _CLIENT_H
+#define _CLIENT_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+
+#include "global.h"
+#include "constants.h"
+#include "protocol.h"
+#include "socket.h"
+#include "utils.h"
+#include "crypto.h"
+#include "session.h"
+#include "operations.h"
+#include "mux.h"
+#include "probe.h"
+
+/*
+	Client library (libfilerail).
+
+	Operations: filerail_client_ping/probe/put/sync/get run one operation over a session, blocking. They never prompt
+	or print unless session is interactive (command line client), questions are answered by the session's
+	policies (on_duplicate, on_resume). Outcome is a RESPONSE: OK if operation completed, otherwise why it
+	didn't (NOT_FOUND, NO_ACCESS, BAD_RESOURCE, INSUFFICIENT_SPACE, DUPLICATE_RESOURCE_NAME if overwrite was
+	declined). They return -1 only if the connection failed or is out of step.
+
+	Asynchronous client: filerail_client_submit queues a transfer and returns right away, a pool of workers
+	runs transfers concurrently, each on a connection of it's own or on a stream of one multiplexed connection
+	(see mux.h). Finished transfers are handed back on the caller's thread by filerail_client_complete, which
+	calls their done callback. filerail_client_fd becomes readable while there are finished transfers, so the
+	client fits in the caller's event loop (poll, epoll), filerail_client_wait is for callers without one.
+	Progress callbacks are called on worker threads.
+
+	Reconnects: filerail_client_run_retry runs an operation on a connection of it's own, and if the connection
+	fails it reconnects (exponential backoff with jitter, see filerail_retry) and runs the operation again, which
+	resumes from the checkpoint left by the failed attempt. Transfers of the asynchronous client are retried the
+	same way unless they are multiplexed (a lost multiplexed connection fails all of it's streams).
+*/
+
+enum OPERATION {
+	OPERATION_PING,
+	OPERATION_PUT,
+	OPERATION_GET,
+	OPERATION_SYNC,
+	OPERATION_MIRROR,
+	OPERATION_PROBE
+};
+
+typedef struct _filerail_transfer filerail_transfer;
+
+// transfer finished, called by filerail_client_complete
+typedef void (*filerail_done_fn)(filerail_transfer *t, void *arg);
+
+// a transfer, owned by caller until it's done callback is called (paths too)
+struct _filerail_transfer {
+	int operation;
+	const char *res_path;
+	const char *des_path;
+	bool dedup; // put only chunks missing on server
+	int on_duplicate; // POLICY_ASK is POLICY_NO here, library never prompts
+	int on_resume;
+	int priority; // PRIORITY of transfer, on both ends (see priority.h)
+	filerail_progress_fn progress; // called on a worker thread, may be NULL
+	filerail_queued_fn queued; // position in server's queue (see admission.h), on a worker thread, may be NULL
+	filerail_done_fn done; // may be NULL
+	void *arg; // passed to all callbacks
+	int status; // set by library: 0, or -1 if transfer failed
+	uint8_t outcome; // set by library: see above
+	filerail_transfer *next;
+};
+
+// reconnects after connection of an operation failed, all zero is no reconnect
+typedef struct _filerail_retry {
+	unsigned int attempts; // max reconnects of an operation
+	unsigned int backoff; // ms before first reconnect, doubled for every next one
+	unsigned int max_backoff; // ms, max delay between two reconnects
+} filerail_retry;
+
+typedef struct _filerail_client_options {
+	char *ip;
+	char *port;
+	char *key_path;
+	char *ckpt_path;
+	int nworkers; // transfers running at once
+	bool multiplex; // all transfers over one connection
+	filerail_retry retry; // transfers on connections of their own only
+} filerail_client_options;
+
+typedef struct _filerail_client {
+	char ip[INET_ADDRSTRLEN];
+	char port[8];
+	char ckpt_path[MAX_PATH_LENGTH];
+	filerail_AES_keys K;
+	filerail_retry retry;
+	int nworkers;
+	pthread_t *workers;
+	int event_fd; // readable while finished transfers wait for filerail_client_complete
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	filerail_transfer *queue; // submitted
+	filerail_transfer *queue_tail;
+	filerail_transfer *finished;
+	filerail_transfer *finished_tail;
+	unsigned int pending; // submitted, not completed yet
+	bool stopping;
+	filerail_mux *mux; // NULL unless multiplexed
+	int mux_fd;
+	pthread_t pump;
+} filerail_client;
+
+int filerail_client_operation(const char *name);
+int filerail_client_ping(filerail_session *s, uint8_t *outcome);
+int filerail_client_probe(filerail_session *s, uint64_t duration, filerail_probe *p, uint8_t *outcome);
+int filerail_client_put(filerail_session *s, const char *res_path, const char *des_path, bool dedup, uint8_t *outcome);
+int filerail_client_put_archive(filerail_session *s, filerail_put_archive *archive, uint8_t *outcome);
+int filerail_client_sync(filerail_session *s, const char *res_path, const char *des_path, bool mirror,
+	uint8_t *outcome);
+int filerail_client_get(filerail_session *s, const char *res_path, const char *des_path, uint8_t *outcome);
+int filerail_client_run(filerail_session *s, int operation, const char *res_path, const char *des_path, bool dedup,
+	uint8_t *outcome);
+void filerail_retry_init(filerail_retry *r);
+void filerail_client_autotune(char *ip, char *port, filerail_AES_keys *K, const char *ckpt_path);
+bool filerail_client_backoff(filerail_session *s, filerail_retry *r, unsigned int attempt);
+int filerail_client_run_retry(filerail_session *s, char *ip, char *port, filerail_retry *r, int operation,
+	const char *res_path, const char *des_path, bool dedup, uint8_t *outcome);
+int filerail_client_init(filerail_client *c, filerail_client_options *o);
+int filerail_client_submit(filerail_client *c, filerail_transfer *t);
+int filerail_client_fd(filerail_client *c);
+int filerail_client_complete(filerail_client *c);
+int filerail_client_wait(filerail_client *c);
+void filerail_client_destroy(filerail_client *c);
+
+#ifdef FILERAIL_IMPLEMENTATION
+
+// OPERATION of it's name, -1 if unknown
+int filerail_client_operation(const char *name) {
+	if (strcmp(name, "ping") == 0) {
+		return OPERATION_PING;
+	} else if (strcmp(name, "put") == 0) {
+		return OPERATION_PUT;
+	} else if (strcmp(name, "get") == 0) {
+		return OPERATION_GET;
+	} else if (strcmp(name, "sync") == 0) {
+		return OPERATION_SYNC;
+	} else if (strcmp(name, "mirror") == 0) {
+		return OPERATION_MIRROR;
+	} else if (strcmp(name, "probe") == 0) {
+		return OPERATION_PROBE;
+	}
+	return -1;
+}
+
+int filerail_client_ping(filerail_session *s, uint8_t *outcome) {
+	/*
+		Client: sends PING command
+		Server: sends PONG as response, if nothing went wrong at server end
+	*/
+	filerail_response_header response;
+
+	*outcome = OK;
+	if (filerail_send_command_header(s->fd, PING) == -1) {
+		return -1;
+	}
+	if (filerail_recv_response_header(s->fd, &response) == -1) {
+		return -1;
+	}
+	if (response.response_type == PONG) {
+		SESSION_SAY(s, printf("PONG\n"));
+	} else {
+		SESSION_SAY(s, printf("PROTOCOL NOT FOLLOWED\n"));
+		*outcome = response.response_type;
+	}
+	return 0;
+}
+
+int filerail_client_probe(filerail_session *s, uint64_t duration, filerail_probe *p, uint8_t *outcome) {
+	/*
+		Client: sends PROBE command and length of a burst (ms)
+		Server: sends OK, then answers round trips and bursts of client (see probe.h)
+	*/
+	filerail_response_header response;
+
+	*outcome = OK;
+	if (
+		filerail_send_command_header(s->fd, PROBE) == -1 ||
+		filerail_send_file_offset(s->fd, duration) == -1 ||
+		filerail_recv_response_header(s->fd, &response) == -1
+	) {
+		return -1;
+	}
+	if (response.response_type != OK) {
+		SESSION_SAY(s, printf("PROTOCOL NOT FOLLOWED\n"));
+		*outcome = response.response_type;
+		return 0;
+	}
+	if (filerail_probe_run(s, duration, p) == -1) {
+		return -1;
+	}
+	SESSION_SAY(s, filerail_probe_print(p));
+	return 0;
+}
+
+// tell user why server refused a pipelined PUT
+static void filerail_client_say_put(filerail_session *s, const char *resource_name, const char *des_path,
+	uint8_t outcome)
+{
+	if (outcome == NO_ACCESS) {
+		SESSION_SAY(s, printf("You don't have write permission for %s on server\n", des_path));
+	} else if (outcome == DUPLICATE_RESOURCE_NAME) {
+		SESSION_SAY(s, printf("%s already exists at %s\n", resource_name, des_path));
+	} else if (outcome == NOT_FOUND) {
+		SESSION_SAY(s, printf("Unable to locate %s\n", des_path));
+	} else if (outcome == INSUFFICIENT_SPACE) {
+		SESSION_SAY(s, printf("Insufficient space on server\n"));
+	} else if (outcome == BAD_RESOURCE) {
+		SESSION_SAY(s, printf("Path of %s at %s is too long for server\n", resource_name, des_path));
+	} else if (outcome != OK) {
+		SESSION_SAY(s, printf("PROTOCOL NOT FOLLOWED\n"));
+	}
+}
+
+int filerail_client_put(filerail_session *s, const char *res_path, const char *des_path, bool dedup, uint8_t *outcome) {
+	/*
+		Client wants to upload resource on server.
+		Client checks:
+		1. If resource exists on client side, only then it can upload
+		2. If it has read access to that resource
+		3. The resource is file or directory
+		4. If all checks passed, send PIPELINED_PUT request: archive is prepared first, and resource, policies and
+		   archive's hash go in one request, answered once (see filerail_pipelined_put_handler). Same checks as
+		   below are made by server, data starts in the next round trip.
+
+		With -D (dedup), DEDUP_PUT is sent (only chunks missing on server are sent), step by step:
+		If no error occurs while transmitting DEDUP_PUT, server will be ready for listening messages from client.
+		Client sends resource name (name of file/dir), destination directory on server side and size of resource
+		Server performs checks and sends:
+		1. NO_ACCESS: Server doesn't have write permission at destination directory
+		2. DUPLICATE_RESOURCE_NAME: There already exists a resource with same resource name in destination directory
+			 Client can send YES (remove previous resource)/NO(abort the process) option (session's on_duplicate)
+		3. NOT_FOUND: Destination directory not found on server side.
+		4. INSUFFICIENT_SPACE: self-explanatory
+
+		If server responds with OK or client responds with OVERWRITE for DUPLICATE_RESOURCE_NAME prompt
+		uploading starts.
+	*/
+	int fd, exit_status;
+	char resource_name[MAX_RESOURCE_LENGTH], resource_dir[MAX_PATH_LENGTH], question[2 * MAX_PATH_LENGTH];
+	struct stat stat_path;
+	filerail_response_header response;
+
+	fd = s->fd;
+	exit_status = 0;
+	*outcome = OK;
+
+	// check if resource exists
+	if (filerail_is_exists(res_path, &stat_path)) {
+		// check if resource is readable
+		if (filerail_is_readable(res_path)) {
+			// check if resource is file or directory
+			if (filerail_is_file(&stat_path) || filerail_is_dir(&stat_path)) {
+				if (!dedup) {
+					if (filerail_parse_resource_path(res_path, resource_name, resource_dir)) {
+						SESSION_SAY(s, printf("Starting transfer process...\n"));
+						if (
+							filerail_pipelined_put_handler(s, resource_dir, resource_name, &stat_path, des_path, NULL,
+								outcome) == -1
+						) {
+							exit_status = -1;
+							goto clean_up;
+						}
+						filerail_client_say_put(s, resource_name, des_path, *outcome);
+					} else {
+						*outcome = BAD_RESOURCE;
+					}
+					SESSION_SAY(s, printf("Done\n"));
+					goto clean_up;
+				}
+				// send the command
+				if (filerail_send_command_header(fd, DEDUP_PUT) == -1) {
+					exit_status = -1;
+					goto clean_up;
+				}
+				// parse resource path
+				if (filerail_parse_resource_path(res_path, resource_name, resource_dir)) {
+					// send resource name, destination dir (on server) and resource size (unzipped)
+					if (
+						filerail_send_resource_header(fd, resource_name, (char*)des_path, stat_path.st_size,
+							s->priority) == -1
+					) {
+						exit_status = -1;
+						goto clean_up;
+					}
+					// server performs checks, and sends response
+					if (filerail_recv_response_header(fd, &response) == -1) {
+						exit_status = -1;
+						goto clean_up;
+					}
+					*outcome = response.response_type;
+					if (response.response_type == NO_ACCESS) {
+						SESSION_SAY(s, printf("You don't have write permission for %s on server\n", des_path));
+						goto clean_up;
+					} else if (response.response_type == DUPLICATE_RESOURCE_NAME) {
+						// if the resource with same name exists
+						// check if user wants to overwrite
+						snprintf(question, sizeof(question), "%s already exists at %s, do you wish to re-write[Y/N]: ",
+							resource_name, des_path);
+						if (filerail_session_confirm(s, s->on_duplicate, question)) {
+							if (filerail_send_response_header(fd, OVERWRITE) == -1) {
+								exit_status = -1;
+								goto clean_up;
+							}
+							// if overwrite is ok, start the sending process
+							put_file:
+							*outcome = OK;
+							SESSION_SAY(s, printf("Starting transfer process...\n"));
+							if (filerail_dedup_sendfile_handler(s, resource_dir, resource_name, &stat_path) == -1) {
+								exit_status = -1;
+							}
+						} else {
+							// if sender doesn't want to overwrite, ABORT the process
+							if (filerail_send_response_header(fd, ABORT) == -1) {
+								exit_status = -1;
+							}
+						}
+					} else if (response.response_type == NOT_FOUND) {
+						SESSION_SAY(s, printf("Unable to locate %s\n", des_path));
+					} else if (response.response_type == INSUFFICIENT_SPACE) {
+						SESSION_SAY(s, printf("Insufficient space on server\n"));
+					} else if (response.response_type == OK) {
+						goto put_file;
+					} else {
+						SESSION_SAY(s, printf("PROTOCOL NOT FOLLOWED\n"));
+					}
+				} else {
+					*outcome = BAD_RESOURCE;
+				}
+				SESSION_SAY(s, printf("Done\n"));
+			} else {
+				*outcome = BAD_RESOURCE;
+				SESSION_SAY(s, printf("%s is neither file or directory\n", res_path));
+			}
+		} else {
+			*outcome = NO_ACCESS;
+			SESSION_SAY(s, printf("You don't have read permission for %s\n", res_path));
+		}
+	} else {
+		*outcome = NOT_FOUND;
+		SESSION_SAY(s, printf("%s doesn't exists\n", res_path));
+	}
+
+	clean_up:
+	return exit_status;
+}
+
+/*
+	PUT of an archive prepared by filerail_prepare_put (batch prepares next PUT while one before it transfers),
+	archive is kept, caller removes it once it is done with it.
+*/
+int filerail_client_put_archive(filerail_session *s, filerail_put_archive *archive, uint8_t *outcome) {
+	int ret;
+
+	// as filerail_client_run
+	if (s->priority != PRIORITY_NORMAL) {
+		filerail_session_priority(s, s->priority);
+	}
+	filerail_io_queued(s->queued, s->queued_arg);
+	SESSION_SAY(s, printf("Starting transfer process...\n"));
+	ret = filerail_pipelined_put_handler(s, NULL, NULL, NULL, NULL, archive, outcome);
+	filerail_io_queued(NULL, NULL);
+	if (s->priority != PRIORITY_NORMAL) {
+		filerail_priority_io(PRIORITY_NORMAL);
+	}
+	if (ret == -1) {
+		return -1;
+	}
+	filerail_client_say_put(s, archive->request.resource_name, archive->request.resource_dir, *outcome);
+	SESSION_SAY(s, printf("Done\n"));
+	return 0;
+}
+
+int filerail_client_sync(filerail_session *s, const char *res_path, const char *des_path, bool mirror,
+	uint8_t *outcome)
+{
+	/*
+		Client wants to bring resource on server up to date with local resource.
+		Same checks as put, but an existing resource on server is not a duplicate, it is the target of sync.
+		Client sends SYNC (MIRROR additionally removes files on server which don't exist on client anymore).
+		Server sends OK, NO_ACCESS, NOT_FOUND or INSUFFICIENT_SPACE.
+
+		On OK, client sends manifest (path, size, mtime and md5 hash of every entry), server answers with
+		the files which are new or changed, and only those are zipped and sent.
+	*/
+	int fd, exit_status;
+	char resource_name[MAX_RESOURCE_LENGTH], resource_dir[MAX_PATH_LENGTH];
+	struct stat stat_path;
+	filerail_response_header response;
+
+	fd = s->fd;
+	exit_status = 0;
+	*outcome = OK;
+
+	// check if resource exists
+	if (filerail_is_exists(res_path, &stat_path)) {
+		// check if resource is readable
+		if (filerail_is_readable(res_path)) {
+			// check if resource is file or directory
+			if (filerail_is_file(&stat_path) || filerail_is_dir(&stat_path)) {
+				// parse resource path
+				if (filerail_parse_resource_path(res_path, resource_name, resource_dir)) {
+					// send the command
+					if (filerail_send_command_header(fd, mirror ? MIRROR : SYNC) == -1) {
+						exit_status = -1;
+						goto clean_up;
+					}
+					// send resource name, destination dir (on server) and resource size
+					if (
+						filerail_send_resource_header(fd, resource_name, (char*)des_path, stat_path.st_size,
+							s->priority) == -1
+					) {
+						exit_status = -1;
+						goto clean_up;
+					}
+					// server performs checks, and sends response
+					if (filerail_recv_response_header(fd, &response) == -1) {
+						exit_status = -1;
+						goto clean_up;
+					}
+					*outcome = response.response_type;
+					if (response.response_type == OK) {
+						SESSION_SAY(s, printf("Starting sync process...\n"));
+						if (filerail_sync_sendfile_handler(s, resource_dir, resource_name, &stat_path) == -1) {
+							exit_status = -1;
+						}
+					} else if (response.response_type == NO_ACCESS) {
+						SESSION_SAY(s, printf("You don't have write permission for %s on server\n", des_path));
+					} else if (response.response_type == NOT_FOUND) {
+						SESSION_SAY(s, printf("Unable to locate %s\n", des_path));
+					} else if (response.response_type == INSUFFICIENT_SPACE) {
+						SESSION_SAY(s, printf("Insufficient space on server\n"));
+					} else {
+						SESSION_SAY(s, printf("PROTOCOL NOT FOLLOWED\n"));
+					}
+				} else {
+					*outcome = BAD_RESOURCE;
+				}
+				SESSION_SAY(s, printf("Done\n"));
+			} else {
+				*outcome = BAD_RESOURCE;
+				SESSION_SAY(s, printf("%s is neither file or directory\n", res_path));
+			}
+		} else {
+			*outcome = NO_ACCESS;
+			SESSION_SAY(s, printf("You don't have read permission for %s\n", res_path));
+		}
+	} else {
+		*outcome = NOT_FOUND;
+		SESSION_SAY(s, printf("%s doesn't exists\n", res_path));
+	}
+
+	clean_up:
+	return exit_status;
+}
+
+int filerail_client_get(filerail_session *s, const char *res_path, const char *des_path, uint8_t *outcome) {
+	/*
+		Client wants to download resource from server.
+		Client checks:
+		1. If there is a another resource with same resource name at destination directory on client side
+		   (overwritten only if session's on_duplicate agrees).
+		2. Checks if client has write permission at destination directory.
+		3. If there is no duplicate resource, client checks if destination directory exists with write permission.
+		4. If all checks pass, send PIPELINED_GET request: resource, storage available on client and client's
+		   checkpoint of the resource (if any) in one request.
+
+		Server checks resource exists, is readable and is file or directory, zips it, and answers once with size,
+		hash and offset of archive (OK), or why it refuses (NOT_FOUND, NO_ACCESS, BAD_RESOURCE, INSUFFICIENT_SPACE).
+		Data follows the answer right away (see filerail_pipelined_get_handler).
+	*/
+	int exit_status;
+	char resource_name[MAX_RESOURCE_LENGTH], resource_dir[MAX_PATH_LENGTH], resource_path[MAX_PATH_LENGTH];
+	char question[2 * MAX_PATH_LENGTH];
+	struct stat stat_path;
+
+	exit_status = 0;
+	*outcome = BAD_RESOURCE;
+
+	// parse resource path
+	if (filerail_parse_resource_path(res_path, resource_name, resource_dir)) {
+		resource_path[0] = '\0';
+		strcpy(resource_path, des_path);
+		strcat(resource_path, "/");
+		strcat(resource_path, resource_name);
+		// check if resource name already exists in destination path on client side
+		if (filerail_is_exists(resource_path, &stat_path)) {
+			// ask if the user want to overwrite
+			*outcome = DUPLICATE_RESOURCE_NAME;
+			snprintf(question, sizeof(question), "%s already exists at %s, do you wish to re-write[Y/N]: ",
+				resource_name, resource_dir);
+			// if user wants to overwrite
+			if (filerail_session_confirm(s, s->on_duplicate, question)) {
+				// check if resource is writeable
+				if (filerail_is_writeable(resource_path)) {
+					// start the get process
+					get_file:
+					// the target resource name is always <resource_name>.zip
+					strcat(resource_path, ".zip");
+					if (
+						filerail_pipelined_get_handler(s, resource_name, resource_dir, des_path, resource_path, outcome) == -1
+					) {
+						exit_status = -1;
+						goto clean_up;
+					}
+					if (*outcome == NOT_FOUND) {
+						SESSION_SAY(s, printf("Resource not found\n"));
+					} else if (*outcome == NO_ACCESS) {
+						SESSION_SAY(s, printf("Server doesn't have read permission for %s\n", resource_dir));
+					} else if (*outcome == BAD_RESOURCE) {
+						SESSION_SAY(s, printf("Resource is neither file or directory\n"));
+					} else if (*outcome == INSUFFICIENT_SPACE) {
+						SESSION_SAY(s, printf("Insufficient storage\n"));
+					} else if (*outcome != OK) {
+						SESSION_SAY(s, printf("PROTOCOL NOT FOLLOWED\n"));
+					}
+				} else {
+					*outcome = NO_ACCESS;
+					SESSION_SAY(s, printf("You don't have write permission for %s\n", des_path));
+				}
+			}
+		} else {
+			// check if resource path is not valid, check if at least resource dir (destination dir) exists
+			if (stat(des_path, &stat_path) == -1) {
+				*outcome = NOT_FOUND;
+				SESSION_SAY(s, printf("%s is invalid directory\n", des_path));
+			} else {
+				// if it exists check, if des path is writeable
+				if (filerail_is_writeable(des_path)) {
+					// start the file transfer process
+					goto get_file;
+				}	else {
+					*outcome = NO_ACCESS;
+					SESSION_SAY(s, printf("You don't have write permission for %s\n", des_path));
+				}
+			}
+		}
+		SESSION_SAY(s, printf("Done\n"));
+	}
+
+	clean_up:
+	return exit_status;
+}
+
+// run a single operation over session (res path and des path are ignored by ping and probe)
+int filerail_client_run(filerail_session *s, int operation, const char *res_path, const char *des_path, bool dedup,
+	uint8_t *outcome)
+{
+	int ret;
+	filerail_probe probe;
+
+	// normal leaves io priority of the process (ionice) and marks of it's connection alone
+	if (s->priority != PRIORITY_NORMAL) {
+		filerail_session_priority(s, s->priority);
+	}
+	// positions in server's queue arrive in frames read by this thread
+	filerail_io_queued(s->queued, s->queued_arg);
+	switch (operation) {
+		case OPERATION_PING : {
+			ret = filerail_client_ping(s, outcome);
+			break;
+		}
+		case OPERATION_PROBE : {
+			// later connections of process are tuned from it
+			if ((ret = filerail_client_probe(s, PROBE_DURATION * 1000, &probe, outcome)) != -1 && *outcome == OK) {
+				filerail_probe_tune(&probe);
+			}
+			break;
+		}
+		case OPERATION_PUT : {
+			ret = filerail_client_put(s, res_path, des_path, dedup, outcome);
+			break;
+		}
+		case OPERATION_GET : {
+			ret = filerail_client_get(s, res_path, des_path, outcome);
+			break;
+		}
+		case OPERATION_SYNC :
+		case OPERATION_MIRROR : {
+			ret = filerail_client_sync(s, res_path, des_path, operation == OPERATION_MIRROR, outcome);
+			break;
+		}
+		default : {
+			*outcome = BAD_RESOURCE;
+			ret = 0;
+		}
+	}
+	filerail_io_queued(NULL, NULL);
+	/*
+		Thread starts it's next operation as normal (a worker of the asynchronous client runs transfers of any
+		class), as server does between commands. Session keeps it's class for a retry, connection keeps it's marks.
+	*/
+	if (s->priority != PRIORITY_NORMAL) {
+		filerail_priority_io(PRIORITY_NORMAL);
+	}
+	return ret;
+}
+
+/*
+	-t bw=auto: probe the link on a connection of it's own (bursts of PROBE_AUTO_DURATION ms), and size socket
+	buffers of every later connection of process from it (see filerail_probe_tune). Once per process, before
+	operations connect. A failed probe leaves buffers to kernel autotuning.
+*/
+void filerail_client_autotune(char *ip, char *port, filerail_AES_keys *K, const char *ckpt_path) {
+	uint8_t outcome;
+	filerail_probe probe;
+	filerail_session s;
+
+	if (!tuning.auto_bandwidth) {
+		return;
+	}
+	tuning.auto_bandwidth = false;
+	filerail_session_init(&s, -1, K, ckpt_path);
+	if ((s.fd = filerail_connect_to_tcp_server(ip, port)) == -1) {
+		return;
+	}
+	if (filerail_client_probe(&s, PROBE_AUTO_DURATION, &probe, &outcome) == -1 || outcome != OK) {
+		LOG(LOG_USER | LOG_ERR, "client.h filerail_client_autotune filerail_client_probe\n");
+	} else {
+		filerail_probe_tune(&probe);
+		SESSION_PRINT(&s, printf("Link probed at %llu Mbit/s\n", (unsigned long long)probe.bandwidth));
+	}
+	filerail_close(s.fd);
+}
+
+// default reconnects of command line client
+void filerail_retry_init(filerail_retry *r) {
+	r->attempts = RETRY_ATTEMPTS;
+	r->backoff = RETRY_BACKOFF;
+	r->max_backoff = RETRY_MAX_BACKOFF;
+}
+
+/*
+	Connection of session failed on attempt (from 0): false if r allows no more reconnects, otherwise wait before
+	the next one. Delay is backoff doubled per attempt (up to max_backoff), of which a random half is waited, so
+	clients cut off at once don't come back at once. Checkpoint left by the failed attempt is resumed without
+	asking from now on, and a PUT finding the archive of the failed attempt already published counts as done.
+*/
+bool filerail_client_backoff(filerail_session *s, filerail_retry *r, unsigned int attempt) {
+	unsigned int seed;
+	uint64_t delay;
+	struct timespec ts;
+
+	if (attempt >= r->attempts) {
+		return false;
+	}
+	delay = (uint64_t)r->backoff << (attempt < 20 ? attempt : 20);
+	if (delay > r->max_backoff) {
+		delay = r->max_backoff;
+	}
+	seed = (unsigned int)time(NULL) ^ ((unsigned int)getpid() << 16) ^ s->id ^ attempt;
+	delay = delay - delay / 2 + rand_r(&seed) % (delay / 2 + 1);
+	SESSION_SAY(s, printf("Connection failed, reconnecting in %.1f seconds (%u of %u)...\n", delay / 1000.0,
+		attempt + 1, r->attempts));
+	if (s->on_resume == POLICY_ASK) {
+		s->on_resume = POLICY_YES;
+	}
+	s->retried = true;
+	ts.tv_sec = delay / 1000;
+	ts.tv_nsec = (delay % 1000) * 1000000;
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+		;
+	}
+	return true;
+}
+
+/*
+	Run a single operation on a connection of it's own to ip:port (s->fd is set to it, and closed after), and run
+	it again on a new connection while connection fails and r allows (see filerail_client_backoff). Other failures
+	(refused, protocol, local) would fail the same way again, they aren't retried.
+*/
+int filerail_client_run_retry(filerail_session *s, char *ip, char *port, filerail_retry *r, int operation,
+	const char *res_path, const char *des_path, bool dedup, uint8_t *outcome)
+{
+	int ret;
+	unsigned int attempt;
+
+	for (attempt = 0; ; attempt++) {
+		ret = -1;
+		filerail_connection_clear();
+		if ((s->fd = filerail_connect_to_tcp_server(ip, port)) != -1) {
+			ret = filerail_client_run(s, operation, res_path, des_path, dedup, outcome);
+			filerail_close(s->fd);
+			s->fd = -1;
+		}
+		if (ret != -1 || !filerail_connection_failed() || !filerail_client_backoff(s, r, attempt)) {
+			s->retried = false;
+			return ret;
+		}
+	}
+}
+
+// run one transfer on it's own stream or connection
+static void filerail_client_transfer(filerail_client *c, filerail_transfer *t) {
+	int fd;
+	filerail_session session;
+
+	t->status = -1;
+	t->outcome = OK;
+	filerail_session_init(&session, -1, &c->K, c->ckpt_path);
+	session.verbose = false;
+	session.on_duplicate = t->on_duplicate;
+	session.on_resume = t->on_resume;
+	session.priority = t->priority;
+	session.progress = t->progress;
+	session.progress_arg = t->arg;
+	session.queued = t->queued;
+	session.queued_arg = t->arg;
+	if (c->mux == NULL) {
+		t->status = filerail_client_run_retry(&session, c->ip, c->port, &c->retry, t->operation, t->res_path,
+			t->des_path, t->dedup, &t->outcome);
+		return;
+	}
+	if ((fd = filerail_mux_open(c->mux)) == -1) {
+		return;
+	}
+	session.fd = fd;
+	t->status = filerail_client_run(&session, t->operation, t->res_path, t->des_path, t->dedup, &t->outcome);
+	filerail_close(fd);
+}
+
+static void* filerail_client_worker(void *arg) {
+	uint64_t one;
+	filerail_client *c;
+	filerail_transfer *t;
+	sigset_t set;
+
+	// a connection cut off fails with EPIPE, instead of killing the process
+	sigemptyset(&set);
+	sigaddset(&set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+	c = arg;
+	one = 1;
+	pthread_mutex_lock(&c->lock);
+	while (true) {
+		while (c->queue == NULL && !c->stopping) {
+			pthread_cond_wait(&c->cond, &c->lock);
+		}
+		if (c->queue == NULL) {
+			break;
+		}
+		t = c->queue;
+		if ((c->queue = t->next) == NULL) {
+			c->queue_tail = NULL;
+		}
+		pthread_mutex_unlock(&c->lock);
+
+		filerail_client_transfer(c, t);
+
+		pthread_mutex_lock(&c->lock);
+		t->next = NULL;
+		if (c->finished_tail == NULL) {
+			c->finished = t;
+		} else {
+			c->finished_tail->next = t;
+		}
+		c->finished_tail = t;
+		if (write(c->event_fd, &one, sizeof(one)) != sizeof(one)) {
+			LOG(LOG_USER | LOG_ERR, "client.h filerail_client_worker write\n");
+		}
+	}
+	pthread_mutex_unlock(&c->lock);
+	return NULL;
+}
+
+static void* filerail_client_pump(void *arg) {
+	filerail_mux_run((filerail_mux*)arg);
+	return NULL;
+}
+
+// open multiplexed connection of client
+static int filerail_client_connect_mux(filerail_client *c) {
+	filerail_response_header response;
+
+	if ((c->mux_fd = filerail_connect_to_tcp_server(c->ip, c->port)) == -1) {
+		return -1;
+	}
+	if (
+		filerail_send_command_header(c->mux_fd, MUX) == -1 ||
+		filerail_recv_response_header(c->mux_fd, &response) == -1 ||
+		response.response_type != OK
+	) {
+		LOG(LOG_USER | LOG_ERR, "client.h filerail_client_connect_mux MUX\n");
+		goto clean_up;
+	}
+	if ((c->mux = malloc(sizeof(filerail_mux))) == NULL) {
+		LOG(LOG_USER | LOG_ERR, "client.h filerail_client_connect_mux malloc\n");
+		goto clean_up;
+	}
+	if (filerail_mux_init(c->mux, c->mux_fd, NULL, NULL) == -1) {
+		goto clean_up;
+	}
+	if (pthread_create(&c->pump, NULL, filerail_client_pump, c->mux) != 0) {
+		LOG(LOG_USER | LOG_ERR, "client.h filerail_client_connect_mux pthread_create\n");
+		filerail_mux_free(c->mux);
+		goto clean_up;
+	}
+	return 0;
+
+	clean_up:
+	free(c->mux);
+	c->mux = NULL;
+	filerail_close(c->mux_fd);
+	c->mux_fd = -1;
+	return -1;
+}
+
+// start client: read keys, connect (if multiplexed) and start workers
+int filerail_client_init(filerail_client *c, filerail_client_options *o) {
+	int i;
+	struct stat stat_path;
+
+	memset(c, 0, sizeof(*c));
+	c->mux_fd = c->event_fd = -1;
+	if (
+		strlen(o->ip) >= sizeof(c->ip) || strlen(o->port) >= sizeof(c->port) ||
+		strlen(o->ckpt_path) >= sizeof(c->ckpt_path)
+	) {
+		LOG(LOG_USER | LOG_ERR, "client.h filerail_client_init options\n");
+		return -1;
+	}
+	strcpy(c->ip, o->ip);
+	strcpy(c->port, o->port);
+	strcpy(c->ckpt_path, o->ckpt_path);
+	c->retry = o->retry;
+	c->nworkers = o->nworkers > 0 ? o->nworkers : 1;
+	if (c->nworkers > MUX_MAX_STREAMS && o->multiplex) {
+		c->nworkers = MUX_MAX_STREAMS;
+	}
+	if (filerail_read_AES_keys(o->key_path, &c->K) == -1) {
+		return -1;
+	}
+	if (!filerail_is_exists(c->ckpt_path, &stat_path) && filerail_mkdir(c->ckpt_path) == -1) {
+		return -1;
+	}
+	filerail_client_autotune(c->ip, c->port, &c->K, c->ckpt_path);
+	if ((c->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+		LOG(LOG_USER | LOG_ERR, "client.h filerail_client_init eventfd\n");
+		return -1;
+	}
+	if (o->multiplex && filerail_client_connect_mux(c) == -1) {
+		close(c->event_fd);
+		return -1;
+	}
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->cond, NULL);
+	if ((c->workers = calloc(c->nworkers, sizeof(pthread_t))) == NULL) {
+		LOG(LOG_USER | LOG_ERR, "client.h filerail_client_init calloc\n");
+		c->nworkers = 0;
+		filerail_client_destroy(c);
+		return -1;
+	}
+	for (i = 0; i < c->nworkers; i++) {
+		if (pthread_create(&c->workers[i], NULL, filerail_client_worker, c) != 0) {
+			LOG(LOG_USER | LOG_ERR, "client.h filerail_client_init pthread_create\n");
+			c->nworkers = i;
+			filerail_client_destroy(c);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// queue transfer, returns right away
+int filerail_client_submit(filerail_client *c, filerail_transfer *t) {
+	if (t->operation < OPERATION_PING || t->operation > OPERATION_PROBE) {
+		return -1;
+	}
+	if (
+		t->operation != OPERATION_PING && t->operation != OPERATION_PROBE &&
+		(t->res_path == NULL || t->des_path == NULL)
+	) {
+		return -1;
+	}
+	t->next = NULL;
+	pthread_mutex_lock(&c->lock);
+	if (c->stopping) {
+		pthread_mutex_unlock(&c->lock);
+		return -1;
+	}
+	if (c->queue_tail == NULL) {
+		c->queue = t;
+	} else {
+		c->queue_tail->next = t;
+	}
+	c->queue_tail = t;
+	c->pending++;
+	pthread_cond_signal(&c->cond);
+	pthread_mutex_unlock(&c->lock);
+	return 0;
+}
+
+// readable while finished transfers wait for filerail_client_complete
+int filerail_client_fd(filerail_client *c) {
+	return c->event_fd;
+}
+
+// hand finished transfers back to caller, counting failed ones
+static int filerail_client_reap(filerail_client *c, int *nfailed) {
+	int n;
+	uint64_t count;
+	filerail_transfer *t, *next;
+
+	// reset before taking the list, a transfer finishing meanwhile sets it again
+	if (read(c->event_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+		LOG(LOG_USER | LOG_ERR, "client.h filerail_client_reap read\n");
+	}
+	pthread_mutex_lock(&c->lock);
+	t = c->finished;
+	c->finished = c->finished_tail = NULL;
+	for (next = t, n = 0; next != NULL; next = next->next, n++);
+	c->pending -= n;
+	pthread_mutex_unlock(&c->lock);
+	for (; t != NULL; t = next) {
+		next = t->next;
+		*nfailed += t->status == -1;
+		if (t->done != NULL) {
+			t->done(t, t->arg);
+		}
+	}
+	return n;
+}
+
+// call done callback of every finished transfer (on caller's thread), returns how many
+int filerail_client_complete(filerail_client *c) {
+	int nfailed;
+
+	nfailed = 0;
+	return filerail_client_reap(c, &nfailed);
+}
+
+// block until every submitted transfer completed, returns how many failed
+int filerail_client_wait(filerail_client *c) {
+	int nfailed;
+	struct pollfd pfd;
+
+	nfailed = 0;
+	pfd.fd = c->event_fd;
+	pfd.events = POLLIN;
+	while (true) {
+		pthread_mutex_lock(&c->lock);
+		if (c->pending == 0) {
+			pthread_mutex_unlock(&c->lock);
+			break;
+		}
+		pthread_mutex_unlock(&c->lock);
+		if (poll(&pfd, 1, -1) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			LOG(LOG_USER | LOG_ERR, "client.h filerail_client_wait poll\n");
+			return -1;
+		}
+		filerail_client_reap(c, &nfailed);
+	}
+	return nfailed;
+}
+
+// stop workers once queued transfers ran (their done callbacks are not called), close connection
+void filerail_client_destroy(filerail_client *c) {
+	int i;
+
+	pthread_mutex_lock(&c->lock);
+	c->stopping = true;
+	pthread_cond_broadcast(&c->cond);
+	pthread_mutex_unlock(&c->lock);
+	for (i = 0; i < c->nworkers; i++) {
+		pthread_join(c->workers[i], NULL);
+	}
+	free(c->workers);
+	c->workers = NULL;
+	if (c->mux != NULL) {
+		filerail_mux_shutdown(c->mux);
+		pthread_join(c->pump, NULL);
+		filerail_mux_free(c->mux);
+		free(c->mux);
+		c->mux = NULL;
+		filerail_close(c->mux_fd);
+	}
+	if (c->event_fd != -1) {
+		close(c->event_fd);
+	}
+	pthread_mutex_destroy(&c->lock);
+	pthread_cond_destroy(&c->cond);
+}
+
+#endif /* FILERAIL_IMPLEMENTATION */
+
+#endif
@@ -7,20 +7,197 @@
 #define MAX_RESOURCE_LENGTH 256
 // size of buffer for tcp sockets at application layer
 #define BUFFER_SIZE 1024
-// max number of clients connected
-#define BACKLOG 8
+// length of accept queue (kernel caps it to net.core.somaxconn)
+#define BACKLOG 4096
 // max width of progress bar (50 spaces)
 #define PROGRESS_BAR_WIDTH 50
-// time out blocking for send and recv calls
-#define TIME_OUT 36000
-// time out on recv during file transfer
+// seconds a peer may keep a session waiting for a message (see deadline.h)
 #define MAX_IO_TIME_OUT 10
+// seconds a session waits for next command (persistent session, stream of a multiplexed connection)
+#define COMMAND_TIME_OUT 120
+// seconds server waits for client's user to answer a question (overwrite, resume)
+#define PROMPT_TIME_OUT 600
+// seconds between heartbeats of a side busy zipping, hashing or unzipping (well under MAX_IO_TIME_OUT)
+#define HEARTBEAT_INTERVAL 2
+// transfer moving less than MIN_THROUGHPUT bytes per second over STALL_WINDOW seconds is stalled
+#define MIN_THROUGHPUT 256
+#define STALL_WINDOW 60
 // length of md5 hash
 #define MD5_HASH_LENGTH 16
+// length of md5 hash in hex (including null character)
+#define MD5_HASH_STR_LENGTH (2 * MD5_HASH_LENGTH + 1)
 // number of attributes in filerail_resource_header
-#define NUM_ATTRS_FOR_RESOURCE_HEADER 3
+#define NUM_ATTRS_FOR_RESOURCE_HEADER 4
 // number of attributes in filerail_data_packet
 #define NUM_ATTRS_FOR_DATA_PACKET 2
+// number of attributes in filerail_request_header
+#define NUM_ATTRS_FOR_REQUEST_HEADER 8
+// number of attributes in filerail_request_response
+#define NUM_ATTRS_FOR_REQUEST_RESPONSE 4
+// number of attributes in filerail_manifest_entry
+#define NUM_ATTRS_FOR_MANIFEST_ENTRY 5
+// initial capacity of manifest (must be power of 2)
+#define MANIFEST_INITIAL_CAPACITY 1024
+// prefix of metadata cache files in checkpoints directory
+#define MANIFEST_CACHE_PREFIX "sync_"
+// magic at start of metadata cache file
+#define MANIFEST_CACHE_MAGIC "FRMC"
+// minimum size of content defined chunk
+#define CDC_MIN_CHUNK_SIZE 2048
+// average (normal) size of content defined chunk
+#define CDC_AVG_CHUNK_SIZE 8192
+// maximum size of content defined chunk
+#define CDC_MAX_CHUNK_SIZE 65536
+// mask used before average chunk size (15 bits, harder to cut)
+#define CDC_MASK_S (~0ULL << 49)
+// mask used after average chunk size (11 bits, easier to cut)
+#define CDC_MASK_L (~0ULL << 53)
+// seed for gear table (same on every host, so chunks are same everywhere)
+#define CDC_GEAR_SEED 0x66696c657261696cULL
+// initial capacity of chunk list and chunk set (must be power of 2)
+#define CHUNK_LIST_INITIAL_CAPACITY 1024
+// name of chunk store directory inside checkpoints directory
+#define CHUNK_STORE_DIR "chunks"
+// room left in a path after chunk store directory, for "/<shard>/<md5>.<pid>.<session>.tmp"
+#define CHUNK_STORE_NAME_LENGTH 64
+// number of attributes in filerail_chunk_info
+#define NUM_ATTRS_FOR_CHUNK_INFO 2
+// compression level of archives (fixed, so same tree always gives same archive)
+#define ARCHIVE_COMPRESSION_LEVEL 6
+// archives of DEDUP_PUT store entries as is, so an edit shifts chunks of it's own file only (deflate shifts the rest)
+#define DEDUP_COMPRESSION_LEVEL 0
+// default size budget of chunk store in MB
+#define CHUNK_STORE_BUDGET 4096
+// chunks used within this many seconds are never evicted (a receiver may be rebuilding an archive from them)
+#define CHUNK_STORE_GRACE 3600
+// chunk store is checked against it's budget at most once per this many seconds
+#define CHUNK_STORE_GC_INTERVAL 60
+// timestamp of every archive entry (2010-01-01 00:00:00 UTC)
+#define ARCHIVE_ENTRY_MTIME 1262304000
+// attribute bit (MS-DOS system) of archive entries filerail adds of it's own (extent maps, batches), never set for user's files
+#define ARCHIVE_ENTRY_FLAG 0x04
+// sparse file is sent as extents only if it's holes add up to at least this many bytes
+#define SPARSE_MIN_HOLE_SIZE (1 << 20)
+// buffer used to copy extents of sparse files
+#define SPARSE_COPY_BUFFER_SIZE (1 << 20)
+// suffix of zip entry holding extent map of a sparse file
+#define SPARSE_MAP_SUFFIX ".filerail-sparse"
+// first word of extent map
+#define SPARSE_MAP_MAGIC "FRSPARSE"
+// files of at most this many bytes are packed into batches
+#define PACK_MAX_FILE_SIZE 4096
+// size of a batch of small files (index + data)
+#define PACK_BATCH_SIZE (4 << 20)
+// max number of files in a batch
+#define PACK_BATCH_FILES 65536
+// max size of a batch (batch is closed once full, last file, it's index line and header may go over PACK_BATCH_SIZE)
+#define PACK_MAX_BATCH_SIZE (PACK_BATCH_SIZE + PACK_MAX_FILE_SIZE + MAX_PATH_LENGTH + 128)
+// prefix of zip entries holding batches of small files
+#define PACK_ENTRY_PREFIX ".filerail-pack-"
+// first word of a batch
+#define PACK_MAGIC "FRPACK"
+// threads used to walk a directory tree
+#define WALK_THREADS 8
+// max number of files read ahead of the one being archived
+#define PREFETCH_FILES 64
+// max number of bytes read ahead of the file being archived
+#define PREFETCH_BYTES (64 << 20)
+// max size of first frame (length + command) read by event mode reactor
+#define REACTOR_FRAME_SIZE 64
+// max number of events handled per epoll_wait
+#define REACTOR_MAX_EVENTS 256
+// max number of commands of event mode waiting for a worker, more are refused (connection is closed)
+#define REACTOR_MAX_QUEUED 1024
+// first frame of a command (request or resource header) up to this size is buffered before command is handed over
+#define REACTOR_REQUEST_SIZE (16 << 10)
+// environment variable holding fd a restarted server reports readiness on
+#define MASTER_READY_ENV "FILERAIL_READY_FD"
+// seconds old server waits for the new one during graceful restart
+#define MASTER_READY_TIME_OUT 30
+// name of archive cache directory inside checkpoints directory
+#define ARCHIVE_CACHE_DIR "cache"
+// default disk budget of archive cache in MB
+#define ARCHIVE_CACHE_BUDGET 1024
+// ms between checks of a session waiting for an archive another session is building
+#define ARCHIVE_CACHE_LOCK_POLL 100
+// prefix of staging directory of a resource being received
+#define STAGE_PREFIX ".filerail-stage."
+// extended attribute of a published resource: md5 hash of archive it was extracted from
+#define PUBLISH_RECEIPT_XATTR "user.filerail.archive"
+// name of trash directory inside checkpoints directory
+#define TRASH_DIR "trash"
+// default number of entries per second removed from trash
+#define TRASH_DELETE_RATE 10000
+// seconds between two scans of trash
+#define TRASH_POLL_INTERVAL 1
+// max number of bytes of a stream in one frame of a multiplexed connection
+#define MUX_FRAME_SIZE 16384
+// size of frame header (stream id, type, length)
+#define MUX_HEADER_SIZE 9
+// flow control window of a stream (max bytes in flight, and buffered by receiver)
+#define MUX_WINDOW_SIZE (256 << 10)
+// max number of open streams on a multiplexed connection
+#define MUX_MAX_STREAMS 64
+// frames queued for the connection before streams are read again
+#define MUX_OUT_FRAMES 4
+// max size of a socket buffer set by tuning (see tuning.h)
+#define TUNING_MAX_BUFFER (64 << 20)
+// max length of name of congestion control algorithm (including null character)
+#define TUNING_CC_NAME_LENGTH 16
+// default number of times client reconnects after connection of an operation failed
+#define RETRY_ATTEMPTS 5
+// default delay in ms before first reconnect, doubled for every next one
+#define RETRY_BACKOFF 500
+// default max delay in ms between two reconnects
+#define RETRY_MAX_BACKOFF 60000
+// number of round trips timed by probe
+#define PROBE_PINGS 20
+// default length of a burst of probe in seconds (4 bursts per probe)
+#define PROBE_DURATION 2
+// ms of each burst of the probe run by -t bw=auto, before operations
+#define PROBE_AUTO_DURATION 500
+// max length of a burst of probe in seconds
+#define PROBE_MAX_DURATION 10
+// size of a frame of a raw burst of probe
+#define PROBE_RAW_SIZE (64 << 10)
+// max number of client IPs with limits of their own in limits file of shaper (see shaper.h)
+#define SHAPER_MAX_RULES 256
+// max number of client IPs with transfers in flight tracked by shaper
+#define SHAPER_MAX_CLIENTS 1024
+// max number of transfers tracked with their process by shaper (transfers of a process which died are dropped)
+#define SHAPER_MAX_TRANSFERS 4096
+// max number of bytes taken from token buckets at once
+#define SHAPER_QUANTUM (64 << 10)
+// seconds of rate a token bucket holds at most
+#define SHAPER_BURST 0.1
+// seconds between two checks of limits file for changes
+#define SHAPER_RELOAD_INTERVAL 1
+// max number of sessions queued for or running a phase under admission control (see admission.h)
+#define ADMISSION_MAX_ENTRIES 4096
+// seconds between two checks for queued sessions of dead processes
+#define ADMISSION_POLL_INTERVAL 1
+// bit set in size of a heartbeat frame carrying position of session in server's queue
+#define QUEUED_FRAME 0x80000000U
+// room left in a path after work directory of a benchmark, for the names it creates under it
+#define BENCH_NAME_LENGTH 64
+// default size of dedup benchmark dataset
+#define DEDUP_BENCH_SIZE (64 << 20)
+// default number of versions in dedup benchmark
+#define DEDUP_BENCH_VERSIONS 8
+// number of edits (overwrite, insert, delete) between two versions in dedup benchmark
+#define DEDUP_BENCH_EDITS 16
+// default number of files in pack benchmark
+#define PACK_BENCH_FILES 1000000
+// default size of a file in pack benchmark
+#define PACK_BENCH_FILE_SIZE 1024
+// files per directory in pack benchmark
+#define PACK_BENCH_FILES_PER_DIR 1000
+// default number of entries in walk benchmark
+#define WALK_BENCH_ENTRIES 1000000
+// default number of sessions in ping benchmark
+#define PING_BENCH_CONNECTIONS 20000
+// default number of concurrent clients in ping benchmark
+#define PING_BENCH_CONCURRENCY 64
 // key file size
 #define KEY_FILE_SIZE 96
 // size of AES key (AES-128-CBC => 16 byte keys)
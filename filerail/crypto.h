@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <ctype.h>
 #include <sys/stat.h>
 #include <openssl/aes.h>
@@ -22,13 +23,17 @@ typedef struct _filerail_AES_keys {
 } filerail_AES_keys;
 
 char filerail_dec_hex_to_char(uint8_t c);
-void filerail_hex_to_str(const uint8_t *hash, char *hex_str);
-int filerail_md5(uint8_t *hash, const char *zip_filename);
+void filerail_hash_to_str(const uint8_t *hash, char *hex_str);
+bool filerail_str_to_hash(const char *hex_str, uint8_t *hash);
+int filerail_md5_file(uint8_t *hash, const char *filename);
+int filerail_md5(uint8_t *hash, const char *zip_filename, bool print);
 int filerail_read_AES_keys(char *key_path, filerail_AES_keys *K);
 uint8_t filerail_char_to_hex(uint8_t c);
 int filerail_encrypt(uint8_t *in, uint8_t *out, size_t nbytes, filerail_AES_keys *K);
 int filerail_decrypt(uint8_t *in, uint8_t *out, size_t nbytes, filerail_AES_keys *K);
 
+#ifdef FILERAIL_IMPLEMENTATION
+
 // maps uint8_t hex value to character hex
 char filerail_dec_to_hex_char(uint8_t c) {
 	switch(c) {
@@ -52,7 +57,7 @@ char filerail_dec_to_hex_char(uint8_t c) {
 	return '0';
 }
 
-// converts keys to human readable form (used for checkpointing)
+// converts keys to human readable form (used for checkpointing), hex_str must hold MD5_HASH_STR_LENGTH bytes
 void filerail_hash_to_str(const uint8_t *hash, char *hex_str) {
 	int i;
 
@@ -60,11 +65,27 @@ void filerail_hash_to_str(const uint8_t *hash, char *hex_str) {
 		hex_str[2 * i] = filerail_dec_to_hex_char((0xf0 & hash[i]) >> 4);
 		hex_str[2 * i + 1] = filerail_dec_to_hex_char(0x0f & hash[i]);
 	}
+	hex_str[2 * MD5_DIGEST_LENGTH] = '\0';
+}
+
+// reverse of filerail_hash_to_str, false if hex_str isn't a hash
+bool filerail_str_to_hash(const char *hex_str, uint8_t *hash) {
+	int i;
+
+	for (i = 0; i < 2 * MD5_DIGEST_LENGTH; i++) {
+		if (!isxdigit((unsigned char)hex_str[i])) {
+			return false;
+		}
+	}
+	for (i = 0; i < MD5_DIGEST_LENGTH; i++) {
+		hash[i] = (filerail_char_to_hex(hex_str[2 * i]) << 4) | filerail_char_to_hex(hex_str[2 * i + 1]);
+	}
+	return hex_str[2 * MD5_DIGEST_LENGTH] == '\0';
 }
 
-// computes md5 hash of zip file
-int filerail_md5(uint8_t *hash, const char *zip_filename) {
-	int i, exit_status;
+// computes md5 hash of a file (quiet, used while building manifests of many files)
+int filerail_md5_file(uint8_t *hash, const char *filename) {
+	int exit_status;
 	size_t nbytes;
 	off_t size;
 	uint8_t buffer[BUFFER_SIZE];
@@ -74,16 +95,16 @@ int filerail_md5(uint8_t *hash, const char *zip_filename) {
 
 	exit_status = 0;
 
-	if ((fp = fopen(zip_filename, "rb")) == NULL) {
-		LOG(LOG_USER | LOG_ERR, "crypto.h filerail_md5 fopen\n");
+	if ((fp = fopen(filename, "rb")) == NULL) {
+		LOG(LOG_USER | LOG_ERR, "crypto.h filerail_md5_file fopen\n");
 		exit_status = -1;
 		goto clean_up;
 	}
 
-	if (stat(zip_filename, &stat_path) == -1) {
-		LOG(LOG_USER | LOG_ERR, "crypto.h filerail_md5 stat\n");
+	if (stat(filename, &stat_path) == -1) {
+		LOG(LOG_USER | LOG_ERR, "crypto.h filerail_md5_file stat\n");
 		exit_status = -1;
-		return exit_status;
+		goto clean_up;
 	}
 
 	size = stat_path.st_size;
@@ -91,21 +112,19 @@ int filerail_md5(uint8_t *hash, const char *zip_filename) {
   while (size != 0) {
   	nbytes = fread((void *)buffer, 1, min(BUFFER_SIZE, size), fp);
   	if (nbytes != min(BUFFER_SIZE, size) && ferror(fp)) {
-			LOG(LOG_USER | LOG_ERR, "crypto.h filerail_md5 fread\n");
+			LOG(LOG_USER | LOG_ERR, "crypto.h filerail_md5_file fread\n");
 			exit_status = -1;
 			goto clean_up;
   	}
+  	// file shrunk while hashing
+  	if (nbytes == 0) {
+  		break;
+  	}
   	MD5_Update(&mdContext, buffer, nbytes);
   	size -= nbytes;
   }
   MD5_Final(hash, &mdContext);
 
-  PRINT(printf("Hash: "));
-  for(i = 0; i < MD5_DIGEST_LENGTH; i++) {
-  	PRINT(printf("%02x", hash[i]));
-  }
-  PRINT(printf("\n"));
-
 	clean_up:
 	if (fp != NULL) {
 		fclose(fp);
@@ -113,6 +132,25 @@ int filerail_md5(uint8_t *hash, const char *zip_filename) {
 	return exit_status;
 }
 
+// computes md5 hash of zip file (and prints it, if print is set)
+int filerail_md5(uint8_t *hash, const char *zip_filename, bool print) {
+	int i;
+
+	if (filerail_md5_file(hash, zip_filename) == -1) {
+		return -1;
+	}
+	if (!print) {
+		return 0;
+	}
+
+  printf("Hash: ");
+  for(i = 0; i < MD5_DIGEST_LENGTH; i++) {
+  	printf("%02x", hash[i]);
+  }
+  printf("\n");
+  return 0;
+}
+
 // maps character equivalent in hex to hex in uint8_t
 uint8_t filerail_char_to_hex(uint8_t c) {
 	switch(c) {
@@ -264,4 +302,6 @@ int filerail_decrypt(uint8_t *in, uint8_t *out, size_t nbytes, filerail_AES_keys
 	return exit_status;
 }
 
+#endif /* FILERAIL_IMPLEMENTATION */
+
 #endif
@@ -0,0 +1,240 @@
+#ifndef _DEADLINE_H
+#define _DEADLINE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "global.h"
+#include "constants.h"
+#include "admission.h"
+
+/*
+	Deadlines of blocking I/O on a session's connection.
+
+	Every read and write waits in poll() for at most the time out of the phase the session is in (socket is never
+	blocked on without one, and SO_RCVTIMEO is never touched):
+	MAX_IO_TIME_OUT  : peer is expected to answer, or to keep data coming (default)
+	COMMAND_TIME_OUT : server waits for next command of a persistent session, or first command of a stream
+	PROMPT_TIME_OUT  : server waits for client's user to answer a question
+	Phase is kept per thread, a session runs on one thread (a process, a worker, or a thread of a stream), and so
+	is the callback getting positions in server's queue of the session (see filerail_io_queued).
+
+	A side busy for long while the other one waits on it (zipping, hashing, unzipping) sends heartbeats, empty
+	frames every HEARTBEAT_INTERVAL seconds which receivers skip (see filerail_recv_frame_size), so a dead peer is
+	told from a busy one within MAX_IO_TIME_OUT seconds. A session queued by admission control (see admission.h)
+	tells it's position in queue in them. A peer which is alive but doesn't make progress (less
+	than MIN_THROUGHPUT bytes per second over STALL_WINDOW seconds) fails the transfer too (see filerail_stall).
+*/
+
+// keeps sending heartbeats on fd from a thread of it's own, while session is busy
+typedef struct _filerail_heartbeat {
+	int fd;
+	pid_t owner; // session whose position in queue heartbeats carry
+	unsigned int sid;
+	bool running;
+	bool stop;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} filerail_heartbeat;
+
+// progress of a transfer in current window
+typedef struct _filerail_stall {
+	time_t window_start;
+	uint64_t window_bytes;
+} filerail_stall;
+
+int filerail_io_phase(int time_out);
+void filerail_io_queued(filerail_queued_fn fn, void *arg);
+void filerail_io_queued_at(unsigned int position);
+int filerail_io_wait(int fd, short events);
+void filerail_heartbeat_start(filerail_heartbeat *hb, int fd, pid_t owner, unsigned int sid);
+void filerail_heartbeat_stop(filerail_heartbeat *hb);
+void filerail_stall_init(filerail_stall *st);
+bool filerail_stall_check(filerail_stall *st, uint64_t nbytes);
+
+#ifdef FILERAIL_IMPLEMENTATION
+
+static __thread int filerail_io_time_out = MAX_IO_TIME_OUT;
+static __thread filerail_queued_fn filerail_io_queued_fn = NULL;
+static __thread void *filerail_io_queued_arg = NULL;
+
+static time_t filerail_monotonic(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+// set time out of I/O of calling thread's session, returns the previous one
+int filerail_io_phase(int time_out) {
+	int prev;
+
+	prev = filerail_io_time_out;
+	filerail_io_time_out = time_out;
+	return prev;
+}
+
+// positions in server's queue received by calling thread go to fn (NULL ignores them)
+void filerail_io_queued(filerail_queued_fn fn, void *arg) {
+	filerail_io_queued_fn = fn;
+	filerail_io_queued_arg = arg;
+}
+
+// calling thread received it's session's position in server's queue (see filerail_recv_frame_size)
+void filerail_io_queued_at(unsigned int position) {
+	if (filerail_io_queued_fn != NULL) {
+		filerail_io_queued_fn(filerail_io_queued_arg, position);
+	}
+}
+
+// wait until fd is ready for events, -1 if deadline of current phase passed first
+int filerail_io_wait(int fd, short events) {
+	int ret;
+	time_t deadline, now;
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = events;
+	deadline = filerail_monotonic() + filerail_io_time_out;
+	while (true) {
+		now = filerail_monotonic();
+		if (now >= deadline) {
+			errno = ETIMEDOUT;
+			LOG(LOG_USER | LOG_INFO, "deadline.h filerail_io_wait peer didn't respond in time\n");
+			return -1;
+		}
+		ret = poll(&pfd, 1, (deadline - now) * 1000);
+		if (ret > 0) {
+			// readable hangup and errors are seen by the call which follows
+			return 0;
+		}
+		if (ret == -1 && errno != EINTR) {
+			LOG(LOG_USER | LOG_ERR, "deadline.h filerail_io_wait poll\n");
+			return -1;
+		}
+	}
+}
+
+// an empty frame (zero size), or position of a queued session (see admission.h)
+static int filerail_heartbeat_send(int fd, unsigned int position) {
+	uint32_t frame;
+	size_t len;
+	ssize_t nbytes;
+
+	frame = position == 0 ? 0 : htonl(QUEUED_FRAME | position);
+	len = 0;
+	while (len != sizeof(frame)) {
+		if (filerail_io_wait(fd, POLLOUT) == -1) {
+			return -1;
+		}
+		nbytes = send(fd, (uint8_t*)&frame + len, sizeof(frame) - len, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (nbytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+			continue;
+		}
+		if (nbytes <= 0) {
+			return -1;
+		}
+		len += nbytes;
+	}
+	return 0;
+}
+
+static void *filerail_heartbeat_thread(void *arg) {
+	int ret;
+	struct timespec ts;
+	filerail_heartbeat *hb;
+
+	hb = arg;
+	pthread_mutex_lock(&hb->lock);
+	while (!hb->stop) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_sec += HEARTBEAT_INTERVAL;
+		ret = 0;
+		while (!hb->stop && ret != ETIMEDOUT) {
+			ret = pthread_cond_timedwait(&hb->cond, &hb->lock, &ts);
+		}
+		if (hb->stop) {
+			break;
+		}
+		pthread_mutex_unlock(&hb->lock);
+		// peer is gone, session finds out on it's next I/O
+		if (filerail_heartbeat_send(hb->fd, filerail_admission_position(hb->owner, hb->sid)) == -1) {
+			return NULL;
+		}
+		pthread_mutex_lock(&hb->lock);
+	}
+	pthread_mutex_unlock(&hb->lock);
+	return NULL;
+}
+
+// start sending heartbeats on fd, session mustn't use fd until filerail_heartbeat_stop
+void filerail_heartbeat_start(filerail_heartbeat *hb, int fd, pid_t owner, unsigned int sid) {
+	pthread_condattr_t attr;
+
+	hb->fd = fd;
+	hb->owner = owner;
+	hb->sid = sid;
+	hb->stop = false;
+	hb->running = false;
+	pthread_mutex_init(&hb->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&hb->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	if (pthread_create(&hb->thread, NULL, filerail_heartbeat_thread, hb) != 0) {
+		// peer may time out if work takes long, nothing else breaks
+		LOG(LOG_USER | LOG_ERR, "deadline.h filerail_heartbeat_start pthread_create\n");
+		return;
+	}
+	hb->running = true;
+}
+
+// stop heartbeats, fd is the session's again once it returns
+void filerail_heartbeat_stop(filerail_heartbeat *hb) {
+	if (hb->running) {
+		pthread_mutex_lock(&hb->lock);
+		hb->stop = true;
+		pthread_cond_signal(&hb->cond);
+		pthread_mutex_unlock(&hb->lock);
+		pthread_join(hb->thread, NULL);
+		hb->running = false;
+	}
+	pthread_cond_destroy(&hb->cond);
+	pthread_mutex_destroy(&hb->lock);
+}
+
+void filerail_stall_init(filerail_stall *st) {
+	st->window_start = filerail_monotonic();
+	st->window_bytes = 0;
+}
+
+// account nbytes of progress of a transfer, false if transfer stalled
+bool filerail_stall_check(filerail_stall *st, uint64_t nbytes) {
+	time_t elapsed;
+
+	st->window_bytes += nbytes;
+	elapsed = filerail_monotonic() - st->window_start;
+	if (elapsed < STALL_WINDOW) {
+		return true;
+	}
+	if (st->window_bytes < (uint64_t)MIN_THROUGHPUT * elapsed) {
+		LOG(LOG_USER | LOG_INFO, "deadline.h filerail_stall_check transfer stalled\n");
+		return false;
+	}
+	filerail_stall_init(st);
+	return true;
+}
+
+#endif /* FILERAIL_IMPLEMENTATION */
+
+#endif
@@ -21,6 +21,12 @@ bool filerail_deserialize_resource_header(filerail_resource_header *ptr, void *b
 bool filerail_deserialize_file_offset(filerail_file_offset *ptr, void *buf, size_t size);
 bool filerail_deserialize_resource_hash(filerail_resource_hash *ptr, void *buf, size_t size);
 bool filerail_deserialize_data_packet(filerail_data_packet *ptr, void *buf, size_t size);
+bool filerail_deserialize_manifest_entry(filerail_manifest_entry *ptr, void *buf, size_t size);
+bool filerail_deserialize_chunk_info(filerail_chunk_info *ptr, void *buf, size_t size);
+bool filerail_deserialize_request_header(filerail_request_header *ptr, void *buf, size_t size);
+bool filerail_deserialize_request_response(filerail_request_response *ptr, void *buf, size_t size);
+
+#ifdef FILERAIL_IMPLEMENTATION
 
 bool filerail_deserialize_response_header(filerail_response_header *ptr, void *buf, size_t size) {
 	bool exit_status;
@@ -66,6 +72,8 @@ bool filerail_deserialize_resource_header(filerail_resource_header *ptr, void *b
 		ptr->resource_size = root.via.array.ptr[0].via.u64;
 		memcpy(ptr->resource_name, root.via.array.ptr[1].via.str.ptr, MAX_RESOURCE_LENGTH);
 		memcpy(ptr->resource_dir, root.via.array.ptr[2].via.str.ptr, MAX_PATH_LENGTH);
+		// peers predating priority classes don't send one
+		ptr->priority = root.via.array.size > 3 ? root.via.array.ptr[3].via.u64 : PRIORITY_NORMAL;
 		exit_status = true;
 	}
 	msgpack_unpacked_destroy(&msg);
@@ -127,4 +135,108 @@ bool filerail_deserialize_data_packet(filerail_data_packet *ptr, void *buf, size
 	return exit_status;
 }
 
+bool filerail_deserialize_manifest_entry(filerail_manifest_entry *ptr, void *buf, size_t size) {
+	int i;
+	bool exit_status;
+	size_t path_len;
+	msgpack_unpacked msg;
+	msgpack_object root;
+
+	exit_status = false;
+	msgpack_unpacked_init(&msg);
+	if (msgpack_unpack_next(&msg, buf, size, NULL) == MSGPACK_UNPACK_SUCCESS) {
+		root = msg.data;
+		ptr->entry_type = root.via.array.ptr[0].via.u64;
+		ptr->size = root.via.array.ptr[1].via.u64;
+		ptr->mtime = root.via.array.ptr[2].via.u64;
+		for (i = 0; i < MD5_HASH_LENGTH; i++) {
+			ptr->hash[i] = root.via.array.ptr[3].via.array.ptr[i].via.u64;
+		}
+		// path is not padded, so it has to be null terminated here
+		path_len = min(root.via.array.ptr[4].via.str.size, MAX_PATH_LENGTH - 1);
+		memcpy(ptr->path, root.via.array.ptr[4].via.str.ptr, path_len);
+		ptr->path[path_len] = '\0';
+		exit_status = true;
+	}
+	msgpack_unpacked_destroy(&msg);
+	return exit_status;
+}
+
+bool filerail_deserialize_chunk_info(filerail_chunk_info *ptr, void *buf, size_t size) {
+	int i;
+	bool exit_status;
+	msgpack_unpacked msg;
+	msgpack_object root;
+
+	exit_status = false;
+	msgpack_unpacked_init(&msg);
+	if (msgpack_unpack_next(&msg, buf, size, NULL) == MSGPACK_UNPACK_SUCCESS) {
+		root = msg.data;
+		ptr->length = root.via.array.ptr[0].via.u64;
+		for (i = 0; i < MD5_HASH_LENGTH; i++) {
+			ptr->hash[i] = root.via.array.ptr[1].via.array.ptr[i].via.u64;
+		}
+		exit_status = true;
+	}
+	msgpack_unpacked_destroy(&msg);
+	return exit_status;
+}
+
+bool filerail_deserialize_request_header(filerail_request_header *ptr, void *buf, size_t size) {
+	int i;
+	bool exit_status;
+	size_t name_len, dir_len;
+	msgpack_unpacked msg;
+	msgpack_object root;
+
+	exit_status = false;
+	msgpack_unpacked_init(&msg);
+	if (msgpack_unpack_next(&msg, buf, size, NULL) == MSGPACK_UNPACK_SUCCESS) {
+		root = msg.data;
+		ptr->on_duplicate = root.via.array.ptr[0].via.u64;
+		ptr->on_resume = root.via.array.ptr[1].via.u64;
+		ptr->resource_size = root.via.array.ptr[2].via.u64;
+		ptr->offset = root.via.array.ptr[3].via.u64;
+		for (i = 0; i < MD5_HASH_LENGTH; i++) {
+			ptr->hash[i] = root.via.array.ptr[4].via.array.ptr[i].via.u64;
+		}
+		// name and dir are not padded, so they have to be null terminated here
+		name_len = min(root.via.array.ptr[5].via.str.size, MAX_RESOURCE_LENGTH - 1);
+		memcpy(ptr->resource_name, root.via.array.ptr[5].via.str.ptr, name_len);
+		ptr->resource_name[name_len] = '\0';
+		dir_len = min(root.via.array.ptr[6].via.str.size, MAX_PATH_LENGTH - 1);
+		memcpy(ptr->resource_dir, root.via.array.ptr[6].via.str.ptr, dir_len);
+		ptr->resource_dir[dir_len] = '\0';
+		// peers predating priority classes don't send one
+		ptr->priority = root.via.array.size > 7 ? root.via.array.ptr[7].via.u64 : PRIORITY_NORMAL;
+		exit_status = true;
+	}
+	msgpack_unpacked_destroy(&msg);
+	return exit_status;
+}
+
+bool filerail_deserialize_request_response(filerail_request_response *ptr, void *buf, size_t size) {
+	int i;
+	bool exit_status;
+	msgpack_unpacked msg;
+	msgpack_object root;
+
+	exit_status = false;
+	msgpack_unpacked_init(&msg);
+	if (msgpack_unpack_next(&msg, buf, size, NULL) == MSGPACK_UNPACK_SUCCESS) {
+		root = msg.data;
+		ptr->response_type = root.via.array.ptr[0].via.u64;
+		ptr->resource_size = root.via.array.ptr[1].via.u64;
+		ptr->offset = root.via.array.ptr[2].via.u64;
+		for (i = 0; i < MD5_HASH_LENGTH; i++) {
+			ptr->hash[i] = root.via.array.ptr[3].via.array.ptr[i].via.u64;
+		}
+		exit_status = true;
+	}
+	msgpack_unpacked_destroy(&msg);
+	return exit_status;
+}
+
+#endif /* FILERAIL_IMPLEMENTATION */
+
 #endif
@@ -21,9 +21,29 @@
 		perror(m);						 \
 	}
 
-int verbose = 0; // flag for setting verbose mode
-int is_server = 0; // flag to check if host is client/server
+/*
+	Library is header only. Exactly one translation unit of a program defines FILERAIL_IMPLEMENTATION before
+	including any of it's headers, and gets the definitions (functions and process wide state), every other
+	translation unit gets declarations only.
+*/
+
+/*
+	Process wide defaults, set by main() before any session starts and never changed afterwards.
+	Sessions copy them (see session.h), only logging and start up output read them directly.
+*/
+extern int verbose; // flag for setting verbose mode
+extern int is_server; // flag to check if host is client/server
+extern int pack_small_files; // batch small files into pack entries while zipping (see pack.h)
 
 #define min(a, b) ((a) > (b) ? (b) : (a))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+
+#ifdef FILERAIL_IMPLEMENTATION
+
+int verbose = 0;
+int is_server = 0;
+int pack_small_files = 1;
+
+#endif /* FILERAIL_IMPLEMENTATION */
 
 #endif
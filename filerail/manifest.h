@@ -0,0 +1,658 @@
+#ifndef _MANIFEST_H
+#define _MANIFEST_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <openssl/md5.h>
+
+#include "global.h"
+#include "constants.h"
+#include "protocol.h"
+#include "utils.h"
+#include "crypto.h"
+#include "session.h"
+
+/*
+	Manifest is the list of entries (files and directories) of a resource along with size, mtime and md5 hash of every file.
+	Paths are relative to resource dir, so they always start with resource name (same as zip entries).
+
+	Same structure is persisted in checkpoints directory as metadata cache. While building manifest (sender) or
+	diffing it (receiver), a file whose size, mtime and inode match the cache is not re-hashed. So re-syncing a huge
+	tree costs one lstat per entry, only new or changed files are read.
+*/
+
+// one entry of manifest (in memory)
+typedef struct _filerail_manifest_record {
+	char *path; // relative to resource dir
+	uint8_t entry_type; // MANIFEST_FILE or MANIFEST_DIR
+	bool needed; // receiver doesn't have this file (or it's content differs)
+	uint64_t size; // self-explanatory
+	uint64_t mtime; // modification time in nanoseconds
+	uint64_t ino; // inode number on host which owns the record (0 if unknown)
+	uint8_t hash[MD5_HASH_LENGTH]; // md5 hash of file content
+} filerail_manifest_record;
+
+// list of records + open addressing hash table on path (stores index + 1 of record, 0 means empty slot)
+typedef struct _filerail_manifest {
+	filerail_manifest_record *records;
+	size_t count;
+	size_t capacity;
+	uint32_t *table;
+	size_t table_size;
+} filerail_manifest;
+
+void filerail_manifest_init(filerail_manifest *m);
+void filerail_manifest_free(filerail_manifest *m);
+filerail_manifest_record *filerail_manifest_find(filerail_manifest *m, const char *path);
+filerail_manifest_record *filerail_manifest_add(filerail_manifest *m, const char *path, uint8_t entry_type);
+uint64_t filerail_mtime_ns(struct stat *s);
+void filerail_manifest_set_stat(filerail_manifest_record *record, struct stat *s);
+bool filerail_manifest_stat_matches(filerail_manifest_record *record, struct stat *s);
+void filerail_manifest_cache_path(const char *ckpt_path, const char *resource_dir, const char *resource_name,
+	char *cache_path);
+int filerail_manifest_load(filerail_session *s, filerail_manifest *m, const char *cache_path);
+int filerail_manifest_save(filerail_manifest *m, const char *cache_path);
+int filerail_manifest_scan(filerail_manifest *m, filerail_manifest *cache, const char *resource_dir,
+	const char *rel_path);
+int filerail_manifest_diff(filerail_manifest *m, filerail_manifest *cache, const char *resource_dir,
+	uint64_t *nneeded);
+int filerail_manifest_prune(filerail_session *s, filerail_manifest *m, const char *resource_dir, const char *rel_path,
+	uint64_t *nremoved);
+void filerail_manifest_refresh(filerail_manifest *m, const char *resource_dir);
+bool filerail_is_safe_path(const char *path, const char *resource_name);
+bool filerail_zip_manifest(struct zip_t *zip, const char *resource_dir, filerail_manifest *m);
+
+#ifdef FILERAIL_IMPLEMENTATION
+
+// FNV-1a, good enough for paths
+static uint64_t filerail_manifest_hash(const char *path) {
+	uint64_t h;
+
+	h = 14695981039346656037ULL;
+	while (*path) {
+		h ^= (uint8_t)*path++;
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+// (re)build hash table with table_size slots
+static bool filerail_manifest_rehash(filerail_manifest *m, size_t table_size) {
+	size_t i, slot;
+	uint32_t *table;
+
+	table = calloc(table_size, sizeof(uint32_t));
+	if (table == NULL) {
+		LOG(LOG_USER | LOG_ERR, "manifest.h filerail_manifest_rehash calloc\n");
+		return false;
+	}
+	for (i = 0; i < m->count; i++) {
+		slot = filerail_manifest_hash(m->records[i].path) & (table_size - 1);
+		while (table[slot] != 0) {
+			slot = (slot + 1) & (table_size - 1);
+		}
+		table[slot] = i + 1;
+	}
+	free(m->table);
+	m->table = table;
+	m->table_size = table_size;
+	return true;
+}
+
+void filerail_manifest_init(filerail_manifest *m) {
+	memset(m, 0, sizeof(filerail_manifest));
+}
+
+void filerail_manifest_free(filerail_manifest *m) {
+	size_t i;
+
+	for (i = 0; i < m->count; i++) {
+		free(m->records[i].path);
+	}
+	free(m->records);
+	free(m->table);
+	filerail_manifest_init(m);
+}
+
+// look up record by path, NULL if not found
+filerail_manifest_record *filerail_manifest_find(filerail_manifest *m, const char *path) {
+	size_t slot;
+
+	if (m->table_size == 0) {
+		return NULL;
+	}
+	slot = filerail_manifest_hash(path) & (m->table_size - 1);
+	while (m->table[slot] != 0) {
+		if (strcmp(m->records[m->table[slot] - 1].path, path) == 0) {
+			return &m->records[m->table[slot] - 1];
+		}
+		slot = (slot + 1) & (m->table_size - 1);
+	}
+	return NULL;
+}
+
+// append a zeroed record (pointers returned earlier are invalidated)
+filerail_manifest_record *filerail_manifest_add(filerail_manifest *m, const char *path, uint8_t entry_type) {
+	size_t slot, capacity;
+	filerail_manifest_record *records, *record;
+
+	// keep load factor of hash table below 0.5
+	if (2 * (m->count + 1) > m->table_size) {
+		if (!filerail_manifest_rehash(m, m->table_size == 0 ? MANIFEST_INITIAL_CAPACITY : 2 * m->table_size)) {
+			return NULL;
+		}
+	}
+	if (m->count == m->capacity) {
+		capacity = m->capacity == 0 ? MANIFEST_INITIAL_CAPACITY : 2 * m->capacity;
+		records = realloc(m->records, capacity * sizeof(filerail_manifest_record));
+		if (records == NULL) {
+			LOG(LOG_USER | LOG_ERR, "manifest.h filerail_manifest_add realloc\n");
+			return NULL;
+		}
+		m->records = records;
+		m->capacity = capacity;
+	}
+
+	record = &m->records[m->count];
+	memset(record, 0, sizeof(filerail_manifest_record));
+	record->path = strdup(path);
+	if (record->path == NULL) {
+		LOG(LOG_USER | LOG_ERR, "manifest.h filerail_manifest_add strdup\n");
+		return NULL;
+	}
+	record->entry_type = entry_type;
+	m->count++;
+
+	slot = filerail_manifest_hash(path) & (m->table_size - 1);
+	while (m->table[slot] != 0) {
+		slot = (slot + 1) & (m->table_size - 1);
+	}
+	m->table[slot] = m->count;
+	return record;
+}
+
+// modification time with nanoseconds precision
+uint64_t filerail_mtime_ns(struct stat *s) {
+	return (uint64_t)s->st_mtim.tv_sec * 1000000000ULL + s->st_mtim.tv_nsec;
+}
+
+void filerail_manifest_set_stat(filerail_manifest_record *record, struct stat *s) {
+	record->size = s->st_size;
+	record->mtime = filerail_mtime_ns(s);
+	record->ino = s->st_ino;
+}
+
+// if size, mtime and inode are same, file content is assumed to be same (hash can be reused)
+bool filerail_manifest_stat_matches(filerail_manifest_record *record, struct stat *s) {
+	return
+		record->ino != 0 &&
+		record->size == (uint64_t)s->st_size &&
+		record->mtime == filerail_mtime_ns(s) &&
+		record->ino == (uint64_t)s->st_ino;
+}
+
+// cache of every resource is named after md5 of it's path
+void filerail_manifest_cache_path(
+	const char *ckpt_path,
+	const char *resource_dir,
+	const char *resource_name,
+	char *cache_path)
+{
+	uint8_t hash[MD5_HASH_LENGTH];
+	char path[MAX_PATH_LENGTH], hex_str[MD5_HASH_STR_LENGTH];
+
+	snprintf(path, sizeof(path), "%s/%s", resource_dir, resource_name);
+	MD5((const uint8_t *)path, strlen(path), hash);
+	filerail_hash_to_str(hash, hex_str);
+	snprintf(cache_path, MAX_PATH_LENGTH, "%s/%s%s", ckpt_path, MANIFEST_CACHE_PREFIX, hex_str);
+}
+
+/*
+	Cache file format (host endianness, it never leaves the host):
+	magic | count | count * (path length (uint16) | path | entry type | size | mtime | inode | hash)
+*/
+
+// load cache, missing cache file is not an error (first sync)
+int filerail_manifest_load(filerail_session *s, filerail_manifest *m, const char *cache_path) {
+	int exit_status;
+	uint64_t i, count;
+	uint16_t path_len;
+	char magic[sizeof(MANIFEST_CACHE_MAGIC)], path[MAX_PATH_LENGTH];
+	FILE *fp;
+	filerail_manifest_record record, *ptr;
+
+	exit_status = 0;
+	fp = fopen(cache_path, "rb");
+	if (fp == NULL) {
+		if (errno != ENOENT) {
+			LOG(LOG_USER | LOG_ERR, "manifest.h filerail_manifest_load fopen\n");
+			exit_status = -1;
+		}
+		goto clean_up;
+	}
+
+	if (
+		fread(magic, 1, sizeof(magic), fp) != sizeof(magic) ||
+		memcmp(magic, MANIFEST_CACHE_MAGIC, sizeof(magic)) != 0 ||
+		fread(&count, sizeof(count), 1, fp) != 1
+	) {
+		// corrupted cache just means everything gets re-hashed
+		SESSION_PRINT(s, printf("Ignoring corrupted metadata cache...\n"));
+		goto clean_up;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (
+			fread(&path_len, sizeof(path_len), 1, fp) != 1 ||
+			path_len >= MAX_PATH_LENGTH ||
+			fread(path, 1, path_len, fp) != path_len ||
+			fread(&record.entry_type, sizeof(record.entry_type), 1, fp) != 1 ||
+			fread(&record.size, sizeof(record.size), 1, fp) != 1 ||
+			fread(&record.mtime, sizeof(record.mtime), 1, fp) != 1 ||
+			fread(&record.ino, sizeof(record.ino), 1, fp) != 1 ||
+			fread(record.hash, 1, MD5_HASH_LENGTH, fp) != MD5_HASH_LENGTH
+		) {
+			SESSION_PRINT(s, printf("Ignoring corrupted metadata cache...\n"));
+			filerail_manifest_free(m);
+			goto clean_up;
+		}
+		path[path_len] = '\0';
+		if ((ptr = filerail_manifest_add(m, path, record.entry_type)) == NULL) {
+			exit_status = -1;
+			goto clean_up;
+		}
+		ptr->size = record.size;
+		ptr->mtime = record.mtime;
+		ptr->ino = record.ino;
+		memcpy(ptr->hash, record.hash, MD5_HASH_LENGTH);
+	}
+
+	clean_up:
+	if (fp != NULL) {
+		fclose(fp);
+	}
+	return exit_status;
+}
+
+// save cache (written to tmp file and renamed, same as checkpoints)
+int filerail_manifest_save(filerail_manifest *m, const char *cache_path) {
+	int exit_status;
+	size_t i;
+	uint64_t count;
+	uint16_t path_len;
+	char tmp_cache_path[MAX_PATH_LENGTH];
+	FILE *fp;
+	filerail_manifest_record *record;
+
+	exit_status = 0;
+	snprintf(tmp_cache_path, sizeof(tmp_cache_path), "%s.tmp", cache_path);
+	fp = fopen(tmp_cache_path, "wb");
+	if (fp == NULL) {
+		LOG(LOG_USER | LOG_ERR, "manifest.h filerail_manifest_save fopen\n");
+		exit_status = -1;
+		goto clean_up;
+	}
+
+	count = m->count;
+	if (
+		fwrite(MANIFEST_CACHE_MAGIC, 1, sizeof(MANIFEST_CACHE_MAGIC), fp) != sizeof(MANIFEST_CACHE_MAGIC) ||
+		fwrite(&count, sizeof(count), 1, fp) != 1
+	) {
+		LOG(LOG_USER | LOG_ERR, "manifest.h filerail_manifest_save fwrite\n");
+		exit_status = -1;
+		goto clean_up;
+	}
+	for (i = 0; i < m->count; i++) {
+		record = &m->records[i];
+		path_len = strlen(record->path);
+		if (
+			fwrite(&path_len, sizeof(path_len), 1, fp) != 1 ||
+			fwrite(record->path, 1, path_len, fp) != path_len ||
+			fwrite(&record->entry_type, sizeof(record->entry_type), 1, fp) != 1 ||
+			fwrite(&record->size, sizeof(record->size), 1, fp) != 1 ||
+			fwrite(&record->mtime, sizeof(record->mtime), 1, fp) != 1 ||
+			fwrite(&record->ino, sizeof(record->ino), 1, fp) != 1 ||
+			fwrite(record->hash, 1, MD5_HASH_LENGTH, fp) != MD5_HASH_LENGTH
+		) {
+			LOG(LOG_USER | LOG_ERR, "manifest.h filerail_manifest_save fwrite\n");
+			exit_status = -1;
+			goto clean_up;
+		}
+	}
+	fflush(fp);
+	// it is important to close the file, before renaming
+	fclose(fp);
+	fp = NULL;
+
+	if (rename(tmp_cache_path, cache_path) == -1) {
+		LOG(LOG_USER | LOG_ERR, "manifest.h filerail_manifest_save rename\n");
+		exit_status = -1;
+	}
+
+	clean_up:
+	if (fp != NULL) {
+		fclose(fp);
+	}
+	return exit_status;
+}
+
+// state of a manifest scan, shared by walk threads
+typedef struct _filerail_manifest_scanner {
+	pthread_mutex_t lock; // guards m (cache is only read)
+	filerail_manifest *m;
+	filerail_manifest *cache;
+	size_t dir_len; // length of "<resource_dir>/", stripped from walked paths
+} filerail_manifest_scanner;
+
+static int filerail_manifest_path_cmp(const void *a, const void *b) {
+	return strcmp(((const filerail_manifest_record*)a)->path, ((const filerail_manifest_record*)b)->path);
+}
+
+// sort records by path (a directory comes before it's content), hash table is rebuilt
+static bool filerail_manifest_sort(filerail_manifest *m) {
+	if (m->count == 0) {
+		return true;
+	}
+	qsort(m->records, m->count, sizeof(filerail_manifest_record), filerail_manifest_path_cmp);
+	return filerail_manifest_rehash(m, m->table_size);
+}
+
+// add entry at path to manifest as rel_path, a file is hashed (outside the lock) unless cache has it
+static int filerail_manifest_scan_entry(filerail_manifest_scanner *sc, const char *path, const char *rel_path,
+	struct stat *s)
+{
+	int exit_status;
+	uint8_t hash[MD5_HASH_LENGTH];
+	filerail_manifest_record *record, *cached;
+
+	if (S_ISDIR(s->st_mode)) {
+		pthread_mutex_lock(&sc->lock);
+		exit_status = filerail_manifest_add(sc->m, rel_path, MANIFEST_DIR) == NULL ? -1 : 0;
+		pthread_mutex_unlock(&sc->lock);
+		return exit_status;
+	}
+	if (!S_ISREG(s->st_mode) && !S_ISLNK(s->st_mode)) {
+		// anything else (fifo, socket, device) can't be zipped, so it is skipped
+		return 0;
+	}
+	cached = sc->cache != NULL ? filerail_manifest_find(sc->cache, rel_path) : NULL;
+	if (
+		cached != NULL &&
+		cached->entry_type == MANIFEST_FILE &&
+		filerail_manifest_stat_matches(cached, s)
+	) {
+		memcpy(hash, cached->hash, MD5_HASH_LENGTH);
+	} else if (filerail_md5_file(hash, path) == -1) {
+		return -1;
+	}
+	exit_status = -1;
+	pthread_mutex_lock(&sc->lock);
+	if ((record = filerail_manifest_add(sc->m, rel_path, MANIFEST_FILE)) != NULL) {
+		filerail_manifest_set_stat(record, s);
+		memcpy(record->hash, hash, MD5_HASH_LENGTH);
+		exit_status = 0;
+	}
+	pthread_mutex_unlock(&sc->lock);
+	return exit_status;
+}
+
+static int filerail_manifest_scan_visit(filerail_walk_entry *entry, void *arg) {
+	filerail_manifest_scanner *sc;
+
+	sc = arg;
+	return filerail_manifest_scan_entry(sc, entry->path, entry->path + sc->dir_len, entry->stat);
+}
+
+/*
+	Build manifest of resource_dir/rel_path, hashes are reused from cache when stat matches.
+	Tree is walked (and new files hashed) in parallel, records are then sorted by path, so a directory
+	always comes before it's content (receiver creates directories in record order).
+*/
+int filerail_manifest_scan(
+	filerail_manifest *m,
+	filerail_manifest *cache,
+	const char *resource_dir,
+	const char *rel_path)
+{
+	int exit_status;
+	struct stat s;
+	char path[MAX_PATH_LENGTH];
+	filerail_manifest_scanner sc;
+
+	snprintf(path, sizeof(path), "%s/%s", resource_dir, rel_path);
+	if (lstat(path, &s) == -1) {
+		LOG(LOG_USER | LOG_ERR, "manifest.h filerail_manifest_scan lstat\n");
+		return -1;
+	}
+	pthread_mutex_init(&sc.lock, NULL);
+	sc.m = m;
+	sc.cache = cache;
+	sc.dir_len = strlen(resource_dir) + 1;
+	exit_status = filerail_manifest_scan_entry(&sc, path, rel_path, &s);
+	if (exit_status == 0 && S_ISDIR(s.st_mode)) {
+		exit_status = filerail_walk(path, WALK_STAT, WALK_THREADS, filerail_manifest_scan_visit, NULL, &sc);
+	}
+	pthread_mutex_destroy(&sc.lock);
+	if (exit_status == 0 && !filerail_manifest_sort(m)) {
+		exit_status = -1;
+	}
+	return exit_status;
+}
+
+/*
+	Receiver side: compare manifest sent by sender with files present in resource_dir.
+	Marks records which have to be sent, creates missing directories and removes entries whose type changed.
+	Records of files which are up to date are updated with local stat, so manifest can be saved as cache.
+*/
+int filerail_manifest_diff(
+	filerail_manifest *m,
+	filerail_manifest *cache,
+	const char *resource_dir,
+	uint64_t *nneeded)
+{
+	size_t i;
+	bool exists;
+	struct stat s;
+	char path[MAX_PATH_LENGTH];
+	uint8_t hash[MD5_HASH_LENGTH];
+	filerail_manifest_record *record, *cached;
+
+	*nneeded = 0;
+	for (i = 0; i < m->count; i++) {
+		record = &m->records[i];
+		snprintf(path, sizeof(path), "%s/%s", resource_dir, record->path);
+
+		exists = true;
+		if (lstat(path, &s) == -1) {
+			if (errno != ENOENT) {
+				LOG(LOG_USER | LOG_ERR, "manifest.h filerail_manifest_diff lstat\n");
+				return -1;
+			}
+			exists = false;
+		}
+
+		// file became a directory or vice versa
+		if (exists && S_ISDIR(s.st_mode) != (record->entry_type == MANIFEST_DIR)) {
+			if (filerail_rm(path) == -1) {
+				return -1;
+			}
+			exists = false;
+		}
+
+		if (record->entry_type == MANIFEST_DIR) {
+			// zip doesn't carry empty directories, so create them here
+			if (!exists && filerail_mkdir(path) == -1) {
+				return -1;
+			}
+			continue;
+		}
+
+		if (exists) {
+			cached = filerail_manifest_find(cache, record->path);
+			if (
+				cached != NULL &&
+				cached->entry_type == MANIFEST_FILE &&
+				filerail_manifest_stat_matches(cached, &s)
+			) {
+				memcpy(hash, cached->hash, MD5_HASH_LENGTH);
+			} else if (filerail_md5_file(hash, path) == -1) {
+				return -1;
+			}
+			if (memcmp(hash, record->hash, MD5_HASH_LENGTH) == 0) {
+				filerail_manifest_set_stat(record, &s);
+				continue;
+			}
+		}
+
+		record->needed = true;
+		(*nneeded)++;
+	}
+	return 0;
+}
+
+// state of a prune, shared by walk threads
+typedef struct _filerail_manifest_pruner {
+	filerail_session *s; // only read (prints)
+	filerail_manifest *m; // only read
+	size_t dir_len; // length of "<resource_dir>/", stripped from walked paths
+	uint64_t nremoved; // updated atomically
+} filerail_manifest_pruner;
+
+// remove entry at path if manifest has no rel_path, returns WALK_SKIP once it is removed
+static int filerail_manifest_prune_entry(filerail_manifest_pruner *p, const char *path, const char *rel_path) {
+	if (filerail_manifest_find(p->m, rel_path) != NULL) {
+		return 0;
+	}
+	SESSION_PRINT(p->s, printf("Removing %s...\n", path));
+	if (filerail_rm(path) == -1) {
+		return -1;
+	}
+	__atomic_fetch_add(&p->nremoved, 1, __ATOMIC_RELAXED);
+	return WALK_SKIP;
+}
+
+static int filerail_manifest_prune_visit(filerail_walk_entry *entry, void *arg) {
+	filerail_manifest_pruner *p;
+
+	p = arg;
+	return filerail_manifest_prune_entry(p, entry->path, entry->path + p->dir_len);
+}
+
+// receiver side: remove everything under resource_dir/rel_path which is not present in manifest
+int filerail_manifest_prune(filerail_session *s, filerail_manifest *m, const char *resource_dir, const char *rel_path,
+	uint64_t *nremoved)
+{
+	int ret;
+	struct stat st;
+	char path[MAX_PATH_LENGTH];
+	filerail_manifest_pruner p;
+
+	snprintf(path, sizeof(path), "%s/%s", resource_dir, rel_path);
+	if (lstat(path, &st) == -1) {
+		return 0;
+	}
+	p.s = s;
+	p.m = m;
+	p.dir_len = strlen(resource_dir) + 1;
+	p.nremoved = 0;
+	ret = filerail_manifest_prune_entry(&p, path, rel_path);
+	if (ret == 0 && S_ISDIR(st.st_mode)) {
+		ret = filerail_walk(path, 0, WALK_THREADS, filerail_manifest_prune_visit, NULL, &p);
+	}
+	*nremoved += p.nremoved;
+	return ret == -1 ? -1 : 0;
+}
+
+// receiver side: after needed files are extracted, record their local stat (hash is already known)
+void filerail_manifest_refresh(filerail_manifest *m, const char *resource_dir) {
+	size_t i;
+	struct stat s;
+	char path[MAX_PATH_LENGTH];
+	filerail_manifest_record *record;
+
+	for (i = 0; i < m->count; i++) {
+		record = &m->records[i];
+		if (!record->needed) {
+			continue;
+		}
+		snprintf(path, sizeof(path), "%s/%s", resource_dir, record->path);
+		if (lstat(path, &s) == -1) {
+			// never matches, so it gets re-hashed next time
+			record->ino = 0;
+		} else {
+			filerail_manifest_set_stat(record, &s);
+		}
+		record->needed = false;
+	}
+}
+
+// path sent by peer must stay inside resource (no absolute paths, no ..)
+bool filerail_is_safe_path(const char *path, const char *resource_name) {
+	size_t name_len;
+	const char *component;
+
+	name_len = strlen(resource_name);
+	if (strncmp(path, resource_name, name_len) != 0 || (path[name_len] != '\0' && path[name_len] != '/')) {
+		return false;
+	}
+	component = path;
+	while (component != NULL) {
+		if (!strncmp(component, "..", 2) && (component[2] == '/' || component[2] == '\0')) {
+			return false;
+		}
+		component = strchr(component, '/');
+		if (component != NULL) {
+			component++;
+		}
+	}
+	return true;
+}
+
+// zip only the files marked as needed (entries are named by their path relative to resource dir)
+static int filerail_manifest_record_cmp(const void *a, const void *b) {
+	return strcmp((*(filerail_manifest_record* const*)a)->path, (*(filerail_manifest_record* const*)b)->path);
+}
+
+bool filerail_zip_manifest(struct zip_t *zip, const char *resource_dir, filerail_manifest *m) {
+	size_t i, n;
+	bool exit_status;
+	char path[MAX_PATH_LENGTH];
+	filerail_manifest_record **needed;
+
+	// zip in path order (not scan order), so that archive is deterministic
+	needed = malloc((m->count + 1) * sizeof(filerail_manifest_record*));
+	if (needed == NULL) {
+		LOG(LOG_USER | LOG_ERR, "manifest.h filerail_zip_manifest malloc\n");
+		return false;
+	}
+	n = 0;
+	for (i = 0; i < m->count; i++) {
+		if (m->records[i].needed && m->records[i].entry_type == MANIFEST_FILE) {
+			needed[n++] = &m->records[i];
+		}
+	}
+	qsort(needed, n, sizeof(filerail_manifest_record*), filerail_manifest_record_cmp);
+
+	exit_status = true;
+	for (i = 0; i < n; i++) {
+		snprintf(path, sizeof(path), "%s/%s", resource_dir, needed[i]->path);
+		if (!filerail_zip_entry(zip, path, needed[i]->path)) {
+			LOG(LOG_USER | LOG_ERR, "manifest.h filerail_zip_manifest\n");
+			exit_status = false;
+			break;
+		}
+	}
+	free(needed);
+	return exit_status;
+}
+
+#endif /* FILERAIL_IMPLEMENTATION */
+
+#endif
@@ -0,0 +1,283 @@
+#ifndef _MASTER_H
+#define _MASTER_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "global.h"
+#include "constants.h"
+#include "socket.h"
+
+/*
+	Multi worker mode of server.
+
+	Master opens n listening sockets on the same address (SO_REUSEPORT), and forks one acceptor per socket,
+	optionally pinned to a core. Kernel spreads incoming connections across the sockets, so accepting scales
+	with the number of acceptors. Each acceptor serves it's socket like a single server would (a process per
+	connection, or event mode). Master only supervises: an acceptor that dies is restarted on the same socket,
+	so connections waiting in it's accept queue are not lost.
+
+	Graceful restart (binary upgrade), on SIGHUP to master:
+	1. master executes the (new) binary with the same arguments, passing it a pipe in MASTER_READY_ENV
+	2. new server opens it's own listeners next to the old ones and writes to the pipe
+	3. old master sends SIGTERM to it's acceptors: each one accepts what is already queued on it's socket,
+	   closes it, lets running sessions complete and exits, then old master exits
+	Sessions in flight are never interrupted. If new server doesn't report ready in MASTER_READY_TIME_OUT
+	seconds, old server keeps running.
+	State shared by processes of a server (bandwidth shaping, admission queues) is created anew by the new server,
+	old and new one each enforce their limits while the old one drains (see shaper.h).
+*/
+
+// serves listening socket until *stop is set
+typedef int (*filerail_listener_fn)(int listen_fd, volatile sig_atomic_t *stop, void *arg);
+
+int filerail_master_run(char *ip, char *port, int nworkers, bool pin, filerail_listener_fn serve, void *arg,
+	const char *self_path, char *argv[]);
+void filerail_master_ready(void);
+
+#ifdef FILERAIL_IMPLEMENTATION
+
+static volatile sig_atomic_t filerail_master_reload = 0;
+static volatile sig_atomic_t filerail_master_stop = 0;
+
+static void filerail_master_signal(int signum) {
+	if (signum == SIGHUP) {
+		filerail_master_reload = 1;
+	} else if (signum == SIGTERM || signum == SIGINT) {
+		filerail_master_stop = 1;
+	}
+}
+
+// acceptors reap their session processes
+static void filerail_master_reap(int signum) {
+	while (waitpid(-1, NULL, WNOHANG) > 0) {
+		;
+	}
+}
+
+// tell the server that executed this one (graceful restart) that listeners are up
+void filerail_master_ready(void) {
+	char *env;
+	int fd;
+	char ready;
+
+	if ((env = getenv(MASTER_READY_ENV)) == NULL) {
+		return;
+	}
+	fd = atoi(env);
+	ready = 1;
+	if (write(fd, &ready, 1) != 1) {
+		LOG(LOG_USER | LOG_ERR, "master.h filerail_master_ready write\n");
+	}
+	close(fd);
+	unsetenv(MASTER_READY_ENV);
+}
+
+static pid_t filerail_master_spawn(int *fds, int nworkers, int i, bool pin, filerail_listener_fn serve, void *arg) {
+	int j, ncpu;
+	pid_t pid;
+	cpu_set_t set;
+	struct sigaction act;
+
+	if ((pid = fork()) != 0) {
+		if (pid == -1) {
+			LOG(LOG_USER | LOG_ERR, "master.h filerail_master_spawn fork\n");
+		}
+		return pid;
+	}
+	for (j = 0; j < nworkers; j++) {
+		if (j != i) {
+			close(fds[j]);
+		}
+	}
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = &filerail_master_reap;
+	sigaction(SIGCHLD, &act, NULL);
+	act.sa_handler = &filerail_master_signal;
+	sigaction(SIGTERM, &act, NULL);
+	signal(SIGHUP, SIG_IGN);
+	if (pin) {
+		ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		j = i % (ncpu > 0 ? ncpu : 1);
+		CPU_ZERO(&set);
+		CPU_SET(j, &set);
+		if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+			LOG(LOG_USER | LOG_ERR, "master.h filerail_master_spawn sched_setaffinity\n");
+		}
+		// prefer this socket for connections whose packets arrive on this core
+		setsockopt(fds[i], SOL_SOCKET, SO_INCOMING_CPU, &j, sizeof(j));
+	}
+	_exit(serve(fds[i], &filerail_master_stop, arg) == -1 ? 1 : 0);
+}
+
+// execute new binary and wait until it is listening, returns 0 if it took over
+static int filerail_master_exec(int *fds, int nworkers, const char *self_path, char *argv[]) {
+	int p[2], i, ret;
+	pid_t pid;
+	char env[16], ready;
+	struct pollfd pfd;
+
+	if (pipe(p) == -1) {
+		LOG(LOG_USER | LOG_ERR, "master.h filerail_master_exec pipe\n");
+		return -1;
+	}
+	if ((pid = fork()) == -1) {
+		LOG(LOG_USER | LOG_ERR, "master.h filerail_master_exec fork\n");
+		close(p[0]);
+		close(p[1]);
+		return -1;
+	}
+	if (pid == 0) {
+		// new server must not hold on to old listeners
+		for (i = 0; i < nworkers; i++) {
+			close(fds[i]);
+		}
+		close(p[0]);
+		snprintf(env, sizeof(env), "%d", p[1]);
+		setenv(MASTER_READY_ENV, env, 1);
+		signal(SIGHUP, SIG_DFL);
+		signal(SIGTERM, SIG_DFL);
+		signal(SIGCHLD, SIG_DFL);
+		execv(self_path, argv);
+		LOG(LOG_USER | LOG_ERR, "master.h filerail_master_exec execv\n");
+		_exit(1);
+	}
+	close(p[1]);
+	pfd.fd = p[0];
+	pfd.events = POLLIN;
+	while ((ret = poll(&pfd, 1, MASTER_READY_TIME_OUT * 1000)) == -1 && errno == EINTR) {
+		;
+	}
+	ret = ret == 1 && read(p[0], &ready, 1) == 1 ? 0 : -1;
+	close(p[0]);
+	if (ret == -1) {
+		LOG(LOG_USER | LOG_INFO, "master.h filerail_master_exec new server not ready, keeping old one\n");
+	}
+	return ret;
+}
+
+// run nworkers acceptors on ip:port (0 is one per core), returns once stopped or replaced
+int filerail_master_run(char *ip, char *port, int nworkers, bool pin, filerail_listener_fn serve, void *arg,
+	const char *self_path, char *argv[])
+{
+	int i, status, exit_status, alive;
+	int *fds;
+	pid_t pid, *pids;
+	time_t *started;
+	bool draining;
+	struct sigaction act;
+
+	if (nworkers <= 0 && (nworkers = sysconf(_SC_NPROCESSORS_ONLN)) <= 0) {
+		nworkers = 1;
+	}
+	exit_status = 0;
+	draining = false;
+	fds = calloc(nworkers, sizeof(int));
+	pids = calloc(nworkers, sizeof(pid_t));
+	started = calloc(nworkers, sizeof(time_t));
+	if (fds == NULL || pids == NULL || started == NULL) {
+		LOG(LOG_USER | LOG_ERR, "master.h filerail_master_run calloc\n");
+		exit_status = -1;
+		goto clean_up;
+	}
+	for (i = 0; i < nworkers; i++) {
+		fds[i] = -1;
+	}
+	for (i = 0; i < nworkers; i++) {
+		if ((fds[i] = filerail_create_tcp_server(ip, port)) == -1) {
+			exit_status = -1;
+			goto clean_up;
+		}
+	}
+	filerail_master_ready();
+
+	// master reaps acceptors itself
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = &filerail_master_signal;
+	sigaction(SIGHUP, &act, NULL);
+	sigaction(SIGTERM, &act, NULL);
+	signal(SIGCHLD, SIG_DFL);
+
+	alive = 0;
+	for (i = 0; i < nworkers; i++) {
+		pids[i] = filerail_master_spawn(fds, nworkers, i, pin, serve, arg);
+		started[i] = time(NULL);
+		alive += pids[i] > 0;
+	}
+
+	while (alive > 0) {
+		if (!draining && filerail_master_reload) {
+			filerail_master_reload = 0;
+			if (filerail_master_exec(fds, nworkers, self_path, argv) == 0) {
+				filerail_master_stop = 1;
+			}
+		}
+		if (!draining && filerail_master_stop) {
+			// acceptors finish what they have, new connections go to the new server (or nowhere)
+			draining = true;
+			for (i = 0; i < nworkers; i++) {
+				if (pids[i] > 0) {
+					kill(pids[i], SIGTERM);
+				}
+				close(fds[i]);
+				fds[i] = -1;
+			}
+		}
+		if ((pid = waitpid(-1, &status, 0)) == -1) {
+			if (errno == ECHILD) {
+				break;
+			}
+			continue;
+		}
+		for (i = 0; i < nworkers && pids[i] != pid; i++) {
+			;
+		}
+		if (i == nworkers) {
+			// not an acceptor (trash deleter)
+			continue;
+		}
+		if (draining) {
+			pids[i] = -1;
+			alive--;
+			continue;
+		}
+		LOG(LOG_USER | LOG_ERR, "master.h filerail_master_run acceptor died, restarting\n");
+		// don't spin on an acceptor which can't start
+		if (time(NULL) - started[i] < 1) {
+			sleep(1);
+		}
+		pids[i] = filerail_master_spawn(fds, nworkers, i, pin, serve, arg);
+		started[i] = time(NULL);
+		if (pids[i] == -1) {
+			alive--;
+		}
+	}
+
+	clean_up:
+	if (fds != NULL) {
+		for (i = 0; i < nworkers; i++) {
+			if (fds[i] != -1) {
+				close(fds[i]);
+			}
+		}
+	}
+	free(fds);
+	free(pids);
+	free(started);
+	return exit_status;
+}
+
+#endif /* FILERAIL_IMPLEMENTATION */
+
+#endif
@@ -0,0 +1,587 @@
+#ifndef _MUX_H
+#define _MUX_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <arpa/inet.h>
+
+#include "global.h"
+#include "constants.h"
+#include "protocol.h"
+
+/*
+	Stream multiplexing.
+
+	After MUX (answered with OK) connection carries frames instead of messages:
+	stream id (uint32) | type (uint8) | length (uint32) | payload      (network byte order)
+	Stream is opened by client with it's first frame, and ends once both sides sent MUX_FIN.
+
+	Every stream is a unix socketpair: one end is the fd a session runs on (a client job, or a server thread
+	serving the stream like a connection), the other end is pumped by filerail_mux_run. So every operation runs
+	on a stream unchanged, and many of them share one connection.
+
+	Flow control: a side sends at most MUX_WINDOW_SIZE bytes of a stream which the other side hasn't consumed
+	yet (written to the stream's socketpair), receiver returns credit with MUX_WINDOW once a quarter of the
+	window is consumed. Receiver can always buffer what it is sent, so reading the connection never waits on a
+	slow stream: a stream which doesn't keep up stalls only itself.
+	Scheduling: streams take turns (round robin), one frame of at most MUX_FRAME_SIZE bytes per turn, so a
+	small transfer waits for at most one frame of every other stream, not behind a whole large one.
+*/
+
+// serves a stream opened by peer, fd is it's end of the stream (closed by callee)
+typedef int (*filerail_stream_fn)(int fd, void *arg);
+
+typedef struct _filerail_mux_stream {
+	bool used;
+	uint32_t id;
+	int fd; // pump end of socketpair
+	uint8_t *in; // received from peer, not yet written to fd
+	uint32_t in_len;
+	uint32_t window; // bytes which may still be sent to peer
+	uint32_t consumed; // bytes written to fd, not yet credited to peer
+	bool readable; // fd polled readable
+	bool eof; // local end done sending, MUX_FIN due
+	bool fin_sent;
+	bool peer_fin; // peer done sending, fd is shut down for writing once in is drained
+	bool shut;
+	bool broken; // local end gone, what peer sends is dropped
+	bool has_thread;
+	pthread_t thread; // serves stream opened by peer
+} filerail_mux_stream;
+
+typedef struct _filerail_mux {
+	int fd; // connection
+	int wake[2]; // wakes pump when a stream is opened, or on shutdown
+	filerail_stream_fn accept; // NULL if peer can't open streams (client)
+	void *arg;
+	pthread_mutex_t lock;
+	filerail_mux_stream streams[MUX_MAX_STREAMS];
+	uint32_t next_id;
+	bool closing;
+	unsigned int rr; // scheduler's next turn
+	uint8_t out[MUX_OUT_FRAMES * (MUX_HEADER_SIZE + MUX_FRAME_SIZE)]; // frames for connection
+	size_t out_len;
+	uint8_t in[MUX_HEADER_SIZE + MUX_FRAME_SIZE]; // frame(s) read from connection
+	size_t in_len;
+} filerail_mux;
+
+int filerail_mux_init(filerail_mux *m, int fd, filerail_stream_fn accept, void *arg);
+int filerail_mux_open(filerail_mux *m);
+void filerail_mux_shutdown(filerail_mux *m);
+int filerail_mux_run(filerail_mux *m);
+void filerail_mux_free(filerail_mux *m);
+
+// arguments of a thread serving a stream opened by peer
+typedef struct _filerail_mux_thread_arg {
+	filerail_mux *m;
+	int fd;
+} filerail_mux_thread_arg;
+
+#ifdef FILERAIL_IMPLEMENTATION
+
+static int filerail_mux_nonblock(int fd) {
+	int flags;
+
+	if ((flags = fcntl(fd, F_GETFL)) == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+		LOG(LOG_USER | LOG_ERR, "mux.h filerail_mux_nonblock fcntl\n");
+		return -1;
+	}
+	return 0;
+}
+
+// m (connection) of a side, accept serves streams opened by peer (NULL on client)
+int filerail_mux_init(filerail_mux *m, int fd, filerail_stream_fn accept, void *arg) {
+	memset(m->streams, 0, sizeof(m->streams));
+	m->fd = fd;
+	m->accept = accept;
+	m->arg = arg;
+	m->next_id = 1;
+	m->closing = false;
+	m->rr = 0;
+	m->out_len = m->in_len = 0;
+	if (pipe(m->wake) == -1) {
+		LOG(LOG_USER | LOG_ERR, "mux.h filerail_mux_init pipe\n");
+		return -1;
+	}
+	if (
+		filerail_mux_nonblock(m->fd) == -1 || filerail_mux_nonblock(m->wake[0]) == -1 ||
+		filerail_mux_nonblock(m->wake[1]) == -1
+	) {
+		close(m->wake[0]);
+		close(m->wake[1]);
+		return -1;
+	}
+	pthread_mutex_init(&m->lock, NULL);
+	return 0;
+}
+
+void filerail_mux_free(filerail_mux *m) {
+	close(m->wake[0]);
+	close(m->wake[1]);
+	pthread_mutex_destroy(&m->lock);
+}
+
+static void filerail_mux_wake(filerail_mux *m) {
+	char c;
+
+	c = 1;
+	// pipe full means pump is going to wake anyway
+	if (write(m->wake[1], &c, 1) == -1 && errno != EAGAIN) {
+		LOG(LOG_USER | LOG_ERR, "mux.h filerail_mux_wake write\n");
+	}
+}
+
+// caller holds lock
+static filerail_mux_stream* filerail_mux_find(filerail_mux *m, uint32_t id) {
+	int i;
+
+	for (i = 0; i < MUX_MAX_STREAMS; i++) {
+		if (m->streams[i].used && m->streams[i].id == id) {
+			return &m->streams[i];
+		}
+	}
+	return NULL;
+}
+
+// caller holds lock, fd is pump end of stream
+static filerail_mux_stream* filerail_mux_add(filerail_mux *m, uint32_t id, int fd) {
+	int i;
+	filerail_mux_stream *st;
+
+	for (i = 0; i < MUX_MAX_STREAMS && m->streams[i].used; i++) {
+		;
+	}
+	if (i == MUX_MAX_STREAMS) {
+		LOG(LOG_USER | LOG_ERR, "mux.h filerail_mux_add too many streams\n");
+		return NULL;
+	}
+	st = &m->streams[i];
+	memset(st, 0, sizeof(*st));
+	if ((st->in = malloc(MUX_WINDOW_SIZE)) == NULL) {
+		LOG(LOG_USER | LOG_ERR, "mux.h filerail_mux_add malloc\n");
+		return NULL;
+	}
+	if (filerail_mux_nonblock(fd) == -1) {
+		free(st->in);
+		return NULL;
+	}
+	st->used = true;
+	st->id = id;
+	st->fd = fd;
+	st->window = MUX_WINDOW_SIZE;
+	return st;
+}
+
+// caller holds lock
+static void filerail_mux_remove(filerail_mux *m, filerail_mux_stream *st) {
+	close(st->fd);
+	free(st->in);
+	if (st->has_thread) {
+		// thread is done (or about to be), it closed it's end
+		pthread_mutex_unlock(&m->lock);
+		pthread_join(st->thread, NULL);
+		pthread_mutex_lock(&m->lock);
+	}
+	st->used = false;
+}
+
+// drop streams which ended both ways, caller holds lock
+static void filerail_mux_reap(filerail_mux *m) {
+	int i;
+
+	for (i = 0; i < MUX_MAX_STREAMS; i++) {
+		if (m->streams[i].used && m->streams[i].fin_sent && m->streams[i].shut) {
+			filerail_mux_remove(m, &m->streams[i]);
+		}
+	}
+}
+
+/*
+	New stream, returns the fd to run a session on (closed by caller once done).
+	Client only, may be called from any thread while filerail_mux_run is pumping.
+*/
+int filerail_mux_open(filerail_mux *m) {
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+		LOG(LOG_USER | LOG_ERR, "mux.h filerail_mux_open socketpair\n");
+		return -1;
+	}
+	pthread_mutex_lock(&m->lock);
+	if (m->closing || filerail_mux_add(m, m->next_id, sv[0]) == NULL) {
+		pthread_mutex_unlock(&m->lock);
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+	m->next_id++;
+	pthread_mutex_unlock(&m->lock);
+	filerail_mux_wake(m);
+	return sv[1];
+}
+
+// no more streams, filerail_mux_run returns once open ones end
+void filerail_mux_shutdown(filerail_mux *m) {
+	pthread_mutex_lock(&m->lock);
+	m->closing = true;
+	pthread_mutex_unlock(&m->lock);
+	filerail_mux_wake(m);
+}
+
+static void* filerail_mux_thread(void *ptr) {
+	filerail_mux_thread_arg *arg;
+	sigset_t set;
+
+	// a stream cut off fails with EPIPE, instead of killing the process
+	sigemptyset(&set);
+	sigaddset(&set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+	arg = ptr;
+	arg->m->accept(arg->fd, arg->m->arg);
+	free(arg);
+	return NULL;
+}
+
+// caller holds lock, peer opened stream id
+static filerail_mux_stream* filerail_mux_accept(filerail_mux *m, uint32_t id) {
+	int sv[2];
+	filerail_mux_stream *st;
+	filerail_mux_thread_arg *arg;
+
+	if (m->accept == NULL) {
+		LOG(LOG_USER | LOG_ERR, "PROTOCOL NOT FOLLOWED\n");
+		return NULL;
+	}
+	// peer reuses slots as soon as it has seen both FINs, which may be before this side dropped them
+	filerail_mux_reap(m);
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+		LOG(LOG_USER | LOG_ERR, "mux.h filerail_mux_accept socketpair\n");
+		return NULL;
+	}
+	if ((st = filerail_mux_add(m, id, sv[0])) == NULL) {
+		close(sv[0]);
+		close(sv[1]);
+		return NULL;
+	}
+	if ((arg = malloc(sizeof(*arg))) == NULL) {
+		LOG(LOG_USER | LOG_ERR, "mux.h filerail_mux_accept malloc\n");
+		close(sv[1]);
+		return st;
+	}
+	arg->m = m;
+	arg->fd = sv[1];
+	if (pthread_create(&st->thread, NULL, filerail_mux_thread, arg) != 0) {
+		LOG(LOG_USER | LOG_ERR, "mux.h filerail_mux_accept pthread_create\n");
+		free(arg);
+		// stream ends right away, peer sees it closed
+		close(sv[1]);
+		return st;
+	}
+	st->has_thread = true;
+	return st;
+}
+
+// write what peer sent to stream, caller holds lock
+static void filerail_mux_deliver(filerail_mux_stream *st) {
+	ssize_t n;
+
+	if (st->in_len != 0 && !st->broken) {
+		n = send(st->fd, st->in, st->in_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n > 0) {
+			memmove(st->in, st->in + n, st->in_len - n);
+			st->in_len -= n;
+			st->consumed += n;
+		} else if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+			st->broken = true;
+		}
+	}
+	if (st->broken) {
+		st->consumed += st->in_len;
+		st->in_len = 0;
+	}
+	if (st->peer_fin && st->in_len == 0 && !st->shut) {
+		shutdown(st->fd, SHUT_WR);
+		st->shut = true;
+	}
+}
+
+// handle a frame read from connection, caller holds lock
+static int filerail_mux_frame_in(filerail_mux *m, uint32_t id, uint8_t type, uint8_t *payload, uint32_t len) {
+	uint32_t credit;
+	filerail_mux_stream *st;
+
+	st = filerail_mux_find(m, id);
+	if (type == MUX_WINDOW) {
+		if (st != NULL && len == sizeof(credit)) {
+			memcpy(&credit, payload, sizeof(credit));
+			st->window += ntohl(credit);
+		}
+		return 0;
+	}
+	if (type != MUX_DATA && type != MUX_FIN) {
+		LOG(LOG_USER | LOG_ERR, "PROTOCOL NOT FOLLOWED\n");
+		return -1;
+	}
+	if (st == NULL && (st = filerail_mux_accept(m, id)) == NULL) {
+		return -1;
+	}
+	if (st->peer_fin) {
+		LOG(LOG_USER | LOG_ERR, "PROTOCOL NOT FOLLOWED\n");
+		return -1;
+	}
+	if (type == MUX_FIN) {
+		st->peer_fin = true;
+	} else {
+		if (st->in_len + len > MUX_WINDOW_SIZE) {
+			LOG(LOG_USER | LOG_ERR, "mux.h filerail_mux_frame_in window exceeded\n");
+			return -1;
+		}
+		memcpy(st->in + st->in_len, payload, len);
+		st->in_len += len;
+	}
+	filerail_mux_deliver(st);
+	return 0;
+}
+
+// read frames from connection, returns 1 once peer closed it
+static int filerail_mux_read(filerail_mux *m) {
+	ssize_t n;
+	size_t off;
+	uint32_t id, len;
+
+	n = recv(m->fd, m->in + m->in_len, sizeof(m->in) - m->in_len, MSG_DONTWAIT);
+	if (n == 0) {
+		return 1;
+	}
+	if (n == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			return 0;
+		}
+		LOG(LOG_USER | LOG_ERR, "mux.h filerail_mux_read recv\n");
+		return -1;
+	}
+	m->in_len += n;
+	off = 0;
+	while (m->in_len - off >= MUX_HEADER_SIZE) {
+		memcpy(&id, m->in + off, sizeof(id));
+		memcpy(&len, m->in + off + 5, sizeof(len));
+		id = ntohl(id);
+		len = ntohl(len);
+		if (len > MUX_FRAME_SIZE) {
+			LOG(LOG_USER | LOG_ERR, "PROTOCOL NOT FOLLOWED\n");
+			return -1;
+		}
+		if (m->in_len - off < MUX_HEADER_SIZE + len) {
+			break;
+		}
+		if (filerail_mux_frame_in(m, id, m->in[off + 4], m->in + off + MUX_HEADER_SIZE, len) == -1) {
+			return -1;
+		}
+		off += MUX_HEADER_SIZE + len;
+	}
+	memmove(m->in, m->in + off, m->in_len - off);
+	m->in_len -= off;
+	return 0;
+}
+
+// queue frame header, payload is already in place after it
+static void filerail_mux_frame_out(filerail_mux *m, uint32_t id, uint8_t type, uint32_t len) {
+	uint8_t *p;
+
+	p = m->out + m->out_len;
+	id = htonl(id);
+	memcpy(p, &id, sizeof(id));
+	p[4] = type;
+	len = htonl(len);
+	memcpy(p + 5, &len, sizeof(len));
+	m->out_len += MUX_HEADER_SIZE + ntohl(len);
+}
+
+// queue control frames (credit, FIN) and one data frame per stream with something to send, caller holds lock
+static void filerail_mux_schedule(filerail_mux *m) {
+	int i, k;
+	ssize_t n;
+	uint32_t credit;
+	filerail_mux_stream *st;
+
+	for (i = 0; i < MUX_MAX_STREAMS; i++) {
+		st = &m->streams[i];
+		if (!st->used) {
+			continue;
+		}
+		if (st->consumed >= MUX_WINDOW_SIZE / 4 && sizeof(m->out) - m->out_len >= MUX_HEADER_SIZE + sizeof(credit)) {
+			credit = htonl(st->consumed);
+			memcpy(m->out + m->out_len + MUX_HEADER_SIZE, &credit, sizeof(credit));
+			filerail_mux_frame_out(m, st->id, MUX_WINDOW, sizeof(credit));
+			st->consumed = 0;
+		}
+	}
+	for (k = 0; k < MUX_MAX_STREAMS; k++) {
+		st = &m->streams[(m->rr + k) % MUX_MAX_STREAMS];
+		if (!st->used || st->fin_sent) {
+			continue;
+		}
+		if (!st->eof && st->readable && st->window != 0) {
+			if (sizeof(m->out) - m->out_len < MUX_HEADER_SIZE + MUX_FRAME_SIZE) {
+				break;
+			}
+			n = recv(st->fd, m->out + m->out_len + MUX_HEADER_SIZE, min(MUX_FRAME_SIZE, st->window), MSG_DONTWAIT);
+			if (n > 0) {
+				filerail_mux_frame_out(m, st->id, MUX_DATA, n);
+				st->window -= n;
+			} else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+				st->eof = true;
+			}
+			st->readable = false;
+		}
+		if (st->eof && sizeof(m->out) - m->out_len >= MUX_HEADER_SIZE) {
+			filerail_mux_frame_out(m, st->id, MUX_FIN, 0);
+			st->fin_sent = true;
+		}
+	}
+	// a stream cut off by a full queue has the next turn
+	m->rr = (m->rr + (k < MUX_MAX_STREAMS ? k : 1)) % MUX_MAX_STREAMS;
+}
+
+// write queued frames to connection
+static int filerail_mux_write(filerail_mux *m) {
+	ssize_t n;
+
+	n = send(m->fd, m->out, m->out_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (n == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			return 0;
+		}
+		LOG(LOG_USER | LOG_ERR, "mux.h filerail_mux_write send\n");
+		return -1;
+	}
+	memmove(m->out, m->out + n, m->out_len - n);
+	m->out_len -= n;
+	return 0;
+}
+
+/*
+	Pump frames between connection and streams until the connection ends: peer closed it, or (client)
+	filerail_mux_shutdown was called and every stream ended. Streams still open then are cut off.
+	Returns -1 if connection failed, or ended with streams still open.
+*/
+int filerail_mux_run(filerail_mux *m) {
+	int i, n, ret, exit_status, timeout;
+	int slot[MUX_MAX_STREAMS];
+	bool shut, idle;
+	char drain[64];
+	struct pollfd pfds[MUX_MAX_STREAMS + 2];
+	filerail_mux_stream *st;
+
+	exit_status = 0;
+	shut = false;
+	pthread_mutex_lock(&m->lock);
+	while (true) {
+		filerail_mux_reap(m);
+		idle = true;
+		for (i = 0; i < MUX_MAX_STREAMS; i++) {
+			idle = idle && !m->streams[i].used;
+		}
+		filerail_mux_schedule(m);
+		if (m->closing && idle && m->out_len == 0 && !shut) {
+			// peer closes the connection in turn
+			shutdown(m->fd, SHUT_WR);
+			shut = true;
+		}
+
+		pfds[0].fd = m->fd;
+		pfds[0].events = (m->in_len < sizeof(m->in) ? POLLIN : 0) | (m->out_len != 0 ? POLLOUT : 0);
+		pfds[1].fd = m->wake[0];
+		pfds[1].events = POLLIN;
+		n = 2;
+		for (i = 0; i < MUX_MAX_STREAMS; i++) {
+			st = &m->streams[i];
+			if (!st->used) {
+				continue;
+			}
+			pfds[n].fd = st->fd;
+			pfds[n].events = 0;
+			if (!st->eof && !st->readable && st->window != 0) {
+				pfds[n].events |= POLLIN;
+			}
+			if (st->in_len != 0 && !st->broken) {
+				pfds[n].events |= POLLOUT;
+			}
+			slot[n - 2] = i;
+			n++;
+		}
+		// an idle connection is given as long as a session waiting for a command (see deadline.h)
+		timeout = idle ? COMMAND_TIME_OUT * 1000 : -1;
+		pthread_mutex_unlock(&m->lock);
+		ret = poll(pfds, n, timeout);
+		pthread_mutex_lock(&m->lock);
+		if (ret == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			LOG(LOG_USER | LOG_ERR, "mux.h filerail_mux_run poll\n");
+			exit_status = -1;
+			break;
+		}
+		if (ret == 0) {
+			break;
+		}
+		if (pfds[1].revents & POLLIN) {
+			while (read(m->wake[0], drain, sizeof(drain)) > 0) {
+				;
+			}
+		}
+		for (i = 2; i < n; i++) {
+			st = &m->streams[slot[i - 2]];
+			if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+				st->readable = true;
+			}
+			if (pfds[i].revents & (POLLOUT | POLLERR)) {
+				filerail_mux_deliver(st);
+			}
+		}
+		if (pfds[0].revents & POLLOUT && filerail_mux_write(m) == -1) {
+			exit_status = -1;
+			break;
+		}
+		if (pfds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+			if ((ret = filerail_mux_read(m)) == -1) {
+				exit_status = -1;
+				break;
+			}
+			if (ret == 1) {
+				break;
+			}
+		}
+	}
+
+	// connection is done, streams still open see their end closed
+	for (i = 0; i < MUX_MAX_STREAMS; i++) {
+		st = &m->streams[i];
+		if (st->used) {
+			if (!(st->fin_sent && st->shut)) {
+				exit_status = -1;
+			}
+			shutdown(st->fd, SHUT_RDWR);
+			filerail_mux_remove(m, st);
+		}
+	}
+	m->closing = true;
+	pthread_mutex_unlock(&m->lock);
+	return exit_status;
+}
+
+#endif /* FILERAIL_IMPLEMENTATION */
+
+#endif
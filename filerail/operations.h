@@ -8,6 +8,11 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <pthread.h>
 
 #include "global.h"
 #include "constants.h"
@@ -15,374 +20,1119 @@
 #include "socket.h"
 #include "utils.h"
 #include "crypto.h"
+#include "session.h"
+#include "manifest.h"
+#include "chunker.h"
+#include "chunkstore.h"
+#include "archive_cache.h"
+#include "publish.h"
+
+/*
+	Archive of a GET prepared by a child process while step by step handshake goes on (server would otherwise wait
+	for client's OK before zipping anything). Child reports status and hash of archive through a pipe, and is
+	killed if client ABORTs, it's partial archive is removed.
+	A process running other threads (streams of a multiplexed connection) can't fork safely, archive is built by a
+	thread of it's own there, which reports through the pipe the same way. A thread can't be killed, an ABORTed
+	job waits for it.
+*/
+typedef struct _filerail_archive_job {
+	pid_t pid; // -1 if there is no child (cache hit, or archive was built without one)
+	bool threaded; // archive is built by thread instead of child
+	pthread_t thread;
+	int fd; // read end of pipe
+	int out; // write end of pipe, thread closes it once it reported
+	const char *cache_path; // NULL if archive isn't cached
+	bool published; // archive is cache's now
+	char resource_dir[MAX_PATH_LENGTH];
+	char resource_name[MAX_RESOURCE_LENGTH];
+	struct stat stat_resource;
+	filerail_session session; // thread's copy of session, without connection
+	char resource_path[MAX_PATH_LENGTH];
+	uint8_t fingerprint[MD5_HASH_LENGTH]; // of resource before zipping (see archive_cache.h)
+	char lock_path[MAX_PATH_LENGTH]; // job builds archive of cache (see filerail_cache_lock), empty if it doesn't
+	char ref_path[MAX_PATH_LENGTH]; // session's link to cached archive
+	char tmp_path[MAX_PATH_LENGTH]; // archive being built
+	// what child reports
+	struct {
+		int8_t status;
+		uint8_t hash[MD5_HASH_LENGTH];
+	} result;
+} filerail_archive_job;
+
+// archive of a pipelined PUT and request carrying it's hash, prepared before anything is sent
+typedef struct _filerail_put_archive {
+	char zip_filename[MAX_PATH_LENGTH]; // private to session which prepared it
+	filerail_request_header request; // policies and priority are filled in by sending session
+} filerail_put_archive;
+
+int filerail_zip_resource(
+	const char *zip_filename,
+	const char *resource_dir,
+	const char *resource_name,
+	struct stat *stat_resource,
+	filerail_manifest *manifest,
+	bool pack,
+	int level);
+
+int filerail_prepare_archive(
+	filerail_session *s,
+	const char *resource_dir,
+	const char *resource_name,
+	struct stat *stat_resource,
+	filerail_manifest *manifest,
+	const char *zip_filename,
+	uint8_t *hash);
 
 int filerail_sendfile_handler(
-	int fd,
+	filerail_session *s,
+	const char *resource_dir,
+	const char *resource_name,
+	struct stat *stat_resource,
+	filerail_manifest *manifest,
+	filerail_request_header *request);
+
+int filerail_send_archive(
+	filerail_session *s,
+	const char *zip_filename,
+	const uint8_t *hash,
+	filerail_request_header *request);
+
+int filerail_send_archive_from(
+	filerail_session *s,
+	const char *zip_filename,
+	uint64_t offset);
+
+int filerail_cached_sendfile_handler(
+	filerail_session *s,
 	const char *resource_dir,
 	const char *resource_name,
 	struct stat *stat_resource,
-	const char* ckpt_path,
-	filerail_AES_keys *K);
+	const char *cache_path,
+	uint64_t budget,
+	filerail_request_header *request);
+
+void filerail_cache_publish_archive(
+	const char *cache_path,
+	const char *resource_path,
+	const uint8_t *fingerprint,
+	unsigned int session_id,
+	const char *tmp_path,
+	const uint8_t *hash,
+	char *ref_path,
+	bool *published);
+
+int filerail_archive_job_start(
+	filerail_archive_job *job,
+	filerail_session *s,
+	const char *resource_dir,
+	const char *resource_name,
+	struct stat *stat_resource,
+	const char *cache_path);
+
+int filerail_archive_job_send(
+	filerail_archive_job *job,
+	filerail_session *s,
+	uint64_t budget,
+	filerail_request_header *request);
+
+void filerail_archive_job_cancel(filerail_archive_job *job);
+
+int filerail_find_checkpoint(
+	filerail_session *s,
+	const uint8_t *hash,
+	const char *resource_path,
+	char *ckpt_resource_path,
+	uint64_t *offset);
+
+bool filerail_find_checkpoint_of(filerail_session *s, const char *resource_path, uint8_t *hash, uint64_t *offset);
 
 int filerail_recvfile_handler(
-	int fd,
+	filerail_session *s,
+	const char *resource_name,
+	const char *resource_dir,
+	const char *resource_path,
+	bool stage);
+
+int filerail_recv_archive(
+	filerail_session *s,
+	const char *resource_name,
+	const char *resource_dir,
+	const char *resource_path,
+	const char *ckpt_resource_path,
+	const uint8_t *hash,
+	uint64_t offset,
+	bool stage);
+
+int filerail_sync_sendfile_handler(
+	filerail_session *s,
+	const char *resource_dir,
+	const char *resource_name,
+	struct stat *stat_resource);
+
+int filerail_sync_recvfile_handler(
+	filerail_session *s,
+	const char *resource_name,
+	const char *resource_dir,
+	bool mirror);
+
+int filerail_dedup_sendfile_handler(
+	filerail_session *s,
+	const char *resource_dir,
+	const char *resource_name,
+	struct stat *stat_resource);
+
+int filerail_dedup_recvfile_handler(
+	filerail_session *s,
+	const char *resource_name,
+	const char *resource_dir,
+	const char *resource_path);
+
+int filerail_prepare_put(
+	filerail_session *s,
+	const char *resource_dir,
+	const char *resource_name,
+	struct stat *stat_resource,
+	const char *des_dir,
+	filerail_put_archive *archive);
+
+int filerail_put_archive_clean(filerail_put_archive *archive);
+
+int filerail_pipelined_put_send(
+	filerail_session *s,
+	filerail_put_archive *archive,
+	uint8_t *response_type);
+
+int filerail_pipelined_put_handler(
+	filerail_session *s,
+	const char *resource_dir,
+	const char *resource_name,
+	struct stat *stat_resource,
+	const char *des_dir,
+	filerail_put_archive *prepared,
+	uint8_t *response_type);
+
+int filerail_pipelined_recvfile_handler(
+	filerail_session *s,
+	filerail_request_header *request,
+	const char *resource_path);
+
+int filerail_pipelined_get_handler(
+	filerail_session *s,
 	const char *resource_name,
 	const char *resource_dir,
+	const char *des_dir,
 	const char *resource_path,
-	const char* ckpt_path,
-	filerail_AES_keys *K);
+	uint8_t *response_type);
+
+#ifdef FILERAIL_IMPLEMENTATION
+
+// zip the resource, if manifest is not NULL only files marked as needed are zipped
+int filerail_zip_resource(
+	const char *zip_filename,
+	const char *resource_dir,
+	const char *resource_name,
+	struct stat *stat_resource,
+	filerail_manifest *manifest,
+	bool pack,
+	int level)
+{
+	bool ok;
+	struct zip_t *zip;
+
+	if ((zip = zip_open(zip_filename, level, 'w')) == NULL) {
+		LOG(LOG_USER | LOG_ERR, "operations.h filerail_zip_resource zip_open\n");
+		return -1;
+	}
+	if (manifest != NULL) {
+		ok = filerail_zip_manifest(zip, resource_dir, manifest);
+	} else if (S_ISDIR(stat_resource->st_mode)) {
+		ok = filerail_zip_folder(zip, resource_dir, resource_name, pack);
+	} else {
+		ok = filerail_zip_file(zip, resource_dir, resource_name);
+	}
+	zip_close(zip);
+	if (!ok) {
+		LOG(LOG_USER | LOG_ERR, "operations.h filerail_zip_resource\n");
+		return -1;
+	}
+	return 0;
+}
+
+// zip the resource into zip_filename and compute md5 hash of the zip
+int filerail_prepare_archive(
+	filerail_session *s,
+	const char *resource_dir,
+	const char *resource_name,
+	struct stat *stat_resource,
+	filerail_manifest *manifest,
+	const char *zip_filename,
+	uint8_t *hash)
+{
+	int exit_status;
+	filerail_admission_ticket ticket;
+
+	exit_status = 0;
+	filerail_session_busy(s, true);
 
-// handles sending of files
+	// zip the resource (waits for it's turn on a busy server, see admission.h)
+	SESSION_PRINT(s, printf("Zipping resource...\n"));
+	filerail_session_admit(s, ADMIT_ARCHIVE, &ticket);
+	exit_status = filerail_zip_resource(zip_filename, resource_dir, resource_name, stat_resource, manifest, s->pack_small_files,
+		s->archive_level);
+	filerail_admission_release(&ticket);
+	if (exit_status == -1) {
+		goto clean_up;
+	}
+	SESSION_PRINT(s, printf("Finished...\n"));
+
+	// find the md5 hash of zipped file
+	SESSION_PRINT(s, printf("Generating md5 hash for zip file...\n"));
+	filerail_session_admit(s, ADMIT_HASH, &ticket);
+	exit_status = filerail_md5(hash, zip_filename, SESSION_VERBOSE(s));
+	filerail_admission_release(&ticket);
+	if (exit_status == -1) {
+		goto clean_up;
+	}
+	SESSION_PRINT(s, printf("Finished...\n"));
+
+	clean_up:
+	filerail_session_busy(s, false);
+	return exit_status;
+}
+
+/*
+	handles sending of files (if manifest is not NULL, only files marked as needed in manifest are sent)
+	request is the pipelined GET being answered, NULL for the step by step handshake
+*/
 int filerail_sendfile_handler(
-	int fd,
+	filerail_session *s,
 	const char *resource_dir,
 	const char *resource_name,
 	struct stat *stat_resource,
-	const char* ckpt_path,
-	filerail_AES_keys *K)
+	filerail_manifest *manifest,
+	filerail_request_header *request)
 {
 	int exit_status;
-	struct zip_t *zip;
-	clock_t start, end;
-	double cpu_time_used;
-	filerail_file_offset fo;
-	filerail_command_header command;
-	filerail_response_header response;
-	char current_dir[MAX_PATH_LENGTH], zip_filename[MAX_RESOURCE_LENGTH], option;
+	char zip_filename[MAX_PATH_LENGTH];
 	uint8_t hash[MD5_HASH_LENGTH];
 
 	exit_status = 0;
-	fo.offset = 0;
-	zip_filename[0] = '\0';
-	strcpy(zip_filename, resource_name);
-	strcat(zip_filename, ".zip");
+	// zip is private to the session, two sessions may send the same resource at once
+	filerail_session_tmp_path(s, resource_dir, resource_name, ".zip", zip_filename);
 
-	// store the current directory
-	if (filerail_getcwd(current_dir) == -1) {
+	if (filerail_prepare_archive(s, resource_dir, resource_name, stat_resource, manifest, zip_filename, hash) == -1) {
 		exit_status = -1;
-		goto clean_up;
+		goto clean_files;
 	}
 
-	// change the directory to resource directory (because the zip lib requires the resource to be in current dir)
-	if (filerail_cd(resource_dir) == -1) {
+	if (filerail_send_archive(s, zip_filename, hash, request) == -1) {
 		exit_status = -1;
-		goto clean_up;
 	}
 
-	// zip the resource
-	PRINT(printf("Zipping resource...\n"));
-	if (S_ISDIR(stat_resource->st_mode)) {
-		if (
-			(zip = zip_open(zip_filename, ZIP_DEFAULT_COMPRESSION_LEVEL, 'w')) == NULL ||
-			!filerail_zip_folder(zip, resource_name)
-		)
-		{
-			LOG(LOG_USER | LOG_ERR, "operations.h filerail_sendfile_handler\n");
-			goto clean_up;
-		}
-	} else {
-		if (
-			(zip = zip_open(zip_filename, ZIP_DEFAULT_COMPRESSION_LEVEL, 'w')) == NULL ||
-			!filerail_zip_file(zip, resource_name)
-			)
-		{
-			LOG(LOG_USER | LOG_ERR, "operations.h filerail_sendfile_handler\n");
-			goto clean_up;
-		}
+	// remove the zip file
+	clean_files:
+	if (access(zip_filename, F_OK) == 0 && filerail_rm(zip_filename) == -1) {
+		exit_status = -1;
 	}
-	zip_close(zip);
-	zip = NULL;
-	PRINT(printf("Finished...\n"));
+	return exit_status;
+}
 
-	// find the md5 hash of zipped file
-	PRINT(printf("Generating md5 hash for zip file...\n"));
-	if (filerail_md5(hash, zip_filename) == -1) {
-		exit_status = -1;
-		goto clean_up;
+/*
+	send a prepared zip file whose md5 hash is already known (resumes from receiver's checkpoint if it has one)
+	Step by step: hash is advertised, receiver offers it's checkpoint (RESUME) or RESTART.
+	Pipelined GET (request is not NULL): receiver sent hash and offset of it's checkpoint in request, one answer
+	carries size, hash and offset of archive, and data follows right away.
+*/
+int filerail_send_archive(
+	filerail_session *s,
+	const char *zip_filename,
+	const uint8_t *hash,
+	filerail_request_header *request)
+{
+	filerail_file_offset fo;
+	filerail_command_header command;
+	filerail_request_response answer;
+	struct stat stat_path;
+
+	fo.offset = 0;
+
+	if (request != NULL) {
+		if (stat(zip_filename, &stat_path) == -1) {
+			LOG(LOG_USER | LOG_ERR, "operations.h filerail_send_archive stat\n");
+			return -1;
+		}
+		memset(&answer, 0, sizeof(answer));
+		answer.response_type = OK;
+		answer.resource_size = stat_path.st_size;
+		memcpy(answer.hash, hash, MD5_HASH_LENGTH);
+		if (answer.resource_size > request->resource_size) {
+			// receiver doesn't have space for it
+			answer.response_type = INSUFFICIENT_SPACE;
+		} else if (
+			request->on_resume == POLICY_YES && request->offset <= answer.resource_size &&
+			memcmp(request->hash, hash, MD5_HASH_LENGTH) == 0
+		) {
+			answer.offset = request->offset;
+		}
+		if (filerail_send_request_response(s->fd, &answer) == -1) {
+			return -1;
+		}
+		if (answer.response_type != OK) {
+			return 0;
+		}
+		return filerail_send_archive_from(s, zip_filename, answer.offset);
 	}
-	PRINT(printf("Finished...\n"));
 
 	// advertise md5 hash to receiver (so that it can start checkpointing, and search for preivous checkpoints)
-	PRINT(printf("Sending md5 hash...\n"));
-	if (filerail_send_resource_hash(fd, hash) == -1) {
-		exit_status = -1;
-		goto clean_up;
+	SESSION_PRINT(s, printf("Sending md5 hash...\n"));
+	if (filerail_send_resource_hash(s->fd, (uint8_t*)hash) == -1) {
+		return -1;
 	}
-	PRINT(printf("Finished...\n"));
+	SESSION_PRINT(s, printf("Finished...\n"));
 
 	/*
 		receive response from receiver (whether it wants to resume from previous checkpoint
 		or restart entire process)
 	*/
-	if (filerail_recv_command_header(fd, &command) == -1) {
-		exit_status = -1;
-		goto clean_up;
+	if (filerail_recv_command_header(s->fd, &command) == -1) {
+		return -1;
 	}
 	// RESUME: receiver finds previous checkpoint, so it inquires if sender wants to resume
 	if (command.command_type == RESUME) {
-		// by deafult server agrees to resume
-		if (!is_server) {
-			printf("Do you wish to restart from previous checkpoint[Y/N] : ");
-			scanf("%c", &option);
-			getchar();
-		} else {
-			option = 'y';
-		}
-		if (option == 'Y' || option == 'y') {
-			if (filerail_send_response_header(fd, OK) == -1) {
-				exit_status = -1;
-				goto clean_up;
+		if (filerail_session_confirm(s, s->on_resume, "Do you wish to restart from previous checkpoint[Y/N] : ")) {
+			if (filerail_send_response_header(s->fd, OK) == -1) {
+				return -1;
 			}
 			// if sender agrees to resume, wait for receiver to send offset of zip file
-			if (filerail_recv_file_offset(fd, &fo) == -1) {
-				exit_status = -1;
-				goto clean_up;
+			if (filerail_recv_file_offset(s->fd, &fo) == -1) {
+				return -1;
 			}
 		} else {
 			// if sender disagrees, abort the checkpoint resumption and restart transferring the whole file
-			if (filerail_send_response_header(fd, ABORT) == -1) {
-				exit_status = -1;
-				goto clean_up;
+			if (filerail_send_response_header(s->fd, ABORT) == -1) {
+				return -1;
 			}
 		}
 	} else if (command.command_type == RESTART) {
 		// receiver didn't find any checkpoint
 		// do nothing, simply restart the whole process of sending file
 	} else {
-		PRINT(printf("PROTOCOL NOT FOLLOWED\n"););
+		SESSION_PRINT(s, printf("PROTOCOL NOT FOLLOWED\n"););
 	}
 
+	return filerail_send_archive_from(s, zip_filename, fo.offset);
+}
+
+// send zip file from offset, and wait for receiver to verify it's hash
+int filerail_send_archive_from(
+	filerail_session *s,
+	const char *zip_filename,
+	uint64_t offset)
+{
+	int exit_status;
+	clock_t start, end;
+	double cpu_time_used;
+	filerail_response_header response;
+	filerail_admission_ticket ticket;
+
+	exit_status = 0;
+
 	// send the file
-	PRINT(printf("Ready to send resource...\n"));
+	SESSION_PRINT(s, printf("Ready to send resource...\n"));
   start = clock();
-  if (filerail_sendfile(fd, zip_filename, K, fo.offset) == -1) {
-  	exit_status = -1;
+  filerail_session_admit(s, ADMIT_SEND, &ticket);
+  exit_status = filerail_sendfile(s, zip_filename, offset);
+  filerail_admission_release(&ticket);
+  if (exit_status == -1) {
   	goto clean_up;
   }
   end = clock();
   cpu_time_used = ((double) (end - start)) / CLOCKS_PER_SEC;
-  PRINT(printf("File transfer complete in %f seconds...\n", cpu_time_used));
+  SESSION_PRINT(s, printf("File transfer complete in %f seconds...\n", cpu_time_used));
 
   // wait for receiver to compute the hash, and verify integrity
-  PRINT(printf("Verifying hash...\n"));
-  if (filerail_recv_response_header(fd, &response) == -1) {
+  SESSION_PRINT(s, printf("Verifying hash...\n"));
+  if (filerail_recv_response_header(s->fd, &response) == -1) {
   	exit_status = -1;
   	goto clean_up;
   }
 
   if (response.response_type == OK) {
-  	PRINT(printf("md5 hash matched\n"));
+  	SESSION_PRINT(s, printf("md5 hash matched\n"));
   } else if (response.response_type == NO_INTEGRITY) {
-  	PRINT(printf("md5 hash didn't match on receiver end\n"));
+  	SESSION_PRINT(s, printf("md5 hash didn't match on receiver end\n"));
   	exit_status = -1;
   } else {
   	exit_status = -1;
-  	PRINT(printf("PROTOCOL NOT FOLLOWED\n"));
+  	SESSION_PRINT(s, printf("PROTOCOL NOT FOLLOWED\n"));
   }
-  PRINT(printf("Finished...\n"));
-
-  // remove the zip file
-	if (filerail_rm(zip_filename) == -1) {
-		exit_status = -1;
-		goto clean_up;
-	}
+  SESSION_PRINT(s, printf("Finished...\n"));
 
-	// go back to previosu directory
-	if (filerail_cd(current_dir) == -1) {
-		exit_status = -1;
-		goto clean_up;
-	}
 	clean_up:
-	zip_close(zip);
 	return exit_status;
 }
 
-// handles receving of files
-int filerail_recvfile_handler(
-	int fd,
-	const char *resource_name,
-	const char *resource_dir,
+/*
+	Publish archive of resource_path built at tmp_path into archive cache (see filerail_cache_insert), and link it
+	to ref_path first, so it can't be evicted before it is sent. ref_path is cleared if it couldn't be linked (send
+	tmp_path then). Archive of a resource which changed while zipping is not published.
+*/
+void filerail_cache_publish_archive(
+	const char *cache_path,
 	const char *resource_path,
-	const char* ckpt_path,
-	filerail_AES_keys *K)
+	const uint8_t *fingerprint,
+	unsigned int session_id,
+	const char *tmp_path,
+	const uint8_t *hash,
+	char *ref_path,
+	bool *published)
 {
-  int exit_status;
-  uint64_t offset;
-  char current_dir[MAX_PATH_LENGTH], zip_filename[MAX_RESOURCE_LENGTH];
-	clock_t start, end;
-	double cpu_time_used;
-	uint8_t computed_hash[MD5_HASH_LENGTH];
-	char ckpt_resource_path[MAX_PATH_LENGTH], hex_str[2 * MD5_HASH_LENGTH];
-	struct stat stat_path;
-	filerail_checkpoint ckpt;
-	filerail_response_header response;
-	filerail_resource_hash rh;
-	FILE *fp;
-
-	fp = NULL;
-	offset = 0;
-  exit_status = 0;
+	uint8_t fingerprint_after[MD5_HASH_LENGTH];
 
-  // store current directory
-  if (filerail_getcwd(current_dir) == -1) {
-  	exit_status = -1;
-  	goto clean_up;
-  }
+	*published = false;
+	filerail_cache_ref_path(cache_path, resource_path, session_id, ref_path);
+	unlink(ref_path);
+	if (link(tmp_path, ref_path) == -1) {
+		ref_path[0] = '\0';
+		return;
+	}
+	// archive of a resource which changed while zipping must not be served to anyone else
+	if (
+		filerail_cache_fingerprint(resource_path, fingerprint_after) == 0 &&
+		memcmp(fingerprint, fingerprint_after, MD5_HASH_LENGTH) == 0 &&
+		filerail_cache_insert(cache_path, resource_path, fingerprint, tmp_path, hash) == 0
+	) {
+		*published = true;
+	}
+}
 
-	// wait for sender to advertise md5 hash
-	PRINT(printf("Waiting for md5 hash...\n"););
-	if (filerail_recv_resource_hash(fd, &rh) == -1) {
-  	exit_status = -1;
-  	goto clean_up;
-  }
-  PRINT(printf("Finished...\n"));
+/*
+	GET through archive cache: if resource hasn't changed since it was last zipped (same fingerprint), cached
+	archive and it's hash are sent right away. Otherwise resource is zipped into the cache and published, unless
+	it changed while being zipped. Concurrent misses of the same tree zip it once, the others wait for it (see
+	filerail_cache_lock). Cache is trimmed to budget bytes afterwards.
+	request is the pipelined GET being answered (see filerail_send_archive), NULL for the step by step handshake.
+*/
+int filerail_cached_sendfile_handler(
+	filerail_session *s,
+	const char *resource_dir,
+	const char *resource_name,
+	struct stat *stat_resource,
+	const char *cache_path,
+	uint64_t budget,
+	filerail_request_header *request)
+{
+	int exit_status;
+	bool published, hit;
+	char resource_path[MAX_PATH_LENGTH], ref_path[MAX_PATH_LENGTH], tmp_path[MAX_PATH_LENGTH];
+	char lock_path[MAX_PATH_LENGTH];
+	uint8_t hash[MD5_HASH_LENGTH], fingerprint[MD5_HASH_LENGTH];
 
-  // search for checkpoints
-  PRINT(printf("Searching for checkpoints...\n"));
-	ckpt_resource_path[0] = '\0';
-	strcpy(ckpt_resource_path, ckpt_path);
-	filerail_hash_to_str(rh.hash, hex_str);
-	strcat(ckpt_resource_path, "/");
-	strcat(ckpt_resource_path, hex_str);
+	exit_status = 0;
+	published = false;
+	ref_path[0] = tmp_path[0] = '\0';
+	snprintf(resource_path, sizeof(resource_path), "%s/%s", resource_dir, resource_name);
 
-	if (filerail_is_exists(ckpt_resource_path, &stat_path)) {
-		if (filerail_is_readable(ckpt_resource_path)) {
-			// if checkpoint exists and it is readable, read the checkpoint
-			if ((fp = fopen(ckpt_resource_path, "rb")) == NULL) {
-				LOG(LOG_USER | LOG_ERR, "operations.h filerail_recvfile_handler fopen\n");
-				exit_status = -1;
-				goto restart;
-			}
-			// file corruption handled here
-			if (fread((void *)&ckpt, 1, sizeof(ckpt), fp) != sizeof(ckpt)) {
-				LOG(LOG_USER | LOG_ERR, "operations.h filerail_recvfile_handler fread\n");
-				exit_status = -1;
-				goto restart;
-			}
-			// check if resource path stored in checkpoint and new resource path sent by sender matches
-			if (strcmp(ckpt.resource_path, resource_path) != 0) {
-				PRINT(printf("Resource path in checkpoint doesn't match resource path of request...\n"));
-				goto restart;
-			}
-			// check offset stored in checkpoint matches, the size of incompelete zip file (to make sure someone didnt modify)
-			if (stat(resource_path, &stat_path) == -1) {
-				LOG(LOG_USER | LOG_ERR, "operations.h filerail_recvfile_handler stat\n");
-				exit_status = -1;
-				goto restart;
-			}
-			// check if offset is valid
-			if (ckpt.offset > stat_path.st_size) {
-				PRINT(printf("Offset of checkpoint greater than zipped resource...\n"));
-				goto restart;
-			}
-			// ask if sender want to resume
-			if (filerail_send_command_header(fd, RESUME) == -1) {
-				exit_status = -1;
-				goto clean_up;
-			}
-			// wait for response
-			if (filerail_recv_response_header(fd, &response) == -1) {
-				exit_status = -1;
-				goto clean_up;
-			}
-			// if OK, resume from previous checkpoint
-			if (response.response_type == OK) {
-				// send offset to sender
-				offset = ckpt.offset;
-				if (filerail_send_file_offset(fd, offset) == -1) {
-					exit_status = -1;
-					goto clean_up;
-				}
-				PRINT(printf("Resuming from previous checkpoint...\n"));
-			} else if (response.response_type == ABORT) {
-				// do nothing restart the process
-			} else {
-				PRINT(printf("PROTOCOL NOT FOLLOWED\n"));
-				goto clean_up;
-			}
-		} else {
-			LOG(LOG_USER | LOG_ERR, "You don't have read permission\n");
+	// fingerprint walks the whole tree
+	filerail_session_busy(s, true);
+	if (filerail_cache_fingerprint(resource_path, fingerprint) == -1) {
+		filerail_session_busy(s, false);
+		exit_status = -1;
+		goto clean_up;
+	}
+	hit = filerail_cache_lookup(cache_path, resource_path, fingerprint, s->id, ref_path, hash);
+	// another session is zipping the same tree, take it's archive once it's published
+	while (!hit && !filerail_cache_lock(cache_path, resource_path, fingerprint, lock_path)) {
+		SESSION_PRINT(s, printf("Waiting for archive built by another session...\n"));
+		filerail_cache_wait(lock_path);
+		hit = filerail_cache_lookup(cache_path, resource_path, fingerprint, s->id, ref_path, hash);
+	}
+	if (!hit) {
+		ref_path[0] = '\0';
+		filerail_cache_tmp_path(cache_path, resource_path, s->id, tmp_path);
+		if (filerail_prepare_archive(s, resource_dir, resource_name, stat_resource, NULL, tmp_path, hash) == -1) {
+			filerail_cache_unlock(lock_path);
+			filerail_session_busy(s, false);
 			exit_status = -1;
 			goto clean_up;
 		}
+		filerail_cache_publish_archive(cache_path, resource_path, fingerprint, s->id, tmp_path, hash, ref_path, &published);
+		filerail_cache_unlock(lock_path);
 	} else {
-		// restart the transfer process
-		restart:
-		PRINT(printf("No checkpoints found...\n"));
-		if (filerail_send_command_header(fd, RESTART) == -1) {
-			exit_status = -1;
-			goto clean_up;
-		}
+		SESSION_PRINT(s, printf("Archive cache hit...\n"));
 	}
+	filerail_session_busy(s, false);
 
-	// recv the file
-  PRINT(printf("Waiting for server to respond...\n"));
-  start = clock();
-  if (filerail_recvfile(fd, resource_path, K, offset, ckpt_resource_path, resource_path) == -1) {
-  	exit_status = -1;
-  	goto clean_up;
-  }
-  end = clock();
-  cpu_time_used = ((double) (end - start)) / CLOCKS_PER_SEC;
-  PRINT(printf("File transfer complete in %f seconds...\n", cpu_time_used));
+	if (filerail_send_archive(s, ref_path[0] != '\0' ? ref_path : tmp_path, hash, request) == -1) {
+		exit_status = -1;
+	}
 
-  // go back to resource directory
-  if (filerail_cd(resource_dir) == -1) {
-  	exit_status = -1;
-  	goto clean_up;
-  }
+	clean_up:
+	if (ref_path[0] != '\0') {
+		unlink(ref_path);
+	}
+	if (tmp_path[0] != '\0' && !published) {
+		unlink(tmp_path);
+	}
+	filerail_cache_evict(cache_path, budget);
+	return exit_status;
+}
 
-  zip_filename[0] = '\0';
-  strcpy(zip_filename, resource_name);
-  strcat(zip_filename, ".zip");
+// threads running in this process, 0 if unknown
+static int filerail_thread_count(void) {
+	char line[64];
+	int n;
+	FILE *fp;
 
-  // generate the md5 hash
-  PRINT(printf("Generating hash...\n"));
-	if (filerail_md5(computed_hash, zip_filename) == -1) {
-		exit_status = -1;
-		goto clean_up;
+	n = 0;
+	if ((fp = fopen("/proc/self/status", "r")) != NULL) {
+		while (fgets(line, sizeof(line), fp) != NULL && sscanf(line, "Threads: %d", &n) != 1) {
+			;
+		}
+		fclose(fp);
 	}
-	PRINT(printf("Finished...\n"));
+	return n;
+}
 
-	// compute the hash of received zip file and verify it with advertised md5 hash
-  PRINT(printf("Verifying hash...\n"));
-  if (memcmp(computed_hash, rh.hash, MD5_HASH_LENGTH) == 0) {
-  	if (filerail_send_response_header(fd, OK) == -1) {
-  		exit_status = -1;
-  		goto clean_up;
-  	}
-  } else {
-  	if (filerail_send_response_header(fd, NO_INTEGRITY) == -1) {
-  		exit_status = -1;
-  		goto clean_up;
-  	}
-  	PRINT(printf("md5 hash doesn't match...\n"));
-  	goto clean_files;
-  }
-  PRINT(printf("Finished...\n"));
+// child building an archive keeps stdio and the pipe (keep) only, connections and listeners of server are closed
+static void filerail_close_inherited(int keep) {
+	int fd;
+	DIR *dir;
+	struct dirent *entry;
 
-  // if hash matches unzip the resource
-  PRINT(printf("Unzipping...\n"));
-  if (zip_extract(zip_filename, resource_dir, zip_on_extract_entry, NULL) == -1) {
-  	LOG(LOG_USER | LOG_ERR, "operations.h filerail_recvfile_handler\n");
-  	exit_status = -1;
-  	goto clean_up;
-  }
-  PRINT(printf("Finished...\n"));
+	// log socket is reopened by next syslog
+	closelog();
+	if ((dir = opendir("/proc/self/fd")) == NULL) {
+		return;
+	}
+	while ((entry = readdir(dir)) != NULL) {
+		fd = atoi(entry->d_name);
+		if (fd > STDERR_FILENO && fd != keep && fd != dirfd(dir)) {
+			close(fd);
+		}
+	}
+	closedir(dir);
+}
 
-  // oops
-  clean_files:
-  // go back to previous directory
-  if (filerail_cd(current_dir) == -1) {
-  	exit_status = -1;
-  	goto clean_up;
-  }
+static void *filerail_archive_job_thread(void *arg) {
+	filerail_archive_job *job;
 
-  // remove the zip file
-  if (filerail_rm(resource_path) == -1) {
-  	exit_status = -1;
-  	goto clean_up;
-  }
+	job = arg;
+	job->result.status = filerail_prepare_archive(&job->session, job->resource_dir, job->resource_name,
+		&job->stat_resource, NULL, job->tmp_path, job->result.hash);
+	if (write(job->out, &job->result, sizeof(job->result)) != sizeof(job->result)) {
+		LOG(LOG_USER | LOG_ERR, "operations.h filerail_archive_job_thread write\n");
+	}
+	close(job->out);
+	return NULL;
+}
+
+/*
+	Start preparing archive of a GET (see filerail_archive_job), cache_path is NULL if cache is disabled.
+	Cache hits are taken right away. Otherwise a child (or thread) zips and hashes the resource into tmp_path, named
+	by this process (cache reaps files of dead processes), and archive is published into cache once it is done.
+	Concurrent misses of the same tree build it once, like filerail_cached_sendfile_handler.
+*/
+int filerail_archive_job_start(
+	filerail_archive_job *job,
+	filerail_session *s,
+	const char *resource_dir,
+	const char *resource_name,
+	struct stat *stat_resource,
+	const char *cache_path)
+{
+	int fds[2];
+	bool hit;
+
+	job->pid = -1;
+	job->threaded = false;
+	job->fd = job->out = -1;
+	job->cache_path = cache_path;
+	job->published = false;
+	job->ref_path[0] = job->tmp_path[0] = job->lock_path[0] = '\0';
+	job->result.status = 0;
+	snprintf(job->resource_dir, sizeof(job->resource_dir), "%s", resource_dir);
+	snprintf(job->resource_name, sizeof(job->resource_name), "%s", resource_name);
+	job->stat_resource = *stat_resource;
+	snprintf(job->resource_path, sizeof(job->resource_path), "%s/%s", resource_dir, resource_name);
+
+	if (cache_path != NULL) {
+		filerail_session_busy(s, true);
+		if (filerail_cache_fingerprint(job->resource_path, job->fingerprint) == -1) {
+			filerail_session_busy(s, false);
+			job->result.status = -1;
+			return -1;
+		}
+		hit = filerail_cache_lookup(cache_path, job->resource_path, job->fingerprint, s->id, job->ref_path,
+			job->result.hash);
+		// another session is zipping the same tree, take it's archive once it's published
+		while (!hit && !filerail_cache_lock(cache_path, job->resource_path, job->fingerprint, job->lock_path)) {
+			filerail_cache_wait(job->lock_path);
+			job->lock_path[0] = '\0';
+			hit = filerail_cache_lookup(cache_path, job->resource_path, job->fingerprint, s->id, job->ref_path,
+				job->result.hash);
+		}
+		filerail_session_busy(s, false);
+		if (hit) {
+			return 0;
+		}
+		job->ref_path[0] = '\0';
+		filerail_cache_tmp_path(cache_path, job->resource_path, s->id, job->tmp_path);
+	} else {
+		filerail_session_tmp_path(s, resource_dir, resource_name, ".zip", job->tmp_path);
+	}
+
+	if (pipe(fds) == -1) {
+		LOG(LOG_USER | LOG_ERR, "operations.h filerail_archive_job_start pipe\n");
+		goto build_here;
+	}
+	if (filerail_thread_count() != 1) {
+		// thread never talks to the peer
+		job->session = *s;
+		job->session.fd = -1;
+		job->session.busy = 0;
+		job->out = fds[1];
+		if (pthread_create(&job->thread, NULL, filerail_archive_job_thread, job) != 0) {
+			LOG(LOG_USER | LOG_ERR, "operations.h filerail_archive_job_start pthread_create\n");
+			close(fds[0]);
+			close(fds[1]);
+			job->out = -1;
+			goto build_here;
+		}
+		job->threaded = true;
+		job->fd = fds[0];
+		return 0;
+	}
+	if ((job->pid = fork()) == -1) {
+		LOG(LOG_USER | LOG_ERR, "operations.h filerail_archive_job_start fork\n");
+		close(fds[0]);
+		close(fds[1]);
+		goto build_here;
+	}
+	if (job->pid == 0) {
+		// child never talks to the peer
+		filerail_close_inherited(fds[1]);
+		s->fd = -1;
+		job->result.status = filerail_prepare_archive(s, resource_dir, resource_name, stat_resource, NULL,
+			job->tmp_path, job->result.hash);
+		// smaller than PIPE_BUF, a single write
+		if (write(fds[1], &job->result, sizeof(job->result)) != sizeof(job->result)) {
+			_exit(1);
+		}
+		_exit(job->result.status == -1 ? 1 : 0);
+	}
+	close(fds[1]);
+	job->fd = fds[0];
+	return 0;
+
+	build_here:
+	// handshake waits
+	job->pid = -1;
+	filerail_session_busy(s, true);
+	job->result.status = filerail_prepare_archive(s, resource_dir, resource_name, stat_resource, NULL,
+		job->tmp_path, job->result.hash);
+	filerail_session_busy(s, false);
+	return job->result.status;
+}
+
+// collect child (SIGCHLD handler may have reaped it already) or thread of a job
+static void filerail_archive_job_reap(filerail_archive_job *job) {
+	if (job->threaded) {
+		pthread_join(job->thread, NULL);
+		job->threaded = false;
+	}
+	if (job->fd != -1) {
+		close(job->fd);
+		job->fd = -1;
+	}
+	if (job->pid != -1) {
+		while (waitpid(job->pid, NULL, 0) == -1 && errno == EINTR) {
+			;
+		}
+		job->pid = -1;
+	}
+}
+
+// let sessions waiting for archive of job go (it's published, or won't be)
+static void filerail_archive_job_unlock(filerail_archive_job *job) {
+	filerail_cache_unlock(job->lock_path);
+	job->lock_path[0] = '\0';
+}
+
+// remove session's link to cached archive, and archive unless it was published into cache
+static void filerail_archive_job_clean(filerail_archive_job *job) {
+	filerail_archive_job_unlock(job);
+	if (job->ref_path[0] != '\0') {
+		unlink(job->ref_path);
+	}
+	if (job->tmp_path[0] != '\0' && !job->published) {
+		unlink(job->tmp_path);
+	}
+}
+
+// wait for archive of job, send it (client agreed to GET) and clean up after it
+int filerail_archive_job_send(
+	filerail_archive_job *job,
+	filerail_session *s,
+	uint64_t budget,
+	filerail_request_header *request)
+{
+	int exit_status;
+	ssize_t n;
+
+	exit_status = 0;
+	if (job->fd != -1) {
+		// child may still be zipping
+		filerail_session_busy(s, true);
+		while ((n = read(job->fd, &job->result, sizeof(job->result))) == -1 && errno == EINTR) {
+			;
+		}
+		filerail_session_busy(s, false);
+		if (n != sizeof(job->result)) {
+			LOG(LOG_USER | LOG_ERR, "operations.h filerail_archive_job_send read\n");
+			job->result.status = -1;
+		}
+	}
+	filerail_archive_job_reap(job);
+
+	if (job->result.status == -1) {
+		exit_status = -1;
+		goto clean_up;
+	}
+	// archive built by child
+	if (job->cache_path != NULL && job->tmp_path[0] != '\0') {
+		filerail_cache_publish_archive(job->cache_path, job->resource_path, job->fingerprint, s->id, job->tmp_path,
+			job->result.hash, job->ref_path, &job->published);
+		filerail_archive_job_unlock(job);
+	}
+	if (filerail_send_archive(s, job->ref_path[0] != '\0' ? job->ref_path : job->tmp_path, job->result.hash, request) == -1) {
+		exit_status = -1;
+	}
+
+	clean_up:
+	filerail_archive_job_clean(job);
+	if (job->cache_path != NULL) {
+		filerail_cache_evict(job->cache_path, budget);
+	}
+	return exit_status;
+}
+
+// client ABORTed: stop building archive right away (thread is waited for), and remove it
+void filerail_archive_job_cancel(filerail_archive_job *job) {
+	if (job->pid != -1) {
+		kill(job->pid, SIGKILL);
+	}
+	filerail_archive_job_reap(job);
+	filerail_archive_job_clean(job);
+}
+
+// look for checkpoint of archive (by it's hash) being received into resource_path: 1 if found (offset is set), 0 if not
+int filerail_find_checkpoint(
+	filerail_session *s,
+	const uint8_t *hash,
+	const char *resource_path,
+	char *ckpt_resource_path,
+	uint64_t *offset)
+{
+	int exit_status;
+	char hex_str[MD5_HASH_STR_LENGTH];
+	struct stat stat_path;
+	filerail_checkpoint ckpt;
+	FILE *fp;
+
+	fp = NULL;
+	exit_status = 0;
+	*offset = 0;
+	ckpt_resource_path[0] = '\0';
+	strcpy(ckpt_resource_path, s->ckpt_path);
+	filerail_hash_to_str(hash, hex_str);
+	strcat(ckpt_resource_path, "/");
+	strcat(ckpt_resource_path, hex_str);
+
+	if (!filerail_is_exists(ckpt_resource_path, &stat_path)) {
+		goto clean_up;
+	}
+	if (!filerail_is_readable(ckpt_resource_path)) {
+		LOG(LOG_USER | LOG_ERR, "You don't have read permission\n");
+		exit_status = -1;
+		goto clean_up;
+	}
+	// if checkpoint exists and it is readable, read the checkpoint
+	if ((fp = fopen(ckpt_resource_path, "rb")) == NULL) {
+		LOG(LOG_USER | LOG_ERR, "operations.h filerail_find_checkpoint fopen\n");
+		exit_status = -1;
+		goto clean_up;
+	}
+	// file corruption handled here
+	if (fread((void *)&ckpt, 1, sizeof(ckpt), fp) != sizeof(ckpt)) {
+		LOG(LOG_USER | LOG_ERR, "operations.h filerail_find_checkpoint fread\n");
+		exit_status = -1;
+		goto clean_up;
+	}
+	// check if resource path stored in checkpoint and new resource path sent by sender matches
+	if (strcmp(ckpt.resource_path, resource_path) != 0) {
+		SESSION_PRINT(s, printf("Resource path in checkpoint doesn't match resource path of request...\n"));
+		goto clean_up;
+	}
+	// check offset stored in checkpoint matches, the size of incompelete zip file (to make sure someone didnt modify)
+	if (stat(resource_path, &stat_path) == -1) {
+		LOG(LOG_USER | LOG_ERR, "operations.h filerail_find_checkpoint stat\n");
+		exit_status = -1;
+		goto clean_up;
+	}
+	// check if offset is valid
+	if (ckpt.offset > stat_path.st_size) {
+		SESSION_PRINT(s, printf("Offset of checkpoint greater than zipped resource...\n"));
+		goto clean_up;
+	}
+	*offset = ckpt.offset;
+	exit_status = 1;
+
+	clean_up:
+	if (fp != NULL) {
+		fclose(fp);
+	}
+	return exit_status;
+}
+
+/*
+	Look for checkpoint of an archive being received into resource_path, when hash of archive isn't known yet
+	(pipelined GET asks for it in the request). Checkpoints are named by hash, so every checkpoint in checkpoints
+	directory is read, there are only as many as interrupted transfers.
+*/
+bool filerail_find_checkpoint_of(filerail_session *s, const char *resource_path, uint8_t *hash, uint64_t *offset) {
+	bool found;
+	char ckpt_resource_path[MAX_PATH_LENGTH];
+	struct stat stat_path;
+	struct dirent *entry;
+	filerail_checkpoint ckpt;
+	DIR *dir;
+	FILE *fp;
+
+	found = false;
+	*offset = 0;
+	if ((dir = opendir(s->ckpt_path)) == NULL) {
+		LOG(LOG_USER | LOG_ERR, "operations.h filerail_find_checkpoint_of opendir\n");
+		return false;
+	}
+	while (!found && (entry = readdir(dir)) != NULL) {
+		if (strlen(entry->d_name) != MD5_HASH_STR_LENGTH - 1 || !filerail_str_to_hash(entry->d_name, hash)) {
+			continue;
+		}
+		snprintf(ckpt_resource_path, sizeof(ckpt_resource_path), "%s/%s", s->ckpt_path, entry->d_name);
+		if ((fp = fopen(ckpt_resource_path, "rb")) == NULL) {
+			continue;
+		}
+		if (
+			fread((void *)&ckpt, 1, sizeof(ckpt), fp) == sizeof(ckpt) &&
+			strncmp(ckpt.resource_path, resource_path, MAX_PATH_LENGTH) == 0 &&
+			stat(resource_path, &stat_path) == 0 && ckpt.offset <= stat_path.st_size
+		) {
+			*offset = ckpt.offset;
+			found = true;
+		}
+		fclose(fp);
+	}
+	closedir(dir);
+	return found;
+}
+
+// handles receving of files (stage: extract aside and publish atomically, else extract over existing files)
+int filerail_recvfile_handler(
+	filerail_session *s,
+	const char *resource_name,
+	const char *resource_dir,
+	const char *resource_path,
+	bool stage)
+{
+	int ret, phase, exit_status;
+	uint64_t offset;
+	char ckpt_resource_path[MAX_PATH_LENGTH];
+	filerail_response_header response;
+	filerail_resource_hash rh;
+
+	offset = 0;
+	exit_status = 0;
+
+	// wait for sender to advertise md5 hash
+	SESSION_PRINT(s, printf("Waiting for md5 hash...\n"););
+	if (filerail_recv_resource_hash(s->fd, &rh) == -1) {
+		return -1;
+	}
+	SESSION_PRINT(s, printf("Finished...\n"));
+
+	// search for checkpoints
+	SESSION_PRINT(s, printf("Searching for checkpoints...\n"));
+	switch (filerail_find_checkpoint(s, rh.hash, resource_path, ckpt_resource_path, &offset)) {
+		case 1 : {
+			// ask if sender want to resume
+			if (filerail_send_command_header(s->fd, RESUME) == -1) {
+				return -1;
+			}
+			// wait for response, client may be asking it's user
+			phase = filerail_io_phase(s->is_server ? PROMPT_TIME_OUT : MAX_IO_TIME_OUT);
+			ret = filerail_recv_response_header(s->fd, &response);
+			filerail_io_phase(phase);
+			if (ret == -1) {
+				return -1;
+			}
+			// if OK, resume from previous checkpoint
+			if (response.response_type == OK) {
+				// send offset to sender
+				if (filerail_send_file_offset(s->fd, offset) == -1) {
+					return -1;
+				}
+				SESSION_PRINT(s, printf("Resuming from previous checkpoint...\n"));
+			} else if (response.response_type == ABORT) {
+				// do nothing restart the process
+				offset = 0;
+			} else {
+				SESSION_PRINT(s, printf("PROTOCOL NOT FOLLOWED\n"));
+				return 0;
+			}
+			break;
+		}
+		case -1 : {
+			exit_status = -1;
+		}
+		// fall through, restart the transfer process
+		default : {
+			SESSION_PRINT(s, printf("No checkpoints found...\n"));
+			offset = 0;
+			if (filerail_send_command_header(s->fd, RESTART) == -1) {
+				return -1;
+			}
+		}
+	}
+
+	if (filerail_recv_archive(s, resource_name, resource_dir, resource_path, ckpt_resource_path, rh.hash, offset, stage) == -1) {
+		exit_status = -1;
+	}
+	return exit_status;
+}
+
+/*
+	Verify received archive against hash, and unzip it: over resource_dir (partial resource of sync), or into a
+	staging directory which is published over the resource (see publish.h). Returns OK or NO_INTEGRITY, corrupt
+	is set if archive itself is bad (so is it's checkpoint).
+*/
+static uint8_t filerail_unpack_archive(
+	filerail_session *s,
+	const char *resource_name,
+	const char *resource_dir,
+	const char *resource_path,
+	const uint8_t *hash,
+	bool stage,
+	bool *corrupt)
+{
+	int ret;
+	uint8_t computed_hash[MD5_HASH_LENGTH];
+	char stage_path[MAX_PATH_LENGTH];
+	filerail_admission_ticket ticket;
+
+	*corrupt = false;
+
+  // generate the md5 hash
+  SESSION_PRINT(s, printf("Generating hash...\n"));
+  filerail_session_admit(s, ADMIT_HASH, &ticket);
+  ret = filerail_md5(computed_hash, resource_path, SESSION_VERBOSE(s));
+  filerail_admission_release(&ticket);
+	if (ret == -1) {
+		return NO_INTEGRITY;
+	}
+	SESSION_PRINT(s, printf("Finished...\n"));
+
+	// compute the hash of received zip file and verify it with advertised md5 hash
+  SESSION_PRINT(s, printf("Verifying hash...\n"));
+  if (memcmp(computed_hash, hash, MD5_HASH_LENGTH) != 0) {
+  	SESSION_PRINT(s, printf("md5 hash doesn't match...\n"));
+  	*corrupt = true;
+  	return NO_INTEGRITY;
+  }
+  SESSION_PRINT(s, printf("Finished...\n"));
+
+  // if hash matches unzip the resource into staging directory, and publish it (see publish.h)
+  SESSION_PRINT(s, printf("Unzipping...\n"));
+  filerail_session_admit(s, ADMIT_EXTRACT, &ticket);
+  if (!stage) {
+  	// partial resource (sync), extracted over existing files
+  	if (!zip_extract_resource(resource_path, resource_dir)) {
+  		LOG(LOG_USER | LOG_ERR, "operations.h filerail_unpack_archive\n");
+  		filerail_admission_release(&ticket);
+  		return NO_INTEGRITY;
+  	}
+  } else {
+  	filerail_stage_path(resource_dir, resource_name, s->id, stage_path);
+  	if (filerail_stage_init(stage_path) == -1) {
+  		filerail_admission_release(&ticket);
+  		return NO_INTEGRITY;
+  	}
+  	if (
+  		!zip_extract_resource(resource_path, stage_path) ||
+  		filerail_publish(stage_path, resource_dir, resource_name, s->is_server ? s->ckpt_path : NULL,
+  			s->is_server ? hash : NULL) == -1
+  	) {
+  		LOG(LOG_USER | LOG_ERR, "operations.h filerail_unpack_archive\n");
+  		filerail_stage_abort(stage_path);
+  		filerail_admission_release(&ticket);
+  		return NO_INTEGRITY;
+  	}
+  }
+  filerail_admission_release(&ticket);
+  SESSION_PRINT(s, printf("Finished...\n"));
+  return OK;
+}
+
+// receive archive (from offset) into resource_path, verify it against hash, and unzip it
+int filerail_recv_archive(
+	filerail_session *s,
+	const char *resource_name,
+	const char *resource_dir,
+	const char *resource_path,
+	const char *ckpt_resource_path,
+	const uint8_t *hash,
+	uint64_t offset,
+	bool stage)
+{
+	int exit_status;
+	clock_t start, end;
+	double cpu_time_used;
+	uint8_t response_type;
+	bool corrupt;
+
+	exit_status = 0;
+
+	// recv the file
+  SESSION_PRINT(s, printf("Waiting for server to respond...\n"));
+  start = clock();
+  if (filerail_recvfile(s, resource_path, offset, ckpt_resource_path, resource_path) == -1) {
+  	exit_status = -1;
+  	goto clean_up;
+  }
+  end = clock();
+  cpu_time_used = ((double) (end - start)) / CLOCKS_PER_SEC;
+  SESSION_PRINT(s, printf("File transfer complete in %f seconds...\n", cpu_time_used));
+
+  // sender is done once resource is in place, not when it's bytes are
+  filerail_session_busy(s, true);
+  response_type = filerail_unpack_archive(s, resource_name, resource_dir, resource_path, hash, stage, &corrupt);
+  filerail_session_busy(s, false);
+  if (filerail_send_response_header(s->fd, response_type) == -1) {
+  	exit_status = -1;
+  }
+  if (response_type != OK) {
+  	exit_status = -1;
+  	// archive is fine, it may still be unzipped later
+  	if (!corrupt) {
+  		goto clean_up;
+  	}
+  }
+
+  // remove the zip file
+  if (filerail_rm(resource_path) == -1) {
+  	exit_status = -1;
+  	goto clean_up;
+  }
 
   // remove the checkpoints
   if (filerail_rm(ckpt_resource_path) == -1) {
@@ -390,11 +1140,808 @@ int filerail_recvfile_handler(
   	goto clean_up;
   }
 
+	clean_up:
+	return exit_status;
+}
+
+// handles sync on sender side: send manifest, receive list of needed files and send only those
+int filerail_sync_sendfile_handler(
+	filerail_session *s,
+	const char *resource_dir,
+	const char *resource_name,
+	struct stat *stat_resource)
+{
+	int exit_status;
+	size_t i;
+	uint64_t nneeded;
+	char cache_path[MAX_PATH_LENGTH];
+	filerail_manifest manifest, cache;
+	filerail_manifest_entry entry;
+	filerail_manifest_record *record;
+
+	exit_status = 0;
+	nneeded = 0;
+	filerail_manifest_init(&manifest);
+	filerail_manifest_init(&cache);
+
+	// build manifest, hashes of unchanged files are taken from metadata cache of previous sync
+	SESSION_PRINT(s, printf("Building manifest...\n"));
+	filerail_manifest_cache_path(s->ckpt_path, resource_dir, resource_name, cache_path);
+	filerail_session_busy(s, true);
+	if (
+		filerail_manifest_load(s, &cache, cache_path) == -1 ||
+		filerail_manifest_scan(&manifest, &cache, resource_dir, resource_name) == -1 ||
+		filerail_manifest_save(&manifest, cache_path) == -1
+	) {
+		filerail_session_busy(s, false);
+		exit_status = -1;
+		goto clean_up;
+	}
+	filerail_session_busy(s, false);
+	filerail_manifest_free(&cache);
+	SESSION_PRINT(s, printf("Finished (%zu entries)...\n", manifest.count));
+
+	// send the manifest
+	SESSION_PRINT(s, printf("Sending manifest...\n"));
+	for (i = 0; i < manifest.count; i++) {
+		record = &manifest.records[i];
+		entry.entry_type = record->entry_type;
+		entry.size = record->size;
+		entry.mtime = record->mtime;
+		memcpy(entry.hash, record->hash, MD5_HASH_LENGTH);
+		strcpy(entry.path, record->path);
+		if (filerail_send_manifest_entry(s->fd, &entry) == -1) {
+			exit_status = -1;
+			goto clean_up;
+		}
+	}
+	memset(&entry, 0, sizeof(entry));
+	entry.entry_type = MANIFEST_END;
+	if (filerail_send_manifest_entry(s->fd, &entry) == -1) {
+		exit_status = -1;
+		goto clean_up;
+	}
+	SESSION_PRINT(s, printf("Finished...\n"));
+
+	// receiver answers with the files it needs
+	SESSION_PRINT(s, printf("Waiting for receiver to diff manifest...\n"));
+	while (true) {
+		if (filerail_recv_manifest_entry(s->fd, &entry) == -1) {
+			exit_status = -1;
+			goto clean_up;
+		}
+		if (entry.entry_type == MANIFEST_END) {
+			break;
+		}
+		record = filerail_manifest_find(&manifest, entry.path);
+		if (record == NULL || record->entry_type != MANIFEST_FILE) {
+			SESSION_PRINT(s, printf("PROTOCOL NOT FOLLOWED\n"));
+			exit_status = -1;
+			goto clean_up;
+		}
+		if (!record->needed) {
+			record->needed = true;
+			nneeded++;
+		}
+	}
+	SESSION_PRINT(s, printf("Finished (%lu of %zu entries changed)...\n", (unsigned long)nneeded, manifest.count));
+
+	if (nneeded == 0) {
+		SESSION_PRINT(s, printf("Resource is already in sync...\n"));
+		goto clean_up;
+	}
+
+	// send only the files receiver needs
+	if (filerail_sendfile_handler(s, resource_dir, resource_name, stat_resource, &manifest, NULL) == -1) {
+		exit_status = -1;
+	}
+
+	clean_up:
+	filerail_manifest_free(&manifest);
+	filerail_manifest_free(&cache);
+	return exit_status;
+}
+
+// handles sync on receiver side: diff manifest against local tree, request changed files and receive them
+int filerail_sync_recvfile_handler(
+	filerail_session *s,
+	const char *resource_name,
+	const char *resource_dir,
+	bool mirror)
+{
+	int exit_status;
+	size_t i;
+	uint64_t nneeded, nremoved;
+	char cache_path[MAX_PATH_LENGTH], zip_path[MAX_PATH_LENGTH];
+	filerail_manifest manifest, cache;
+	filerail_manifest_entry entry;
+	filerail_manifest_record *record;
+
+	exit_status = 0;
+	nneeded = nremoved = 0;
+	filerail_manifest_init(&manifest);
+	filerail_manifest_init(&cache);
+
+	// load metadata cache of previous sync, so that unchanged files are not re-hashed
+	filerail_manifest_cache_path(s->ckpt_path, resource_dir, resource_name, cache_path);
+	if (filerail_manifest_load(s, &cache, cache_path) == -1) {
+		exit_status = -1;
+		goto clean_up;
+	}
+
+	// receive the manifest
+	SESSION_PRINT(s, printf("Receiving manifest...\n"));
+	while (true) {
+		if (filerail_recv_manifest_entry(s->fd, &entry) == -1) {
+			exit_status = -1;
+			goto clean_up;
+		}
+		if (entry.entry_type == MANIFEST_END) {
+			break;
+		}
+		if (
+			(entry.entry_type != MANIFEST_FILE && entry.entry_type != MANIFEST_DIR) ||
+			!filerail_is_safe_path(entry.path, resource_name)
+		) {
+			LOG(LOG_USER | LOG_INFO, "operations.h filerail_sync_recvfile_handler bad manifest entry\n");
+			exit_status = -1;
+			goto clean_up;
+		}
+		if ((record = filerail_manifest_add(&manifest, entry.path, entry.entry_type)) == NULL) {
+			exit_status = -1;
+			goto clean_up;
+		}
+		record->size = entry.size;
+		record->mtime = entry.mtime;
+		memcpy(record->hash, entry.hash, MD5_HASH_LENGTH);
+	}
+	SESSION_PRINT(s, printf("Finished (%zu entries)...\n", manifest.count));
+
+	// find out what has changed
+	SESSION_PRINT(s, printf("Comparing manifest with local resource...\n"));
+	filerail_session_busy(s, true);
+	if (
+		filerail_manifest_diff(&manifest, &cache, resource_dir, &nneeded) == -1 ||
+		(mirror && filerail_manifest_prune(s, &manifest, resource_dir, resource_name, &nremoved) == -1)
+	) {
+		filerail_session_busy(s, false);
+		exit_status = -1;
+		goto clean_up;
+	}
+	filerail_session_busy(s, false);
+	filerail_manifest_free(&cache);
+	SESSION_PRINT(s, printf("Finished (%lu changed, %lu removed)...\n", (unsigned long)nneeded, (unsigned long)nremoved));
+
+	// ask sender for the changed files
+	for (i = 0; i < manifest.count; i++) {
+		record = &manifest.records[i];
+		if (!record->needed) {
+			continue;
+		}
+		entry.entry_type = MANIFEST_FILE;
+		entry.size = record->size;
+		entry.mtime = record->mtime;
+		memcpy(entry.hash, record->hash, MD5_HASH_LENGTH);
+		strcpy(entry.path, record->path);
+		if (filerail_send_manifest_entry(s->fd, &entry) == -1) {
+			exit_status = -1;
+			goto clean_up;
+		}
+	}
+	memset(&entry, 0, sizeof(entry));
+	entry.entry_type = MANIFEST_END;
+	if (filerail_send_manifest_entry(s->fd, &entry) == -1) {
+		exit_status = -1;
+		goto clean_up;
+	}
+
+	if (nneeded != 0) {
+		// changed files arrive as regular zip, which is extracted over the old files
+		snprintf(zip_path, sizeof(zip_path), "%s/%s.zip", resource_dir, resource_name);
+		if (filerail_recvfile_handler(s, resource_name, resource_dir, zip_path, false) == -1) {
+			// old cache is still valid, so it is kept
+			exit_status = -1;
+			goto clean_up;
+		}
+		filerail_manifest_refresh(&manifest, resource_dir);
+	}
+
+	// manifest now describes local resource, it becomes the cache for next sync
+	if (filerail_manifest_save(&manifest, cache_path) == -1) {
+		exit_status = -1;
+	}
+
+	clean_up:
+	filerail_manifest_free(&manifest);
+	filerail_manifest_free(&cache);
+	return exit_status;
+}
+
+/*
+	Handles DEDUP_PUT on sender side.
+	Zip is split into content defined chunks, fingerprints of all chunks are advertised,
+	and only the chunks receiver asks for (missing in it's chunk store) are sent.
+	Entries are stored, not deflated (DEDUP_COMPRESSION_LEVEL): chunks then cut through file contents as they are
+	on disk, and a small edit in a large file changes the chunks around it only, instead of every byte of deflate
+	stream after it.
+*/
+int filerail_dedup_sendfile_handler(
+	filerail_session *s,
+	const char *resource_dir,
+	const char *resource_name,
+	struct stat *stat_resource)
+{
+	int exit_status, ret, level;
+	size_t i, cursor;
+	uint64_t nbytes_sent, nbytes_total, nbytes_needed;
+	bool zipped;
+	char zip_filename[MAX_PATH_LENGTH];
+	uint8_t hash[MD5_HASH_LENGTH];
+	FILE *fp;
+	filerail_chunk_list list, needed;
+	filerail_chunk *chunk;
+	filerail_chunk_info ci;
+	filerail_response_header response;
+
+	fp = NULL;
+	exit_status = 0;
+	zipped = false;
+	nbytes_sent = nbytes_total = nbytes_needed = 0;
+	filerail_chunk_list_init(&list);
+	filerail_chunk_list_init(&needed);
+	filerail_session_tmp_path(s, resource_dir, resource_name, ".zip", zip_filename);
+
+	// hash of whole zip, so that receiver can verify reconstructed zip
+	zipped = true;
+	level = s->archive_level;
+	s->archive_level = DEDUP_COMPRESSION_LEVEL;
+	ret = filerail_prepare_archive(s, resource_dir, resource_name, stat_resource, NULL, zip_filename, hash);
+	s->archive_level = level;
+	if (ret == -1) {
+		exit_status = -1;
+		goto clean_up;
+	}
+	if (filerail_send_resource_hash(s->fd, hash) == -1) {
+		exit_status = -1;
+		goto clean_up;
+	}
+
+	SESSION_PRINT(s, printf("Chunking zip file...\n"));
+	filerail_session_busy(s, true);
+	if (filerail_chunk_file(zip_filename, &list) == -1) {
+		filerail_session_busy(s, false);
+		exit_status = -1;
+		goto clean_up;
+	}
+	filerail_session_busy(s, false);
+	SESSION_PRINT(s, printf("Finished (%zu chunks)...\n", list.count));
+
+	// advertise fingerprints, zero length chunk marks end of list
+	SESSION_PRINT(s, printf("Sending fingerprints...\n"));
+	for (i = 0; i < list.count; i++) {
+		nbytes_total += list.chunks[i].length;
+		if (filerail_send_chunk_info(s->fd, list.chunks[i].length, list.chunks[i].hash) == -1) {
+			exit_status = -1;
+			goto clean_up;
+		}
+	}
+	if (filerail_send_chunk_info(s->fd, 0, hash) == -1) {
+		exit_status = -1;
+		goto clean_up;
+	}
+	SESSION_PRINT(s, printf("Finished...\n"));
+
+	/*
+		Receiver asks for missing chunks in stream order. Whole list is read before sending any data,
+		otherwise both ends could block on send with full socket buffers.
+	*/
+	cursor = 0;
+	while (true) {
+		if (filerail_recv_chunk_info(s->fd, &ci) == -1) {
+			exit_status = -1;
+			goto clean_up;
+		}
+		if (ci.length == 0) {
+			break;
+		}
+		while (cursor < list.count && memcmp(list.chunks[cursor].hash, ci.hash, MD5_HASH_LENGTH) != 0) {
+			cursor++;
+		}
+		if (cursor == list.count) {
+			SESSION_PRINT(s, printf("PROTOCOL NOT FOLLOWED\n"));
+			exit_status = -1;
+			goto clean_up;
+		}
+		if ((chunk = filerail_chunk_list_add(&needed)) == NULL) {
+			exit_status = -1;
+			goto clean_up;
+		}
+		*chunk = list.chunks[cursor];
+	}
+
+	// send the missing chunks
+	SESSION_PRINT(s, printf("Sending %zu of %zu chunks...\n", needed.count, list.count));
+	if ((fp = fopen(zip_filename, "rb")) == NULL) {
+		LOG(LOG_USER | LOG_ERR, "operations.h filerail_dedup_sendfile_handler fopen\n");
+		exit_status = -1;
+		goto clean_up;
+	}
+	for (i = 0; i < needed.count; i++) {
+		nbytes_needed += needed.chunks[i].length;
+	}
+	filerail_tune_cork(s->fd, true);
+	for (i = 0; i < needed.count; i++) {
+		if (filerail_send_chunk(s->fd, fp, needed.chunks[i].offset, needed.chunks[i].length, s->K) == -1) {
+			filerail_tune_cork(s->fd, false);
+			exit_status = -1;
+			goto clean_up;
+		}
+		nbytes_sent += needed.chunks[i].length;
+		filerail_session_progress(s, nbytes_sent, nbytes_needed);
+	}
+	filerail_tune_cork(s->fd, false);
+	SESSION_PRINT(s, printf("Sent %lu of %lu bytes (%.1f%% deduplicated)...\n",
+		(unsigned long)nbytes_sent, (unsigned long)nbytes_total,
+		nbytes_total == 0 ? 0.0 : 100.0 * (nbytes_total - nbytes_sent) / nbytes_total));
+
+	// wait for receiver to reconstruct the zip, and verify integrity
+	SESSION_PRINT(s, printf("Verifying hash...\n"));
+	if (filerail_recv_response_header(s->fd, &response) == -1) {
+		exit_status = -1;
+		goto clean_up;
+	}
+	if (response.response_type == OK) {
+		SESSION_PRINT(s, printf("md5 hash matched\n"));
+	} else if (response.response_type == NO_INTEGRITY) {
+		SESSION_PRINT(s, printf("md5 hash didn't match on receiver end\n"));
+		exit_status = -1;
+	} else {
+		exit_status = -1;
+		SESSION_PRINT(s, printf("PROTOCOL NOT FOLLOWED\n"));
+	}
+
 	clean_up:
 	if (fp != NULL) {
 		fclose(fp);
 	}
+	if (zipped && access(zip_filename, F_OK) == 0 && filerail_rm(zip_filename) == -1) {
+		exit_status = -1;
+	}
+	filerail_chunk_list_free(&list);
+	filerail_chunk_list_free(&needed);
 	return exit_status;
 }
 
+/*
+	Handles DEDUP_PUT on receiver side.
+	Asks only for chunks missing in chunk store (received chunks are stored, so an interrupted transfer
+	doesn't need them again), then rebuilds the zip from chunk store, verifies it and unzips.
+*/
+int filerail_dedup_recvfile_handler(
+	filerail_session *s,
+	const char *resource_name,
+	const char *resource_dir,
+	const char *resource_path)
+{
+	int exit_status;
+	size_t i;
+	bool intact, corrupt;
+	char store_path[MAX_PATH_LENGTH];
+	uint8_t *buf, response_type, computed_hash[MD5_HASH_LENGTH];
+	FILE *fp;
+	filerail_chunk_list list, needed;
+	filerail_chunk_set requested;
+	filerail_chunk *chunk;
+	filerail_chunk_info ci;
+	filerail_resource_hash rh;
+
+	fp = NULL;
+	buf = NULL;
+	exit_status = 0;
+	intact = true;
+	filerail_chunk_list_init(&list);
+	filerail_chunk_list_init(&needed);
+	filerail_chunk_set_init(&requested);
+
+	if (filerail_chunkstore_init(s->ckpt_path, store_path) == -1) {
+		exit_status = -1;
+		goto clean_up;
+	}
+	if ((buf = malloc(CDC_MAX_CHUNK_SIZE)) == NULL) {
+		LOG(LOG_USER | LOG_ERR, "operations.h filerail_dedup_recvfile_handler malloc\n");
+		exit_status = -1;
+		goto clean_up;
+	}
+
+	// wait for sender to advertise md5 hash of zip
+	SESSION_PRINT(s, printf("Waiting for md5 hash...\n"));
+	if (filerail_recv_resource_hash(s->fd, &rh) == -1) {
+		exit_status = -1;
+		goto clean_up;
+	}
+
+	// receive fingerprints
+	SESSION_PRINT(s, printf("Receiving fingerprints...\n"));
+	while (true) {
+		if (filerail_recv_chunk_info(s->fd, &ci) == -1) {
+			exit_status = -1;
+			goto clean_up;
+		}
+		if (ci.length == 0) {
+			break;
+		}
+		if (ci.length > CDC_MAX_CHUNK_SIZE) {
+			LOG(LOG_USER | LOG_INFO, "operations.h filerail_dedup_recvfile_handler bad chunk\n");
+			exit_status = -1;
+			goto clean_up;
+		}
+		if ((chunk = filerail_chunk_list_add(&list)) == NULL) {
+			exit_status = -1;
+			goto clean_up;
+		}
+		chunk->length = ci.length;
+		memcpy(chunk->hash, ci.hash, MD5_HASH_LENGTH);
+	}
+
+	// ask for chunks which are neither in store nor already asked for
+	for (i = 0; i < list.count; i++) {
+		if (
+			filerail_chunk_set_contains(&requested, list.chunks[i].hash) ||
+			filerail_chunkstore_has(store_path, list.chunks[i].hash)
+		) {
+			continue;
+		}
+		if (
+			filerail_chunk_set_insert(&requested, list.chunks[i].hash) == -1 ||
+			(chunk = filerail_chunk_list_add(&needed)) == NULL
+		) {
+			exit_status = -1;
+			goto clean_up;
+		}
+		*chunk = list.chunks[i];
+		if (filerail_send_chunk_info(s->fd, chunk->length, chunk->hash) == -1) {
+			exit_status = -1;
+			goto clean_up;
+		}
+	}
+	if (filerail_send_chunk_info(s->fd, 0, rh.hash) == -1) {
+		exit_status = -1;
+		goto clean_up;
+	}
+	SESSION_PRINT(s, printf("Finished (%zu of %zu chunks missing)...\n", needed.count, list.count));
+
+	// receive missing chunks, verify and store them
+	for (i = 0; i < needed.count; i++) {
+		if (filerail_recv_chunk(s->fd, buf, needed.chunks[i].length, s->K) == -1) {
+			exit_status = -1;
+			goto clean_up;
+		}
+		MD5(buf, needed.chunks[i].length, computed_hash);
+		if (memcmp(computed_hash, needed.chunks[i].hash, MD5_HASH_LENGTH) != 0) {
+			// never store a corrupted chunk, reconstruction below will fail
+			SESSION_PRINT(s, printf("Chunk hash doesn't match...\n"));
+			continue;
+		}
+		if (filerail_chunkstore_put(store_path, needed.chunks[i].hash, buf, needed.chunks[i].length, s->id) == -1) {
+			exit_status = -1;
+			goto clean_up;
+		}
+		SESSION_PRINT(s, filerail_progress_bar(1.0 - (i + 1) / (1.0 * needed.count)));
+	}
+
+	// rebuild the zip from chunk store, sender is done once resource is in place
+	filerail_session_busy(s, true);
+	SESSION_PRINT(s, printf("Reconstructing zip file...\n"));
+	if ((fp = fopen(resource_path, "wb")) == NULL) {
+		LOG(LOG_USER | LOG_ERR, "operations.h filerail_dedup_recvfile_handler fopen\n");
+		filerail_session_busy(s, false);
+		exit_status = -1;
+		goto clean_up;
+	}
+	for (i = 0; i < list.count && intact; i++) {
+		if (
+			filerail_chunkstore_get(store_path, list.chunks[i].hash, buf, list.chunks[i].length) == -1 ||
+			fwrite(buf, 1, list.chunks[i].length, fp) != list.chunks[i].length
+		) {
+			intact = false;
+		}
+	}
+	fclose(fp);
+	fp = NULL;
+	response_type = intact ? filerail_unpack_archive(s, resource_name, resource_dir, resource_path, rh.hash, true, &corrupt) : NO_INTEGRITY;
+	filerail_session_busy(s, false);
+	if (filerail_send_response_header(s->fd, response_type) == -1 || response_type != OK) {
+		exit_status = -1;
+	}
+
+	if (filerail_rm(resource_path) == -1) {
+		exit_status = -1;
+	}
+	// store grows with every transfer, keep it within it's budget
+	filerail_chunkstore_evict(store_path, chunkstore_budget);
+
+	clean_up:
+	if (fp != NULL) {
+		fclose(fp);
+	}
+	free(buf);
+	filerail_chunk_list_free(&list);
+	filerail_chunk_list_free(&needed);
+	filerail_chunk_set_free(&requested);
+	return exit_status;
+}
+
+/*
+	Zip and hash resource for a pipelined PUT to des_dir (archive->zip_filename is set even if it fails, remove it
+	with filerail_put_archive_clean). Needs no connection, so next PUT of a batch is prepared while one before it
+	transfers.
+*/
+int filerail_prepare_put(
+	filerail_session *s,
+	const char *resource_dir,
+	const char *resource_name,
+	struct stat *stat_resource,
+	const char *des_dir,
+	filerail_put_archive *archive)
+{
+	struct stat stat_zip;
+
+	// zip is private to the session, two sessions may send the same resource at once
+	filerail_session_tmp_path(s, resource_dir, resource_name, ".zip", archive->zip_filename);
+	memset(&archive->request, 0, sizeof(archive->request));
+	if (
+		filerail_prepare_archive(s, resource_dir, resource_name, stat_resource, NULL, archive->zip_filename,
+			archive->request.hash) == -1 ||
+		stat(archive->zip_filename, &stat_zip) == -1
+	) {
+		return -1;
+	}
+	archive->request.resource_size = stat_zip.st_size;
+	snprintf(archive->request.resource_name, MAX_RESOURCE_LENGTH, "%s", resource_name);
+	snprintf(archive->request.resource_dir, MAX_PATH_LENGTH, "%s", des_dir);
+	return 0;
+}
+
+// remove zip of a prepared PUT
+int filerail_put_archive_clean(filerail_put_archive *archive) {
+	if (access(archive->zip_filename, F_OK) == 0 && filerail_rm(archive->zip_filename) == -1) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+	Pipelined PUT, sender side: archive is prepared first, so one request carries resource, policies, size and hash
+	of archive, and one answer comes back: OK with offset to send from (receiver's checkpoint, if on_resume agrees),
+	or why request is refused (response_type). Data starts in the next round trip.
+	Only questions the user has to answer (policy is POLICY_ASK) cost a round trip of their own:
+	DUPLICATE_RESOURCE_NAME is answered with OVERWRITE (and answered again) or ABORT, CHECKPOINT (receiver has a
+	checkpoint) with OK or ABORT.
+	Sends request of archive (PIPELINED_PUT is already sent) and archive, archive is kept (a retry sends it again).
+*/
+int filerail_pipelined_put_send(
+	filerail_session *s,
+	filerail_put_archive *archive,
+	uint8_t *response_type)
+{
+	uint64_t offset;
+	char question[2 * MAX_PATH_LENGTH];
+	filerail_request_header *request;
+	filerail_request_response answer;
+
+	*response_type = OK;
+	request = &archive->request;
+	request->on_duplicate = filerail_session_policy(s, s->on_duplicate);
+	request->on_resume = filerail_session_policy(s, s->on_resume);
+	request->priority = s->priority;
+
+	if (
+		filerail_send_request_header(s->fd, request) == -1 ||
+		filerail_recv_request_response(s->fd, &answer) == -1
+	) {
+		return -1;
+	}
+	// PUT is retried, and the attempt before it got as far as publishing the archive (see publish.h)
+	if (
+		answer.response_type == DUPLICATE_RESOURCE_NAME && s->retried &&
+		memcmp(answer.hash, request->hash, MD5_HASH_LENGTH) == 0
+	) {
+		if (request->on_duplicate == POLICY_ASK && filerail_send_command_header(s->fd, ABORT) == -1) {
+			return -1;
+		}
+		SESSION_PRINT(s, printf("Archive is already in place...\n"));
+		return 0;
+	}
+	// server waits for user's answer, and answers again
+	if (answer.response_type == DUPLICATE_RESOURCE_NAME && request->on_duplicate == POLICY_ASK) {
+		snprintf(question, sizeof(question), "%s already exists at %s, do you wish to re-write[Y/N]: ",
+			request->resource_name, request->resource_dir);
+		if (filerail_session_confirm(s, POLICY_ASK, question)) {
+			if (
+				filerail_send_command_header(s->fd, OVERWRITE) == -1 ||
+				filerail_recv_request_response(s->fd, &answer) == -1
+			) {
+				return -1;
+			}
+		} else if (filerail_send_command_header(s->fd, ABORT) == -1) {
+			return -1;
+		}
+	}
+
+	offset = answer.offset;
+	if (answer.response_type == CHECKPOINT) {
+		if (filerail_session_confirm(s, POLICY_ASK, "Do you wish to restart from previous checkpoint[Y/N] : ")) {
+			if (filerail_send_response_header(s->fd, OK) == -1) {
+				return -1;
+			}
+		} else {
+			// restart transferring the whole file
+			offset = 0;
+			if (filerail_send_response_header(s->fd, ABORT) == -1) {
+				return -1;
+			}
+		}
+	} else if (answer.response_type != OK) {
+		*response_type = answer.response_type;
+		return 0;
+	}
+
+	if (offset != 0) {
+		SESSION_PRINT(s, printf("Resuming from previous checkpoint...\n"));
+	}
+	return filerail_send_archive_from(s, archive->zip_filename, offset);
+}
+
+// pipelined PUT of resource, or of an archive prepared before (prepared is not NULL, it is kept)
+int filerail_pipelined_put_handler(
+	filerail_session *s,
+	const char *resource_dir,
+	const char *resource_name,
+	struct stat *stat_resource,
+	const char *des_dir,
+	filerail_put_archive *prepared,
+	uint8_t *response_type)
+{
+	int exit_status;
+	filerail_put_archive archive;
+
+	*response_type = OK;
+	// command and request go back to back, archive is zipped and hashed before (peer gets heartbeats meanwhile)
+	if (prepared != NULL) {
+		if (filerail_send_command_header(s->fd, PIPELINED_PUT) == -1) {
+			return -1;
+		}
+		return filerail_pipelined_put_send(s, prepared, response_type);
+	}
+	exit_status = 0;
+	if (
+		filerail_prepare_put(s, resource_dir, resource_name, stat_resource, des_dir, &archive) == -1 ||
+		filerail_send_command_header(s->fd, PIPELINED_PUT) == -1 ||
+		filerail_pipelined_put_send(s, &archive, response_type) == -1
+	) {
+		exit_status = -1;
+	}
+	// remove the zip file
+	if (filerail_put_archive_clean(&archive) == -1) {
+		exit_status = -1;
+	}
+	return exit_status;
+}
+
+// pipelined PUT, receiver side (request passed receiver's checks): answer with checkpoint offset and receive archive
+int filerail_pipelined_recvfile_handler(
+	filerail_session *s,
+	filerail_request_header *request,
+	const char *resource_path)
+{
+	int ret, phase, exit_status;
+	uint64_t offset;
+	char ckpt_resource_path[MAX_PATH_LENGTH];
+	filerail_request_response answer;
+	filerail_response_header response;
+
+	exit_status = 0;
+	memset(&answer, 0, sizeof(answer));
+	answer.response_type = OK;
+
+	// search for checkpoints
+	if ((ret = filerail_find_checkpoint(s, request->hash, resource_path, ckpt_resource_path, &offset)) == -1) {
+		exit_status = -1;
+	}
+	if (ret == 1 && request->on_resume != POLICY_NO) {
+		answer.offset = offset;
+		// sender asks the user
+		if (request->on_resume == POLICY_ASK) {
+			answer.response_type = CHECKPOINT;
+		}
+	}
+	if (filerail_send_request_response(s->fd, &answer) == -1) {
+		return -1;
+	}
+	if (answer.response_type == CHECKPOINT) {
+		// client is asking it's user
+		phase = filerail_io_phase(PROMPT_TIME_OUT);
+		ret = filerail_recv_response_header(s->fd, &response);
+		filerail_io_phase(phase);
+		if (ret == -1) {
+			return -1;
+		}
+		if (response.response_type == ABORT) {
+			answer.offset = 0;
+		} else if (response.response_type != OK) {
+			LOG(LOG_INFO | LOG_USER, "PROTOCOL NOT FOLLOWED\n");
+			return -1;
+		}
+	}
+
+	if (
+		filerail_recv_archive(
+			s,
+			request->resource_name,
+			request->resource_dir,
+			resource_path,
+			ckpt_resource_path,
+			request->hash,
+			answer.offset,
+			true
+		) == -1) {
+		exit_status = -1;
+	}
+	return exit_status;
+}
+
+/*
+	Pipelined GET, receiver side: one request carries resource, storage available and checkpoint receiver has of
+	resource_path (looked up by path, hash of archive isn't known yet). Sender answers with size, hash and offset of
+	archive, and data follows in the same round trip. Receiver resumes from it's checkpoint unless on_resume is
+	POLICY_NO, checkpoint is only used if sender's archive has the same hash. resource_dir is dir of resource on
+	sender, des_dir the local dir it is extracted into.
+*/
+int filerail_pipelined_get_handler(
+	filerail_session *s,
+	const char *resource_name,
+	const char *resource_dir,
+	const char *des_dir,
+	const char *resource_path,
+	uint8_t *response_type)
+{
+	char ckpt_resource_path[MAX_PATH_LENGTH], hex_str[MD5_HASH_STR_LENGTH];
+	filerail_request_header request;
+	filerail_request_response answer;
+
+	*response_type = OK;
+	memset(&request, 0, sizeof(request));
+	request.on_duplicate = POLICY_YES;
+	request.on_resume = POLICY_NO;
+	if (s->on_resume != POLICY_NO && filerail_find_checkpoint_of(s, resource_path, request.hash, &request.offset)) {
+		request.on_resume = POLICY_YES;
+	}
+	request.resource_size = filerail_available_storage();
+	request.priority = s->priority;
+	snprintf(request.resource_name, MAX_RESOURCE_LENGTH, "%s", resource_name);
+	snprintf(request.resource_dir, MAX_PATH_LENGTH, "%s", resource_dir);
+
+	if (
+		filerail_send_command_header(s->fd, PIPELINED_GET) == -1 ||
+		filerail_send_request_header(s->fd, &request) == -1 ||
+		filerail_recv_request_response(s->fd, &answer) == -1
+	) {
+		return -1;
+	}
+	if (answer.response_type != OK) {
+		*response_type = answer.response_type;
+		return 0;
+	}
+	if (answer.offset != 0) {
+		SESSION_PRINT(s, printf("Resuming from previous checkpoint...\n"));
+	}
+
+	// checkpoint is named by hash of archive
+	filerail_hash_to_str(answer.hash, hex_str);
+	snprintf(ckpt_resource_path, sizeof(ckpt_resource_path), "%s/%s", s->ckpt_path, hex_str);
+	return filerail_recv_archive(s, resource_name, des_dir, resource_path, ckpt_resource_path, answer.hash, answer.offset, true);
+}
+
+#endif /* FILERAIL_IMPLEMENTATION */
+
 #endif
@@ -0,0 +1,434 @@
+#ifndef _PACK_H
+#define _PACK_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "global.h"
+#include "constants.h"
+
+/*
+	Small file packing: files of at most PACK_MAX_FILE_SIZE bytes are not zipped one entry per file, but batched
+	into a single zip entry "<resource>/.filerail-pack-<n>", which is compressed as a whole (small files share
+	the dictionary), and costs one entry header instead of thousands.
+
+	Batch layout:
+	FRPACK <count>\n
+	<mode in octal> <size> <path relative to resource>\n (count lines, index)
+	data of all files back to back (in index order)
+
+	Receiver unpacks a batch once it is extracted (from zip_extract call back): files are created directory by
+	directory (sorted), with openat on a directory fd kept open while it's files are written. Only entries flagged
+	by sender (ARCHIVE_ENTRY_FLAG) in top directory are batches, and a batch is read only after it's header checks
+	out, none of it's paths is followed through a symlink.
+*/
+
+// batch being built by sender
+typedef struct _filerail_packer {
+	char *index;
+	size_t index_len;
+	size_t index_capacity;
+	uint8_t *data;
+	size_t data_len;
+	size_t data_capacity;
+	size_t count;
+	unsigned int seq; // number of batches written so far
+} filerail_packer;
+
+// file of a batch being unpacked
+typedef struct _filerail_packed_file {
+	char *path;
+	char *name; // last component of path
+	size_t dir_len; // length of directory part of path (0 if file is at top)
+	mode_t mode;
+	uint64_t size;
+	const uint8_t *data;
+} filerail_packed_file;
+
+void filerail_packer_init(filerail_packer *p);
+void filerail_packer_free(filerail_packer *p);
+bool filerail_is_packable(const char *name, struct stat *s);
+int filerail_packer_add(filerail_packer *p, const char *path, const char *relative_path, struct stat *s);
+bool filerail_packer_is_full(filerail_packer *p);
+int filerail_packer_header(filerail_packer *p, char *header, size_t len);
+void filerail_packer_reset(filerail_packer *p);
+bool filerail_is_pack_entry(const char *name);
+int filerail_unpack(const char *pack_path);
+
+#ifdef FILERAIL_IMPLEMENTATION
+
+static mode_t filerail_pack_umask_value;
+static pthread_once_t filerail_pack_umask_once = PTHREAD_ONCE_INIT;
+/*
+	umask can only be read by setting it, and it is process wide: a file created by another thread meanwhile
+	would ignore umask. So it is read from /proc (Linux 4.7+), and only set and restored if that fails,
+	once per process.
+*/
+static void filerail_pack_read_umask(void) {
+	char line[64];
+	unsigned int mask;
+	bool found;
+	FILE *fp;
+
+	found = false;
+	if ((fp = fopen("/proc/self/status", "r")) != NULL) {
+		while (!found && fgets(line, sizeof(line), fp) != NULL) {
+			found = sscanf(line, "Umask: %o", &mask) == 1;
+		}
+		fclose(fp);
+	}
+	if (found) {
+		filerail_pack_umask_value = mask;
+	} else {
+		filerail_pack_umask_value = umask(0);
+		umask(filerail_pack_umask_value);
+	}
+}
+
+static mode_t filerail_pack_umask(void) {
+	pthread_once(&filerail_pack_umask_once, filerail_pack_read_umask);
+	return filerail_pack_umask_value;
+}
+
+void filerail_packer_init(filerail_packer *p) {
+	memset(p, 0, sizeof(filerail_packer));
+}
+
+void filerail_packer_free(filerail_packer *p) {
+	free(p->index);
+	free(p->data);
+	filerail_packer_init(p);
+}
+
+// grow buffer to hold at least len bytes
+static int filerail_pack_reserve(void **buf, size_t *capacity, size_t len) {
+	size_t new_capacity;
+	void *new_buf;
+
+	if (len <= *capacity) {
+		return 0;
+	}
+	new_capacity = *capacity == 0 ? PACK_BATCH_SIZE : *capacity;
+	while (new_capacity < len) {
+		new_capacity *= 2;
+	}
+	if ((new_buf = realloc(*buf, new_capacity)) == NULL) {
+		LOG(LOG_USER | LOG_ERR, "pack.h filerail_pack_reserve realloc\n");
+		return -1;
+	}
+	*buf = new_buf;
+	*capacity = new_capacity;
+	return 0;
+}
+
+// regular small file, whose name fits in a line of index
+bool filerail_is_packable(const char *name, struct stat *s) {
+	return S_ISREG(s->st_mode) && s->st_size <= PACK_MAX_FILE_SIZE && strchr(name, '\n') == NULL;
+}
+
+// read file at path into batch, it is recreated at relative_path (relative to resource)
+int filerail_packer_add(filerail_packer *p, const char *path, const char *relative_path, struct stat *s) {
+	int fd, len;
+	ssize_t nbytes;
+	char line[MAX_PATH_LENGTH + 64];
+
+	if (filerail_pack_reserve((void**)&p->data, &p->data_capacity, p->data_len + s->st_size) == -1) {
+		return -1;
+	}
+	if ((fd = open(path, O_RDONLY)) == -1) {
+		LOG(LOG_USER | LOG_ERR, "pack.h filerail_packer_add open\n");
+		return -1;
+	}
+	// file may have shrunk since stat, size in index is what was actually read
+	nbytes = read(fd, p->data + p->data_len, s->st_size);
+	close(fd);
+	if (nbytes == -1) {
+		LOG(LOG_USER | LOG_ERR, "pack.h filerail_packer_add read\n");
+		return -1;
+	}
+
+	len = snprintf(line, sizeof(line), "%o %zd %s\n", (unsigned int)(s->st_mode & 0777), nbytes, relative_path);
+	if (filerail_pack_reserve((void**)&p->index, &p->index_capacity, p->index_len + len) == -1) {
+		return -1;
+	}
+	memcpy(p->index + p->index_len, line, len);
+	p->index_len += len;
+	p->data_len += nbytes;
+	p->count++;
+	return 0;
+}
+
+bool filerail_packer_is_full(filerail_packer *p) {
+	return p->data_len + p->index_len >= PACK_BATCH_SIZE || p->count >= PACK_BATCH_FILES;
+}
+
+// first line of batch, written before index and data
+int filerail_packer_header(filerail_packer *p, char *header, size_t len) {
+	return snprintf(header, len, "%s %zu\n", PACK_MAGIC, p->count);
+}
+
+// start next batch (buffers are kept)
+void filerail_packer_reset(filerail_packer *p) {
+	p->index_len = p->data_len = p->count = 0;
+	p->seq++;
+}
+
+// batches live in top directory of resource ("<resource>/.filerail-pack-<n>")
+bool filerail_is_pack_entry(const char *name) {
+	const char *slash;
+
+	slash = strchr(name, '/');
+	return slash != NULL && slash != name && strchr(slash + 1, '/') == NULL &&
+		strncmp(slash + 1, PACK_ENTRY_PREFIX, strlen(PACK_ENTRY_PREFIX)) == 0;
+}
+
+// relative, without empty, "." or ".." components
+static bool filerail_pack_is_safe_path(const char *path) {
+	const char *component, *end;
+	size_t len;
+
+	if (path[0] == '\0' || path[0] == '/') {
+		return false;
+	}
+	for (component = path; component != NULL; component = end == NULL ? NULL : end + 1) {
+		end = strchr(component, '/');
+		len = end == NULL ? strlen(component) : (size_t)(end - component);
+		if (len == 0 || (len == 1 && component[0] == '.') || (len == 2 && !strncmp(component, "..", 2))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// directory sorted order: files of a directory are together, directories and names in byte order
+static int filerail_packed_file_cmp(const void *a, const void *b) {
+	const filerail_packed_file *x = a, *y = b;
+	int ret;
+
+	ret = strncmp(x->path, y->path, min(x->dir_len, y->dir_len));
+	if (ret != 0 || x->dir_len != y->dir_len) {
+		return ret != 0 ? ret : (x->dir_len > y->dir_len) - (x->dir_len < y->dir_len);
+	}
+	return strcmp(x->name, y->name);
+}
+
+// open (creating if needed) directory dir_len bytes of path, relative to base_fd, a component at a time (mkdir -p),
+// without following symlinks
+static int filerail_pack_open_dir(int base_fd, char *path, size_t dir_len) {
+	char *component, *slash;
+	int fd, next_fd;
+
+	if ((fd = dup(base_fd)) == -1 || dir_len == 0) {
+		return fd;
+	}
+	path[dir_len] = '\0';
+	for (component = path; component != NULL; component = slash == NULL ? NULL : slash + 1) {
+		if ((slash = strchr(component, '/')) != NULL) {
+			*slash = '\0';
+		}
+		if ((next_fd = openat(fd, component, O_RDONLY | O_DIRECTORY | O_NOFOLLOW)) == -1 && errno == ENOENT) {
+			if (mkdirat(fd, component, 0777) == -1 && errno != EEXIST) {
+				LOG(LOG_USER | LOG_ERR, "pack.h filerail_pack_open_dir mkdirat\n");
+			}
+			next_fd = openat(fd, component, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		}
+		if (slash != NULL) {
+			*slash = '/';
+		}
+		close(fd);
+		if ((fd = next_fd) == -1) {
+			LOG(LOG_USER | LOG_ERR, "pack.h filerail_pack_open_dir openat\n");
+			break;
+		}
+	}
+	path[dir_len] = '/';
+	return fd;
+}
+
+// recreate files of an extracted batch (in it's directory) and remove the batch, anything else is left as it is
+int filerail_unpack(const char *pack_path) {
+	int exit_status, base_fd, dir_fd, fd;
+	size_t i, count, len, data_len;
+	ssize_t nbytes;
+	uint8_t *buf;
+	char *line, *end, *sp, *dir_path, *last_dir, header[64];
+	const uint8_t *data;
+	unsigned int mode;
+	uint64_t size;
+	struct stat s;
+	mode_t mask;
+	filerail_packed_file *files;
+
+	exit_status = 0;
+	buf = NULL;
+	mask = filerail_pack_umask();
+	files = NULL;
+	base_fd = dir_fd = -1;
+	last_dir = NULL;
+
+	if ((fd = open(pack_path, O_RDONLY | O_NOFOLLOW)) == -1 || fstat(fd, &s) == -1) {
+		LOG(LOG_USER | LOG_ERR, "pack.h filerail_unpack open\n");
+		if (fd != -1) {
+			close(fd);
+		}
+		return -1;
+	}
+	// header first, nothing is allocated for a file that isn't a batch (or claims more than one holds)
+	if ((nbytes = pread(fd, header, sizeof(header) - 1, 0)) == -1) {
+		LOG(LOG_USER | LOG_ERR, "pack.h filerail_unpack pread\n");
+		close(fd);
+		return -1;
+	}
+	header[nbytes] = '\0';
+	if (
+		!S_ISREG(s.st_mode) || s.st_size > PACK_MAX_BATCH_SIZE || strchr(header, '\n') == NULL ||
+		sscanf(header, PACK_MAGIC " %zu", &count) != 1 || count > PACK_BATCH_FILES || count > (size_t)s.st_size
+	) {
+		LOG(LOG_USER | LOG_ERR, "pack.h filerail_unpack bad header\n");
+		close(fd);
+		return -1;
+	}
+	// whole batch (at most PACK_MAX_BATCH_SIZE)
+	if ((buf = malloc(s.st_size + 1)) == NULL) {
+		LOG(LOG_USER | LOG_ERR, "pack.h filerail_unpack malloc\n");
+		close(fd);
+		return -1;
+	}
+	len = 0;
+	while (len < (size_t)s.st_size && (nbytes = pread(fd, buf + len, s.st_size - len, len)) > 0) {
+		len += nbytes;
+	}
+	close(fd);
+	buf[len] = '\0';
+
+	// index
+	if ((end = memchr(buf, '\n', len)) == NULL) {
+		LOG(LOG_USER | LOG_ERR, "pack.h filerail_unpack bad header\n");
+		exit_status = -1;
+		goto clean_up;
+	}
+	if ((files = calloc(count + 1, sizeof(filerail_packed_file))) == NULL) {
+		LOG(LOG_USER | LOG_ERR, "pack.h filerail_unpack calloc\n");
+		exit_status = -1;
+		goto clean_up;
+	}
+	data_len = 0;
+	for (i = 0; i < count; i++) {
+		line = end + 1;
+		if (
+			(end = memchr(line, '\n', len - (line - (char*)buf))) == NULL ||
+			sscanf(line, "%o %" SCNu64, &mode, &size) != 2 ||
+			(sp = strchr(line, ' ')) == NULL || (sp = strchr(sp + 1, ' ')) == NULL || sp > end
+		) {
+			LOG(LOG_USER | LOG_ERR, "pack.h filerail_unpack bad index\n");
+			exit_status = -1;
+			goto clean_up;
+		}
+		*end = '\0';
+		files[i].path = sp + 1;
+		files[i].name = strrchr(files[i].path, '/');
+		files[i].name = files[i].name == NULL ? files[i].path : files[i].name + 1;
+		files[i].dir_len = files[i].name == files[i].path ? 0 : (size_t)(files[i].name - files[i].path - 1);
+		files[i].mode = mode & 0777;
+		files[i].size = size;
+		data_len += size;
+		if (!filerail_pack_is_safe_path(files[i].path)) {
+			LOG(LOG_USER | LOG_ERR, "pack.h filerail_unpack unsafe path\n");
+			exit_status = -1;
+			goto clean_up;
+		}
+	}
+	data = (uint8_t*)end + 1;
+	if (data + data_len != buf + len) {
+		LOG(LOG_USER | LOG_ERR, "pack.h filerail_unpack size mismatch\n");
+		exit_status = -1;
+		goto clean_up;
+	}
+	for (i = 0; i < count; i++) {
+		files[i].data = data;
+		data += files[i].size;
+	}
+	qsort(files, count, sizeof(filerail_packed_file), filerail_packed_file_cmp);
+
+	// batch lives in top directory of resource, paths are relative to it
+	dir_path = strdup(pack_path);
+	if (dir_path == NULL) {
+		exit_status = -1;
+		goto clean_up;
+	}
+	sp = strrchr(dir_path, '/');
+	if (sp != NULL) {
+		*sp = '\0';
+	}
+	base_fd = open(sp == NULL ? "." : dir_path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	free(dir_path);
+	if (base_fd == -1) {
+		LOG(LOG_USER | LOG_ERR, "pack.h filerail_unpack open\n");
+		exit_status = -1;
+		goto clean_up;
+	}
+
+	for (i = 0; i < count; i++) {
+		// one directory fd per run of files in same directory
+		if (
+			last_dir == NULL || files[i].dir_len != files[i - 1].dir_len ||
+			strncmp(files[i].path, last_dir, files[i].dir_len) != 0
+		) {
+			if (dir_fd != -1) {
+				close(dir_fd);
+			}
+			if ((dir_fd = filerail_pack_open_dir(base_fd, files[i].path, files[i].dir_len)) == -1) {
+				exit_status = -1;
+				goto clean_up;
+			}
+			last_dir = files[i].path;
+		}
+		// fd of a newly created file is writeable whatever it's mode, fchmod only if umask strips bits
+		fd = openat(dir_fd, files[i].name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, files[i].mode);
+		if (fd == -1) {
+			LOG(LOG_USER | LOG_ERR, "pack.h filerail_unpack openat\n");
+			exit_status = -1;
+			goto clean_up;
+		}
+		if (
+			write(fd, files[i].data, files[i].size) != (ssize_t)files[i].size ||
+			((files[i].mode & mask) != 0 && fchmod(fd, files[i].mode) == -1)
+		) {
+			LOG(LOG_USER | LOG_ERR, "pack.h filerail_unpack write\n");
+			close(fd);
+			exit_status = -1;
+			goto clean_up;
+		}
+		close(fd);
+	}
+
+	if (unlink(pack_path) == -1) {
+		LOG(LOG_USER | LOG_ERR, "pack.h filerail_unpack unlink\n");
+		exit_status = -1;
+	}
+
+	clean_up:
+	if (dir_fd != -1) {
+		close(dir_fd);
+	}
+	if (base_fd != -1) {
+		close(base_fd);
+	}
+	free(files);
+	free(buf);
+	return exit_status;
+}
+
+#endif /* FILERAIL_IMPLEMENTATION */
+
+#endif
@@ -0,0 +1,141 @@
+#ifndef _PREFETCH_H
+#define _PREFETCH_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+#include "global.h"
+#include "constants.h"
+#include "walk.h"
+
+/*
+	Read ahead for archive creation.
+
+	Entries of an archive are added in path order (archives must be deterministic), which on a rotating disk
+	or network block device is close to random order. So while an entry is being compressed, the next files
+	of the tree (at most PREFETCH_FILES files / PREFETCH_BYTES bytes ahead) are handed to the kernel with
+	posix_fadvise(WILLNEED), a batch at a time, sorted by physical location of their first extent (FIEMAP),
+	or by inode number where the file system can't map extents. Reads are then served sequentially-ish by
+	the disk in the background, and compression finds the data in page cache.
+*/
+
+// a file of the batch being prefetched
+typedef struct _filerail_prefetch_item {
+	int fd;
+	int mapped; // 0 if key is a physical offset, 1 if it is an inode number (sorted after mapped files)
+	uint64_t key;
+	off_t size;
+} filerail_prefetch_item;
+
+typedef struct _filerail_prefetcher {
+	filerail_tree *tree;
+	size_t current; // entry being archived
+	size_t next; // first entry not prefetched yet
+	off_t ahead; // bytes prefetched from current (included) to next (excluded)
+} filerail_prefetcher;
+
+void filerail_prefetcher_init(filerail_prefetcher *prefetcher, filerail_tree *tree);
+void filerail_prefetch(filerail_prefetcher *prefetcher, size_t current);
+
+#ifdef FILERAIL_IMPLEMENTATION
+
+void filerail_prefetcher_init(filerail_prefetcher *prefetcher, filerail_tree *tree) {
+	memset(prefetcher, 0, sizeof(filerail_prefetcher));
+	prefetcher->tree = tree;
+}
+
+// physical offset of first extent of file, falls back to inode number
+static void filerail_prefetch_key(filerail_prefetch_item *item, ino_t ino) {
+	char buf[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+	struct fiemap *fm;
+
+	fm = (struct fiemap*)buf;
+	memset(buf, 0, sizeof(buf));
+	fm->fm_start = 0;
+	fm->fm_length = FIEMAP_MAX_OFFSET;
+	fm->fm_extent_count = 1;
+	if (ioctl(item->fd, FS_IOC_FIEMAP, fm) == 0 && fm->fm_mapped_extents != 0) {
+		item->mapped = 0;
+		item->key = fm->fm_extents[0].fe_physical;
+		return;
+	}
+	item->mapped = 1;
+	item->key = ino;
+}
+
+static int filerail_prefetch_item_cmp(const void *a, const void *b) {
+	const filerail_prefetch_item *x, *y;
+
+	x = a;
+	y = b;
+	if (x->mapped != y->mapped) {
+		return x->mapped - y->mapped;
+	}
+	if (x->key != y->key) {
+		return x->key < y->key ? -1 : 1;
+	}
+	return 0;
+}
+
+// called before archiving entry current of tree, keeps read ahead window in front of it (best effort, never fails)
+void filerail_prefetch(filerail_prefetcher *prefetcher, size_t current) {
+	filerail_prefetch_item items[PREFETCH_FILES];
+	filerail_tree_entry *entry;
+	size_t i, n;
+
+	// entries archived since last call leave the window
+	for (; prefetcher->current < current && prefetcher->current < prefetcher->next; prefetcher->current++) {
+		prefetcher->ahead -= prefetcher->tree->entries[prefetcher->current].size;
+	}
+	prefetcher->current = current;
+	if (prefetcher->next < current) {
+		prefetcher->next = current;
+		prefetcher->ahead = 0;
+	}
+	// refill only once half of window is consumed, so batches are large enough to be worth sorting
+	if (
+		prefetcher->next - current >= PREFETCH_FILES / 2 ||
+		prefetcher->ahead >= PREFETCH_BYTES / 2 ||
+		prefetcher->next >= prefetcher->tree->count
+	) {
+		return;
+	}
+
+	n = 0;
+	while (
+		prefetcher->next < prefetcher->tree->count &&
+		prefetcher->next - current < PREFETCH_FILES &&
+		prefetcher->ahead < PREFETCH_BYTES
+	) {
+		entry = &prefetcher->tree->entries[prefetcher->next++];
+		prefetcher->ahead += entry->size;
+		if (!S_ISREG(entry->mode) || entry->size == 0) {
+			continue;
+		}
+		if ((items[n].fd = open(entry->path, O_RDONLY | O_NOFOLLOW)) == -1) {
+			// archiving will report it
+			continue;
+		}
+		items[n].size = entry->size < PREFETCH_BYTES ? entry->size : PREFETCH_BYTES;
+		filerail_prefetch_key(&items[n], entry->ino);
+		n++;
+	}
+	qsort(items, n, sizeof(filerail_prefetch_item), filerail_prefetch_item_cmp);
+	for (i = 0; i < n; i++) {
+		// starts reads and returns
+		posix_fadvise(items[i].fd, 0, items[i].size, POSIX_FADV_WILLNEED);
+		close(items[i].fd);
+	}
+}
+
+#endif /* FILERAIL_IMPLEMENTATION */
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef _PRIORITY_H
+#define _PRIORITY_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+
+#include "global.h"
+#include "constants.h"
+#include "protocol.h"
+
+/*
+	Priority classes of transfers (PRIORITY, carried by filerail_request_header), honored by:
+	- admission control: higher rank is admitted first (see admission.h)
+	- bandwidth shaping: weight of transfer in it's share of a congested uplink (see shaper.h)
+	- disk: best effort io priority of thread running the session (level 0 is first, 7 is last)
+	- network: SO_PRIORITY (queueing discipline band) and DSCP of connection, CS1 (lower effort) for bulk,
+	  AF21 (low latency data) for interactive
+	An interactive transfer (a hotfix deploy) goes ahead of bulk ones (backups) on the same server.
+*/
+
+typedef struct _filerail_priority_class {
+	const char *name;
+	int rank;
+	unsigned int weight;
+	int io_level;
+	int so_priority;
+	int tos;
+} filerail_priority_class;
+
+int filerail_priority_parse(const char *name);
+int filerail_priority_rank(uint8_t priority);
+unsigned int filerail_priority_weight(uint8_t priority);
+void filerail_priority_io(uint8_t priority);
+void filerail_priority_socket(int fd, uint8_t priority);
+
+#ifdef FILERAIL_IMPLEMENTATION
+
+// indexed by PRIORITY
+static const filerail_priority_class priority_classes[PRIORITY_CLASSES] = {
+	{"normal", 1, 4, 4, 0, 0x00},
+	{"bulk", 0, 1, 7, 2, 0x20},
+	{"interactive", 2, 16, 0, 6, 0x48}
+};
+
+// PRIORITY of it's name, -1 if unknown
+int filerail_priority_parse(const char *name) {
+	int i;
+
+	for (i = 0; i < PRIORITY_CLASSES; i++) {
+		if (strcmp(name, priority_classes[i].name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// unknown classes (newer peer) are treated as normal
+static const filerail_priority_class *filerail_priority_class_of(uint8_t priority) {
+	return &priority_classes[priority < PRIORITY_CLASSES ? priority : PRIORITY_NORMAL];
+}
+
+int filerail_priority_rank(uint8_t priority) {
+	return filerail_priority_class_of(priority)->rank;
+}
+
+unsigned int filerail_priority_weight(uint8_t priority) {
+	return filerail_priority_class_of(priority)->weight;
+}
+
+// io priority of calling thread (children forked by it inherit it)
+void filerail_priority_io(uint8_t priority) {
+	// IOPRIO_WHO_PROCESS of calling thread, IOPRIO_CLASS_BE
+	if (syscall(SYS_ioprio_set, 1, 0, (2 << 13) | filerail_priority_class_of(priority)->io_level) == -1) {
+		LOG(LOG_USER | LOG_ERR, "priority.h filerail_priority_io ioprio_set\n");
+	}
+}
+
+// mark packets of connection fd (no-op for streams of a multiplexed connection, they share it's socket)
+void filerail_priority_socket(int fd, uint8_t priority) {
+	int optval;
+	const filerail_priority_class *c;
+
+	c = filerail_priority_class_of(priority);
+	// IP_TOS resets SO_PRIORITY from TOS, so it goes first
+	optval = c->tos;
+	if (setsockopt(fd, IPPROTO_IP, IP_TOS, &optval, sizeof(optval)) == -1) {
+		return;
+	}
+	optval = c->so_priority;
+	if (setsockopt(fd, SOL_SOCKET, SO_PRIORITY, &optval, sizeof(optval)) == -1) {
+		LOG(LOG_USER | LOG_ERR, "priority.h filerail_priority_socket SO_PRIORITY\n");
+	}
+}
+
+#endif /* FILERAIL_IMPLEMENTATION */
+
+#endif
@@ -0,0 +1,341 @@
+#ifndef _PROBE_H
+#define _PROBE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "global.h"
+#include "constants.h"
+#include "protocol.h"
+#include "socket.h"
+#include "crypto.h"
+#include "session.h"
+#include "tuning.h"
+
+/*
+	Probe of the link between client and server (PROBE command), run over a session like any other operation.
+
+	Client sends PROBE and length of a burst in ms (filerail_file_offset), server answers OK and then serves
+	sub commands until BYE (answered with FINISH):
+	PING          : answered with PONG, client times PROBE_PINGS of them (RTT distribution)
+	PROBE_RAW_UP  : client sends frames of PROBE_RAW_SIZE bytes for a burst, ended by a frame of 1 byte, server
+	                answers with number of bytes received (filerail_file_offset)
+	PROBE_UP      : same with data packets (BUFFER_SIZE, encrypted and decrypted like a transfer), ended by a packet
+	                with data_size 0
+	PROBE_RAW_DOWN, PROBE_DOWN : same, from server to client
+	Raw bursts tell what TCP achieves on the link (link capacity), the others what a transfer of filerail achieves
+	(framing and cipher on top). Both are measured on the same connection with the same socket options.
+*/
+
+typedef struct _filerail_probe {
+	double rtt_min, rtt_avg, rtt_p50, rtt_p90, rtt_max; // ms
+	double up_link, up_rate; // bytes per second, raw bursts and filerail bursts
+	double down_link, down_rate;
+	unsigned int streams; // suggested number of concurrent transfers (-j), to fill the link
+	uint64_t bandwidth; // suggested bandwidth of tuning (-t bw=), Mbit/s
+} filerail_probe;
+
+int filerail_probe_handler(filerail_session *s);
+int filerail_probe_run(filerail_session *s, uint64_t duration, filerail_probe *p);
+void filerail_probe_print(filerail_probe *p);
+void filerail_probe_tune(filerail_probe *p);
+
+#ifdef FILERAIL_IMPLEMENTATION
+
+// monotonic clock in seconds
+static double filerail_probe_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int filerail_probe_compare(const void *a, const void *b) {
+	double x, y;
+
+	x = *(const double*)a;
+	y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+// send a burst for duration ms, raw frames or data packets
+static int filerail_probe_send_burst(filerail_session *s, bool raw, uint64_t duration) {
+	int exit_status;
+	uint8_t *buf;
+	uint8_t in[BUFFER_SIZE], out[BUFFER_SIZE];
+	double end;
+	filerail_shaper_transfer shaped;
+
+	exit_status = 0;
+	if ((buf = malloc(PROBE_RAW_SIZE)) == NULL) {
+		LOG(LOG_USER | LOG_ERR, "probe.h filerail_probe_send_burst malloc\n");
+		return -1;
+	}
+	memset(buf, 0xa5, PROBE_RAW_SIZE);
+	memset(in, 0xa5, BUFFER_SIZE);
+	end = filerail_probe_now() + duration / 1000.0;
+
+	// bursts of server are shaped like transfers (see shaper.h)
+	filerail_shaper_begin(&shaped, filerail_priority_weight(s->priority));
+	filerail_tune_cork(s->fd, true);
+	while (filerail_probe_now() < end) {
+		filerail_shaper_consume(&shaped, raw ? PROBE_RAW_SIZE : BUFFER_SIZE);
+		if (raw) {
+			if (filerail_send_frame(s->fd, buf, PROBE_RAW_SIZE) == -1) {
+				exit_status = -1;
+				goto clean_up;
+			}
+		} else {
+			if (
+				filerail_encrypt(in, out, BUFFER_SIZE, s->K) == -1 ||
+				filerail_send_data_packet(s->fd, out, BUFFER_SIZE) == -1
+			) {
+				exit_status = -1;
+				goto clean_up;
+			}
+		}
+	}
+	if (raw) {
+		exit_status = filerail_send_frame(s->fd, buf, 1);
+	} else {
+		exit_status = filerail_send_data_packet(s->fd, out, 0);
+	}
+
+	clean_up:
+	filerail_shaper_end(&shaped);
+	filerail_tune_cork(s->fd, false);
+	free(buf);
+	return exit_status;
+}
+
+// receive a burst, bytes received and seconds from it's first byte to it's end
+static int filerail_probe_recv_burst(filerail_session *s, bool raw, uint64_t *bytes, double *elapsed) {
+	int exit_status;
+	uint32_t size;
+	uint8_t *buf;
+	uint8_t out[BUFFER_SIZE];
+	double start;
+	filerail_data_packet packet;
+
+	exit_status = 0;
+	*bytes = 0;
+	start = 0;
+	if ((buf = malloc(PROBE_RAW_SIZE)) == NULL) {
+		LOG(LOG_USER | LOG_ERR, "probe.h filerail_probe_recv_burst malloc\n");
+		return -1;
+	}
+	while (true) {
+		if (raw) {
+			if (filerail_recv_frame_size(s->fd, &size) == -1 || size > PROBE_RAW_SIZE) {
+				exit_status = -1;
+				goto clean_up;
+			}
+			if (filerail_recv(s->fd, buf, size, MSG_WAITALL) == -1) {
+				exit_status = -1;
+				goto clean_up;
+			}
+			if (size == 1) {
+				break;
+			}
+		} else {
+			if (filerail_recv_data_packet(s->fd, &packet) == -1) {
+				exit_status = -1;
+				goto clean_up;
+			}
+			if (packet.data_size == 0) {
+				break;
+			}
+			if (filerail_decrypt(packet.data_payload, out, BUFFER_SIZE, s->K) == -1) {
+				exit_status = -1;
+				goto clean_up;
+			}
+			size = packet.data_size;
+		}
+		// time is counted from end of first message, so it's bytes aren't counted either
+		if (start == 0) {
+			start = filerail_probe_now();
+		} else {
+			*bytes += size;
+		}
+	}
+	*elapsed = start == 0 ? 0 : filerail_probe_now() - start;
+
+	clean_up:
+	free(buf);
+	return exit_status;
+}
+
+// serve sub commands of PROBE until BYE (PROBE command has been received)
+int filerail_probe_handler(filerail_session *s) {
+	uint64_t duration, bytes;
+	double elapsed;
+	bool raw;
+	filerail_file_offset offset;
+	filerail_command_header command;
+
+	if (filerail_recv_file_offset(s->fd, &offset) == -1) {
+		return -1;
+	}
+	duration = min(offset.offset, (uint64_t)PROBE_MAX_DURATION * 1000);
+	if (filerail_send_response_header(s->fd, OK) == -1) {
+		return -1;
+	}
+	while (true) {
+		if (filerail_recv_command_header(s->fd, &command) == -1) {
+			return -1;
+		}
+		raw = command.command_type == PROBE_RAW_UP || command.command_type == PROBE_RAW_DOWN;
+		if (command.command_type == PING) {
+			if (filerail_send_response_header(s->fd, PONG) == -1) {
+				return -1;
+			}
+		} else if (command.command_type == PROBE_UP || command.command_type == PROBE_RAW_UP) {
+			if (
+				filerail_probe_recv_burst(s, raw, &bytes, &elapsed) == -1 ||
+				filerail_send_file_offset(s->fd, bytes) == -1
+			) {
+				return -1;
+			}
+		} else if (command.command_type == PROBE_DOWN || command.command_type == PROBE_RAW_DOWN) {
+			if (filerail_probe_send_burst(s, raw, duration) == -1) {
+				return -1;
+			}
+		} else if (command.command_type == BYE) {
+			return filerail_send_response_header(s->fd, FINISH);
+		} else {
+			LOG(LOG_ERR | LOG_USER, "PROTOCOL NOT FOLLOWED\n");
+			return -1;
+		}
+	}
+}
+
+// one burst to server, rate in bytes per second (round trip of answer is taken out of elapsed time)
+static int filerail_probe_up(filerail_session *s, bool raw, uint64_t duration, double rtt, double *rate) {
+	double start, elapsed;
+	filerail_file_offset offset;
+
+	start = filerail_probe_now();
+	if (
+		filerail_send_command_header(s->fd, raw ? PROBE_RAW_UP : PROBE_UP) == -1 ||
+		filerail_probe_send_burst(s, raw, duration) == -1 ||
+		filerail_recv_file_offset(s->fd, &offset) == -1
+	) {
+		return -1;
+	}
+	elapsed = filerail_probe_now() - start - rtt / 1000;
+	*rate = elapsed > 0 ? offset.offset / elapsed : 0;
+	return 0;
+}
+
+// one burst from server, rate in bytes per second
+static int filerail_probe_down(filerail_session *s, bool raw, double *rate) {
+	uint64_t bytes;
+	double elapsed;
+
+	if (
+		filerail_send_command_header(s->fd, raw ? PROBE_RAW_DOWN : PROBE_DOWN) == -1 ||
+		filerail_probe_recv_burst(s, raw, &bytes, &elapsed) == -1
+	) {
+		return -1;
+	}
+	*rate = elapsed > 0 ? bytes / elapsed : 0;
+	return 0;
+}
+
+/*
+	Client side of probe, after server answered OK to PROBE: PROBE_PINGS round trips, then a raw and a filerail
+	burst of duration ms in each direction, and BYE. Suggestions are derived from the measurements.
+*/
+int filerail_probe_run(filerail_session *s, uint64_t duration, filerail_probe *p) {
+	unsigned int i;
+	double start, sum, link, rate;
+	double rtt[PROBE_PINGS];
+	filerail_response_header response;
+
+	memset(p, 0, sizeof(filerail_probe));
+	sum = 0;
+	for (i = 0; i < PROBE_PINGS; i++) {
+		start = filerail_probe_now();
+		if (
+			filerail_send_command_header(s->fd, PING) == -1 ||
+			filerail_recv_response_header(s->fd, &response) == -1 ||
+			response.response_type != PONG
+		) {
+			return -1;
+		}
+		rtt[i] = (filerail_probe_now() - start) * 1000;
+		sum += rtt[i];
+	}
+	qsort(rtt, PROBE_PINGS, sizeof(double), filerail_probe_compare);
+	p->rtt_min = rtt[0];
+	p->rtt_avg = sum / PROBE_PINGS;
+	p->rtt_p50 = rtt[PROBE_PINGS / 2];
+	p->rtt_p90 = rtt[PROBE_PINGS * 9 / 10];
+	p->rtt_max = rtt[PROBE_PINGS - 1];
+
+	SESSION_PRINT(s, printf("Probing upload...\n"));
+	if (
+		filerail_probe_up(s, true, duration, p->rtt_min, &p->up_link) == -1 ||
+		filerail_probe_up(s, false, duration, p->rtt_min, &p->up_rate) == -1
+	) {
+		return -1;
+	}
+	SESSION_PRINT(s, printf("Probing download...\n"));
+	if (
+		filerail_probe_down(s, true, &p->down_link) == -1 ||
+		filerail_probe_down(s, false, &p->down_rate) == -1
+	) {
+		return -1;
+	}
+	if (
+		filerail_send_command_header(s->fd, BYE) == -1 ||
+		filerail_recv_response_header(s->fd, &response) == -1 ||
+		response.response_type != FINISH
+	) {
+		return -1;
+	}
+
+	/*
+		A transfer is bound by it's cipher and framing when it's rate falls short of the link, concurrent
+		transfers (streams of a multiplexed connection) run them on as many threads.
+	*/
+	link = p->up_link > p->down_link ? p->up_link : p->down_link;
+	rate = p->up_rate < p->down_rate ? p->up_rate : p->down_rate;
+	p->streams = 1;
+	if (rate > 0 && link > rate) {
+		p->streams = (unsigned int)min((uint64_t)(link / rate + 0.999), (uint64_t)MUX_MAX_STREAMS);
+	}
+	p->bandwidth = (uint64_t)(link * 8 / 1000000);
+	return 0;
+}
+
+void filerail_probe_print(filerail_probe *p) {
+	printf(
+		"rtt: min %.3f ms, avg %.3f ms, p50 %.3f ms, p90 %.3f ms, max %.3f ms\n",
+		p->rtt_min, p->rtt_avg, p->rtt_p50, p->rtt_p90, p->rtt_max
+	);
+	printf(
+		"upload: link %.1f Mbit/s, filerail %.1f Mbit/s (%.0f%%)\n",
+		p->up_link * 8 / 1e6, p->up_rate * 8 / 1e6, p->up_link > 0 ? 100 * p->up_rate / p->up_link : 0
+	);
+	printf(
+		"download: link %.1f Mbit/s, filerail %.1f Mbit/s (%.0f%%)\n",
+		p->down_link * 8 / 1e6, p->down_rate * 8 / 1e6, p->down_link > 0 ? 100 * p->down_rate / p->down_link : 0
+	);
+	printf("suggested: -j %u -t bw=%llu\n", p->streams, (unsigned long long)p->bandwidth);
+}
+
+// size socket buffers of next connections of process from measured bandwidth, unless tuning was set by user
+void filerail_probe_tune(filerail_probe *p) {
+	if (tuning.bandwidth == 0 && tuning.buffer == 0) {
+		tuning.bandwidth = p->bandwidth * 1000000 / 8;
+	}
+}
+
+#endif /* FILERAIL_IMPLEMENTATION */
+
+#endif
@@ -16,7 +16,20 @@ enum COMMAND {
 	OVERWRITE, // notify user about overwriting files while uploading
 	RESOURCE_SIZE, // advertise resource size
 	RESUME, // prompt client whether it wants to resume from previous checkpoint
-	RESTART // tell client there are no checkpoints
+	RESTART, // tell client there are no checkpoints
+	SYNC, // upload only new or changed files of resource
+	MIRROR, // same as SYNC, but also remove files on server which are not present at client
+	DEDUP_PUT, // same as PUT, but only chunks missing in server's chunk store are sent
+	SESSION, // keep connection open for a sequence of commands (until BYE)
+	BYE, // end the session
+	MUX, // carry concurrent streams, each one like a connection of it's own (see mux.h)
+	PIPELINED_PUT, // PUT in one request (see filerail_request_header), answered with one filerail_request_response
+	PIPELINED_GET, // same for GET
+	PROBE, // measure RTT and throughput of link (see probe.h)
+	PROBE_UP, // burst of data packets from client, during PROBE
+	PROBE_DOWN, // burst of data packets from server, during PROBE
+	PROBE_RAW_UP, // burst of plain frames from client, during PROBE
+	PROBE_RAW_DOWN // burst of plain frames from server, during PROBE
 };
 
 // filerail responses
@@ -26,10 +39,26 @@ enum RESPONSE {
 	FINISH, // process finished
 	NOT_FOUND, // if resource not found
 	NO_ACCESS, // peer doens't have read/write access
-	BAD_RESOURCE, // bad resource (not file or directory)
+	BAD_RESOURCE, // bad resource (not file or directory), or it's path (and archive's) too long for server
 	INSUFFICIENT_SPACE, // insufficient storage on server
 	DUPLICATE_RESOURCE_NAME, // two resource having same name
-	NO_INTEGRITY // to indicate md5 hash calculated at receiver is not same as advertised md5 hash
+	NO_INTEGRITY, // to indicate md5 hash calculated at receiver is not same as advertised md5 hash
+	CHECKPOINT // receiver has a checkpoint (at offset), sender answers OK to resume from it or ABORT
+};
+
+// type of frame on a multiplexed connection
+enum MUX_FRAME {
+	MUX_DATA, // bytes of a stream
+	MUX_WINDOW, // receiver consumed bytes of a stream, sender may send as many more
+	MUX_FIN // sender won't send anything more on stream
+};
+
+// priority class of a transfer (see priority.h)
+enum PRIORITY {
+	PRIORITY_NORMAL, // default
+	PRIORITY_BULK, // backups, mirrors: yields to everything else
+	PRIORITY_INTERACTIVE, // someone is waiting on it: goes first
+	PRIORITY_CLASSES
 };
 
 // command structure
@@ -47,6 +76,7 @@ typedef struct _filerail_resource_header {
 	uint64_t resource_size; // stores resource size
 	char resource_name[MAX_RESOURCE_LENGTH]; // self-explanatory
 	char resource_dir[MAX_PATH_LENGTH]; // self-explanatory
+	uint8_t priority; // PRIORITY of transfer (PUT, DEDUP_PUT, SYNC, MIRROR, GET)
 } filerail_resource_header;
 
 // packet which transports encrypted data
@@ -71,4 +101,50 @@ typedef struct _filerail_resource_hash {
 	uint8_t hash[MD5_HASH_LENGTH];
 } filerail_resource_hash;
 
+/*
+	Pipelined request: sent after PIPELINED_PUT/PIPELINED_GET command (without waiting for an answer), carries
+	everything the PUT/GET handshake used to ask for one round trip at a time. Policies are POLICY values
+	(see session.h) of the session making the request.
+*/
+typedef struct _filerail_request_header {
+	uint8_t on_duplicate; // PUT: resource already exists at destination
+	uint8_t on_resume; // receiver has a checkpoint of archive
+	uint64_t resource_size; // PUT: size of archive, GET: storage available on client
+	uint64_t offset; // GET: offset of client's checkpoint
+	uint8_t hash[MD5_HASH_LENGTH]; // PUT: md5 hash of archive, GET: md5 hash of archive client has a checkpoint of
+	char resource_name[MAX_RESOURCE_LENGTH]; // self-explanatory
+	char resource_dir[MAX_PATH_LENGTH]; // destination dir (PUT), dir of resource on server (GET)
+	uint8_t priority; // PRIORITY of transfer
+} filerail_request_header;
+
+// answer to pipelined request, archive follows (GET) or is expected (PUT) if it is OK
+typedef struct _filerail_request_response {
+	uint8_t response_type; // OK, CHECKPOINT, or why request is refused
+	uint64_t resource_size; // GET: size of archive
+	uint64_t offset; // archive is sent from offset (receiver's checkpoint)
+	uint8_t hash[MD5_HASH_LENGTH]; // GET: md5 hash of archive, PUT refused as duplicate: of archive resource came from
+} filerail_request_response;
+
+// type of entry in manifest
+enum MANIFEST_ENTRY {
+	MANIFEST_FILE, // regular file (or link)
+	MANIFEST_DIR, // directory
+	MANIFEST_END // marks end of manifest
+};
+
+// one entry of manifest exchanged during sync (path is relative to resource dir)
+typedef struct _filerail_manifest_entry {
+	uint8_t entry_type; // self-explanatory
+	uint64_t size; // size of file
+	uint64_t mtime; // modification time in nanoseconds
+	uint8_t hash[MD5_HASH_LENGTH]; // md5 hash of file content
+	char path[MAX_PATH_LENGTH]; // self-explanatory
+} filerail_manifest_entry;
+
+// fingerprint of content defined chunk (length 0 marks end of list)
+typedef struct _filerail_chunk_info {
+	uint64_t length; // self-explanatory
+	uint8_t hash[MD5_HASH_LENGTH]; // md5 hash of chunk
+} filerail_chunk_info;
+
 #endif
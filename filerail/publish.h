@@ -0,0 +1,149 @@
+#ifndef _PUBLISH_H
+#define _PUBLISH_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+
+#include "global.h"
+#include "constants.h"
+#include "utils.h"
+#include "trash.h"
+
+/*
+	Atomic publish of a received resource.
+
+	Archive is extracted into a staging directory next to the resource, "<resource_dir>/.filerail-stage.<name>.<pid>.<session>",
+	so readers never see a half extracted tree, and a failed transfer only leaves the staging directory,
+	which is removed. Once extraction is complete:
+	1. syncfs once for the whole tree (instead of a fsync per file)
+	2. rename staged resource into resource_dir (RENAME_NOREPLACE), or swap it with the existing one (RENAME_EXCHANGE)
+	3. fsync resource_dir, so the rename itself is durable
+	The replaced resource ends up in staging directory and is moved to trash of checkpoints directory (removed in
+	background), or removed right away if no checkpoints directory is given.
+
+	Server marks the staged resource with hash of the archive it came from (PUBLISH_RECEIPT_XATTR) before renaming
+	it, so a PUT retried after it's answer was lost can tell it's archive is already in place (see
+	filerail_published_hash). File systems without user extended attributes just go without it.
+*/
+
+void filerail_stage_path(const char *resource_dir, const char *resource_name, unsigned int session_id, char *stage_path);
+int filerail_stage_init(const char *stage_path);
+void filerail_stage_abort(const char *stage_path);
+int filerail_publish(const char *stage_path, const char *resource_dir, const char *resource_name, const char *ckpt_path,
+	const uint8_t *hash);
+bool filerail_published_hash(const char *resource_path, uint8_t *hash);
+
+#ifdef FILERAIL_IMPLEMENTATION
+
+void filerail_stage_path(const char *resource_dir, const char *resource_name, unsigned int session_id, char *stage_path) {
+	snprintf(stage_path, MAX_PATH_LENGTH, "%s/%s%s.%d.%u", resource_dir, STAGE_PREFIX, resource_name, (int)getpid(), session_id);
+}
+
+int filerail_stage_init(const char *stage_path) {
+	if (mkdir(stage_path, 0700) == -1) {
+		LOG(LOG_USER | LOG_ERR, "publish.h filerail_stage_init mkdir\n");
+		return -1;
+	}
+	return 0;
+}
+
+// remove whatever a failed transfer extracted
+void filerail_stage_abort(const char *stage_path) {
+	if (access(stage_path, F_OK) == 0 && filerail_rm(stage_path) == -1) {
+		LOG(LOG_USER | LOG_ERR, "publish.h filerail_stage_abort\n");
+	}
+}
+
+// get rid of resource replaced by publish (ckpt_path is NULL if there is no background deleter)
+static int filerail_publish_discard(const char *path, const char *ckpt_path) {
+	char trash_path[MAX_PATH_LENGTH];
+
+	if (ckpt_path != NULL && filerail_trash_init(ckpt_path, trash_path) == 0) {
+		return filerail_trash_move(trash_path, path);
+	}
+	return filerail_rm(path);
+}
+
+// make staged resource visible at resource_dir/resource_name in a single step, marked with hash if it isn't NULL
+int filerail_publish(const char *stage_path, const char *resource_dir, const char *resource_name, const char *ckpt_path,
+	const uint8_t *hash)
+{
+	int fd, exit_status;
+	char src[MAX_PATH_LENGTH], dst[MAX_PATH_LENGTH];
+
+	exit_status = 0;
+	snprintf(src, sizeof(src), "%s/%s", stage_path, resource_name);
+	snprintf(dst, sizeof(dst), "%s/%s", resource_dir, resource_name);
+	// an empty directory has no entries in archive
+	if (access(src, F_OK) == -1 && mkdir(src, 0777) == -1) {
+		LOG(LOG_USER | LOG_ERR, "publish.h filerail_publish mkdir\n");
+		return -1;
+	}
+	if (hash != NULL && lsetxattr(src, PUBLISH_RECEIPT_XATTR, hash, MD5_HASH_LENGTH, 0) == -1 && errno != ENOTSUP) {
+		LOG(LOG_USER | LOG_ERR, "publish.h filerail_publish lsetxattr\n");
+	}
+
+	// flush extracted tree in one go
+	if ((fd = open(stage_path, O_RDONLY | O_DIRECTORY)) == -1) {
+		LOG(LOG_USER | LOG_ERR, "publish.h filerail_publish open\n");
+		return -1;
+	}
+	if (syncfs(fd) == -1) {
+		LOG(LOG_USER | LOG_ERR, "publish.h filerail_publish syncfs\n");
+	}
+	close(fd);
+
+	if (renameat2(AT_FDCWD, src, AT_FDCWD, dst, RENAME_NOREPLACE) == -1) {
+		if (errno == EEXIST) {
+			// old resource swaps into staging directory
+			if (renameat2(AT_FDCWD, src, AT_FDCWD, dst, RENAME_EXCHANGE) == -1) {
+				LOG(LOG_USER | LOG_ERR, "publish.h filerail_publish renameat2\n");
+				return -1;
+			}
+			if (filerail_publish_discard(src, ckpt_path) == -1) {
+				exit_status = -1;
+			}
+		} else if (errno == EINVAL || errno == ENOSYS) {
+			// file system without renameat2 flags, old resource is briefly missing
+			if (access(dst, F_OK) == 0 && filerail_publish_discard(dst, ckpt_path) == -1) {
+				return -1;
+			}
+			if (rename(src, dst) == -1) {
+				LOG(LOG_USER | LOG_ERR, "publish.h filerail_publish rename\n");
+				return -1;
+			}
+		} else {
+			LOG(LOG_USER | LOG_ERR, "publish.h filerail_publish renameat2\n");
+			return -1;
+		}
+	}
+
+	// make rename durable
+	if ((fd = open(resource_dir, O_RDONLY | O_DIRECTORY)) != -1) {
+		fsync(fd);
+		close(fd);
+	}
+	if (rmdir(stage_path) == -1) {
+		LOG(LOG_USER | LOG_ERR, "publish.h filerail_publish rmdir\n");
+		exit_status = -1;
+	}
+	return exit_status;
+}
+
+// hash of archive resource was published from, false if it isn't known
+bool filerail_published_hash(const char *resource_path, uint8_t *hash) {
+	return lgetxattr(resource_path, PUBLISH_RECEIPT_XATTR, hash, MD5_HASH_LENGTH) == MD5_HASH_LENGTH;
+}
+
+#endif /* FILERAIL_IMPLEMENTATION */
+
+#endif
@@ -0,0 +1,920 @@
+#ifndef _REACTOR_H
+#define _REACTOR_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+
+#include "global.h"
+#include "constants.h"
+#include "protocol.h"
+#include "socket.h"
+#include "serializer.h"
+#include "deserializer.h"
+
+/*
+	Event mode of server.
+
+	Instead of forking a process per connection, a single reactor (epoll) accepts connections, and keeps every
+	connection as a non-blocking state machine for as long as it is waiting on it's client:
+	READ_COMMAND : read length of frame, then the frame (exactly, client may already have sent more)
+	WRITE_REPLY  : PING, SESSION and BYE are answered by the reactor itself (PONG, OK, FINISH)
+	WAIT_REQUEST : a command is handed over only once it's first frame (request or resource header) is buffered,
+	               so a client still zipping or hashing (sending heartbeats) holds no worker
+	QUEUED       : waiting for a worker, client gets a heartbeat every HEARTBEAT_INTERVAL seconds (see deadline.h)
+	RUNNING      : a worker serves the command
+	Heavy part of a command (zip, hash, disk I/O, the transfer) is served by one of a fixed pool of pre-forked
+	workers, one command at a time, with the blocking session code. fd is passed over a unix socket with
+	SCM_RIGHTS and reactor keeps it's copy: once the command is done, connection of a SESSION goes back to
+	READ_COMMAND, so an idle session holds no worker. A MUX connection (concurrent streams for it's whole life)
+	gets a process of it's own instead. At most REACTOR_MAX_QUEUED commands wait for a worker, connections of
+	any more are closed (client retries). Processes forked by reactor keep no fd of it's other connections.
+	Connections which don't send a command in time are closed (MAX_IO_TIME_OUT, COMMAND_TIME_OUT between commands
+	of a session, heartbeats of client extend it). A worker that dies is replaced, it's connection is closed.
+*/
+
+// serves one command on a blocking fd (MUX: whole connection), -1 if connection may be out of step
+typedef int (*filerail_session_fn)(int fd, filerail_command_header *command, void *arg);
+
+enum REACTOR_KIND {
+	REACTOR_LISTENER,
+	REACTOR_CONN,
+	REACTOR_WORKER
+};
+
+enum REACTOR_STATE {
+	READ_COMMAND,
+	WRITE_REPLY,
+	WAIT_REQUEST,
+	QUEUED,
+	RUNNING
+};
+
+// connection owned by reactor
+typedef struct _filerail_reactor_conn {
+	int kind;
+	int fd;
+	int state;
+	uint32_t events; // events fd is registered for in epoll (0 if it isn't)
+	bool in_session; // after SESSION, connection goes back to READ_COMMAND once a command is done
+	bool close_after; // close once reply is written
+	uint8_t buf[REACTOR_FRAME_SIZE]; // frame being read or written
+	size_t len; // bytes read or written so far
+	size_t size; // size of whole frame, 0 while length isn't known
+	time_t deadline; // time out, or next heartbeat while QUEUED
+	filerail_command_header command;
+	struct _filerail_reactor_conn *prev, *next; // all connections (every fd a forked process must close)
+	struct _filerail_reactor_conn *queue_next; // commands waiting for a worker
+} filerail_reactor_conn;
+
+typedef struct _filerail_reactor_worker {
+	int kind;
+	pid_t pid;
+	int sock; // reactor end of unix socket, -1 if worker couldn't be started
+	filerail_reactor_conn *conn; // connection whose command is being served, NULL if idle
+	bool dedicated; // serves a single connection and exits
+	struct _filerail_reactor_worker *next; // dedicated processes
+} filerail_reactor_worker;
+
+typedef struct _filerail_reactor {
+	int epfd;
+	int listen_fd;
+	int listener_kind; // epoll tag of listen_fd
+	filerail_reactor_worker *workers;
+	int nworkers;
+	filerail_reactor_worker *dedicated;
+	filerail_reactor_conn *conns;
+	filerail_reactor_conn *queue_head, *queue_tail;
+	size_t nqueued;
+	uint8_t reply[FINISH + 1][REACTOR_FRAME_SIZE]; // serialized OK, PONG and FINISH (with length)
+	size_t reply_len[FINISH + 1];
+	filerail_session_fn session;
+	void *arg;
+} filerail_reactor;
+
+int filerail_reactor_run(int listen_fd, int nworkers, filerail_session_fn session, void *arg,
+	volatile sig_atomic_t *stop);
+
+#ifdef FILERAIL_IMPLEMENTATION
+
+// pass fd and first command to worker
+static int filerail_reactor_send_fd(int sock, int fd, uint8_t command_type) {
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char control[CMSG_SPACE(sizeof(int))];
+
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+	iov.iov_base = &command_type;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	if (sendmsg(sock, &msg, MSG_NOSIGNAL) != 1) {
+		LOG(LOG_USER | LOG_ERR, "reactor.h filerail_reactor_send_fd sendmsg\n");
+		return -1;
+	}
+	return 0;
+}
+
+// receive fd and first command from reactor, returns 0 once reactor is gone
+static int filerail_reactor_recv_fd(int sock, int *fd, uint8_t *command_type) {
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char control[CMSG_SPACE(sizeof(int))];
+	ssize_t n;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = command_type;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	while ((n = recvmsg(sock, &msg, 0)) == -1 && errno == EINTR) {
+		;
+	}
+	if (n <= 0) {
+		return n;
+	}
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+		LOG(LOG_USER | LOG_ERR, "reactor.h filerail_reactor_recv_fd no fd\n");
+		return -1;
+	}
+	memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+	return 1;
+}
+
+// session code is blocking, and tuned here (connections answered by reactor itself don't need it)
+static void filerail_reactor_prepare(int fd) {
+	int flags;
+
+	if ((flags = fcntl(fd, F_GETFL)) != -1) {
+		fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+	}
+	filerail_tune_socket(fd);
+	filerail_tune_buffers(fd);
+	filerail_tune_report(fd, "session");
+}
+
+// body of a worker process, never returns
+static void filerail_reactor_worker_loop(int sock, filerail_session_fn session, void *arg) {
+	int fd, ret;
+	uint8_t status;
+	filerail_command_header command;
+
+	while ((ret = filerail_reactor_recv_fd(sock, &fd, &command.command_type)) != 0) {
+		status = 1;
+		if (ret == 1) {
+			filerail_reactor_prepare(fd);
+			if (session(fd, &command, arg) == -1) {
+				LOG(LOG_INFO | LOG_USER, "worker process, FAILED\n");
+			} else {
+				LOG(LOG_INFO | LOG_USER, "worker process, SUCCESS\n");
+				status = 0;
+			}
+			// reactor keeps it's copy of connection
+			close(fd);
+			// sessions may change directory
+			if (chdir("/") == -1) {
+				LOG(LOG_USER | LOG_ERR, "reactor.h filerail_reactor_worker_loop chdir\n");
+			}
+		}
+		// 0: connection is in step, 1: reactor closes it
+		if (send(sock, &status, 1, MSG_NOSIGNAL) != 1) {
+			break;
+		}
+	}
+	// reactor is gone
+	_exit(0);
+}
+
+/*
+	Fork a process, connected to reactor by a unix socket (*sock is it's end in either process).
+	Child keeps none of reactor's fds (listening socket, epoll, sockets of other workers, connections whether
+	read, queued or served) but keep_fd.
+*/
+static pid_t filerail_reactor_fork(filerail_reactor *r, int keep_fd, int *sock) {
+	int sv[2], i;
+	pid_t pid;
+	filerail_reactor_conn *conn;
+	filerail_reactor_worker *w;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+		LOG(LOG_USER | LOG_ERR, "reactor.h filerail_reactor_fork socketpair\n");
+		return -1;
+	}
+	if ((pid = fork()) == -1) {
+		LOG(LOG_USER | LOG_ERR, "reactor.h filerail_reactor_fork fork\n");
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+	if (pid == 0) {
+		close(sv[0]);
+		close(r->epfd);
+		if (r->listen_fd != -1) {
+			close(r->listen_fd);
+		}
+		for (i = 0; i < r->nworkers; i++) {
+			if (r->workers[i].sock != -1) {
+				close(r->workers[i].sock);
+			}
+		}
+		for (w = r->dedicated; w != NULL; w = w->next) {
+			close(w->sock);
+		}
+		for (conn = r->conns; conn != NULL; conn = conn->next) {
+			if (conn->fd != keep_fd) {
+				close(conn->fd);
+			}
+		}
+		*sock = sv[1];
+		return 0;
+	}
+	close(sv[1]);
+	*sock = sv[0];
+	return pid;
+}
+
+static int filerail_reactor_watch_worker(filerail_reactor *r, filerail_reactor_worker *w) {
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = w;
+	if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, w->sock, &ev) == -1) {
+		LOG(LOG_USER | LOG_ERR, "reactor.h filerail_reactor_watch_worker epoll_ctl\n");
+		close(w->sock);
+		w->sock = -1;
+		kill(w->pid, SIGTERM);
+		return -1;
+	}
+	return 0;
+}
+
+static int filerail_reactor_start_worker(filerail_reactor *r, filerail_reactor_worker *w) {
+	int sock;
+	pid_t pid;
+
+	w->kind = REACTOR_WORKER;
+	w->sock = -1;
+	w->conn = NULL;
+	w->dedicated = false;
+	if ((pid = filerail_reactor_fork(r, -1, &sock)) == -1) {
+		return -1;
+	}
+	if (pid == 0) {
+		filerail_reactor_worker_loop(sock, r->session, r->arg);
+	}
+	w->pid = pid;
+	w->sock = sock;
+	return filerail_reactor_watch_worker(r, w);
+}
+
+// (re)register fd of connection for events, 0 stops watching it
+static int filerail_reactor_watch(filerail_reactor *r, filerail_reactor_conn *conn, uint32_t events) {
+	int op;
+	struct epoll_event ev;
+
+	if (events == conn->events) {
+		return 0;
+	}
+	op = conn->events == 0 ? EPOLL_CTL_ADD : (events == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD);
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = conn;
+	if (epoll_ctl(r->epfd, op, conn->fd, &ev) == -1) {
+		LOG(LOG_USER | LOG_ERR, "reactor.h filerail_reactor_watch epoll_ctl\n");
+		return -1;
+	}
+	conn->events = events;
+	return 0;
+}
+
+// connection must not be queued
+static void filerail_reactor_close(filerail_reactor *r, filerail_reactor_conn *conn) {
+	if (conn->prev != NULL) {
+		conn->prev->next = conn->next;
+	} else {
+		r->conns = conn->next;
+	}
+	if (conn->next != NULL) {
+		conn->next->prev = conn->prev;
+	}
+	// closing the fd removes it from epoll
+	close(conn->fd);
+	free(conn);
+}
+
+// wait for next command (first one, or next one of a session)
+static void filerail_reactor_read_command(filerail_reactor *r, filerail_reactor_conn *conn) {
+	conn->state = READ_COMMAND;
+	conn->len = conn->size = 0;
+	conn->deadline = time(NULL) + (conn->in_session ? COMMAND_TIME_OUT : MAX_IO_TIME_OUT);
+	if (filerail_reactor_watch(r, conn, EPOLLIN) == -1) {
+		filerail_reactor_close(r, conn);
+	}
+}
+
+// write rest of reply, then close connection or read it's next command
+static void filerail_reactor_write(filerail_reactor *r, filerail_reactor_conn *conn) {
+	ssize_t n;
+
+	while (conn->len < conn->size) {
+		n = send(conn->fd, conn->buf + conn->len, conn->size - conn->len, MSG_NOSIGNAL);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			if (filerail_reactor_watch(r, conn, EPOLLOUT) == -1) {
+				filerail_reactor_close(r, conn);
+			}
+			return;
+		}
+		if (n <= 0) {
+			filerail_reactor_close(r, conn);
+			return;
+		}
+		conn->len += n;
+	}
+	if (conn->close_after) {
+		filerail_reactor_close(r, conn);
+		return;
+	}
+	filerail_reactor_read_command(r, conn);
+}
+
+// answer command with a response of reactor (OK, PONG or FINISH)
+static void filerail_reactor_reply(filerail_reactor *r, filerail_reactor_conn *conn, uint8_t type, bool close_after) {
+	memcpy(conn->buf, r->reply[type], r->reply_len[type]);
+	conn->state = WRITE_REPLY;
+	conn->len = 0;
+	conn->size = r->reply_len[type];
+	conn->close_after = close_after;
+	conn->deadline = time(NULL) + MAX_IO_TIME_OUT;
+	filerail_reactor_write(r, conn);
+}
+
+// wake up for fd only once at least n bytes are buffered
+static int filerail_reactor_lowat(int fd, size_t n) {
+	int optval;
+
+	optval = n;
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVLOWAT, &optval, sizeof(optval)) == -1) {
+		LOG(LOG_USER | LOG_ERR, "reactor.h filerail_reactor_lowat setsockopt\n");
+		return -1;
+	}
+	return 0;
+}
+
+static void filerail_reactor_queue(filerail_reactor *r, filerail_reactor_conn *conn) {
+	if (r->nqueued >= REACTOR_MAX_QUEUED) {
+		LOG(LOG_USER | LOG_INFO, "reactor.h filerail_reactor_queue queue full\n");
+		filerail_reactor_close(r, conn);
+		return;
+	}
+	if (filerail_reactor_watch(r, conn, 0) == -1) {
+		filerail_reactor_close(r, conn);
+		return;
+	}
+	conn->state = QUEUED;
+	conn->queue_next = NULL;
+	conn->deadline = time(NULL) + HEARTBEAT_INTERVAL;
+	if (r->queue_tail != NULL) {
+		r->queue_tail->queue_next = conn;
+	} else {
+		r->queue_head = conn;
+	}
+	r->queue_tail = conn;
+	r->nqueued++;
+}
+
+// queue command once it's first frame is buffered (heartbeats before it are consumed)
+static void filerail_reactor_wait_request(filerail_reactor *r, filerail_reactor_conn *conn) {
+	ssize_t n;
+	int avail;
+	uint32_t size;
+	size_t need;
+
+	while (true) {
+		n = recv(conn->fd, &size, sizeof(size), MSG_PEEK);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return;
+		}
+		if (n <= 0) {
+			filerail_reactor_close(r, conn);
+			return;
+		}
+		if ((size_t)n < sizeof(size)) {
+			need = sizeof(size);
+		} else if ((size = ntohl(size)) == 0) {
+			// heartbeat, client is busy preparing it's request
+			if (recv(conn->fd, &size, sizeof(size), 0) != sizeof(size)) {
+				filerail_reactor_close(r, conn);
+				return;
+			}
+			conn->deadline = time(NULL) + MAX_IO_TIME_OUT;
+			continue;
+		} else {
+			need = sizeof(size) + size;
+			// a frame too large to wait for is left to worker
+			if (size > REACTOR_REQUEST_SIZE || (ioctl(conn->fd, FIONREAD, &avail) == 0 && (size_t)avail >= need)) {
+				break;
+			}
+		}
+		// level triggered epoll would report a partial frame over and over
+		if (filerail_reactor_lowat(conn->fd, need) == -1) {
+			break;
+		}
+		return;
+	}
+	filerail_reactor_lowat(conn->fd, 1);
+	filerail_reactor_queue(r, conn);
+}
+
+// connection (MUX) is served by a process of it's own for it's whole life, workers keep serving commands
+static void filerail_reactor_dedicate(filerail_reactor *r, filerail_reactor_conn *conn) {
+	int fd, sock;
+	pid_t pid;
+	filerail_command_header command;
+	filerail_reactor_worker *w;
+
+	if ((w = calloc(1, sizeof(filerail_reactor_worker))) == NULL) {
+		LOG(LOG_USER | LOG_ERR, "reactor.h filerail_reactor_dedicate calloc\n");
+		filerail_reactor_close(r, conn);
+		return;
+	}
+	if ((pid = filerail_reactor_fork(r, conn->fd, &sock)) == -1) {
+		free(w);
+		filerail_reactor_close(r, conn);
+		return;
+	}
+	if (pid == 0) {
+		// socket to reactor stays open until exit, reactor sees it's end
+		fd = conn->fd;
+		command = conn->command;
+		filerail_reactor_prepare(fd);
+		if (r->session(fd, &command, r->arg) == -1) {
+			LOG(LOG_INFO | LOG_USER, "dedicated process, FAILED\n");
+			_exit(1);
+		}
+		LOG(LOG_INFO | LOG_USER, "dedicated process, SUCCESS\n");
+		_exit(0);
+	}
+	w->kind = REACTOR_WORKER;
+	w->pid = pid;
+	w->sock = sock;
+	w->dedicated = true;
+	if (filerail_reactor_watch_worker(r, w) == -1) {
+		free(w);
+	} else {
+		w->next = r->dedicated;
+		r->dedicated = w;
+	}
+	// child has it's own copy
+	filerail_reactor_close(r, conn);
+}
+
+// hand queued commands to idle workers
+static void filerail_reactor_dispatch(filerail_reactor *r) {
+	int i;
+	filerail_reactor_worker *w;
+	filerail_reactor_conn *conn;
+
+	for (i = 0; i < r->nworkers && r->queue_head != NULL; i++) {
+		w = &r->workers[i];
+		if (w->sock == -1 || w->conn != NULL) {
+			continue;
+		}
+		conn = r->queue_head;
+		r->queue_head = conn->queue_next;
+		if (r->queue_head == NULL) {
+			r->queue_tail = NULL;
+		}
+		r->nqueued--;
+		if (filerail_reactor_send_fd(w->sock, conn->fd, conn->command.command_type) == -1) {
+			filerail_reactor_close(r, conn);
+			continue;
+		}
+		conn->state = RUNNING;
+		w->conn = conn;
+	}
+}
+
+static void filerail_reactor_accept(filerail_reactor *r) {
+	int fd;
+	filerail_reactor_conn *conn;
+
+	while (true) {
+		if ((fd = accept4(r->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+				LOG(LOG_USER | LOG_ERR, "reactor.h filerail_reactor_accept accept4\n");
+			}
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			return;
+		}
+		if ((conn = calloc(1, sizeof(filerail_reactor_conn))) == NULL) {
+			LOG(LOG_USER | LOG_ERR, "reactor.h filerail_reactor_accept calloc\n");
+			close(fd);
+			continue;
+		}
+		conn->kind = REACTOR_CONN;
+		conn->fd = fd;
+		conn->next = r->conns;
+		if (r->conns != NULL) {
+			r->conns->prev = conn;
+		}
+		r->conns = conn;
+		filerail_reactor_read_command(r, conn);
+	}
+}
+
+// command is read: answer it, or hand it over
+static void filerail_reactor_command(filerail_reactor *r, filerail_reactor_conn *conn) {
+	switch (conn->command.command_type) {
+		case PING: {
+			filerail_reactor_reply(r, conn, PONG, !conn->in_session);
+			break;
+		}
+		case SESSION: {
+			if (conn->in_session) {
+				LOG(LOG_INFO | LOG_USER, "PROTOCOL NOT FOLLOWED\n");
+				filerail_reactor_close(r, conn);
+				break;
+			}
+			conn->in_session = true;
+			filerail_reactor_reply(r, conn, OK, false);
+			break;
+		}
+		case BYE: {
+			if (!conn->in_session) {
+				LOG(LOG_INFO | LOG_USER, "PROTOCOL NOT FOLLOWED\n");
+				filerail_reactor_close(r, conn);
+				break;
+			}
+			filerail_reactor_reply(r, conn, FINISH, true);
+			break;
+		}
+		case MUX: {
+			if (conn->in_session) {
+				LOG(LOG_INFO | LOG_USER, "PROTOCOL NOT FOLLOWED\n");
+				filerail_reactor_close(r, conn);
+				break;
+			}
+			filerail_reactor_dedicate(r, conn);
+			break;
+		}
+		default: {
+			conn->state = WAIT_REQUEST;
+			conn->deadline = time(NULL) + MAX_IO_TIME_OUT;
+			filerail_reactor_wait_request(r, conn);
+			break;
+		}
+	}
+}
+
+// connection is readable or writeable
+static void filerail_reactor_handle(filerail_reactor *r, filerail_reactor_conn *conn) {
+	ssize_t n;
+	size_t want;
+	uint32_t size;
+
+	if (conn->state == WRITE_REPLY) {
+		filerail_reactor_write(r, conn);
+		return;
+	}
+	if (conn->state == WAIT_REQUEST) {
+		filerail_reactor_wait_request(r, conn);
+		return;
+	}
+
+	while (true) {
+		// length first, then exactly one frame
+		want = conn->size == 0 ? sizeof(uint32_t) : conn->size;
+		if (conn->len == want) {
+			if (conn->size != 0) {
+				break;
+			}
+			memcpy(&size, conn->buf, sizeof(uint32_t));
+			size = ntohl(size);
+			if (size == 0) {
+				// heartbeat, client is busy preparing it's request
+				conn->len = 0;
+				if (conn->deadline < time(NULL) + MAX_IO_TIME_OUT) {
+					conn->deadline = time(NULL) + MAX_IO_TIME_OUT;
+				}
+				continue;
+			}
+			if (size > REACTOR_FRAME_SIZE - sizeof(uint32_t)) {
+				LOG(LOG_USER | LOG_INFO, "reactor.h filerail_reactor_handle bad frame\n");
+				filerail_reactor_close(r, conn);
+				return;
+			}
+			conn->size = sizeof(uint32_t) + size;
+			continue;
+		}
+		n = recv(conn->fd, conn->buf + conn->len, want - conn->len, 0);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return;
+		}
+		if (n <= 0) {
+			filerail_reactor_close(r, conn);
+			return;
+		}
+		conn->len += n;
+	}
+
+	if (!filerail_deserialize_command_header(&conn->command, conn->buf + sizeof(uint32_t), conn->size - sizeof(uint32_t))) {
+		filerail_reactor_close(r, conn);
+		return;
+	}
+	filerail_reactor_command(r, conn);
+}
+
+// close connections which didn't get their command (or reply) through in time, and heartbeat queued commands
+static void filerail_reactor_expire(filerail_reactor *r) {
+	time_t now;
+	ssize_t n;
+	uint32_t frame;
+	filerail_reactor_conn *conn, *next, *prev;
+
+	now = time(NULL);
+	for (conn = r->conns; conn != NULL; conn = next) {
+		next = conn->next;
+		if (conn->state != QUEUED && conn->state != RUNNING && now > conn->deadline) {
+			filerail_reactor_close(r, conn);
+		}
+	}
+
+	frame = 0;
+	prev = NULL;
+	for (conn = r->queue_head; conn != NULL; conn = next) {
+		next = conn->queue_next;
+		if (now < conn->deadline) {
+			prev = conn;
+			continue;
+		}
+		conn->deadline = now + HEARTBEAT_INTERVAL;
+		n = send(conn->fd, &frame, sizeof(frame), MSG_DONTWAIT | MSG_NOSIGNAL);
+		// client not reading (it's buffer is full) is left to worker's deadlines
+		if (n == sizeof(frame) || (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))) {
+			prev = conn;
+			continue;
+		}
+		// client is gone, or stream was cut in the middle of a frame
+		if (prev != NULL) {
+			prev->queue_next = next;
+		} else {
+			r->queue_head = next;
+		}
+		if (r->queue_tail == conn) {
+			r->queue_tail = prev;
+		}
+		r->nqueued--;
+		filerail_reactor_close(r, conn);
+	}
+}
+
+// worker is done with a command, or a worker exited
+static void filerail_reactor_worker_event(filerail_reactor *r, filerail_reactor_worker *w) {
+	uint8_t status;
+	ssize_t n;
+	int flags;
+	filerail_reactor_conn *conn;
+	filerail_reactor_worker **link;
+
+	n = recv(w->sock, &status, 1, MSG_DONTWAIT);
+	if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		return;
+	}
+	if (n == 1 && !w->dedicated) {
+		conn = w->conn;
+		w->conn = NULL;
+		if (conn == NULL) {
+			return;
+		}
+		// worker made it blocking (file status flags are shared with reactor's copy)
+		if (
+			status != 0 || !conn->in_session ||
+			(flags = fcntl(conn->fd, F_GETFL)) == -1 || fcntl(conn->fd, F_SETFL, flags | O_NONBLOCK) == -1
+		) {
+			filerail_reactor_close(r, conn);
+			return;
+		}
+		filerail_reactor_read_command(r, conn);
+		return;
+	}
+	close(w->sock);
+	w->sock = -1;
+	if (w->dedicated) {
+		for (link = &r->dedicated; *link != w; link = &(*link)->next) {
+			;
+		}
+		*link = w->next;
+		free(w);
+		return;
+	}
+	// worker died (it's command is lost), replace it
+	LOG(LOG_USER | LOG_ERR, "reactor.h filerail_reactor_worker_event worker died\n");
+	if (w->conn != NULL) {
+		filerail_reactor_close(r, w->conn);
+		w->conn = NULL;
+	}
+	filerail_reactor_start_worker(r, w);
+}
+
+// no connection left (every command is done), and no dedicated process
+static bool filerail_reactor_idle(filerail_reactor *r) {
+	return r->conns == NULL && r->dedicated == NULL;
+}
+
+static void filerail_reactor_free(filerail_reactor *r) {
+	int i;
+	filerail_reactor_worker *w;
+
+	for (i = 0; i < r->nworkers; i++) {
+		if (r->workers[i].sock != -1) {
+			// worker exits once it's command is over
+			close(r->workers[i].sock);
+		}
+	}
+	while ((w = r->dedicated) != NULL) {
+		r->dedicated = w->next;
+		close(w->sock);
+		free(w);
+	}
+	r->queue_head = r->queue_tail = NULL;
+	while (r->conns != NULL) {
+		filerail_reactor_close(r, r->conns);
+	}
+	free(r->workers);
+	if (r->epfd != -1) {
+		close(r->epfd);
+	}
+}
+
+// serialize response (with length) reactor answers by itself
+static int filerail_reactor_init_reply(filerail_reactor *r, uint8_t type) {
+	void *buf;
+	size_t size;
+	uint32_t frame_size;
+	filerail_response_header response;
+
+	buf = NULL;
+	response.response_type = type;
+	if ((size = filerail_serialize_response_header(&response, &buf)) == 0 || size > REACTOR_FRAME_SIZE - sizeof(uint32_t)) {
+		free(buf);
+		return -1;
+	}
+	frame_size = htonl(size);
+	memcpy(r->reply[type], &frame_size, sizeof(uint32_t));
+	memcpy(r->reply[type] + sizeof(uint32_t), buf, size);
+	r->reply_len[type] = sizeof(uint32_t) + size;
+	free(buf);
+	return 0;
+}
+
+/*
+	Run event mode server on listen_fd with nworkers session workers.
+	Once *stop is set, connections already queued on listen_fd are accepted, listen_fd is closed,
+	and it returns when every session is over.
+*/
+int filerail_reactor_run(int listen_fd, int nworkers, filerail_session_fn session, void *arg,
+	volatile sig_atomic_t *stop)
+{
+	int i, n, exit_status, flags;
+	bool stopping;
+	time_t now, last_expire;
+	struct epoll_event ev, events[REACTOR_MAX_EVENTS];
+	filerail_reactor r;
+
+	memset(&r, 0, sizeof(r));
+	r.listen_fd = listen_fd;
+	r.listener_kind = REACTOR_LISTENER;
+	r.session = session;
+	r.arg = arg;
+	exit_status = -1;
+
+	// replies of reactor are always the same frames
+	if (
+		filerail_reactor_init_reply(&r, OK) == -1 ||
+		filerail_reactor_init_reply(&r, PONG) == -1 ||
+		filerail_reactor_init_reply(&r, FINISH) == -1
+	) {
+		return -1;
+	}
+
+	if ((r.epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		LOG(LOG_USER | LOG_ERR, "reactor.h filerail_reactor_run epoll_create1\n");
+		return -1;
+	}
+	if ((flags = fcntl(listen_fd, F_GETFL)) == -1 || fcntl(listen_fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+		LOG(LOG_USER | LOG_ERR, "reactor.h filerail_reactor_run fcntl\n");
+		goto clean_up;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = &r.listener_kind;
+	if (epoll_ctl(r.epfd, EPOLL_CTL_ADD, listen_fd, &ev) == -1) {
+		LOG(LOG_USER | LOG_ERR, "reactor.h filerail_reactor_run epoll_ctl\n");
+		goto clean_up;
+	}
+
+	if ((r.workers = calloc(nworkers, sizeof(filerail_reactor_worker))) == NULL) {
+		LOG(LOG_USER | LOG_ERR, "reactor.h filerail_reactor_run calloc\n");
+		goto clean_up;
+	}
+	for (i = 0; i < nworkers; i++) {
+		r.workers[i].sock = -1;
+	}
+	r.nworkers = nworkers;
+	for (i = 0; i < nworkers; i++) {
+		if (filerail_reactor_start_worker(&r, &r.workers[i]) == -1) {
+			goto clean_up;
+		}
+	}
+
+	last_expire = time(NULL);
+	stopping = false;
+	while (true) {
+		if (*stop && !stopping) {
+			stopping = true;
+			filerail_reactor_accept(&r);
+			close(listen_fd);
+			r.listen_fd = -1;
+		}
+		if (stopping && filerail_reactor_idle(&r)) {
+			exit_status = 0;
+			break;
+		}
+		// wake up every second for time outs
+		n = epoll_wait(r.epfd, events, REACTOR_MAX_EVENTS, 1000);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			LOG(LOG_USER | LOG_ERR, "reactor.h filerail_reactor_run epoll_wait\n");
+			goto clean_up;
+		}
+		for (i = 0; i < n; i++) {
+			switch (*(int*)events[i].data.ptr) {
+				case REACTOR_LISTENER: {
+					filerail_reactor_accept(&r);
+					break;
+				}
+				case REACTOR_CONN: {
+					filerail_reactor_handle(&r, events[i].data.ptr);
+					break;
+				}
+				case REACTOR_WORKER: {
+					filerail_reactor_worker_event(&r, events[i].data.ptr);
+					break;
+				}
+			}
+		}
+		filerail_reactor_dispatch(&r);
+		if ((now = time(NULL)) != last_expire) {
+			filerail_reactor_expire(&r);
+			last_expire = now;
+		}
+	}
+
+	clean_up:
+	filerail_reactor_free(&r);
+	return exit_status;
+}
+
+#endif /* FILERAIL_IMPLEMENTATION */
+
+#endif
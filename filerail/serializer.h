@@ -31,6 +31,12 @@ size_t filerail_serialize_resource_header(filerail_resource_header *ptr, void **
 size_t filerail_serialize_file_offset(filerail_file_offset *ptr, void **buf);
 size_t filerail_serialize_resource_hash(filerail_resource_hash *ptr, void **buf);
 size_t filerail_serialize_data_packet(filerail_data_packet *ptr, void **buf);
+size_t filerail_serialize_manifest_entry(filerail_manifest_entry *ptr, void **buf);
+size_t filerail_serialize_chunk_info(filerail_chunk_info *ptr, void **buf);
+size_t filerail_serialize_request_header(filerail_request_header *ptr, void **buf);
+size_t filerail_serialize_request_response(filerail_request_response *ptr, void **buf);
+
+#ifdef FILERAIL_IMPLEMENTATION
 
 size_t filerail_serialize_response_header(filerail_response_header *ptr, void **buf) {
 	size_t ret;
@@ -108,6 +114,10 @@ size_t filerail_serialize_resource_header(filerail_resource_header *ptr, void **
 		msgpack_pack_str_body(&pk, ptr->resource_dir, MAX_PATH_LENGTH),
 		"serializer.h filerail_serialize_resource_header\n"
 	);
+	ERR_CHECK(
+		msgpack_pack_uint8(&pk, ptr->priority),
+		"serializer.h filerail_serialize_resource_header\n"
+	);
 
 	*buf = malloc(sbuf.size);
 	if (*buf == NULL) {
@@ -209,4 +219,230 @@ size_t filerail_serialize_data_packet(filerail_data_packet *ptr, void **buf) {
 	return ret;
 }
 
+/*
+	Unlike resource header, path is packed with its actual length.
+	Manifest of large trees has millions of entries, padding each path to MAX_PATH_LENGTH is not affordable.
+*/
+size_t filerail_serialize_manifest_entry(filerail_manifest_entry *ptr, void **buf) {
+	int i;
+	size_t ret, path_len;
+	msgpack_sbuffer sbuf;
+	msgpack_packer pk;
+
+	msgpack_sbuffer_init(&sbuf);
+	msgpack_packer_init(&pk, &sbuf, msgpack_sbuffer_write);
+
+	path_len = strlen(ptr->path);
+	ERR_CHECK(
+		msgpack_pack_array(&pk, NUM_ATTRS_FOR_MANIFEST_ENTRY),
+		"serializer.h filerail_serialize_manifest_entry\n"
+	);
+	ERR_CHECK(
+		msgpack_pack_uint8(&pk, ptr->entry_type),
+		"serializer.h filerail_serialize_manifest_entry\n"
+	);
+	ERR_CHECK(
+		msgpack_pack_uint64(&pk, ptr->size),
+		"serializer.h filerail_serialize_manifest_entry\n"
+	);
+	ERR_CHECK(
+		msgpack_pack_uint64(&pk, ptr->mtime),
+		"serializer.h filerail_serialize_manifest_entry\n"
+	);
+	ERR_CHECK(
+		msgpack_pack_array(&pk, MD5_HASH_LENGTH),
+		"serializer.h filerail_serialize_manifest_entry\n"
+	);
+	for (i = 0; i < MD5_HASH_LENGTH; i++) {
+		ERR_CHECK(
+			msgpack_pack_uint8(&pk, ptr->hash[i]),
+			"serializer.h filerail_serialize_manifest_entry\n"
+		);
+	}
+	ERR_CHECK(
+		msgpack_pack_str(&pk, path_len),
+		"serializer.h filerail_serialize_manifest_entry\n"
+	);
+	ERR_CHECK(
+		msgpack_pack_str_body(&pk, ptr->path, path_len),
+		"serializer.h filerail_serialize_manifest_entry\n"
+	);
+
+	*buf = malloc(sbuf.size);
+	if (*buf == NULL) {
+		LOG(LOG_USER | LOG_ERR, "serializer.h filerail_serialize_manifest_entry\n");
+		return 0;
+	}
+	ret = sbuf.size;
+	memcpy(*buf, sbuf.data, sbuf.size);
+
+	msgpack_sbuffer_destroy(&sbuf);
+	return ret;
+}
+
+size_t filerail_serialize_chunk_info(filerail_chunk_info *ptr, void **buf) {
+	int i;
+	size_t ret;
+	msgpack_sbuffer sbuf;
+	msgpack_packer pk;
+
+	msgpack_sbuffer_init(&sbuf);
+	msgpack_packer_init(&pk, &sbuf, msgpack_sbuffer_write);
+
+	ERR_CHECK(
+		msgpack_pack_array(&pk, NUM_ATTRS_FOR_CHUNK_INFO),
+		"serializer.h filerail_serialize_chunk_info\n"
+	);
+	ERR_CHECK(
+		msgpack_pack_uint64(&pk, ptr->length),
+		"serializer.h filerail_serialize_chunk_info\n"
+	);
+	ERR_CHECK(
+		msgpack_pack_array(&pk, MD5_HASH_LENGTH),
+		"serializer.h filerail_serialize_chunk_info\n"
+	);
+	for (i = 0; i < MD5_HASH_LENGTH; i++) {
+		ERR_CHECK(
+			msgpack_pack_uint8(&pk, ptr->hash[i]),
+			"serializer.h filerail_serialize_chunk_info\n"
+		);
+	}
+
+	*buf = malloc(sbuf.size);
+	if (*buf == NULL) {
+		LOG(LOG_USER | LOG_ERR, "serializer.h filerail_serialize_chunk_info\n");
+		return 0;
+	}
+	ret = sbuf.size;
+	memcpy(*buf, sbuf.data, sbuf.size);
+
+	msgpack_sbuffer_destroy(&sbuf);
+	return ret;
+}
+
+// name and dir are packed with their actual length (like manifest entry), so request fits in one segment
+size_t filerail_serialize_request_header(filerail_request_header *ptr, void **buf) {
+	int i;
+	size_t ret, name_len, dir_len;
+	msgpack_sbuffer sbuf;
+	msgpack_packer pk;
+
+	msgpack_sbuffer_init(&sbuf);
+	msgpack_packer_init(&pk, &sbuf, msgpack_sbuffer_write);
+
+	name_len = strlen(ptr->resource_name);
+	dir_len = strlen(ptr->resource_dir);
+	ERR_CHECK(
+		msgpack_pack_array(&pk, NUM_ATTRS_FOR_REQUEST_HEADER),
+		"serializer.h filerail_serialize_request_header\n"
+	);
+	ERR_CHECK(
+		msgpack_pack_uint8(&pk, ptr->on_duplicate),
+		"serializer.h filerail_serialize_request_header\n"
+	);
+	ERR_CHECK(
+		msgpack_pack_uint8(&pk, ptr->on_resume),
+		"serializer.h filerail_serialize_request_header\n"
+	);
+	ERR_CHECK(
+		msgpack_pack_uint64(&pk, ptr->resource_size),
+		"serializer.h filerail_serialize_request_header\n"
+	);
+	ERR_CHECK(
+		msgpack_pack_uint64(&pk, ptr->offset),
+		"serializer.h filerail_serialize_request_header\n"
+	);
+	ERR_CHECK(
+		msgpack_pack_array(&pk, MD5_HASH_LENGTH),
+		"serializer.h filerail_serialize_request_header\n"
+	);
+	for (i = 0; i < MD5_HASH_LENGTH; i++) {
+		ERR_CHECK(
+			msgpack_pack_uint8(&pk, ptr->hash[i]),
+			"serializer.h filerail_serialize_request_header\n"
+		);
+	}
+	ERR_CHECK(
+		msgpack_pack_str(&pk, name_len),
+		"serializer.h filerail_serialize_request_header\n"
+	);
+	ERR_CHECK(
+		msgpack_pack_str_body(&pk, ptr->resource_name, name_len),
+		"serializer.h filerail_serialize_request_header\n"
+	);
+	ERR_CHECK(
+		msgpack_pack_str(&pk, dir_len),
+		"serializer.h filerail_serialize_request_header\n"
+	);
+	ERR_CHECK(
+		msgpack_pack_str_body(&pk, ptr->resource_dir, dir_len),
+		"serializer.h filerail_serialize_request_header\n"
+	);
+	ERR_CHECK(
+		msgpack_pack_uint8(&pk, ptr->priority),
+		"serializer.h filerail_serialize_request_header\n"
+	);
+
+	*buf = malloc(sbuf.size);
+	if (*buf == NULL) {
+		LOG(LOG_USER | LOG_ERR, "serializer.h filerail_serialize_request_header\n");
+		return 0;
+	}
+	ret = sbuf.size;
+	memcpy(*buf, sbuf.data, sbuf.size);
+
+	msgpack_sbuffer_destroy(&sbuf);
+	return ret;
+}
+
+size_t filerail_serialize_request_response(filerail_request_response *ptr, void **buf) {
+	int i;
+	size_t ret;
+	msgpack_sbuffer sbuf;
+	msgpack_packer pk;
+
+	msgpack_sbuffer_init(&sbuf);
+	msgpack_packer_init(&pk, &sbuf, msgpack_sbuffer_write);
+
+	ERR_CHECK(
+		msgpack_pack_array(&pk, NUM_ATTRS_FOR_REQUEST_RESPONSE),
+		"serializer.h filerail_serialize_request_response\n"
+	);
+	ERR_CHECK(
+		msgpack_pack_uint8(&pk, ptr->response_type),
+		"serializer.h filerail_serialize_request_response\n"
+	);
+	ERR_CHECK(
+		msgpack_pack_uint64(&pk, ptr->resource_size),
+		"serializer.h filerail_serialize_request_response\n"
+	);
+	ERR_CHECK(
+		msgpack_pack_uint64(&pk, ptr->offset),
+		"serializer.h filerail_serialize_request_response\n"
+	);
+	ERR_CHECK(
+		msgpack_pack_array(&pk, MD5_HASH_LENGTH),
+		"serializer.h filerail_serialize_request_response\n"
+	);
+	for (i = 0; i < MD5_HASH_LENGTH; i++) {
+		ERR_CHECK(
+			msgpack_pack_uint8(&pk, ptr->hash[i]),
+			"serializer.h filerail_serialize_request_response\n"
+		);
+	}
+
+	*buf = malloc(sbuf.size);
+	if (*buf == NULL) {
+		LOG(LOG_USER | LOG_ERR, "serializer.h filerail_serialize_request_response\n");
+		return 0;
+	}
+	ret = sbuf.size;
+	memcpy(*buf, sbuf.data, sbuf.size);
+
+	msgpack_sbuffer_destroy(&sbuf);
+	return ret;
+}
+
+#endif /* FILERAIL_IMPLEMENTATION */
+
 #endif
@@ -0,0 +1,179 @@
+#ifndef _SESSION_H
+#define _SESSION_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "global.h"
+#include "constants.h"
+#include "crypto.h"
+#include "utils.h"
+#include "deadline.h"
+#include "admission.h"
+#include "priority.h"
+
+/*
+	Context of one session (a connection and everything transferred over it).
+
+	Operations take everything they need from here instead of process wide state, and never change working
+	directory (resources are addressed by resource_dir + resource_name, zip entries are named relative to
+	resource_dir), so any number of sessions can run at once in one process: threads, event loop, or a program
+	embedding the client. Process wide flags in global.h are only defaults, set by main() before any session
+	starts, and the log sink.
+*/
+
+// answer to a question asked during an operation (overwrite a resource, resume from checkpoint)
+enum POLICY {
+	POLICY_ASK, // ask the user (interactive sessions only, no otherwise)
+	POLICY_YES,
+	POLICY_NO
+};
+
+// done of total bytes of a transfer
+typedef void (*filerail_progress_fn)(void *arg, uint64_t done, uint64_t total);
+
+typedef struct _filerail_session {
+	int fd;
+	filerail_AES_keys *K;
+	const char *ckpt_path; // checkpoints, chunk store, metadata caches and trash live here
+	bool is_server; // server never prompts, and moves replaced resources to trash
+	bool verbose; // print progress (never on server)
+	bool pack_small_files; // see pack.h
+	int archive_level; // compression level of archives session builds
+	bool interactive; // command line client: prompts and prints outcome of operations
+	int on_duplicate; // resource already exists at destination
+	int on_resume; // receiver has a checkpoint of the resource
+	filerail_progress_fn progress; // replaces progress bar if set
+	void *progress_arg;
+	filerail_queued_fn queued; // position of session in server's queue (see admission.h), may be NULL
+	void *queued_arg;
+	unsigned int id; // unique within process, names temporary files of the session
+	pid_t owner; // process owning the connection (children building archives of session inherit it)
+	int priority; // PRIORITY of session's transfers (see priority.h)
+	int busy; // nesting of filerail_session_busy, peer gets heartbeats while it isn't 0
+	filerail_heartbeat heartbeat;
+	bool retried; // operation runs again, on a new connection (see filerail_client_backoff)
+} filerail_session;
+
+#define SESSION_VERBOSE(s) ((s)->verbose && !(s)->is_server)
+
+#define SESSION_PRINT(s, x) 		\
+	if (SESSION_VERBOSE(s)) { \
+		x;										\
+	}
+
+// outcome of an operation, for the user of command line client
+#define SESSION_SAY(s, x) 			\
+	if ((s)->interactive) { 	\
+		x;										\
+	}
+
+void filerail_session_init(filerail_session *s, int fd, filerail_AES_keys *K, const char *ckpt_path);
+void filerail_session_tmp_path(filerail_session *s, const char *dir, const char *name, const char *suffix, char *path);
+int filerail_session_policy(filerail_session *s, int policy);
+bool filerail_session_confirm(filerail_session *s, int policy, const char *question);
+void filerail_session_progress(filerail_session *s, uint64_t done, uint64_t total);
+void filerail_session_busy(filerail_session *s, bool busy);
+void filerail_session_admit(filerail_session *s, int phase, filerail_admission_ticket *t);
+void filerail_session_priority(filerail_session *s, int priority);
+
+#ifdef FILERAIL_IMPLEMENTATION
+
+static unsigned int filerail_session_seq = 0;
+// new session on fd, flags default to those of the process
+void filerail_session_init(filerail_session *s, int fd, filerail_AES_keys *K, const char *ckpt_path) {
+	s->fd = fd;
+	s->K = K;
+	s->ckpt_path = ckpt_path;
+	s->is_server = is_server;
+	s->verbose = verbose;
+	s->pack_small_files = pack_small_files;
+	s->archive_level = ARCHIVE_COMPRESSION_LEVEL;
+	s->interactive = false;
+	s->on_duplicate = POLICY_ASK;
+	// server always agrees to resume
+	s->on_resume = is_server ? POLICY_YES : POLICY_ASK;
+	s->progress = NULL;
+	s->progress_arg = NULL;
+	s->queued = NULL;
+	s->queued_arg = NULL;
+	s->id = __sync_add_and_fetch(&filerail_session_seq, 1);
+	s->owner = getpid();
+	s->priority = PRIORITY_NORMAL;
+	s->busy = 0;
+	s->retried = false;
+}
+
+// "<dir>/<name>.<pid>.<session id><suffix>", never shared with another session (or process)
+void filerail_session_tmp_path(filerail_session *s, const char *dir, const char *name, const char *suffix, char *path) {
+	snprintf(path, MAX_PATH_LENGTH, "%s/%s.%d.%u%s", dir, name, (int)getpid(), s->id, suffix);
+}
+
+// policy as session applies it, POLICY_ASK only if session can ask the user
+int filerail_session_policy(filerail_session *s, int policy) {
+	return policy == POLICY_ASK && !s->interactive ? POLICY_NO : policy;
+}
+
+// answer question by policy, or ask the user
+bool filerail_session_confirm(filerail_session *s, int policy, const char *question) {
+	char option;
+
+	policy = filerail_session_policy(s, policy);
+	if (policy != POLICY_ASK) {
+		return policy == POLICY_YES;
+	}
+	printf("%s", question);
+	if (scanf("%c", &option) != 1) {
+		return false;
+	}
+	getchar();
+	return option == 'Y' || option == 'y';
+}
+
+// report progress to callback, or draw progress bar
+void filerail_session_progress(filerail_session *s, uint64_t done, uint64_t total) {
+	if (s->progress != NULL) {
+		s->progress(s->progress_arg, done, total);
+	} else {
+		SESSION_PRINT(s, filerail_progress_bar(1.0 - done / (1.0 * total)));
+	}
+}
+
+/*
+	Session works for long without talking to peer (zip, hash, unzip), while peer waits for it's next message.
+	Peer gets heartbeats until session is done (busy is false), so it isn't taken for dead (see deadline.h).
+	Calls nest, session mustn't use it's connection in between.
+*/
+void filerail_session_busy(filerail_session *s, bool busy) {
+	if (busy) {
+		if (s->busy++ == 0 && s->fd != -1) {
+			filerail_heartbeat_start(&s->heartbeat, s->fd, s->owner, s->id);
+		}
+	} else if (--s->busy == 0 && s->fd != -1) {
+		filerail_heartbeat_stop(&s->heartbeat);
+	}
+}
+
+// wait for session's turn in phase (see admission.h), peer gets heartbeats with position in queue meanwhile
+void filerail_session_admit(filerail_session *s, int phase, filerail_admission_ticket *t) {
+	if (filerail_admission_try(t, phase, filerail_priority_rank(s->priority), s->owner, s->id)) {
+		return;
+	}
+	filerail_session_busy(s, true);
+	filerail_admission_wait(t);
+	filerail_session_busy(s, false);
+}
+
+// session's transfers are of class priority: disk io of calling thread, and packets of connection
+void filerail_session_priority(filerail_session *s, int priority) {
+	s->priority = priority >= 0 && priority < PRIORITY_CLASSES ? priority : PRIORITY_NORMAL;
+	filerail_priority_io(s->priority);
+	if (s->fd != -1) {
+		filerail_priority_socket(s->fd, s->priority);
+	}
+}
+
+#endif /* FILERAIL_IMPLEMENTATION */
+
+#endif
@@ -0,0 +1,475 @@
+#ifndef _SHAPER_H
+#define _SHAPER_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "global.h"
+#include "constants.h"
+
+/*
+	Bandwidth shaping of what server sends (archives of GETs, probe bursts), set with -L <limits file>:
+	global <Mbit/s>                     : cap of all transfers together
+	client * <Mbit/s> [weight]          : cap (and weight) of every client IP without a line of it's own
+	client <ipv4> <Mbit/s> [weight]     : cap and weight of one client IP
+	0 Mbit/s is unlimited, weight defaults to 1, lines starting with # are comments.
+	File is read again within SHAPER_RELOAD_INTERVAL seconds of being changed, running transfers pick up new limits.
+
+	Token buckets live in memory shared by every process of the server (children, workers, acceptors), created
+	before any of them is forked, under a process shared (robust) mutex:
+	- a bucket per client IP, shared by all transfers of that client, refilled at client's cap
+	- a global bucket refilled at global cap. While it has tokens any transfer takes them (idle bandwidth isn't
+	  wasted), once it runs short every transfer waits for it's weighted share of global cap (global cap times
+	  it's weight over sum of weights of active transfers) before taking, so transfers share a congested uplink
+	  by weight and a large GET can't starve the others.
+	Weight of a transfer is it's client's weight times weight of it's priority class (see priority.h), and
+	transfers of one client over it's cap wait for tokens in proportion to their class weights as well.
+	Transfers take tokens in quanta of at most SHAPER_QUANTUM bytes (a tenth of a second of their rate), not per
+	packet, so the shared lock is taken a few times per 100 ms per transfer.
+	Every transfer is registered with the process running it, transfers of processes which died without ending
+	them (killed session, crashed worker) are dropped, so their weight doesn't hold back the others for good.
+
+	A graceful restart (see master.h) creates the state anew in the new server, while the old one drains it's
+	sessions with the old state: until the old server is gone, both enforce caps of their own (up to twice the
+	cap together). State isn't handed over, as a new binary may lay it out differently.
+*/
+
+// bucket of a client IP (slot is free while transfers is 0)
+typedef struct _filerail_shaper_client {
+	in_addr_t ip;
+	unsigned int transfers;
+	uint64_t rate; // bytes per second, 0 is unlimited
+	unsigned int weight;
+	uint64_t classes; // sum of class weights of it's transfers
+	double tokens;
+	double last;
+} filerail_shaper_client;
+
+// transfer in flight and process running it (slot is free while pid is 0)
+typedef struct _filerail_shaper_slot {
+	pid_t pid;
+	unsigned int client; // index in clients
+	unsigned int weight; // of priority class
+} filerail_shaper_slot;
+
+// limit of one client IP read from limits file
+typedef struct _filerail_shaper_rule {
+	in_addr_t ip;
+	uint64_t rate;
+	unsigned int weight;
+} filerail_shaper_rule;
+
+// state shared by every process of the server
+typedef struct _filerail_shaper {
+	pthread_mutex_t lock;
+	char path[MAX_PATH_LENGTH];
+	struct timespec mtime; // of limits file when it was read
+	double checked; // last time limits file was checked for changes
+	uint64_t rate; // global cap, bytes per second
+	uint64_t default_rate; // cap of a client without a rule
+	unsigned int default_weight;
+	unsigned int nrules;
+	filerail_shaper_rule rules[SHAPER_MAX_RULES];
+	double tokens; // of global bucket, negative while transfers are in debt
+	double last;
+	uint64_t weights; // sum of weights of active transfers
+	double reaped; // last time transfers of dead processes were looked for
+	filerail_shaper_client clients[SHAPER_MAX_CLIENTS];
+	filerail_shaper_slot transfers[SHAPER_MAX_TRANSFERS];
+} filerail_shaper;
+
+// a transfer being shaped
+typedef struct _filerail_shaper_transfer {
+	filerail_shaper_client *client; // NULL if client table was full
+	int slot; // in transfers of shaper, -1 if that table was full (transfer isn't dropped if it's process dies)
+	unsigned int weight; // of priority class
+	int64_t credit; // bytes taken from buckets but not sent yet
+	bool active;
+} filerail_shaper_transfer;
+
+// process wide, NULL unless server was started with -L
+extern filerail_shaper *shaper;
+// IPv4 address of client served by this process (streams of a multiplexed connection are unix sockets)
+extern in_addr_t shaper_peer;
+
+int filerail_shaper_init(const char *path);
+void filerail_shaper_peer(int fd);
+void filerail_shaper_begin(filerail_shaper_transfer *t, unsigned int weight);
+void filerail_shaper_consume(filerail_shaper_transfer *t, uint64_t nbytes);
+void filerail_shaper_end(filerail_shaper_transfer *t);
+
+#ifdef FILERAIL_IMPLEMENTATION
+
+filerail_shaper *shaper = NULL;
+in_addr_t shaper_peer = INADDR_NONE;
+
+static double filerail_shaper_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// lock shared state, made consistent again if it's owner died holding it
+static void filerail_shaper_lock(void) {
+	if (pthread_mutex_lock(&shaper->lock) == EOWNERDEAD) {
+		pthread_mutex_consistent(&shaper->lock);
+	}
+}
+
+static void filerail_shaper_unlock(void) {
+	pthread_mutex_unlock(&shaper->lock);
+}
+
+// cap and weight of client ip (locked)
+static void filerail_shaper_limit(in_addr_t ip, uint64_t *rate, unsigned int *weight) {
+	unsigned int i;
+
+	for (i = 0; i < shaper->nrules; i++) {
+		if (shaper->rules[i].ip == ip) {
+			*rate = shaper->rules[i].rate;
+			*weight = shaper->rules[i].weight;
+			return;
+		}
+	}
+	*rate = shaper->default_rate;
+	*weight = shaper->default_weight;
+}
+
+// read limits file into shaper (locked), -1 if it can't be read or has a bad line (limits in place are kept)
+static int filerail_shaper_load(void) {
+	int exit_status;
+	unsigned int i, nrules, weight, default_weight;
+	uint64_t rate, global_rate, default_rate;
+	char line[256], *key, *who, *value, *w, *end, *save;
+	FILE *fp;
+	struct stat st;
+	struct in_addr addr;
+	filerail_shaper_rule rules[SHAPER_MAX_RULES];
+
+	exit_status = 0;
+	if ((fp = fopen(shaper->path, "r")) == NULL) {
+		LOG(LOG_USER | LOG_ERR, "shaper.h filerail_shaper_load fopen\n");
+		return -1;
+	}
+	if (fstat(fileno(fp), &st) == -1) {
+		LOG(LOG_USER | LOG_ERR, "shaper.h filerail_shaper_load fstat\n");
+		exit_status = -1;
+		goto clean_up;
+	}
+	global_rate = default_rate = 0;
+	default_weight = 1;
+	nrules = 0;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if ((key = strtok_r(line, " \t\r\n", &save)) == NULL || key[0] == '#') {
+			continue;
+		}
+		who = NULL;
+		if (strcmp(key, "client") == 0) {
+			who = strtok_r(NULL, " \t\r\n", &save);
+		} else if (strcmp(key, "global") != 0) {
+			goto bad_line;
+		}
+		if ((strcmp(key, "client") == 0 && who == NULL) || (value = strtok_r(NULL, " \t\r\n", &save)) == NULL) {
+			goto bad_line;
+		}
+		errno = 0;
+		rate = strtoull(value, &end, 10) * 1000000 / 8;
+		if (*end != '\0' || errno != 0) {
+			goto bad_line;
+		}
+		weight = 1;
+		if (who != NULL && (w = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+			weight = strtoul(w, &end, 10);
+			if (*end != '\0' || weight == 0) {
+				goto bad_line;
+			}
+		}
+		if (who == NULL) {
+			global_rate = rate;
+		} else if (strcmp(who, "*") == 0) {
+			default_rate = rate;
+			default_weight = weight;
+		} else {
+			if (inet_pton(AF_INET, who, &addr) != 1 || nrules == SHAPER_MAX_RULES) {
+				goto bad_line;
+			}
+			rules[nrules].ip = addr.s_addr;
+			rules[nrules].rate = rate;
+			rules[nrules].weight = weight;
+			nrules++;
+		}
+		continue;
+
+		bad_line:
+		LOG(LOG_USER | LOG_ERR, "shaper.h filerail_shaper_load bad line\n");
+		exit_status = -1;
+		goto clean_up;
+	}
+
+	shaper->rate = global_rate;
+	shaper->default_rate = default_rate;
+	shaper->default_weight = default_weight;
+	shaper->nrules = nrules;
+	memcpy(shaper->rules, rules, nrules * sizeof(filerail_shaper_rule));
+	shaper->mtime = st.st_mtim;
+
+	// running transfers get new limits of their client, and weights are summed again
+	shaper->weights = 0;
+	for (i = 0; i < SHAPER_MAX_CLIENTS; i++) {
+		if (shaper->clients[i].transfers != 0) {
+			filerail_shaper_limit(shaper->clients[i].ip, &shaper->clients[i].rate, &shaper->clients[i].weight);
+			shaper->weights += shaper->clients[i].classes * shaper->clients[i].weight;
+		}
+	}
+
+	clean_up:
+	fclose(fp);
+	return exit_status;
+}
+
+// read limits file again if it changed since it was read (locked)
+static void filerail_shaper_reload(double now) {
+	struct stat st;
+
+	if (now - shaper->checked < SHAPER_RELOAD_INTERVAL) {
+		return;
+	}
+	shaper->checked = now;
+	if (stat(shaper->path, &st) == -1) {
+		return;
+	}
+	if (st.st_mtim.tv_sec != shaper->mtime.tv_sec || st.st_mtim.tv_nsec != shaper->mtime.tv_nsec) {
+		if (filerail_shaper_load() == 0) {
+			LOG(LOG_USER | LOG_INFO, "shaper.h limits reloaded\n");
+		}
+	}
+}
+
+// transfer leaves it's client's bucket and the sum of weights (locked)
+static void filerail_shaper_leave(filerail_shaper_client *c, unsigned int weight) {
+	c->transfers--;
+	c->classes -= weight;
+	shaper->weights -= (uint64_t)c->weight * weight;
+}
+
+// drop transfers of processes which died without ending them, every SHAPER_RELOAD_INTERVAL seconds (locked)
+static void filerail_shaper_reap(double now) {
+	unsigned int i;
+	filerail_shaper_slot *slot;
+
+	if (now - shaper->reaped < SHAPER_RELOAD_INTERVAL) {
+		return;
+	}
+	shaper->reaped = now;
+	for (i = 0; i < SHAPER_MAX_TRANSFERS; i++) {
+		slot = &shaper->transfers[i];
+		if (slot->pid != 0 && kill(slot->pid, 0) == -1 && errno == ESRCH) {
+			filerail_shaper_leave(&shaper->clients[slot->client], slot->weight);
+			slot->pid = 0;
+		}
+	}
+}
+
+// add tokens earned since last refill, at most a burst (SHAPER_BURST seconds of rate)
+static void filerail_shaper_refill(double *tokens, double *last, uint64_t rate, double now) {
+	double burst;
+
+	burst = max(rate * SHAPER_BURST, (double)SHAPER_QUANTUM);
+	*tokens = min(*tokens + (now - *last) * rate, burst);
+	*last = now;
+}
+
+// create shared state from limits file (before any process serving clients is forked)
+int filerail_shaper_init(const char *path) {
+	pthread_mutexattr_t attr;
+	filerail_shaper *sh;
+
+	sh = mmap(NULL, sizeof(filerail_shaper), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (sh == MAP_FAILED) {
+		LOG(LOG_USER | LOG_ERR, "shaper.h filerail_shaper_init mmap\n");
+		return -1;
+	}
+	memset(sh, 0, sizeof(filerail_shaper));
+	// server changes directory to / once it's a daemon
+	if (realpath(path, sh->path) == NULL) {
+		LOG(LOG_USER | LOG_ERR, "shaper.h filerail_shaper_init realpath\n");
+		munmap(sh, sizeof(filerail_shaper));
+		return -1;
+	}
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&sh->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	shaper = sh;
+	sh->last = sh->checked = sh->reaped = filerail_shaper_now();
+	if (filerail_shaper_load() == -1) {
+		shaper = NULL;
+		pthread_mutex_destroy(&sh->lock);
+		munmap(sh, sizeof(filerail_shaper));
+		return -1;
+	}
+	return 0;
+}
+
+// remember client of connection fd (ignored for streams of a multiplexed connection, they keep client of it)
+void filerail_shaper_peer(int fd) {
+	socklen_t len;
+	struct sockaddr_in addr;
+
+	len = sizeof(addr);
+	if (getpeername(fd, (struct sockaddr*)&addr, &len) == 0 && addr.sin_family == AF_INET) {
+		shaper_peer = addr.sin_addr.s_addr;
+	}
+}
+
+// register a transfer to client served by this process, of class weight (no-op without -L)
+void filerail_shaper_begin(filerail_shaper_transfer *t, unsigned int weight) {
+	unsigned int i;
+	filerail_shaper_client *c, *free_slot;
+
+	memset(t, 0, sizeof(filerail_shaper_transfer));
+	t->slot = -1;
+	if (shaper == NULL) {
+		return;
+	}
+	filerail_shaper_lock();
+	filerail_shaper_reap(filerail_shaper_now());
+	c = free_slot = NULL;
+	for (i = 0; i < SHAPER_MAX_CLIENTS && c == NULL; i++) {
+		if (shaper->clients[i].transfers == 0) {
+			if (free_slot == NULL) {
+				free_slot = &shaper->clients[i];
+			}
+		} else if (shaper->clients[i].ip == shaper_peer) {
+			c = &shaper->clients[i];
+		}
+	}
+	if (c == NULL && free_slot != NULL) {
+		c = free_slot;
+		c->ip = shaper_peer;
+		filerail_shaper_limit(c->ip, &c->rate, &c->weight);
+		c->classes = 0;
+		c->tokens = 0;
+		c->last = filerail_shaper_now();
+	}
+	// a full client table leaves client uncapped, global cap still holds
+	if (c != NULL) {
+		c->transfers++;
+		c->classes += weight;
+		shaper->weights += (uint64_t)c->weight * weight;
+		for (i = 0; i < SHAPER_MAX_TRANSFERS && t->slot == -1; i++) {
+			if (shaper->transfers[i].pid == 0) {
+				shaper->transfers[i].pid = getpid();
+				shaper->transfers[i].client = c - shaper->clients;
+				shaper->transfers[i].weight = weight;
+				t->slot = i;
+			}
+		}
+	}
+	t->client = c;
+	t->weight = weight;
+	t->active = true;
+	filerail_shaper_unlock();
+}
+
+/*
+	Account nbytes about to be sent by transfer, sleeps while it's client or the uplink is over it's cap.
+	Tokens are taken a quantum at a time, a tenth of a second of transfer's rate (at least BUFFER_SIZE),
+	so waits stay well under MAX_IO_TIME_OUT of receiver.
+*/
+void filerail_shaper_consume(filerail_shaper_transfer *t, uint64_t nbytes) {
+	bool waited;
+	uint64_t weight;
+	double now, wait, share, client_share, quantum;
+	filerail_shaper_client *c;
+	struct timespec ts;
+
+	if (!t->active) {
+		return;
+	}
+	t->credit -= (int64_t)nbytes;
+	waited = false;
+	while (t->credit < 0) {
+		filerail_shaper_lock();
+		now = filerail_shaper_now();
+		filerail_shaper_reload(now);
+		filerail_shaper_reap(now);
+		c = t->client;
+		weight = (uint64_t)(c != NULL ? c->weight : shaper->default_weight) * t->weight;
+		share = shaper->rate == 0 ? 0 : (double)shaper->rate * weight / max(shaper->weights, weight);
+		// share of client's cap, by class weights of it's transfers
+		if (c != NULL && c->rate != 0) {
+			client_share = (double)c->rate * t->weight / max(c->classes, (uint64_t)t->weight);
+			if (share == 0 || client_share < share) {
+				share = client_share;
+			}
+		}
+		quantum = share == 0 ? SHAPER_QUANTUM : min(max(share / 10, (double)BUFFER_SIZE), (double)SHAPER_QUANTUM);
+
+		wait = 0;
+		filerail_shaper_refill(&shaper->tokens, &shaper->last, shaper->rate, now);
+		if (c != NULL && c->rate != 0) {
+			filerail_shaper_refill(&c->tokens, &c->last, c->rate, now);
+			if (c->tokens < quantum) {
+				wait = (quantum - c->tokens) / client_share;
+			}
+		}
+		if (wait == 0 && shaper->rate != 0 && shaper->tokens < quantum && !waited) {
+			// uplink is congested, transfer waits for it's share
+			wait = quantum / share;
+			waited = true;
+		} else if (wait == 0) {
+			if (shaper->rate != 0) {
+				shaper->tokens = max(shaper->tokens - quantum, -(double)shaper->rate * SHAPER_BURST);
+			}
+			if (c != NULL && c->rate != 0) {
+				c->tokens -= quantum;
+			}
+			t->credit += (int64_t)quantum;
+			waited = false;
+		}
+		filerail_shaper_unlock();
+
+		if (wait > 0) {
+			ts.tv_sec = (time_t)wait;
+			ts.tv_nsec = (long)((wait - ts.tv_sec) * 1e9);
+			nanosleep(&ts, NULL);
+		}
+	}
+}
+
+// unregister transfer
+void filerail_shaper_end(filerail_shaper_transfer *t) {
+	if (!t->active) {
+		return;
+	}
+	filerail_shaper_lock();
+	if (t->client != NULL) {
+		filerail_shaper_leave(t->client, t->weight);
+	}
+	if (t->slot != -1) {
+		shaper->transfers[t->slot].pid = 0;
+	}
+	filerail_shaper_unlock();
+	t->active = false;
+}
+
+#endif /* FILERAIL_IMPLEMENTATION */
+
+#endif
@@ -11,6 +11,8 @@
 #include <sys/types.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <assert.h>
@@ -20,37 +22,72 @@
 #include "protocol.h"
 #include "utils.h"
 #include "crypto.h"
+#include "session.h"
+#include "deadline.h"
+#include "tuning.h"
+#include "shaper.h"
 #include "serializer.h"
 #include "deserializer.h"
 
-static int filerail_socket(int domain, int type, int protocol);
-static int filerail_bind(int fd, const struct sockaddr *addr, socklen_t addrlen);
-static int filerail_connect(int fd, const struct sockaddr *addr, socklen_t addrlen);
-static int filerail_listen(int fd, int backlog);
-static int filerail_setsockopt(int fd, int level, int option, const void *optval, socklen_t optlen);
-static int filerail_is_fd_valid(int fd);
-static int filerail_set_timeout(int fd, int level, int option, int s, int u);
 int filerail_dns_resolve(char *hostname);
 int firerail_accept(int fd, struct sockaddr *addr, socklen_t *addrlen);
 int filerail_close(int fd);
 int filerail_create_tcp_server(char *ip, char *port);
 int filerail_connect_to_tcp_server(char *ip, char *port);
 int filerail_who(int fd, const char *action);
+int filerail_send_frame(int fd, void *buf, uint32_t size);
+int filerail_recv_frame_size(int fd, uint32_t *size);
 int filerail_send_response_header(int fd, uint8_t type);
 int filerail_send_command_header(int fd, uint8_t type);
-int filerail_send_resource_header(int fd, char *name, char *dir, uint64_t resource_size);
+int filerail_send_resource_header(int fd, char *name, char *dir, uint64_t resource_size, uint8_t priority);
 int filerail_send_file_offset(int fd, uint64_t offset);
 int filerail_send_resource_hash(int fd, uint8_t *hash);
 int filerail_send_data_packet(int fd, uint8_t *out, uint64_t nbytes);
+int filerail_send_manifest_entry(int fd, filerail_manifest_entry *entry);
+int filerail_send_chunk_info(int fd, uint64_t length, const uint8_t *hash);
+int filerail_send_request_header(int fd, filerail_request_header *request);
+int filerail_send_request_response(int fd, filerail_request_response *response);
 int filerail_recv_response_header(int fd, filerail_response_header *ptr);
 int filerail_recv_command_header(int fd, filerail_command_header *ptr);
 int filerail_recv_resource_header(int fd, filerail_resource_header *ptr);
 int filerail_recv_file_offset(int fd, filerail_file_offset *ptr);
 int filerail_recv_resource_hash(int fd, filerail_resource_hash *ptr);
 int filerail_recv_data_packet(int fd, filerail_data_packet *ptr);
-int filerail_sendfile(int fd, const char *zip_filename, filerail_AES_keys *K, uint64_t offset);
-int filerail_recvfile(int fd, const char *zip_filename, filerail_AES_keys *K, uint64_t offset,
+int filerail_recv_manifest_entry(int fd, filerail_manifest_entry *ptr);
+int filerail_recv_chunk_info(int fd, filerail_chunk_info *ptr);
+int filerail_recv_request_header(int fd, filerail_request_header *ptr);
+int filerail_recv_request_response(int fd, filerail_request_response *ptr);
+int filerail_sendfile(filerail_session *s, const char *zip_filename, uint64_t offset);
+int filerail_recvfile(filerail_session *s, const char *zip_filename, uint64_t offset,
 	const char *ckpt_resource_path, const char *resource_path);
+int filerail_send_chunk(int fd, FILE *fp, uint64_t offset, uint64_t length, filerail_AES_keys *K);
+int filerail_recv_chunk(int fd, uint8_t *chunk, uint64_t length, filerail_AES_keys *K);
+bool filerail_connection_failed(void);
+void filerail_connection_clear(void);
+
+#ifdef FILERAIL_IMPLEMENTATION
+
+static int filerail_socket(int domain, int type, int protocol);
+static int filerail_bind(int fd, const struct sockaddr *addr, socklen_t addrlen);
+static int filerail_connect(int fd, const struct sockaddr *addr, socklen_t addrlen);
+static int filerail_listen(int fd, int backlog);
+static int filerail_setsockopt(int fd, int level, int option, const void *optval, socklen_t optlen);
+static int filerail_is_fd_valid(int fd);
+
+/*
+	Connection of calling thread's session failed (server unreachable, peer gone or reset, deadline passed, transfer
+	stalled), as opposed to a refusal, a protocol error or a local one. Calls still return -1, this tells which
+	failures a new connection may get past (see filerail_client_run_retry).
+*/
+static __thread bool filerail_connection_lost = false;
+
+bool filerail_connection_failed(void) {
+	return filerail_connection_lost;
+}
+
+void filerail_connection_clear(void) {
+	filerail_connection_lost = false;
+}
 
 // pretty standard stuff
 static int filerail_socket(int domain, int type, int protocol) {
@@ -116,19 +153,6 @@ static int filerail_is_fd_valid(int fd) {
 	return fcntl(fd, F_GETFD) != -1 || errno != EBADFD;
 }
 
-// set timeout on receive or send
-static int filerail_set_timeout(int fd, int level, int option, int s, int u) {
-	struct timeval tv;
-
-	tv.tv_sec = s;
-	tv.tv_usec = u;
-
-	if (filerail_setsockopt(fd, level, option, (const void*)&tv, sizeof(tv)) == -1) {
-		return -1;
-	}
-	return 0;
-}
-
 // pretty standard stuff
 int filerail_accept(int fd, struct sockaddr *addr, socklen_t *addrlen) {
 	int clifd;
@@ -154,7 +178,7 @@ int filerail_close(int fd) {
 	return ret;
 }
 
-// spins a server for 10 hours (why 10 hours, pretty random, or just to save CPU consumption if you are not using it)
+// listening socket of server (sessions carry their own deadlines, see deadline.h)
 int filerail_create_tcp_server(char *ip, char *port) {
 	int fd;
 	const int optval = 1;
@@ -171,11 +195,10 @@ int filerail_create_tcp_server(char *ip, char *port) {
 
 	if (
 		(fd = filerail_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) == -1 ||
-		filerail_bind(fd, (const struct sockaddr*)&addr, addrlen) == -1 ||
+		// before bind, so that several listeners (multi worker mode, graceful restart) share the port
 		filerail_setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const void*)&optval, sizeof(const int)) == -1 ||
 		filerail_setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (const void*)&optval, sizeof(const int)) == -1 ||
-		filerail_set_timeout(fd, SOL_SOCKET, SO_RCVTIMEO, TIME_OUT, 0) ||
-		filerail_set_timeout(fd, SOL_SOCKET, SO_SNDTIMEO, TIME_OUT, 0) ||
+		filerail_bind(fd, (const struct sockaddr*)&addr, addrlen) == -1 ||
 		filerail_listen(fd, BACKLOG) == -1
 	) {
 		goto clean_up;
@@ -188,7 +211,7 @@ int filerail_create_tcp_server(char *ip, char *port) {
 	return -1;
 }
 
-// pretty standard stuff
+// connect to server, tuned (see tuning.h)
 int filerail_connect_to_tcp_server(char *ip, char *port) {
 	int fd;
 	socklen_t addrlen;
@@ -201,14 +224,19 @@ int filerail_connect_to_tcp_server(char *ip, char *port) {
 	addr.sin_family = AF_INET;
 	addr.sin_port = htons(atoi(port));
 
-	if (
-		(fd = filerail_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) == -1 ||
-		filerail_connect(fd, (const struct sockaddr*)&addr, addrlen) == -1
-	) {
+	if ((fd = filerail_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) == -1) {
+		goto clean_up;
+	}
+	// client sends small requests back to back, next one must not wait for ACK of the one before it
+	filerail_tune_socket(fd);
+	if (filerail_connect(fd, (const struct sockaddr*)&addr, addrlen) == -1) {
+		filerail_connection_lost = true;
 		goto clean_up;
 	}
+	filerail_tune_buffers(fd);
 
 	PRINT(printf("[✔️ ] Connected to server\n"));
+	filerail_tune_report(fd, "connected");
 
 	return fd;
 
@@ -217,15 +245,23 @@ int filerail_connect_to_tcp_server(char *ip, char *port) {
 	return -1;
 }
 
-// pretty standard stuff
+// send all of buffer, waiting at most for deadline of session's phase whenever socket is full (see deadline.h)
 int filerail_send(int fd, void *buffer, size_t len, int flags) {
 	ssize_t nbytes, cur;
 
 	cur = 0;
 	while (len != 0) {
-		nbytes = send(fd, buffer + cur, len, flags);
+		if (filerail_io_wait(fd, POLLOUT) == -1) {
+			filerail_connection_lost = true;
+			return -1;
+		}
+		nbytes = send(fd, buffer + cur, len, flags | MSG_DONTWAIT);
+		if (nbytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+			continue;
+		}
 		if (nbytes <= 0) {
 			LOG(LOG_USER | LOG_ERR, "socket.h filerail_send send\n");
+			filerail_connection_lost = true;
 			return -1;
 		}
 		len -= nbytes;
@@ -234,16 +270,70 @@ int filerail_send(int fd, void *buffer, size_t len, int flags) {
 	return 0;
 }
 
-// pretty standard stuff
+/*
+	send size of serialized message and message in one write. Two writes would be two segments, and with Nagle's
+	algorithm the second one waits for ACK of the first, a round trip (or delayed ACK) per message.
+*/
+int filerail_send_frame(int fd, void *buf, uint32_t size) {
+	ssize_t nbytes;
+	size_t len;
+	uint32_t nsize;
+	struct iovec iov[2];
+	struct msghdr msg;
+
+	nsize = htonl(size);
+	iov[0].iov_base = &nsize;
+	iov[0].iov_len = sizeof(uint32_t);
+	iov[1].iov_base = buf;
+	iov[1].iov_len = size;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	len = sizeof(uint32_t) + size;
+	do {
+		if (filerail_io_wait(fd, POLLOUT) == -1) {
+			filerail_connection_lost = true;
+			return -1;
+		}
+		nbytes = sendmsg(fd, &msg, MSG_DONTWAIT);
+	} while (nbytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR));
+	if (nbytes <= 0) {
+		LOG(LOG_USER | LOG_ERR, "socket.h filerail_send_frame sendmsg\n");
+		filerail_connection_lost = true;
+		return -1;
+	}
+	if ((size_t)nbytes == len) {
+		return 0;
+	}
+	// rest of a partial write
+	if ((size_t)nbytes < sizeof(uint32_t)) {
+		if (filerail_send(fd, (uint8_t*)&nsize + nbytes, sizeof(uint32_t) - nbytes, 0) == -1) {
+			return -1;
+		}
+		nbytes = sizeof(uint32_t);
+	}
+	return filerail_send(fd, (uint8_t*)buf + (nbytes - sizeof(uint32_t)), len - nbytes, 0);
+}
+
+// receive len bytes, waiting at most for deadline of session's phase for every part of it (see deadline.h)
 int filerail_recv(int fd, void *buffer, size_t len, int flags) {
 	ssize_t nbytes, cur;
 
 	cur = 0;
 	while (len != 0) {
-		nbytes = recv(fd, buffer + cur, len, flags);
+		if (filerail_io_wait(fd, POLLIN) == -1) {
+			filerail_connection_lost = true;
+			return -1;
+		}
+		// MSG_WAITALL would block past the deadline on a peer which died halfway through a message
+		nbytes = recv(fd, buffer + cur, len, (flags & ~MSG_WAITALL) | MSG_DONTWAIT);
+		if (nbytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+			continue;
+		}
 		// if nbytes == 0 => sender disconnected
 		if (nbytes <= 0) {
 			LOG(LOG_USER | LOG_ERR, "socket.h filerail_recv recv\n");
+			filerail_connection_lost = true;
 			return -1;
 		}
 		len -= nbytes;
@@ -252,29 +342,57 @@ int filerail_recv(int fd, void *buffer, size_t len, int flags) {
 	return 0;
 }
 
+// receive size of next message, heartbeats (empty frames or positions in queue, see deadline.h) in between are skipped
+int filerail_recv_frame_size(int fd, uint32_t *size) {
+	do {
+		if (filerail_recv(fd, (void *)size, sizeof(uint32_t), MSG_WAITALL) == -1) {
+			return -1;
+		}
+		*size = ntohl(*size);
+		if (*size & QUEUED_FRAME) {
+			filerail_io_queued_at(*size & ~QUEUED_FRAME);
+		}
+	} while (*size == 0 || (*size & QUEUED_FRAME));
+	return 0;
+}
+
 // pretty standard stuff
 int filerail_who(int fd, const char *action) {
 	socklen_t addrlen;
 	struct sockaddr_in addr;
+	char ip[INET_ADDRSTRLEN];
 
+	addrlen = sizeof(addr);
 	if (getpeername(fd, (struct sockaddr*)&addr, &addrlen) == -1) {
 		LOG(LOG_USER | LOG_ERR, "socket.h filerail_who_called_exit getpeername\n");
 		return -1;
 	}
-	PRINT(printf("%s:%d %s\n", inet_ntoa(addr.sin_addr), addr.sin_port, action));
+	// inet_ntoa's static buffer isn't safe with concurrent sessions
+	if (inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip)) == NULL) {
+		LOG(LOG_USER | LOG_ERR, "socket.h filerail_who inet_ntop\n");
+		return -1;
+	}
+	PRINT(printf("%s:%d %s\n", ip, ntohs(addr.sin_port), action));
 	return 0;
 }
 
-int filerail_sendfile(int fd, const char *zip_filename, filerail_AES_keys *K, uint64_t offset) {
-	int exit_status;
+int filerail_sendfile(filerail_session *s, const char *zip_filename, uint64_t offset) {
+	int fd, exit_status;
 	uint8_t in[BUFFER_SIZE], out[BUFFER_SIZE];
 	uint64_t size, total;
 	size_t nbytes;
 	FILE *fp;
 	struct stat stat_path;
+	filerail_AES_keys *K;
+	filerail_stall stall;
+	filerail_shaper_transfer shaped;
 
 	fp = NULL;
 	exit_status = 0;
+	fd = s->fd;
+	K = s->K;
+	// server's sends are shaped if it was started with limits (see shaper.h), weighted by priority class
+	filerail_shaper_begin(&shaped, filerail_priority_weight(s->priority));
 
 	// open the resource
 	fp = fopen(zip_filename, "rb");
@@ -292,7 +410,7 @@ int filerail_sendfile(int fd, const char *zip_filename, filerail_AES_keys *K, ui
 	}
 
 	// advertise the size of resource
-	if (filerail_send_resource_header(fd, "\0", "\0", stat_path.st_size) == -1) {
+	if (filerail_send_resource_header(fd, "\0", "\0", stat_path.st_size, s->priority) == -1) {
 		LOG(LOG_USER | LOG_ERR, "socket.h filerail_sendfile filerail_send_resource_header\n");
 		exit_status = -1;
 		goto clean_up;
@@ -310,11 +428,9 @@ int filerail_sendfile(int fd, const char *zip_filename, filerail_AES_keys *K, ui
 		goto clean_up;
 	}
 
-	// set timeout of recv
-	if (filerail_set_timeout(fd, SOL_SOCKET, SO_RCVTIMEO, MAX_IO_TIME_OUT, 0) == -1) {
-		exit_status = -1;
-		goto clean_up;
-	}
+	// data frames (BUFFER_SIZE) go out as full segments, uncorking flushes the last one
+	filerail_tune_cork(fd, true);
+	filerail_stall_init(&stall);
   while (size != 0) {
   	// read from file
   	memset(in, 0, BUFFER_SIZE);
@@ -331,6 +447,9 @@ int filerail_sendfile(int fd, const char *zip_filename, filerail_AES_keys *K, ui
 			goto clean_up;
   	}
 
+  	// wait for tokens of client and uplink
+  	filerail_shaper_consume(&shaped, nbytes);
+
   	// encrypt
   	if (filerail_encrypt(in, out, BUFFER_SIZE, K) == -1) {
   		exit_status = -1;
@@ -345,31 +464,34 @@ int filerail_sendfile(int fd, const char *zip_filename, filerail_AES_keys *K, ui
 
   	// subtract the bytes sent
   	size -= nbytes;
-  	PRINT(filerail_progress_bar(size / (1.0 * total)));
+  	filerail_session_progress(s, total - size, total);
+  	if (!filerail_stall_check(&stall, nbytes)) {
+  		filerail_connection_lost = true;
+  		exit_status = -1;
+  		goto clean_up;
+  	}
   }
+  filerail_tune_report(fd, "sent");
 
 	clean_up:
-	PRINT(printf("\n"));
+	filerail_shaper_end(&shaped);
+	filerail_tune_cork(fd, false);
+	SESSION_PRINT(s, printf("\n"));
 	if (fp != NULL) {
 		fclose(fp);
 	}
-	// reset the timeout
-	if (filerail_set_timeout(fd, SOL_SOCKET, SO_RCVTIMEO, TIME_OUT, 0) == -1) {
-		exit_status = -1;
-	}
 	return exit_status;
 }
 
 int filerail_recvfile(
-	int fd,
+	filerail_session *s,
 	const char *zip_filename,
-	filerail_AES_keys *K,
 	uint64_t offset,
 	const char *ckpt_resource_path,
 	const char *resource_path
 	)
 {
-	int i, exit_status;
+	int i, fd, exit_status;
 	ssize_t nbytes;
 	uint64_t size, total;
 	FILE *fp, *fckpt;
@@ -378,9 +500,13 @@ int filerail_recvfile(
 	filerail_resource_header resource;
 	filerail_data_packet data;
 	filerail_checkpoint ckpt;
+	filerail_AES_keys *K;
+	filerail_stall stall;
 
 	fp = fckpt = NULL;
 	exit_status = 0;
+	fd = s->fd;
+	K = s->K;
 	ckpt.resource_path[0] = '\0';
 	strcpy(ckpt.resource_path, resource_path);
 	tmp_ckpt_resource_path[0] = '\0';
@@ -391,7 +517,7 @@ int filerail_recvfile(
 	if (offset == 0) {
 		fp = fopen(zip_filename, "wb");
 	} else {
-		PRINT(printf("Adjusting file offset...\n"));
+		SESSION_PRINT(s, printf("Adjusting file offset...\n"));
 		fp = fopen(zip_filename, "r+b");
 		for (i = 0; i < offset; i++) {
 			if (fgetc(fp) == EOF) {
@@ -400,7 +526,7 @@ int filerail_recvfile(
 				goto clean_up;
 			}
 		}
-		PRINT(printf("Finished...\n"));
+		SESSION_PRINT(s, printf("Finished...\n"));
 	}
 
 	if (fp == NULL) {
@@ -422,12 +548,7 @@ int filerail_recvfile(
 	// initialize the checkpoint struct
 	ckpt.offset = offset;
 
-	// set the timeout
-	if (filerail_set_timeout(fd, SOL_SOCKET, SO_RCVTIMEO, MAX_IO_TIME_OUT, 0) == -1) {
-		exit_status = -1;
-		goto clean_up;
-	}
-
+	filerail_stall_init(&stall);
 	while (size != 0) {
 		// receive the data packet
 		if (filerail_recv_data_packet(fd, &data) == -1) {
@@ -484,23 +605,78 @@ int filerail_recvfile(
 			goto clean_up;
 		}
   	size -= nbytes;
-  	PRINT(filerail_progress_bar(size / (1.0 * total)););
+  	filerail_session_progress(s, total - size, total);
+  	// a stalled transfer is resumed from checkpoint later, rather than kept open
+  	if (!filerail_stall_check(&stall, nbytes)) {
+  		filerail_connection_lost = true;
+  		exit_status = -1;
+  		goto clean_up;
+  	}
 	}
+	filerail_tune_report(fd, "received");
 
 	clean_up:
-	PRINT(printf("\n"));
+	SESSION_PRINT(s, printf("\n"));
 	if (fp != NULL) {
 		fclose(fp);
 	}
 	if (fckpt != NULL) {
 		fclose(fckpt);
 	}
-	if (filerail_set_timeout(fd, SOL_SOCKET, SO_RCVTIMEO, TIME_OUT, 0) == -1) {
-		exit_status = -1;
-	}
 	return exit_status;
 }
 
+// send length bytes of fp starting at offset as encrypted data packets
+int filerail_send_chunk(int fd, FILE *fp, uint64_t offset, uint64_t length, filerail_AES_keys *K) {
+	size_t nbytes;
+	uint8_t in[BUFFER_SIZE], out[BUFFER_SIZE];
+
+	if (fseek(fp, offset, SEEK_SET) == -1) {
+		LOG(LOG_USER | LOG_ERR, "socket.h filerail_send_chunk fseek\n");
+		return -1;
+	}
+	while (length != 0) {
+		memset(in, 0, BUFFER_SIZE);
+		nbytes = fread((void *)in, 1, min(BUFFER_SIZE, length), fp);
+		if (nbytes != min(BUFFER_SIZE, length)) {
+			LOG(LOG_USER | LOG_ERR, "socket.h filerail_send_chunk fread\n");
+			return -1;
+		}
+		if (
+			filerail_encrypt(in, out, BUFFER_SIZE, K) == -1 ||
+			filerail_send_data_packet(fd, out, nbytes) == -1
+		) {
+			return -1;
+		}
+		length -= nbytes;
+	}
+	return 0;
+}
+
+// receive length bytes (sent by filerail_send_chunk) into chunk
+int filerail_recv_chunk(int fd, uint8_t *chunk, uint64_t length, filerail_AES_keys *K) {
+	uint64_t cur;
+	uint8_t out[BUFFER_SIZE];
+	filerail_data_packet data;
+
+	cur = 0;
+	while (cur != length) {
+		if (
+			filerail_recv_data_packet(fd, &data) == -1 ||
+			filerail_decrypt(data.data_payload, out, BUFFER_SIZE, K) == -1
+		) {
+			return -1;
+		}
+		if (data.data_size > BUFFER_SIZE || data.data_size > length - cur) {
+			LOG(LOG_USER | LOG_INFO, "socket.h filerail_recv_chunk bad data packet\n");
+			return -1;
+		}
+		memcpy(chunk + cur, out, data.data_size);
+		cur += data.data_size;
+	}
+	return 0;
+}
+
 /*
 NOTE: Size of serialized message is advertised using uint32_t, for all filerail_send_x
 It is converted to htonl and ntohl (to handle endianess of system i guess)
@@ -523,13 +699,7 @@ int filerail_send_response_header(int fd, uint8_t type) {
 		goto clean_up;
 	}
 
-	size = htonl(size);
-
-	if (
-		filerail_send(fd, (void *)&size, sizeof(uint32_t), 0) == -1 ||
-		filerail_send(fd, buf, ntohl(size), 0) == -1
-		)
-	{
+	if (filerail_send_frame(fd, buf, size) == -1) {
 		exit_status = -1;
 	}
 
@@ -555,13 +725,7 @@ int filerail_send_command_header(int fd, uint8_t type) {
 		goto clean_up;
 	}
 
-	size = htonl(size);
-
-	if (
-		filerail_send(fd, (void *)&size, sizeof(uint32_t), 0) == -1 ||
-		filerail_send(fd, buf, ntohl(size), 0)
-		)
-	{
+	if (filerail_send_frame(fd, buf, size) == -1) {
 		exit_status = -1;
 	}
 
@@ -571,7 +735,7 @@ int filerail_send_command_header(int fd, uint8_t type) {
 }
 
 // send resource header after serialization
-int filerail_send_resource_header(int fd, char *name, char *dir, uint64_t resource_size) {
+int filerail_send_resource_header(int fd, char *name, char *dir, uint64_t resource_size, uint8_t priority) {
 	void *buf;
 	int exit_status;
 	uint32_t size;
@@ -584,19 +748,14 @@ int filerail_send_resource_header(int fd, char *name, char *dir, uint64_t resour
 	strcpy(resource.resource_name, name);
 	strcpy(resource.resource_dir, dir);
 	resource.resource_size = resource_size;
+	resource.priority = priority;
 	size = filerail_serialize_resource_header(&resource, &buf);
 	if (size == 0) {
 		exit_status = -1;
 		goto clean_up;
 	}
 
-	size = htonl(size);
-
-	if (
-		filerail_send(fd, (void *)&size, sizeof(uint32_t), 0) == -1 ||
-		filerail_send(fd, buf, ntohl(size), 0) == -1
-		)
-	{
+	if (filerail_send_frame(fd, buf, size) == -1) {
 		exit_status = -1;
 	}
 
@@ -621,13 +780,7 @@ int filerail_send_file_offset(int fd, uint64_t offset) {
 		goto clean_up;
 	}
 
-	size = htonl(size);
-
-	if (
-		filerail_send(fd, (void *)&size, sizeof(uint32_t), 0) == -1 ||
-		filerail_send(fd, buf, ntohl(size), 0) == -1
-		)
-	{
+	if (filerail_send_frame(fd, buf, size) == -1) {
 		exit_status = -1;
 	}
 
@@ -652,13 +805,7 @@ int filerail_send_resource_hash(int fd, uint8_t *hash) {
 		goto clean_up;
 	}
 
-	size = htonl(size);
-
-	if (
-		filerail_send(fd, (void *)&size, sizeof(uint32_t), 0) == -1 ||
-		filerail_send(fd, buf, ntohl(size), 0) == -1
-		)
-	{
+	if (filerail_send_frame(fd, buf, size) == -1) {
 		exit_status = -1;
 	}
 
@@ -684,13 +831,102 @@ int filerail_send_data_packet(int fd, uint8_t *out, uint64_t nbytes) {
 		goto clean_up;
 	}
 
-	size = htonl(size);
+	if (filerail_send_frame(fd, buf, size) == -1) {
+		exit_status = -1;
+	}
 
-	if (
-		filerail_send(fd, (void *)&size, sizeof(uint32_t), 0) == -1 ||
-		filerail_send(fd, buf, ntohl(size), 0) == -1
-		)
-	{
+	clean_up:
+	free(buf);
+	return exit_status;
+}
+
+// send manifest entry after serialization
+int filerail_send_manifest_entry(int fd, filerail_manifest_entry *entry) {
+	void *buf;
+	int exit_status;
+	uint32_t size;
+
+	buf = NULL;
+	exit_status = 0;
+	size = filerail_serialize_manifest_entry(entry, &buf);
+	if (size == 0) {
+		exit_status = -1;
+		goto clean_up;
+	}
+
+	if (filerail_send_frame(fd, buf, size) == -1) {
+		exit_status = -1;
+	}
+
+	clean_up:
+	free(buf);
+	return exit_status;
+}
+
+// send chunk info after serialization
+int filerail_send_chunk_info(int fd, uint64_t length, const uint8_t *hash) {
+	void *buf;
+	int exit_status;
+	uint32_t size;
+	filerail_chunk_info ci;
+
+	buf = NULL;
+	exit_status = 0;
+	ci.length = length;
+	memcpy(ci.hash, hash, MD5_HASH_LENGTH);
+	size = filerail_serialize_chunk_info(&ci, &buf);
+	if (size == 0) {
+		exit_status = -1;
+		goto clean_up;
+	}
+
+	if (filerail_send_frame(fd, buf, size) == -1) {
+		exit_status = -1;
+	}
+
+	clean_up:
+	free(buf);
+	return exit_status;
+}
+
+// send pipelined request after serialization (right after it's command)
+int filerail_send_request_header(int fd, filerail_request_header *request) {
+	void *buf;
+	int exit_status;
+	uint32_t size;
+
+	buf = NULL;
+	exit_status = 0;
+	size = filerail_serialize_request_header(request, &buf);
+	if (size == 0) {
+		exit_status = -1;
+		goto clean_up;
+	}
+
+	if (filerail_send_frame(fd, buf, size) == -1) {
+		exit_status = -1;
+	}
+
+	clean_up:
+	free(buf);
+	return exit_status;
+}
+
+// send answer to pipelined request after serialization
+int filerail_send_request_response(int fd, filerail_request_response *response) {
+	void *buf;
+	int exit_status;
+	uint32_t size;
+
+	buf = NULL;
+	exit_status = 0;
+	size = filerail_serialize_request_response(response, &buf);
+	if (size == 0) {
+		exit_status = -1;
+		goto clean_up;
+	}
+
+	if (filerail_send_frame(fd, buf, size) == -1) {
 		exit_status = -1;
 	}
 
@@ -708,12 +944,11 @@ int filerail_recv_response_header(int fd, filerail_response_header *ptr) {
 	exit_status = 0;
 	buf = NULL;
 	// receive size of serialized message and allocate buffer to recv it
-	if (filerail_recv(fd, (void *)&size, sizeof(uint32_t), MSG_WAITALL) == -1) {
+	if (filerail_recv_frame_size(fd, &size) == -1) {
 		exit_status = -1;
 		goto clean_up;
 	}
 
-	size = ntohl(size);
 	buf = malloc(size);
 	if (buf == NULL) {
 		LOG(LOG_USER | LOG_ERR, "socket.h filerail_recv_response_header\n");
@@ -743,12 +978,11 @@ int filerail_recv_command_header(int fd, filerail_command_header *ptr) {
 	exit_status = 0;
 	buf = NULL;
 	// receive size of serialized message and allocate buffer to recv it
-	if (filerail_recv(fd, (void *)&size, sizeof(uint32_t), MSG_WAITALL) == -1) {
+	if (filerail_recv_frame_size(fd, &size) == -1) {
 		exit_status = -1;
 		goto clean_up;
 	}
 
-	size = ntohl(size);
 	buf = malloc(size);
 	if (buf == NULL) {
 		LOG(LOG_USER | LOG_ERR, "socket.h filerail_recv_command_header\n");
@@ -778,12 +1012,11 @@ int filerail_recv_resource_header(int fd, filerail_resource_header *ptr) {
 	exit_status = 0;
 	buf = NULL;
 	// receive size of serialized message and allocate buffer to recv it
-	if (filerail_recv(fd, (void *)&size, sizeof(uint32_t), MSG_WAITALL) == -1) {
+	if (filerail_recv_frame_size(fd, &size) == -1) {
 		exit_status = -1;
 		goto clean_up;
 	}
 
-	size = ntohl(size);
 	buf = malloc(size);
 	if (buf == NULL) {
 		LOG(LOG_USER | LOG_ERR, "socket.h filerail_recv_resource_header\n");
@@ -813,12 +1046,11 @@ int filerail_recv_file_offset(int fd, filerail_file_offset *ptr) {
 	exit_status = 0;
 	buf = NULL;
 	// receive size of serialized message and allocate buffer to recv it
-	if (filerail_recv(fd, (void *)&size, sizeof(uint32_t), MSG_WAITALL) == -1) {
+	if (filerail_recv_frame_size(fd, &size) == -1) {
 		exit_status = -1;
 		goto clean_up;
 	}
 
-	size = ntohl(size);
 	buf = malloc(size);
 	if (buf == NULL) {
 		LOG(LOG_USER | LOG_ERR, "socket.h filerail_recv_file_offset\n");
@@ -848,12 +1080,11 @@ int filerail_recv_resource_hash(int fd, filerail_resource_hash *ptr) {
 	exit_status = 0;
 	buf = NULL;
 	// receive size of serialized message and allocate buffer to recv it
-	if (filerail_recv(fd, (void *)&size, sizeof(uint32_t), MSG_WAITALL) == -1) {
+	if (filerail_recv_frame_size(fd, &size) == -1) {
 		exit_status = -1;
 		goto clean_up;
 	}
 
-	size = ntohl(size);
 	buf = malloc(size);
 	if (buf == NULL) {
 		LOG(LOG_USER | LOG_ERR, "socket.h filerail_recv_resource_hash\n");
@@ -883,13 +1114,12 @@ int filerail_recv_data_packet(int fd, filerail_data_packet *ptr) {
 	exit_status = 0;
 	buf = NULL;
 	// receive size of serialized message and allocate buffer to recv it
-	if (filerail_recv(fd, (void *)&size, sizeof(uint32_t), MSG_WAITALL) == -1) {
+	if (filerail_recv_frame_size(fd, &size) == -1) {
 		LOG(LOG_USER | LOG_ERR, "socket.h filerail_recv_data_packet\n");
 		exit_status = -1;
 		goto clean_up;
 	}
 
-	size = ntohl(size);
 	buf = malloc(size);
 	if (buf == NULL) {
 		exit_status = -1;
@@ -909,6 +1139,142 @@ int filerail_recv_data_packet(int fd, filerail_data_packet *ptr) {
 	return exit_status;
 }
 
+// deserialize and parse
+int filerail_recv_manifest_entry(int fd, filerail_manifest_entry *ptr) {
+	void *buf;
+	int exit_status;
+	uint32_t size;
+
+	exit_status = 0;
+	buf = NULL;
+	// receive size of serialized message and allocate buffer to recv it
+	if (filerail_recv_frame_size(fd, &size) == -1) {
+		exit_status = -1;
+		goto clean_up;
+	}
+
+	buf = malloc(size);
+	if (buf == NULL) {
+		LOG(LOG_USER | LOG_ERR, "socket.h filerail_recv_manifest_entry\n");
+		exit_status = -1;
+		goto clean_up;
+	}
+
+	if (
+		filerail_recv(fd, buf, size, MSG_WAITALL) ||
+		!filerail_deserialize_manifest_entry(ptr, buf, size)
+		)
+	{
+		exit_status = -1;
+	}
+
+	clean_up:
+	free(buf);
+	return exit_status;
+}
+
+// deserialize and parse
+int filerail_recv_chunk_info(int fd, filerail_chunk_info *ptr) {
+	void *buf;
+	int exit_status;
+	uint32_t size;
+
+	exit_status = 0;
+	buf = NULL;
+	// receive size of serialized message and allocate buffer to recv it
+	if (filerail_recv_frame_size(fd, &size) == -1) {
+		exit_status = -1;
+		goto clean_up;
+	}
+
+	buf = malloc(size);
+	if (buf == NULL) {
+		LOG(LOG_USER | LOG_ERR, "socket.h filerail_recv_chunk_info\n");
+		exit_status = -1;
+		goto clean_up;
+	}
+
+	if (
+		filerail_recv(fd, buf, size, MSG_WAITALL) ||
+		!filerail_deserialize_chunk_info(ptr, buf, size)
+		)
+	{
+		exit_status = -1;
+	}
+
+	clean_up:
+	free(buf);
+	return exit_status;
+}
+
+// deserialize and parse
+int filerail_recv_request_header(int fd, filerail_request_header *ptr) {
+	void *buf;
+	int exit_status;
+	uint32_t size;
+
+	exit_status = 0;
+	buf = NULL;
+	// receive size of serialized message and allocate buffer to recv it
+	if (filerail_recv_frame_size(fd, &size) == -1) {
+		exit_status = -1;
+		goto clean_up;
+	}
+
+	buf = malloc(size);
+	if (buf == NULL) {
+		LOG(LOG_USER | LOG_ERR, "socket.h filerail_recv_request_header\n");
+		exit_status = -1;
+		goto clean_up;
+	}
+
+	if (
+		filerail_recv(fd, buf, size, MSG_WAITALL) ||
+		!filerail_deserialize_request_header(ptr, buf, size)
+		)
+	{
+		exit_status = -1;
+	}
+
+	clean_up:
+	free(buf);
+	return exit_status;
+}
+
+// deserialize and parse
+int filerail_recv_request_response(int fd, filerail_request_response *ptr) {
+	void *buf;
+	int exit_status;
+	uint32_t size;
+
+	exit_status = 0;
+	buf = NULL;
+	// receive size of serialized message and allocate buffer to recv it
+	if (filerail_recv_frame_size(fd, &size) == -1) {
+		exit_status = -1;
+		goto clean_up;
+	}
+
+	buf = malloc(size);
+	if (buf == NULL) {
+		LOG(LOG_USER | LOG_ERR, "socket.h filerail_recv_request_response\n");
+		exit_status = -1;
+		goto clean_up;
+	}
+
+	if (
+		filerail_recv(fd, buf, size, MSG_WAITALL) ||
+		!filerail_deserialize_request_response(ptr, buf, size)
+		)
+	{
+		exit_status = -1;
+	}
+
+	clean_up:
+	free(buf);
+	return exit_status;
+}
+
 // dns resolver
 int filerail_dns_resolve(char *hostname) {
 	struct hostent *info;
@@ -930,4 +1296,6 @@ int filerail_dns_resolve(char *hostname) {
 	return 0;
 }
 
+#endif /* FILERAIL_IMPLEMENTATION */
+
 #endif
@@ -0,0 +1,358 @@
+#ifndef _SPARSE_H
+#define _SPARSE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <linux/falloc.h>
+#include <zip.h>
+
+#include "global.h"
+#include "constants.h"
+
+/*
+	Sparse files (VM images, database files) are sent as their data extents only.
+	Sender finds extents with lseek SEEK_DATA/SEEK_HOLE, the zip entry of file holds extents back to back,
+	and an extra entry "<file>.filerail-sparse" holds the map. Map entry is flagged (ARCHIVE_ENTRY_FLAG in it's attributes),
+	receiver honors flagged entries only, so a user's file that happens to have the suffix is extracted as is:
+
+	FRSPARSE <apparent size>\n
+	<offset> <length>\n (one line per extent, ascending offsets)
+
+	Map entry is always extracted after it's data entry. Receiver then moves extents to their offsets
+	(backwards, in place), punches holes in between and removes the map. So neither the transfer nor the
+	destination disk pays for holes.
+*/
+
+// data extent of a sparse file
+typedef struct _filerail_extent {
+	uint64_t offset;
+	uint64_t length;
+} filerail_extent;
+
+// extents of a sparse file
+typedef struct _filerail_sparse_map {
+	uint64_t size; // apparent size
+	filerail_extent *extents;
+	size_t count;
+	size_t capacity;
+} filerail_sparse_map;
+
+bool filerail_is_sparse(struct stat *s);
+void filerail_sparse_map_init(filerail_sparse_map *map);
+void filerail_sparse_map_free(filerail_sparse_map *map);
+int filerail_sparse_map_add(filerail_sparse_map *map, uint64_t offset, uint64_t length);
+int filerail_sparse_scan(int fd, uint64_t size, filerail_sparse_map *map);
+int filerail_sparse_zip_data(struct zip_t *zip, int fd, filerail_sparse_map *map);
+int filerail_sparse_zip_map(struct zip_t *zip, filerail_sparse_map *map);
+bool filerail_is_sparse_map_path(const char *path);
+int filerail_sparse_restore(const char *map_path);
+
+#ifdef FILERAIL_IMPLEMENTATION
+
+// worth sending as extents only if holes add up to at least SPARSE_MIN_HOLE_SIZE
+bool filerail_is_sparse(struct stat *s) {
+	return S_ISREG(s->st_mode) && (uint64_t)s->st_blocks * 512 + SPARSE_MIN_HOLE_SIZE <= (uint64_t)s->st_size;
+}
+
+void filerail_sparse_map_init(filerail_sparse_map *map) {
+	memset(map, 0, sizeof(filerail_sparse_map));
+}
+
+void filerail_sparse_map_free(filerail_sparse_map *map) {
+	free(map->extents);
+	filerail_sparse_map_init(map);
+}
+
+int filerail_sparse_map_add(filerail_sparse_map *map, uint64_t offset, uint64_t length) {
+	size_t capacity;
+	filerail_extent *extents;
+
+	if (map->count == map->capacity) {
+		capacity = map->capacity == 0 ? 16 : 2 * map->capacity;
+		extents = realloc(map->extents, capacity * sizeof(filerail_extent));
+		if (extents == NULL) {
+			LOG(LOG_USER | LOG_ERR, "sparse.h filerail_sparse_map_add realloc\n");
+			return -1;
+		}
+		map->extents = extents;
+		map->capacity = capacity;
+	}
+	map->extents[map->count].offset = offset;
+	map->extents[map->count].length = length;
+	map->count++;
+	return 0;
+}
+
+/*
+	Find data extents of an open file.
+	Returns 1 if file system can't report holes (caller sends the file densely), 0 on success, -1 on error.
+*/
+int filerail_sparse_scan(int fd, uint64_t size, filerail_sparse_map *map) {
+	off_t data, hole;
+
+	map->size = size;
+	map->count = 0;
+	data = 0;
+	while ((uint64_t)data < size) {
+		if ((data = lseek(fd, data, SEEK_DATA)) == -1) {
+			if (errno == ENXIO) {
+				// only a hole till end of file
+				break;
+			}
+			if (errno == EINVAL) {
+				return 1;
+			}
+			LOG(LOG_USER | LOG_ERR, "sparse.h filerail_sparse_scan lseek\n");
+			return -1;
+		}
+		if ((hole = lseek(fd, data, SEEK_HOLE)) == -1) {
+			LOG(LOG_USER | LOG_ERR, "sparse.h filerail_sparse_scan lseek\n");
+			return -1;
+		}
+		if ((uint64_t)hole > size) {
+			hole = size;
+		}
+		if (filerail_sparse_map_add(map, data, hole - data) == -1) {
+			return -1;
+		}
+		data = hole;
+	}
+	return 0;
+}
+
+// write data extents back to back into the open zip entry
+int filerail_sparse_zip_data(struct zip_t *zip, int fd, filerail_sparse_map *map) {
+	size_t i;
+	uint64_t done, len;
+	ssize_t nbytes;
+	uint8_t *buf;
+	int exit_status;
+
+	exit_status = 0;
+	if ((buf = malloc(SPARSE_COPY_BUFFER_SIZE)) == NULL) {
+		LOG(LOG_USER | LOG_ERR, "sparse.h filerail_sparse_zip_data malloc\n");
+		return -1;
+	}
+	for (i = 0; i < map->count; i++) {
+		for (done = 0; done < map->extents[i].length; done += nbytes) {
+			len = min(SPARSE_COPY_BUFFER_SIZE, map->extents[i].length - done);
+			nbytes = pread(fd, buf, len, map->extents[i].offset + done);
+			if (nbytes <= 0) {
+				LOG(LOG_USER | LOG_ERR, "sparse.h filerail_sparse_zip_data pread\n");
+				exit_status = -1;
+				goto clean_up;
+			}
+			if (zip_entry_write(zip, buf, nbytes) == -1) {
+				LOG(LOG_USER | LOG_ERR, "sparse.h filerail_sparse_zip_data zip_entry_write\n");
+				exit_status = -1;
+				goto clean_up;
+			}
+		}
+	}
+
+	clean_up:
+	free(buf);
+	return exit_status;
+}
+
+// write the map into the open zip entry
+int filerail_sparse_zip_map(struct zip_t *zip, filerail_sparse_map *map) {
+	size_t i;
+	int len;
+	char line[64];
+
+	len = snprintf(line, sizeof(line), "%s %" PRIu64 "\n", SPARSE_MAP_MAGIC, map->size);
+	if (zip_entry_write(zip, line, len) == -1) {
+		LOG(LOG_USER | LOG_ERR, "sparse.h filerail_sparse_zip_map zip_entry_write\n");
+		return -1;
+	}
+	for (i = 0; i < map->count; i++) {
+		len = snprintf(line, sizeof(line), "%" PRIu64 " %" PRIu64 "\n", map->extents[i].offset, map->extents[i].length);
+		if (zip_entry_write(zip, line, len) == -1) {
+			LOG(LOG_USER | LOG_ERR, "sparse.h filerail_sparse_zip_map zip_entry_write\n");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+bool filerail_is_sparse_map_path(const char *path) {
+	size_t len, suffix_len;
+
+	len = strlen(path);
+	suffix_len = strlen(SPARSE_MAP_SUFFIX);
+	return len > suffix_len && strcmp(path + len - suffix_len, SPARSE_MAP_SUFFIX) == 0;
+}
+
+// read map written by filerail_sparse_zip_map, returns 1 if file is not a map (user file with same suffix)
+static int filerail_sparse_read_map(const char *map_path, filerail_sparse_map *map) {
+	FILE *fp;
+	char magic[16];
+	uint64_t offset, length, end;
+	int exit_status;
+
+	if ((fp = fopen(map_path, "r")) == NULL) {
+		LOG(LOG_USER | LOG_ERR, "sparse.h filerail_sparse_read_map fopen\n");
+		return -1;
+	}
+	exit_status = 0;
+	if (fscanf(fp, "%15s %" SCNu64, magic, &map->size) != 2 || strcmp(magic, SPARSE_MAP_MAGIC) != 0) {
+		exit_status = 1;
+		goto clean_up;
+	}
+	end = 0;
+	while (fscanf(fp, "%" SCNu64 " %" SCNu64, &offset, &length) == 2) {
+		// extents must be ascending and inside the file
+		if (offset < end || offset + length > map->size) {
+			exit_status = 1;
+			goto clean_up;
+		}
+		if (filerail_sparse_map_add(map, offset, length) == -1) {
+			exit_status = -1;
+			goto clean_up;
+		}
+		end = offset + length;
+	}
+
+	clean_up:
+	fclose(fp);
+	return exit_status;
+}
+
+// zero a range, punching a hole if file system supports it
+static int filerail_sparse_punch(int fd, uint64_t offset, uint64_t length, uint8_t *zeros) {
+	uint64_t done, len;
+
+	if (length == 0) {
+		return 0;
+	}
+	if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0) {
+		return 0;
+	}
+	for (done = 0; done < length; done += len) {
+		len = min(SPARSE_COPY_BUFFER_SIZE, length - done);
+		if (pwrite(fd, zeros, len, offset + done) != (ssize_t)len) {
+			LOG(LOG_USER | LOG_ERR, "sparse.h filerail_sparse_punch pwrite\n");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// move packed extents of extracted file to their offsets and recreate holes, map file is removed
+int filerail_sparse_restore(const char *map_path) {
+	int fd, exit_status, ret;
+	size_t i;
+	uint64_t packed, moved, len, end;
+	uint8_t *buf;
+	char data_path[MAX_PATH_LENGTH];
+	struct stat s;
+	filerail_sparse_map map;
+
+	fd = -1;
+	buf = NULL;
+	exit_status = 0;
+	filerail_sparse_map_init(&map);
+
+	if ((ret = filerail_sparse_read_map(map_path, &map)) != 0) {
+		// not a map, leave it as it is
+		filerail_sparse_map_free(&map);
+		return ret == 1 ? 0 : -1;
+	}
+	snprintf(data_path, sizeof(data_path), "%.*s", (int)(strlen(map_path) - strlen(SPARSE_MAP_SUFFIX)), map_path);
+
+	if (stat(data_path, &s) == -1) {
+		LOG(LOG_USER | LOG_ERR, "sparse.h filerail_sparse_restore stat\n");
+		exit_status = -1;
+		goto clean_up;
+	}
+	// extracted file may be read-only, it's mode is restored at the end
+	if (chmod(data_path, s.st_mode | S_IWUSR) == -1 || (fd = open(data_path, O_RDWR)) == -1) {
+		LOG(LOG_USER | LOG_ERR, "sparse.h filerail_sparse_restore open\n");
+		exit_status = -1;
+		goto clean_up;
+	}
+	if ((buf = calloc(1, SPARSE_COPY_BUFFER_SIZE)) == NULL) {
+		LOG(LOG_USER | LOG_ERR, "sparse.h filerail_sparse_restore calloc\n");
+		exit_status = -1;
+		goto clean_up;
+	}
+
+	packed = 0;
+	for (i = 0; i < map.count; i++) {
+		packed += map.extents[i].length;
+	}
+	if (packed != (uint64_t)s.st_size) {
+		LOG(LOG_USER | LOG_ERR, "sparse.h filerail_sparse_restore size mismatch\n");
+		exit_status = -1;
+		goto clean_up;
+	}
+	// everything beyond packed data becomes a hole
+	if (ftruncate(fd, map.size) == -1) {
+		LOG(LOG_USER | LOG_ERR, "sparse.h filerail_sparse_restore ftruncate\n");
+		exit_status = -1;
+		goto clean_up;
+	}
+
+	/*
+		Extent i is at packed offset (sum of lengths before it) <= it's real offset, so moving from last extent
+		to first, and within an extent from it's end, never overwrites data not yet moved.
+	*/
+	for (i = map.count; i-- > 0;) {
+		packed -= map.extents[i].length;
+		if (packed == map.extents[i].offset) {
+			continue;
+		}
+		for (moved = 0; moved < map.extents[i].length; moved += len) {
+			len = min(SPARSE_COPY_BUFFER_SIZE, map.extents[i].length - moved);
+			end = map.extents[i].length - moved - len;
+			if (
+				pread(fd, buf, len, packed + end) != (ssize_t)len ||
+				pwrite(fd, buf, len, map.extents[i].offset + end) != (ssize_t)len
+			) {
+				LOG(LOG_USER | LOG_ERR, "sparse.h filerail_sparse_restore pread/pwrite\n");
+				exit_status = -1;
+				goto clean_up;
+			}
+		}
+	}
+
+	// holes between extents still hold packed data (beyond packed size they are holes since ftruncate)
+	memset(buf, 0, SPARSE_COPY_BUFFER_SIZE);
+	end = 0;
+	for (i = 0; i < map.count && end < (uint64_t)s.st_size; i++) {
+		len = min(map.extents[i].offset, (uint64_t)s.st_size) - end;
+		if (filerail_sparse_punch(fd, end, len, buf) == -1) {
+			exit_status = -1;
+			goto clean_up;
+		}
+		end = map.extents[i].offset + map.extents[i].length;
+	}
+
+	if (unlink(map_path) == -1) {
+		LOG(LOG_USER | LOG_ERR, "sparse.h filerail_sparse_restore unlink\n");
+		exit_status = -1;
+	}
+
+	clean_up:
+	if (fd != -1) {
+		close(fd);
+		chmod(data_path, s.st_mode);
+	}
+	free(buf);
+	filerail_sparse_map_free(&map);
+	return exit_status;
+}
+
+#endif /* FILERAIL_IMPLEMENTATION */
+
+#endif
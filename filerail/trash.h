@@ -0,0 +1,182 @@
+#ifndef _TRASH_H
+#define _TRASH_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+
+#include "global.h"
+#include "constants.h"
+#include "walk.h"
+#include "utils.h"
+
+/*
+	Trash for resources replaced by an OVERWRITE.
+
+	Removing a large tree can take longer than uploading the new one, so once the new resource is published
+	over the old one (see publish.h), the old one is renamed into "<checkpoints directory>/trash/<time>.<pid>.<seq>"
+	(atomic, constant time).
+	A deleter process, forked by the server at start up, empties trash in the background: every entry
+	of trash is removed with a parallel walk (directories are listed and emptied by WALK_THREADS threads),
+	at most rate entries per second and at idle io priority, so it doesn't compete with transfers.
+	Anything left in trash by a crash or restart is picked up on next start.
+
+	Rename only works within a file system, if the resource lives on another one than checkpoints directory
+	it is removed synchronously, as before.
+*/
+
+// state of a rate limited removal
+typedef struct _filerail_trash_deleter {
+	uint64_t rate; // entries per second, 0 is unlimited
+	uint64_t count; // entries removed so far
+	struct timespec start;
+} filerail_trash_deleter;
+
+int filerail_trash_init(const char *ckpt_path, char *trash_path);
+int filerail_trash_move(const char *trash_path, const char *resource_path);
+int filerail_trash_empty(const char *trash_path, uint64_t rate);
+pid_t filerail_trash_start(const char *trash_path, uint64_t rate);
+
+#ifdef FILERAIL_IMPLEMENTATION
+
+// create trash inside checkpoints directory (if it doesn't exist)
+int filerail_trash_init(const char *ckpt_path, char *trash_path) {
+	snprintf(trash_path, MAX_PATH_LENGTH, "%s/%s", ckpt_path, TRASH_DIR);
+	if (mkdir(trash_path, 0777) == -1 && errno != EEXIST) {
+		LOG(LOG_USER | LOG_ERR, "trash.h filerail_trash_init mkdir\n");
+		return -1;
+	}
+	return 0;
+}
+
+// move resource into trash, removes it synchronously if trash is on another file system
+int filerail_trash_move(const char *trash_path, const char *resource_path) {
+	static unsigned int seq;
+	char path[MAX_PATH_LENGTH];
+
+	snprintf(path, sizeof(path), "%s/%ld.%d.%u", trash_path, (long)time(NULL), (int)getpid(), __sync_fetch_and_add(&seq, 1));
+	if (rename(resource_path, path) == 0) {
+		return 0;
+	}
+	if (errno != EXDEV) {
+		LOG(LOG_USER | LOG_ERR, "trash.h filerail_trash_move rename\n");
+		return -1;
+	}
+	return filerail_rm(resource_path);
+}
+
+// count one removed entry, sleep if removal is ahead of rate
+static void filerail_trash_throttle(filerail_trash_deleter *d) {
+	uint64_t n;
+	double due, elapsed;
+	struct timespec now;
+
+	n = __sync_add_and_fetch(&d->count, 1);
+	if (d->rate == 0) {
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	due = (double)n / d->rate;
+	elapsed = (now.tv_sec - d->start.tv_sec) + (now.tv_nsec - d->start.tv_nsec) / 1e9;
+	if (due > elapsed) {
+		usleep((useconds_t)((due - elapsed) * 1e6));
+	}
+}
+
+static int filerail_trash_rm_entry(filerail_walk_entry *entry, void *arg) {
+	if (entry->type == DT_DIR) {
+		return 0;
+	}
+	if (unlinkat(entry->dir_fd, entry->name, 0) == -1 && errno != ENOENT) {
+		LOG(LOG_USER | LOG_ERR, "trash.h filerail_trash_rm_entry unlinkat\n");
+		return -1;
+	}
+	filerail_trash_throttle(arg);
+	return 0;
+}
+
+static int filerail_trash_rm_dir(filerail_walk_entry *entry, void *arg) {
+	if (rmdir(entry->path) == -1) {
+		LOG(LOG_USER | LOG_ERR, "trash.h filerail_trash_rm_dir rmdir\n");
+		return -1;
+	}
+	filerail_trash_throttle(arg);
+	return 0;
+}
+
+// remove everything in trash, at most rate entries per second (0 is unlimited)
+int filerail_trash_empty(const char *trash_path, uint64_t rate) {
+	DIR *dir;
+	struct dirent *de;
+	struct stat s;
+	char path[MAX_PATH_LENGTH];
+	filerail_trash_deleter d;
+	int exit_status;
+
+	if ((dir = opendir(trash_path)) == NULL) {
+		LOG(LOG_USER | LOG_ERR, "trash.h filerail_trash_empty opendir\n");
+		return -1;
+	}
+	memset(&d, 0, sizeof(d));
+	d.rate = rate;
+	clock_gettime(CLOCK_MONOTONIC, &d.start);
+	exit_status = 0;
+	while ((de = readdir(dir)) != NULL) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) {
+			continue;
+		}
+		snprintf(path, sizeof(path), "%s/%s", trash_path, de->d_name);
+		if (lstat(path, &s) == -1) {
+			continue;
+		}
+		if (S_ISDIR(s.st_mode)) {
+			if (filerail_walk(path, 0, WALK_THREADS, filerail_trash_rm_entry, filerail_trash_rm_dir, &d) == -1) {
+				exit_status = -1;
+			}
+		} else if (unlink(path) == -1) {
+			LOG(LOG_USER | LOG_ERR, "trash.h filerail_trash_empty unlink\n");
+			exit_status = -1;
+		} else {
+			filerail_trash_throttle(&d);
+		}
+	}
+	closedir(dir);
+	return exit_status;
+}
+
+// fork the background deleter, it dies with the server
+pid_t filerail_trash_start(const char *trash_path, uint64_t rate) {
+	pid_t pid, ppid;
+
+	ppid = getpid();
+	if ((pid = fork()) != 0) {
+		if (pid == -1) {
+			LOG(LOG_USER | LOG_ERR, "trash.h filerail_trash_start fork\n");
+		}
+		return pid;
+	}
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+	if (getppid() != ppid) {
+		_exit(0);
+	}
+	// idle io class, disk time goes to transfers first
+	syscall(SYS_ioprio_set, 1, 0, 3 << 13);
+	while (true) {
+		filerail_trash_empty(trash_path, rate);
+		sleep(TRASH_POLL_INTERVAL);
+	}
+}
+
+#endif /* FILERAIL_IMPLEMENTATION */
+
+#endif
@@ -0,0 +1,205 @@
+#ifndef _TUNING_H
+#define _TUNING_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "global.h"
+#include "constants.h"
+
+/*
+	TCP tuning of connections, set with -t key=value on client and server:
+	nodelay=0|1 : TCP_NODELAY, small control frames (commands, answers) never wait for ACK of the previous one (default 1)
+	cork=0|1    : TCP_CORK while data flows, so frames of a transfer go out as full segments (default 1)
+	bw=<Mbit/s> : bandwidth of link, socket buffers are grown to bandwidth-delay product (default 0, kernel autotuning)
+	bw=auto     : client probes bandwidth of link first (see filerail_client_autotune)
+	buf=<KB>    : socket buffers of exactly this size, instead of bw
+	cc=<name>   : congestion control (TCP_CONGESTION), e.g. bbr (default is system's)
+	RTT is taken from the kernel (TCP_INFO) once the handshake is done, so it costs no round trip of it's own.
+	Buffers are never shrunk below what the kernel gives, and are capped at TUNING_MAX_BUFFER (and by
+	net.core.rmem_max / wmem_max). Effective settings are reported in verbose mode (see filerail_tune_report).
+*/
+
+typedef struct _filerail_tuning {
+	bool nodelay;
+	bool cork;
+	uint64_t bandwidth; // bytes per second, 0 if unknown
+	bool auto_bandwidth; // bandwidth is to be probed
+	uint64_t buffer; // bytes, 0 if sized from bandwidth
+	char congestion[TUNING_CC_NAME_LENGTH]; // empty keeps system default
+} filerail_tuning;
+
+// process wide, set by main() like the defaults of global.h
+extern filerail_tuning tuning;
+
+int filerail_tuning_set(const char *option);
+void filerail_tune_socket(int fd);
+void filerail_tune_buffers(int fd);
+void filerail_tune_cork(int fd, bool on);
+void filerail_tune_report(int fd, const char *when);
+
+#ifdef FILERAIL_IMPLEMENTATION
+
+filerail_tuning tuning = {true, true, 0, false, 0, ""};
+
+// parse "key=value" of -t, -1 if key is unknown or value is bad
+int filerail_tuning_set(const char *option) {
+	const char *value;
+	char *end;
+	size_t klen;
+	unsigned long long n;
+
+	if ((value = strchr(option, '=')) == NULL) {
+		return -1;
+	}
+	klen = value - option;
+	value++;
+	if (klen == 2 && strncmp(option, "cc", klen) == 0) {
+		if (strlen(value) >= sizeof(tuning.congestion)) {
+			return -1;
+		}
+		strcpy(tuning.congestion, value);
+		return 0;
+	}
+	if (klen == 2 && strncmp(option, "bw", klen) == 0 && strcmp(value, "auto") == 0) {
+		tuning.auto_bandwidth = true;
+		return 0;
+	}
+	errno = 0;
+	n = strtoull(value, &end, 10);
+	if (*value == '\0' || *end != '\0' || errno != 0) {
+		return -1;
+	}
+	if (klen == 7 && strncmp(option, "nodelay", klen) == 0 && n <= 1) {
+		tuning.nodelay = n;
+	} else if (klen == 4 && strncmp(option, "cork", klen) == 0 && n <= 1) {
+		tuning.cork = n;
+	} else if (klen == 2 && strncmp(option, "bw", klen) == 0) {
+		tuning.bandwidth = n * 1000000 / 8;
+	} else if (klen == 3 && strncmp(option, "buf", klen) == 0) {
+		tuning.buffer = n << 10;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+// options which must be in place before data flows: right before connect, or right after accept
+void filerail_tune_socket(int fd) {
+	int optval;
+
+	optval = tuning.nodelay;
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval)) == -1) {
+		LOG(LOG_USER | LOG_ERR, "tuning.h filerail_tune_socket TCP_NODELAY\n");
+	}
+	if (
+		tuning.congestion[0] != '\0' &&
+		setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, tuning.congestion, strlen(tuning.congestion)) == -1
+	) {
+		// not built in, or not in net.ipv4.tcp_allowed_congestion_control
+		LOG(LOG_USER | LOG_ERR, "tuning.h filerail_tune_socket TCP_CONGESTION\n");
+	}
+}
+
+// grow buffer (SO_SNDBUF or SO_RCVBUF) of fd to size, unless kernel already gives more
+static void filerail_tune_buffer(int fd, int option, uint64_t size) {
+	int cur, want;
+	socklen_t len;
+
+	len = sizeof(cur);
+	if (getsockopt(fd, SOL_SOCKET, option, &cur, &len) == -1) {
+		return;
+	}
+	want = (int)min(size, (uint64_t)TUNING_MAX_BUFFER);
+	// kernel reports double of what was asked for (bookkeeping overhead)
+	if (tuning.buffer == 0 && cur / 2 >= want) {
+		return;
+	}
+	if (setsockopt(fd, SOL_SOCKET, option, &want, sizeof(want)) == -1) {
+		LOG(LOG_USER | LOG_ERR, "tuning.h filerail_tune_buffer setsockopt\n");
+	}
+}
+
+// size socket buffers of connected fd to bandwidth-delay product (RTT measured by handshake)
+void filerail_tune_buffers(int fd) {
+	uint64_t size;
+	socklen_t len;
+	struct tcp_info info;
+
+	if (tuning.buffer != 0) {
+		size = tuning.buffer;
+	} else {
+		if (tuning.bandwidth == 0) {
+			return;
+		}
+		len = sizeof(info);
+		if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == -1 || info.tcpi_rtt == 0) {
+			return;
+		}
+		size = tuning.bandwidth * info.tcpi_rtt / 1000000;
+	}
+	filerail_tune_buffer(fd, SO_SNDBUF, size);
+	filerail_tune_buffer(fd, SO_RCVBUF, size);
+}
+
+// hold partial segments while a transfer's frames are sent, off flushes them (no-op for non TCP fds)
+void filerail_tune_cork(int fd, bool on) {
+	int optval;
+
+	if (!tuning.cork) {
+		return;
+	}
+	optval = on;
+	// fails on stream of a multiplexed connection (unix socket), mux batches frames itself
+	setsockopt(fd, IPPROTO_TCP, TCP_CORK, &optval, sizeof(optval));
+}
+
+// effective settings of connection, on terminal (client) or syslog (server) in verbose mode
+void filerail_tune_report(int fd, const char *when) {
+	int sndbuf, rcvbuf, nodelay;
+	char cc[TUNING_CC_NAME_LENGTH];
+	socklen_t len;
+	struct tcp_info info;
+
+	if (!verbose) {
+		return;
+	}
+	len = sizeof(info);
+	if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == -1) {
+		return;
+	}
+	len = sizeof(sndbuf);
+	getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len);
+	len = sizeof(rcvbuf);
+	getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &len);
+	len = sizeof(nodelay);
+	getsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, &len);
+	memset(cc, 0, sizeof(cc));
+	len = sizeof(cc) - 1;
+	getsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, cc, &len);
+
+	if (is_server) {
+		syslog(
+			LOG_USER | LOG_INFO, "%s: rtt %.2f ms, cwnd %u, sndbuf %d KB, rcvbuf %d KB, cc %s, nodelay %d, retrans %u",
+			when, info.tcpi_rtt / 1000.0, info.tcpi_snd_cwnd, sndbuf >> 10, rcvbuf >> 10, cc, nodelay,
+			info.tcpi_total_retrans
+		);
+	} else {
+		printf(
+			"%s: rtt %.2f ms, cwnd %u, sndbuf %d KB, rcvbuf %d KB, cc %s, nodelay %d, retrans %u\n",
+			when, info.tcpi_rtt / 1000.0, info.tcpi_snd_cwnd, sndbuf >> 10, rcvbuf >> 10, cc, nodelay,
+			info.tcpi_total_retrans
+		);
+	}
+}
+
+#endif /* FILERAIL_IMPLEMENTATION */
+
+#endif
@@ -7,15 +7,21 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
 #include <sys/types.h>
-#include <zip.c>
+#include <zip.h>
 
 #include "global.h"
 #include "constants.h"
 #include "protocol.h"
+#include "sparse.h"
+#include "pack.h"
+#include "walk.h"
+#include "prefetch.h"
 
+uint64_t filerail_available_storage(void);
 bool filerail_check_storage_size(off_t resource_size);
 bool filerail_is_file(struct stat *stat_resource);
 bool filerail_is_dir(struct stat *stat_resource);
@@ -23,26 +29,35 @@ bool filerail_is_exists(const char *resource_path, struct stat *stat_resource);
 bool filerail_is_resource_readable(const char *resource_path);
 bool filerail_is_resource_writeable(const char *resource_path);
 bool filerail_parse_resource_path(const char *resource_path, char *resource_name, char *resource_dir);
-int filerail_getcwd(char *dir);
-int filerail_cd(const char *path);
-bool filerail_zip_folder(struct zip_t *zip, const char *resource_path);
-bool zip_file(struct zip_t *zip, const char *resource_name);
+bool filerail_zip_entry(struct zip_t *zip, const char *resource_path, const char *entry_name);
+bool filerail_zip_folder(struct zip_t *zip, const char *resource_dir, const char *resource_name, bool pack);
+bool filerail_zip_file(struct zip_t *zip, const char *resource_dir, const char *resource_name);
 int zip_on_extract_entry(const char *resource_name, void *arg);
 bool zip_extract_resource(const char *source_path, const char *destination_path);
 int filerail_rm(const char *resource_path);
 void filerail_progress_bar(double fraction);
 int filerail_mkdir(const char *dir_path);
 
-// check if there is enough storage size (resource size is sent by client)
-bool filerail_check_storage_size(off_t resource_size) {
+#ifdef FILERAIL_IMPLEMENTATION
+
+// zip library is compiled with the definitions (entries' attributes are set through it's struct zip_t)
+#include <zip.c>
+
+// bytes available to unprivileged users (0 if unknown)
+uint64_t filerail_available_storage(void) {
 	struct statvfs buf;
 
 	if (statvfs("/", &buf) == -1) {
-		LOG(LOG_USER | LOG_ERR, "utils.h filerail_find_available_size statvfs\n");
-		return false;
+		LOG(LOG_USER | LOG_ERR, "utils.h filerail_available_storage statvfs\n");
+		return 0;
 	}
-	// man statvfs, you will get it. (Basically checking if there exists enough memory blocks)
-	return (resource_size / buf.f_frsize) < buf.f_bavail;
+	// man statvfs, you will get it. (Basically counting free memory blocks)
+	return (uint64_t)buf.f_bavail * buf.f_frsize;
+}
+
+// check if there is enough storage size (resource size is sent by client)
+bool filerail_check_storage_size(off_t resource_size) {
+	return (uint64_t)resource_size < filerail_available_storage();
 }
 
 // checks if resource if file
@@ -74,165 +89,358 @@ bool filerail_is_writeable(const char *resource_path) {
   return access(resource_path, W_OK) == 0;
 }
 
-// recursively zip the folder
-bool filerail_zip_folder(struct zip_t *zip, const char *resource_path) {
+/*
+	Archives must be deterministic: resume is keyed by md5 of the zip, and sender rebuilds it on every transfer.
+	So entries are added in sorted order (see filerail_tree_build), with fixed timestamp and only permission bits as attributes,
+	and compression level is fixed (ARCHIVE_COMPRESSION_LEVEL). Same tree always gives byte identical archive.
+	Entries are named relative to resource directory ("<resource_name>/..."), files are read by their full path,
+	so zipping doesn't depend on current directory.
+*/
+
+// close zip entry with fixed timestamp and permission bits of mode as attributes (flagged, if filerail made it itself)
+static bool filerail_zip_entry_close(struct zip_t *zip, mode_t mode, bool flagged) {
+	// zip_entry_fwrite copies mtime and st_mode of the file, they are written to headers on close
+	zip->entry.m_time = ARCHIVE_ENTRY_MTIME;
+	zip->entry.external_attr = (mz_uint32)(S_IFREG | (mode & 0777)) << 16;
+	if ((mode & 0200) == 0) {
+		// MS-DOS read-only
+		zip->entry.external_attr |= 0x01;
+	}
+	if (flagged) {
+		zip->entry.external_attr |= ARCHIVE_ENTRY_FLAG;
+	}
+	if (zip_entry_close(zip) == -1) {
+		LOG(LOG_USER | LOG_ERR, "utils.h filerail_zip_entry_close zip_entry_close\n");
+		return false;
+	}
+	return true;
+}
+
+// add data extents of a sparse file, followed by it's extent map (see sparse.h), returns 1 if holes can't be detected
+static int filerail_zip_sparse_entry(struct zip_t *zip, const char *resource_path, const char *entry_name, struct stat *s) {
+	int fd, exit_status;
+	char map_name[MAX_PATH_LENGTH];
+	filerail_sparse_map map;
+
+	filerail_sparse_map_init(&map);
+	if ((fd = open(resource_path, O_RDONLY)) == -1) {
+		LOG(LOG_USER | LOG_ERR, "utils.h filerail_zip_sparse_entry open\n");
+		return -1;
+	}
+	if ((exit_status = filerail_sparse_scan(fd, s->st_size, &map)) != 0) {
+		goto clean_up;
+	}
+
+	exit_status = -1;
+	if (zip_entry_open(zip, entry_name) == -1) {
+		LOG(LOG_USER | LOG_ERR, "utils.h filerail_zip_sparse_entry zip_entry_open\n");
+		goto clean_up;
+	}
+	if (filerail_sparse_zip_data(zip, fd, &map) == -1) {
+		zip_entry_close(zip);
+		goto clean_up;
+	}
+	if (!filerail_zip_entry_close(zip, s->st_mode, false)) {
+		goto clean_up;
+	}
+
+	snprintf(map_name, sizeof(map_name), "%s%s", entry_name, SPARSE_MAP_SUFFIX);
+	if (zip_entry_open(zip, map_name) == -1) {
+		LOG(LOG_USER | LOG_ERR, "utils.h filerail_zip_sparse_entry zip_entry_open\n");
+		goto clean_up;
+	}
+	if (filerail_sparse_zip_map(zip, &map) == -1) {
+		zip_entry_close(zip);
+		goto clean_up;
+	}
+	if (!filerail_zip_entry_close(zip, 0600, true)) {
+		goto clean_up;
+	}
+	exit_status = 0;
+
+	clean_up:
+	close(fd);
+	filerail_sparse_map_free(&map);
+	return exit_status;
+}
+
+// add file at resource_path to zip as entry_name with normalized metadata, sparse files are added as extents + map
+bool filerail_zip_entry(struct zip_t *zip, const char *resource_path, const char *entry_name) {
+	int ret;
+	struct stat s;
+
+	if (stat(resource_path, &s) == -1) {
+		LOG(LOG_USER | LOG_ERR, "utils.h filerail_zip_entry stat\n");
+		return false;
+	}
+	if (filerail_is_sparse(&s)) {
+		ret = filerail_zip_sparse_entry(zip, resource_path, entry_name, &s);
+		if (ret != 1) {
+			return ret == 0;
+		}
+		// file system can't report holes, send it densely
+	}
+	if (zip_entry_open(zip, entry_name) == -1) {
+		LOG(LOG_USER | LOG_ERR, "utils.h filerail_zip_entry zip_entry_open\n");
+		return false;
+	}
+	if (zip_entry_fwrite(zip, resource_path) == -1) {
+		LOG(LOG_USER | LOG_ERR, "utils.h filerail_zip_entry zip_entry_fwrite\n");
+		zip_entry_close(zip);
+		return false;
+	}
+	return filerail_zip_entry_close(zip, s.st_mode, false);
+}
+
+// write current batch of small files as a single entry in top directory of resource
+static bool filerail_zip_pack(struct zip_t *zip, const char *resource_name, filerail_packer *packer) {
+	char name[MAX_PATH_LENGTH], header[64];
+	int len;
+
+	if (packer->count == 0) {
+		return true;
+	}
+	snprintf(name, sizeof(name), "%s/%s%06u", resource_name, PACK_ENTRY_PREFIX, packer->seq);
+	len = filerail_packer_header(packer, header, sizeof(header));
+	if (zip_entry_open(zip, name) == -1) {
+		LOG(LOG_USER | LOG_ERR, "utils.h filerail_zip_pack zip_entry_open\n");
+		return false;
+	}
+	if (
+		zip_entry_write(zip, header, len) == -1 ||
+		zip_entry_write(zip, packer->index, packer->index_len) == -1 ||
+		(packer->data_len != 0 && zip_entry_write(zip, packer->data, packer->data_len) == -1)
+	) {
+		LOG(LOG_USER | LOG_ERR, "utils.h filerail_zip_pack zip_entry_write\n");
+		zip_entry_close(zip);
+		return false;
+	}
+	if (!filerail_zip_entry_close(zip, 0600, true)) {
+		return false;
+	}
+	filerail_packer_reset(packer);
+	return true;
+}
+
+// recursively zip the folder, reading ahead of it (see prefetch.h) (small files are packed into batches, if pack is set)
+bool filerail_zip_folder(struct zip_t *zip, const char *resource_dir, const char *resource_name, bool pack) {
 	bool exit_status;
-	DIR *dir;
-	struct dirent *entry;
-	char path[MAX_PATH_LENGTH];
+	size_t i, root_len;
 	struct stat s;
+	char resource_path[MAX_PATH_LENGTH], entry_name[MAX_PATH_LENGTH];
+	filerail_tree tree;
+	filerail_tree_entry *entry;
+	filerail_packer packer;
+	filerail_prefetcher prefetcher;
 
 	exit_status = true;
-	memset(path, 0, MAX_PATH_LENGTH);
-	dir = opendir(resource_path);
-	if (dir == NULL) {
-		LOG(LOG_USER | LOG_ERR, "utils.h filerail_zip_folder opendir\n");
+	snprintf(resource_path, sizeof(resource_path), "%s/%s", resource_dir, resource_name);
+	root_len = strlen(resource_path);
+	filerail_packer_init(&packer);
+	if (filerail_tree_build(&tree, resource_path) == -1) {
+		LOG(LOG_USER | LOG_ERR, "utils.h filerail_zip_folder\n");
 		exit_status = false;
 		goto clean_up;
 	}
 
-	while ((entry = readdir(dir)) != NULL) {
-		if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
-			continue;
-		}
-
-		snprintf(path, sizeof(path), "%s/%s", resource_path, entry->d_name);
-		if (lstat(path, &s) == -1) {
-			exit_status = false;
-			goto clean_up;
-		}
-		// if resource is folder, recursively zip it
-		if (S_ISDIR(s.st_mode)) {
-			if (!filerail_zip_folder(zip, path)) {
-				LOG(LOG_USER | LOG_ERR, "utils.h filerail_zip_folder\n");
-				exit_status = false;
-				goto clean_up;
-			}
-		} else {
+	filerail_prefetcher_init(&prefetcher, &tree);
+	for (i = 0; i < tree.count; i++) {
+		filerail_prefetch(&prefetcher, i);
+		entry = &tree.entries[i];
+		s.st_mode = entry->mode;
+		s.st_size = entry->size;
+		if (pack && filerail_is_packable(entry->path, &s)) {
 			if (
-				zip_entry_open(zip, path) == -1 ||
-				zip_entry_fwrite(zip, path) == -1 ||
-				zip_entry_close(zip) == -1
+				filerail_packer_add(&packer, entry->path, entry->path + root_len + 1, &s) == -1 ||
+				(filerail_packer_is_full(&packer) && !filerail_zip_pack(zip, resource_name, &packer))
 			) {
 				LOG(LOG_USER | LOG_ERR, "utils.h filerail_zip_folder\n");
 				exit_status = false;
 				goto clean_up;
 			}
+			continue;
+		}
+		snprintf(entry_name, sizeof(entry_name), "%s%s", resource_name, entry->path + root_len);
+		if (!filerail_zip_entry(zip, entry->path, entry_name)) {
+			LOG(LOG_USER | LOG_ERR, "utils.h filerail_zip_folder\n");
+			exit_status = false;
+			goto clean_up;
 		}
 	}
+	exit_status = filerail_zip_pack(zip, resource_name, &packer);
 
 	clean_up:
-	if (dir != NULL) {
-		closedir(dir);
-	}
+	filerail_tree_free(&tree);
+	filerail_packer_free(&packer);
 	return exit_status;
 }
 
 // zip single file
-bool filerail_zip_file(struct zip_t *zip, const char *resource_path) {
-	if (
-		zip_entry_open(zip, resource_path) == -1 ||
-		zip_entry_fwrite(zip, resource_path) == -1 ||
-		zip_entry_close(zip) == -1
-	) {
+bool filerail_zip_file(struct zip_t *zip, const char *resource_dir, const char *resource_name) {
+	char resource_path[MAX_PATH_LENGTH];
+
+	snprintf(resource_path, sizeof(resource_path), "%s/%s", resource_dir, resource_name);
+	if (!filerail_zip_entry(zip, resource_path, resource_name)) {
 		LOG(LOG_USER | LOG_ERR, "utils.h filerail_zip_file\n");
 		return false;
 	}
 	return true;
 }
 
-// call back for zip extract (check deps)
+// entries of an archive being extracted, that filerail added of it's own (see filerail_zip_entry_close)
+typedef struct _filerail_extract_ctx {
+	size_t dir_len; // length of extraction directory, call back gets "<dir>/<entry name>"
+	char **flagged; // names of flagged entries, sorted
+	size_t count;
+} filerail_extract_ctx;
+
+static int filerail_extract_name_cmp(const void *a, const void *b) {
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static void filerail_extract_ctx_free(filerail_extract_ctx *ctx) {
+	size_t i;
+
+	for (i = 0; i < ctx->count; i++) {
+		free(ctx->flagged[i]);
+	}
+	free(ctx->flagged);
+	ctx->flagged = NULL;
+	ctx->count = 0;
+}
+
+// collect names of flagged entries from central directory, before anything is extracted
+static int filerail_extract_ctx_init(filerail_extract_ctx *ctx, const char *source_path, const char *destination_path) {
+	struct zip_t *zip;
+	ssize_t i, n;
+	char **flagged;
+	const char *name;
+	int exit_status;
+
+	ctx->dir_len = strlen(destination_path);
+	ctx->flagged = NULL;
+	ctx->count = 0;
+	if ((zip = zip_open(source_path, 0, 'r')) == NULL) {
+		LOG(LOG_USER | LOG_ERR, "utils.h filerail_extract_ctx_init zip_open\n");
+		return -1;
+	}
+	exit_status = -1;
+	n = zip_total_entries(zip);
+	for (i = 0; i < n; i++) {
+		if (zip_entry_openbyindex(zip, i) == -1) {
+			LOG(LOG_USER | LOG_ERR, "utils.h filerail_extract_ctx_init zip_entry_openbyindex\n");
+			goto clean_up;
+		}
+		if ((zip->entry.external_attr & ARCHIVE_ENTRY_FLAG) != 0 && (name = zip_entry_name(zip)) != NULL) {
+			if ((flagged = realloc(ctx->flagged, (ctx->count + 1) * sizeof(char *))) == NULL) {
+				LOG(LOG_USER | LOG_ERR, "utils.h filerail_extract_ctx_init realloc\n");
+				zip_entry_close(zip);
+				goto clean_up;
+			}
+			ctx->flagged = flagged;
+			if ((ctx->flagged[ctx->count] = strdup(name)) == NULL) {
+				LOG(LOG_USER | LOG_ERR, "utils.h filerail_extract_ctx_init strdup\n");
+				zip_entry_close(zip);
+				goto clean_up;
+			}
+			ctx->count++;
+		}
+		zip_entry_close(zip);
+	}
+	qsort(ctx->flagged, ctx->count, sizeof(char *), filerail_extract_name_cmp);
+	exit_status = 0;
+
+	clean_up:
+	zip_close(zip);
+	if (exit_status == -1) {
+		filerail_extract_ctx_free(ctx);
+	}
+	return exit_status;
+}
+
+// entry name of extracted path, if it's entry is flagged, NULL otherwise
+static const char *filerail_extract_flagged_name(filerail_extract_ctx *ctx, const char *path) {
+	const char *name;
+
+	if (ctx == NULL || ctx->count == 0 || strlen(path) <= ctx->dir_len) {
+		return NULL;
+	}
+	for (name = path + ctx->dir_len; *name == '/'; name++);
+	return bsearch(&name, ctx->flagged, ctx->count, sizeof(char *), filerail_extract_name_cmp) != NULL ? name : NULL;
+}
+
+// call back for zip extract (arg is filerail_extract_ctx, or NULL), sparse files are expanded once their extent map is extracted
 int zip_on_extract_entry(const char *resource_name, void *arg) {
 	struct stat stat_resource;
+	const char *name;
 
+	// a user's file named like a map or a batch is just a file
+	if ((name = filerail_extract_flagged_name(arg, resource_name)) != NULL) {
+		if (filerail_is_sparse_map_path(name)) {
+			return filerail_sparse_restore(resource_name);
+		}
+		if (filerail_is_pack_entry(name)) {
+			return filerail_unpack(resource_name);
+		}
+	}
   if (lstat(resource_name, &stat_resource) == -1) {
   	LOG(LOG_USER | LOG_ERR, "utils.h zip_on_extract_entry lstat\n");
   	return -1;
   }
-  return stat_resource.st_size;
+  // negative return aborts extraction, so size (which overflows int for files > 2 GB) isn't returned
+  return 0;
 }
 
-// unzip
+// unzip into destination directory, expanding entries filerail added of it's own
 bool zip_extract_resource(const char *source_path, const char *destination_path) {
-	if (zip_extract(source_path, destination_path, zip_on_extract_entry, NULL) == -1) {
-		LOG(LOG_USER | LOG_ERR, "utils.h zip_extract_resource zip_extract\n");
+	bool exit_status;
+	filerail_extract_ctx ctx;
+
+	if (filerail_extract_ctx_init(&ctx, source_path, destination_path) == -1) {
+		LOG(LOG_USER | LOG_ERR, "utils.h zip_extract_resource\n");
 		return false;
 	}
-	return true;
+	exit_status = true;
+	if (zip_extract(source_path, destination_path, zip_on_extract_entry, &ctx) == -1) {
+		LOG(LOG_USER | LOG_ERR, "utils.h zip_extract_resource zip_extract\n");
+		exit_status = false;
+	}
+	filerail_extract_ctx_free(&ctx);
+	return exit_status;
+}
+
+static int filerail_rm_entry(filerail_walk_entry *entry, void *arg) {
+	if (entry->type != DT_DIR && unlinkat(entry->dir_fd, entry->name, 0) == -1) {
+		LOG(LOG_USER | LOG_ERR, "utils.h filerail_rm unlinkat\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int filerail_rm_dir(filerail_walk_entry *entry, void *arg) {
+	if (rmdir(entry->path) == -1) {
+		LOG(LOG_USER | LOG_ERR, "utils.h filerail_rm rmdir\n");
+		return -1;
+	}
+	return 0;
 }
 
-// remove the file/dir
+// remove the file/dir (directories are removed with a parallel walk, each one once it is empty)
 int filerail_rm(const char *resource_path) {
-  int exit_status;
-  DIR *dir;
-  char path[MAX_PATH_LENGTH];
-  struct stat stat_path, stat_entry;
-  struct dirent *entry;
-
-  dir = NULL;
-  exit_status = 0;
+  struct stat stat_path;
+
   if (lstat(resource_path, &stat_path) == -1) {
   	LOG(LOG_USER | LOG_ERR, "utils.h filerail_rm lstat\n");
-  	exit_status = -1;
-  	goto clean_up;
+  	return -1;
   }
-
-  if (S_ISREG(stat_path.st_mode) || S_ISLNK(stat_path.st_mode)) {
-	  if (unlink(resource_path) == -1) {
-	  	LOG(LOG_USER | LOG_ERR, "utils.h filerail_rm unlink\n");
-	  	exit_status = -1;
-	  	goto clean_up;
-	  }
-  } else if (S_ISDIR(stat_path.st_mode)) {
-  	// if directory, recursively remove all sub-dir and files
-	  if ((dir = opendir(resource_path)) == NULL) {
-	  	LOG(LOG_USER | LOG_ERR, "utils.h filerail_rm opendir\n");
-	  	exit_status = -1;
-	    goto clean_up;
-	  }
-
-	  while ((entry = readdir(dir)) != NULL) {
-	    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-	    	continue;
-	    }
-
-	    strcpy(path, resource_path);
-	    strcat(path, "/");
-	    strcat(path, entry->d_name);
-
-	    if (lstat(path, &stat_entry) == -1) {
-		  	LOG(LOG_USER | LOG_ERR, "utils.h filerail_rm lstat\n");
-		  	exit_status = -1;
-		  	goto clean_up;
-	    }
-
-	    if (S_ISDIR(stat_entry.st_mode)) {
-	      if (filerail_rm(path) == -1) {
-	      	exit_status = -1;
-	      	goto clean_up;
-	      }
-	      continue;
-	    }
-
-	    if (unlink(path) == -1) {
-		  	LOG(LOG_USER | LOG_ERR, "operations.h filerail_rm unlink\n");
-		  	exit_status = -1;
-		    goto clean_up;
-	    }
-	  }
-
-	  if (rmdir(resource_path) == -1) {
-	  	LOG(LOG_USER | LOG_ERR, "operations.h filerail_rm unlink\n");
-	  	exit_status = -1;
-	    goto clean_up;
-	  }
+  if (S_ISDIR(stat_path.st_mode)) {
+  	return filerail_walk(resource_path, 0, WALK_THREADS, filerail_rm_entry, filerail_rm_dir, NULL);
   }
-
-  clean_up:
-  if (dir != NULL) {
-  	closedir(dir);
+  if (unlink(resource_path) == -1) {
+  	LOG(LOG_USER | LOG_ERR, "utils.h filerail_rm unlink\n");
+  	return -1;
   }
-  return exit_status;
+  return 0;
 }
 
 // parse the resource path (gets resource dir and resource name)
@@ -262,38 +470,16 @@ bool filerail_parse_resource_path(const char *resource_path, char *resource_name
 		return false;
 	}
 	memcpy(resource_name, resource_path + i + 1, path_len - i - 1);
+	resource_name[path_len - i - 1] = '\0';
 	if (i == 0) {
 		strcpy(resource_dir, "/");
 	} else {
 		memcpy(resource_dir, resource_path, i);
+		resource_dir[i] = '\0';
 	}
 	return true;
 }
 
-// get current dir
-int filerail_getcwd(char *dir) {
-	char *ret;
-
-	ret = getcwd(dir, MAX_PATH_LENGTH);
-	if (ret == NULL) {
-		LOG(LOG_USER | LOG_ERR, "utils.h filerail_getcwd getcwd\n");
-		return -1;
-	}
-	return 0;
-}
-
-// change current dir
-int filerail_cd(const char *path) {
-	int ret;
-
-	ret = chdir(path);
-	if (ret == -1) {
-		LOG(LOG_USER | LOG_ERR, "operations.h filerail_cd chdir\n");
-		return -1;
-	}
-	return 0;
-}
-
 // progress bar
 void filerail_progress_bar(double fraction) {
 	int x, cur;
@@ -321,4 +507,6 @@ int filerail_mkdir(const char *dir_path) {
 	return 0;
 }
 
+#endif /* FILERAIL_IMPLEMENTATION */
+
 #endif
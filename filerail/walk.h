@@ -0,0 +1,383 @@
+#ifndef _WALK_H
+#define _WALK_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "global.h"
+#include "constants.h"
+
+/*
+	Directory walk engine, shared by archiving, deletion and anything else that visits a tree.
+
+	Iterative: directories to list are kept in a work queue (no recursion, no path buffer per stack frame),
+	and are listed by a pool of threads, so wide trees are walked in parallel.
+	Entries are visited relative to the fd of their directory (fstatat/unlinkat), d_type is used so that
+	nothing is stat'ed unless WALK_STAT is asked for (or file system doesn't report d_type).
+
+	visit    : called for every entry below root (directories before their content), in no particular order,
+	           returning WALK_SKIP for a directory leaves it's content out (it may have been removed)
+	post_dir : called for every directory (root included) once everything below it has been visited,
+	           so it can be removed (entry has full path, dir_fd is AT_FDCWD)
+	Call backs run on pool threads concurrently, they must be thread safe. A call back returning -1 stops the walk.
+*/
+
+// entry being visited
+typedef struct _filerail_walk_entry {
+	const char *path; // full path (root/.../name)
+	const char *name; // last component of path
+	int dir_fd; // fd of directory containing the entry
+	unsigned char type; // DT_REG, DT_DIR, DT_LNK ...
+	struct stat *stat; // lstat of entry if WALK_STAT was asked for, else NULL
+} filerail_walk_entry;
+
+typedef int (*filerail_walk_fn)(filerail_walk_entry *entry, void *arg);
+
+// directory waiting to be listed (or waiting for it's subdirectories to complete)
+typedef struct _filerail_walk_node {
+	char *path;
+	struct _filerail_walk_node *parent;
+	struct _filerail_walk_node *next; // link in work queue
+	size_t pending; // own listing + subdirectories not completed yet
+} filerail_walk_node;
+
+// state shared by pool threads
+typedef struct _filerail_walker {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	filerail_walk_node *queue; // LIFO, keeps the walk close to depth first (bounded memory)
+	size_t outstanding; // nodes queued or being listed
+	bool failed; // read and set by every thread without the lock (see filerail_walk_failed)
+	int flags;
+	filerail_walk_fn visit;
+	filerail_walk_fn post_dir;
+	void *arg;
+} filerail_walker;
+
+// flags
+#define WALK_STAT 1
+
+// returned by visit for a directory whose content is not to be walked
+#define WALK_SKIP 1
+
+// non-directory entry of a tree
+typedef struct _filerail_tree_entry {
+	char *path;
+	mode_t mode;
+	off_t size;
+	ino_t ino;
+} filerail_tree_entry;
+
+// all non-directory entries below a root, in path order (see filerail_tree_build)
+typedef struct _filerail_tree {
+	pthread_mutex_t lock;
+	filerail_tree_entry *entries;
+	size_t count;
+	size_t capacity;
+} filerail_tree;
+
+int filerail_walk(const char *root, int flags, int nthreads, filerail_walk_fn visit, filerail_walk_fn post_dir,
+	void *arg);
+int filerail_tree_build(filerail_tree *tree, const char *root);
+void filerail_tree_free(filerail_tree *tree);
+
+#ifdef FILERAIL_IMPLEMENTATION
+
+// failure stops every thread at it's next entry, the flag is only ever set, so relaxed ordering is enough
+static bool filerail_walk_failed(filerail_walker *w) {
+	return __atomic_load_n(&w->failed, __ATOMIC_RELAXED);
+}
+
+static void filerail_walk_fail(filerail_walker *w) {
+	__atomic_store_n(&w->failed, true, __ATOMIC_RELAXED);
+}
+
+static void filerail_walk_push(filerail_walker *w, filerail_walk_node *node) {
+	pthread_mutex_lock(&w->lock);
+	node->next = w->queue;
+	w->queue = node;
+	w->outstanding++;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+// directory and it's subtree are done: post visit it, and complete parents whose last child it was
+static void filerail_walk_complete(filerail_walker *w, filerail_walk_node *node) {
+	filerail_walk_node *parent;
+	filerail_walk_entry entry;
+	bool done;
+
+	while (node != NULL) {
+		pthread_mutex_lock(&w->lock);
+		done = --node->pending == 0;
+		pthread_mutex_unlock(&w->lock);
+		if (!done) {
+			return;
+		}
+		if (w->post_dir != NULL && !filerail_walk_failed(w)) {
+			entry.path = node->path;
+			entry.name = node->path;
+			entry.dir_fd = AT_FDCWD;
+			entry.type = DT_DIR;
+			entry.stat = NULL;
+			if (w->post_dir(&entry, w->arg) == -1) {
+				filerail_walk_fail(w);
+			}
+		}
+		parent = node->parent;
+		free(node->path);
+		free(node);
+		node = parent;
+	}
+}
+
+// list one directory: visit entries, queue subdirectories
+static void filerail_walk_list(filerail_walker *w, filerail_walk_node *node) {
+	int fd, ret;
+	DIR *dir;
+	struct dirent *de;
+	struct stat s;
+	size_t path_len, name_len;
+	char *path;
+	filerail_walk_node *child;
+	filerail_walk_entry entry;
+
+	if ((fd = open(node->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW)) == -1 || (dir = fdopendir(fd)) == NULL) {
+		LOG(LOG_USER | LOG_ERR, "walk.h filerail_walk_list open\n");
+		if (fd != -1) {
+			close(fd);
+		}
+		filerail_walk_fail(w);
+		return;
+	}
+	path_len = strlen(node->path);
+	while (!filerail_walk_failed(w) && (de = readdir(dir)) != NULL) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) {
+			continue;
+		}
+		name_len = strlen(de->d_name);
+		if (path_len + 1 + name_len >= MAX_PATH_LENGTH || (path = malloc(path_len + name_len + 2)) == NULL) {
+			LOG(LOG_USER | LOG_ERR, "walk.h filerail_walk_list path\n");
+			filerail_walk_fail(w);
+			break;
+		}
+		memcpy(path, node->path, path_len);
+		path[path_len] = '/';
+		memcpy(path + path_len + 1, de->d_name, name_len + 1);
+
+		entry.path = path;
+		entry.name = path + path_len + 1;
+		entry.dir_fd = fd;
+		entry.type = de->d_type;
+		entry.stat = NULL;
+		if ((w->flags & WALK_STAT) || entry.type == DT_UNKNOWN) {
+			if (fstatat(fd, de->d_name, &s, AT_SYMLINK_NOFOLLOW) == -1) {
+				LOG(LOG_USER | LOG_ERR, "walk.h filerail_walk_list fstatat\n");
+				free(path);
+				filerail_walk_fail(w);
+				break;
+			}
+			entry.type = IFTODT(s.st_mode);
+			entry.stat = (w->flags & WALK_STAT) ? &s : NULL;
+		}
+
+		ret = w->visit != NULL ? w->visit(&entry, w->arg) : 0;
+		if (ret == -1) {
+			free(path);
+			filerail_walk_fail(w);
+			break;
+		}
+		if (entry.type != DT_DIR || ret == WALK_SKIP) {
+			free(path);
+			continue;
+		}
+		if ((child = calloc(1, sizeof(filerail_walk_node))) == NULL) {
+			LOG(LOG_USER | LOG_ERR, "walk.h filerail_walk_list calloc\n");
+			free(path);
+			filerail_walk_fail(w);
+			break;
+		}
+		child->path = path;
+		child->parent = node;
+		child->pending = 1;
+		pthread_mutex_lock(&w->lock);
+		node->pending++;
+		pthread_mutex_unlock(&w->lock);
+		filerail_walk_push(w, child);
+	}
+	closedir(dir);
+}
+
+static void *filerail_walk_worker(void *arg) {
+	filerail_walker *w;
+	filerail_walk_node *node;
+
+	w = arg;
+	while (true) {
+		pthread_mutex_lock(&w->lock);
+		while (w->queue == NULL && w->outstanding != 0) {
+			pthread_cond_wait(&w->cond, &w->lock);
+		}
+		if (w->queue == NULL) {
+			// nothing queued and nothing being listed, walk is over
+			pthread_mutex_unlock(&w->lock);
+			return NULL;
+		}
+		node = w->queue;
+		w->queue = node->next;
+		pthread_mutex_unlock(&w->lock);
+
+		// after a failure queued nodes are only drained
+		if (!filerail_walk_failed(w)) {
+			filerail_walk_list(w, node);
+		}
+		filerail_walk_complete(w, node);
+
+		pthread_mutex_lock(&w->lock);
+		if (--w->outstanding == 0) {
+			pthread_cond_broadcast(&w->cond);
+		}
+		pthread_mutex_unlock(&w->lock);
+	}
+}
+
+// walk directory tree at root with nthreads threads (1 walks on calling thread)
+int filerail_walk(const char *root, int flags, int nthreads, filerail_walk_fn visit, filerail_walk_fn post_dir,
+	void *arg)
+{
+	int i, started;
+	pthread_t *threads;
+	filerail_walker w;
+	filerail_walk_node *node;
+
+	memset(&w, 0, sizeof(w));
+	w.flags = flags;
+	w.visit = visit;
+	w.post_dir = post_dir;
+	w.arg = arg;
+	if ((node = calloc(1, sizeof(filerail_walk_node))) == NULL || (node->path = strdup(root)) == NULL) {
+		LOG(LOG_USER | LOG_ERR, "walk.h filerail_walk calloc\n");
+		free(node);
+		return -1;
+	}
+	node->pending = 1;
+	pthread_mutex_init(&w.lock, NULL);
+	pthread_cond_init(&w.cond, NULL);
+	filerail_walk_push(&w, node);
+
+	started = 0;
+	threads = NULL;
+	if (nthreads > 1 && (threads = malloc((nthreads - 1) * sizeof(pthread_t))) != NULL) {
+		for (i = 0; i < nthreads - 1; i++) {
+			if (pthread_create(&threads[started], NULL, filerail_walk_worker, &w) != 0) {
+				LOG(LOG_USER | LOG_ERR, "walk.h filerail_walk pthread_create\n");
+				break;
+			}
+			started++;
+		}
+	}
+	// calling thread works too
+	filerail_walk_worker(&w);
+	for (i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+	pthread_mutex_destroy(&w.lock);
+	pthread_cond_destroy(&w.cond);
+	return filerail_walk_failed(&w) ? -1 : 0;
+}
+
+static int filerail_tree_collect(filerail_walk_entry *entry, void *arg) {
+	filerail_tree *tree;
+	filerail_tree_entry *entries;
+	size_t capacity;
+	int exit_status;
+
+	if (entry->type == DT_DIR) {
+		return 0;
+	}
+	tree = arg;
+	exit_status = 0;
+	pthread_mutex_lock(&tree->lock);
+	if (tree->count == tree->capacity) {
+		capacity = tree->capacity == 0 ? 1024 : 2 * tree->capacity;
+		if ((entries = realloc(tree->entries, capacity * sizeof(filerail_tree_entry))) == NULL) {
+			LOG(LOG_USER | LOG_ERR, "walk.h filerail_tree_collect realloc\n");
+			exit_status = -1;
+			goto clean_up;
+		}
+		tree->entries = entries;
+		tree->capacity = capacity;
+	}
+	if ((tree->entries[tree->count].path = strdup(entry->path)) == NULL) {
+		LOG(LOG_USER | LOG_ERR, "walk.h filerail_tree_collect strdup\n");
+		exit_status = -1;
+		goto clean_up;
+	}
+	tree->entries[tree->count].mode = entry->stat->st_mode;
+	tree->entries[tree->count].size = entry->stat->st_size;
+	tree->entries[tree->count].ino = entry->stat->st_ino;
+	tree->count++;
+
+	clean_up:
+	pthread_mutex_unlock(&tree->lock);
+	return exit_status;
+}
+
+// compare paths component by component ('/' sorts before every other byte), same as a sorted depth first walk
+static int filerail_tree_entry_cmp(const void *a, const void *b) {
+	const unsigned char *x, *y;
+
+	x = (const unsigned char*)((const filerail_tree_entry*)a)->path;
+	y = (const unsigned char*)((const filerail_tree_entry*)b)->path;
+	while (*x != '\0' && *x == *y) {
+		x++;
+		y++;
+	}
+	if (*x == *y) {
+		return 0;
+	}
+	if (*x == '/' || *y == '/') {
+		return *x == '/' ? -1 : 1;
+	}
+	return *x < *y ? -1 : 1;
+}
+
+/*
+	Collect non-directory entries below root (with lstat) using a parallel walk, then sort them,
+	so the result doesn't depend on readdir order or thread scheduling.
+*/
+int filerail_tree_build(filerail_tree *tree, const char *root) {
+	memset(tree, 0, sizeof(filerail_tree));
+	pthread_mutex_init(&tree->lock, NULL);
+	if (filerail_walk(root, WALK_STAT, WALK_THREADS, filerail_tree_collect, NULL, tree) == -1) {
+		return -1;
+	}
+	qsort(tree->entries, tree->count, sizeof(filerail_tree_entry), filerail_tree_entry_cmp);
+	return 0;
+}
+
+void filerail_tree_free(filerail_tree *tree) {
+	size_t i;
+
+	for (i = 0; i < tree->count; i++) {
+		free(tree->entries[i].path);
+	}
+	free(tree->entries);
+	pthread_mutex_destroy(&tree->lock);
+	memset(tree, 0, sizeof(filerail_tree));
+}
+
+#endif /* FILERAIL_IMPLEMENTATION */
+
+#endif
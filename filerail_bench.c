@@ -0,0 +1,674 @@
+// for SEEK_DATA/SEEK_HOLE and fallocate
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+// this program holds the definitions of the library (see global.h)
+#define FILERAIL_IMPLEMENTATION
+#include "filerail/global.h"
+#include "filerail/constants.h"
+#include "filerail/chunker.h"
+#include "filerail/utils.h"
+#include "filerail/socket.h"
+#include "filerail/operations.h"
+
+/*
+	Benchmarks for filerail internals, results are printed to stdout.
+	usage: -b benchmark [-s size in MB] [-n count] [-d work directory] [-i ip -p port -c concurrency]
+*/
+
+// xorshift64*, deterministic so that runs are comparable
+static uint64_t bench_state = 0x2545f4914f6cdd1dULL;
+
+static uint64_t bench_rand(void) {
+	bench_state ^= bench_state >> 12;
+	bench_state ^= bench_state << 25;
+	bench_state ^= bench_state >> 27;
+	return bench_state * 0x2545f4914f6cdd1dULL;
+}
+
+static void bench_fill(uint8_t *buf, size_t len) {
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		buf[i] = bench_rand() & 0xff;
+	}
+}
+
+// wall clock in seconds
+static double bench_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// <dir>/filerail_bench_<name>.<pid> into work_dir (of MAX_PATH_LENGTH - BENCH_NAME_LENGTH), -1 if it doesn't fit
+static int bench_work_dir(char *work_dir, const char *dir, const char *name) {
+	if (
+		(size_t)snprintf(work_dir, MAX_PATH_LENGTH - BENCH_NAME_LENGTH, "%s/filerail_bench_%s.%d", dir, name,
+			(int)getpid()) >= MAX_PATH_LENGTH - BENCH_NAME_LENGTH
+	) {
+		printf("Work directory %s is too long\n", dir);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+	Derive next version of a dataset: a few overwrites, insertions and deletions at random offsets
+	(similar to successive builds or VM images).
+*/
+static uint8_t *bench_mutate(uint8_t *buf, size_t *len) {
+	int i;
+	size_t offset, edit;
+	uint8_t *next;
+
+	edit = 1024;
+	next = realloc(buf, *len + DEDUP_BENCH_EDITS * edit);
+	if (next == NULL) {
+		free(buf);
+		return NULL;
+	}
+	for (i = 0; i < DEDUP_BENCH_EDITS; i++) {
+		// overwrite
+		offset = bench_rand() % (*len - edit);
+		bench_fill(next + offset, 64);
+		// insert
+		offset = bench_rand() % (*len - edit);
+		memmove(next + offset + edit, next + offset, *len - offset);
+		bench_fill(next + offset, edit);
+		*len += edit;
+		// delete
+		offset = bench_rand() % (*len - edit);
+		memmove(next + offset, next + offset + edit, *len - offset - edit);
+		*len -= edit;
+	}
+	return next;
+}
+
+// text-like content (small alphabet), so that compression has something to share across files
+static void bench_fill_text(char *buf, size_t len) {
+	static const char alphabet[] = "etaoinshrdlu ;{}()\n\t_=";
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		buf[i] = alphabet[bench_rand() % (sizeof(alphabet) - 1)];
+	}
+}
+
+// bytes of chunks in list not seen in an earlier version, which a dedup put of this version sends
+static size_t bench_dedup_new(filerail_chunk_list *list, filerail_chunk_set *seen) {
+	size_t i, nbytes;
+
+	nbytes = 0;
+	for (i = 0; i < list->count; i++) {
+		if (!filerail_chunk_set_contains(seen, list->chunks[i].hash)) {
+			nbytes += list->chunks[i].length;
+			filerail_chunk_set_insert(seen, list->chunks[i].hash);
+		}
+	}
+	return nbytes;
+}
+
+// archive <work_dir>/data like a session does (entries compressed at level) and chunk the archive, as sender does
+static int bench_dedup_archive(filerail_session *s, const char *work_dir, int level, const char *zip_path,
+	filerail_chunk_list *list, double *elapsed)
+{
+	double start;
+	uint8_t hash[MD5_HASH_LENGTH];
+	char path[MAX_PATH_LENGTH];
+	struct stat st;
+
+	start = bench_now();
+	snprintf(path, sizeof(path), "%s/data", work_dir);
+	if (stat(path, &st) == -1) {
+		perror("filerail_bench bench_dedup_archive stat");
+		return -1;
+	}
+	s->archive_level = level;
+	list->count = 0;
+	if (
+		filerail_prepare_archive(s, work_dir, "data", &st, NULL, zip_path, hash) == -1 ||
+		filerail_chunk_file(zip_path, list) == -1
+	) {
+		return -1;
+	}
+	*elapsed += bench_now() - start;
+	return 0;
+}
+
+// fixed size chunks of a file, for comparison
+static int bench_dedup_fixed(const char *zip_path, filerail_chunk_set *seen, size_t *nbytes) {
+	size_t n;
+	uint8_t *block, hash[MD5_HASH_LENGTH];
+	FILE *fp;
+
+	*nbytes = 0;
+	if ((block = malloc(CDC_AVG_CHUNK_SIZE)) == NULL || (fp = fopen(zip_path, "rb")) == NULL) {
+		perror("filerail_bench bench_dedup_fixed");
+		free(block);
+		return -1;
+	}
+	while ((n = fread(block, 1, CDC_AVG_CHUNK_SIZE, fp)) > 0) {
+		MD5(block, n, hash);
+		if (!filerail_chunk_set_contains(seen, hash)) {
+			*nbytes += n;
+			filerail_chunk_set_insert(seen, hash);
+		}
+	}
+	fclose(fp);
+	free(block);
+	return 0;
+}
+
+/*
+	Bytes a dedup put sends for successive versions of a large, slightly edited file, going through the real path:
+	filerail_prepare_archive builds the archive as DEDUP_PUT does (entries stored) and it's chunked like sender
+	chunks it. Compared with chunks of a deflated archive (what every other operation sends) and fixed size chunks.
+*/
+static int bench_dedup(const char *dir, size_t size, int nversions) {
+	int v, fd, exit_status;
+	size_t len, total, sent_stored, sent_deflated, sent_fixed, new_stored, new_deflated, new_fixed;
+	double stored_time, deflated_time;
+	uint8_t *buf;
+	char work_dir[MAX_PATH_LENGTH - BENCH_NAME_LENGTH], path[MAX_PATH_LENGTH], zip_path[MAX_PATH_LENGTH];
+	filerail_session s;
+	filerail_chunk_list list;
+	filerail_chunk_set seen_stored, seen_deflated, seen_fixed;
+
+	exit_status = 0;
+	// paths under it fit in MAX_PATH_LENGTH
+	if (bench_work_dir(work_dir, dir, "dedup") == -1) {
+		return -1;
+	}
+	filerail_chunk_list_init(&list);
+	filerail_chunk_set_init(&seen_stored);
+	filerail_chunk_set_init(&seen_deflated);
+	filerail_chunk_set_init(&seen_fixed);
+	filerail_gear_init();
+	snprintf(zip_path, sizeof(zip_path), "%s/data.zip", work_dir);
+	filerail_session_init(&s, -1, NULL, work_dir);
+
+	len = size;
+	if ((buf = malloc(len)) == NULL) {
+		perror("filerail_bench bench_dedup malloc");
+		return -1;
+	}
+	// compressible, like most large files worth deduplicating
+	bench_fill_text((char*)buf, len);
+	snprintf(path, sizeof(path), "%s/data", work_dir);
+	if (filerail_mkdir(work_dir) == -1 || filerail_mkdir(path) == -1) {
+		exit_status = -1;
+		goto clean_up;
+	}
+	snprintf(path, sizeof(path), "%s/data/image.bin", work_dir);
+
+	total = sent_stored = sent_deflated = sent_fixed = 0;
+	stored_time = deflated_time = 0;
+	printf("%-8s %12s %16s %16s %16s\n", "version", "size", "sent (dedup put)", "sent (deflated)", "sent (fixed)");
+	for (v = 0; v < nversions; v++) {
+		if (v != 0 && (buf = bench_mutate(buf, &len)) == NULL) {
+			perror("filerail_bench bench_dedup realloc");
+			exit_status = -1;
+			goto clean_up;
+		}
+		if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1 || write(fd, buf, len) != (ssize_t)len) {
+			perror("filerail_bench bench_dedup open/write");
+			if (fd != -1) {
+				close(fd);
+			}
+			exit_status = -1;
+			goto clean_up;
+		}
+		close(fd);
+
+		if (
+			bench_dedup_archive(&s, work_dir, ARCHIVE_COMPRESSION_LEVEL, zip_path, &list, &deflated_time) == -1
+		) {
+			exit_status = -1;
+			goto clean_up;
+		}
+		new_deflated = bench_dedup_new(&list, &seen_deflated);
+		if (
+			bench_dedup_archive(&s, work_dir, DEDUP_COMPRESSION_LEVEL, zip_path, &list, &stored_time) == -1 ||
+			bench_dedup_fixed(zip_path, &seen_fixed, &new_fixed) == -1
+		) {
+			exit_status = -1;
+			goto clean_up;
+		}
+		new_stored = bench_dedup_new(&list, &seen_stored);
+
+		total += len;
+		sent_stored += new_stored;
+		sent_deflated += new_deflated;
+		sent_fixed += new_fixed;
+		printf("%-8d %12zu %16zu %16zu %16zu\n", v, len, new_stored, new_deflated, new_fixed);
+	}
+
+	printf("\nlogical bytes           : %zu\n", total);
+	printf("sent bytes (dedup put)  : %zu (dedup ratio %.2fx)\n", sent_stored, total / (1.0 * sent_stored));
+	printf("sent bytes (deflated)   : %zu (dedup ratio %.2fx)\n", sent_deflated, total / (1.0 * sent_deflated));
+	printf("sent bytes (fixed)      : %zu (dedup ratio %.2fx)\n", sent_fixed, total / (1.0 * sent_fixed));
+	printf("average chunk size      : %.0f bytes\n", len / (1.0 * max(list.count, 1)));
+	printf("archive + chunk (dedup) : %.1f MB/s\n", total / stored_time / (1 << 20));
+	printf("archive + chunk (defl.) : %.1f MB/s\n", total / deflated_time / (1 << 20));
+
+	clean_up:
+	free(buf);
+	filerail_rm(work_dir);
+	filerail_chunk_list_free(&list);
+	filerail_chunk_set_free(&seen_stored);
+	filerail_chunk_set_free(&seen_deflated);
+	filerail_chunk_set_free(&seen_fixed);
+	return exit_status;
+}
+
+// zip src under work_dir into zip_path and extract it into dst, reporting files/sec of both
+static int bench_pack_round(const char *work_dir, const char *zip_path, const char *dst, int nfiles, bool pack) {
+	double start, zip_time, extract_time;
+	struct zip_t *zip;
+	struct stat s;
+	bool ok;
+
+	start = bench_now();
+	if ((zip = zip_open(zip_path, ARCHIVE_COMPRESSION_LEVEL, 'w')) == NULL) {
+		perror("filerail_bench bench_pack_round zip_open");
+		return -1;
+	}
+	ok = filerail_zip_folder(zip, work_dir, "src", pack);
+	zip_close(zip);
+	zip_time = bench_now() - start;
+	if (!ok) {
+		return -1;
+	}
+
+	if (filerail_mkdir(dst) == -1) {
+		return -1;
+	}
+	start = bench_now();
+	if (!zip_extract_resource(zip_path, dst)) {
+		perror("filerail_bench bench_pack_round zip_extract_resource");
+		return -1;
+	}
+	extract_time = bench_now() - start;
+
+	stat(zip_path, &s);
+	printf("%-10s %14.0f %14.0f %14jd\n", pack ? "packed" : "per-file", nfiles / zip_time, nfiles / extract_time,
+		(intmax_t)s.st_size);
+	return filerail_rm(dst) == -1 || filerail_rm(zip_path) == -1 ? -1 : 0;
+}
+
+// files/sec of zip + extract for a tree of many small files, with and without packing
+static int bench_pack(const char *dir, int nfiles, size_t file_size) {
+	int i, fd, exit_status;
+	char work_dir[MAX_PATH_LENGTH - BENCH_NAME_LENGTH], path[MAX_PATH_LENGTH], zip_path[MAX_PATH_LENGTH];
+	char dst[MAX_PATH_LENGTH];
+	char *content;
+	double start;
+
+	exit_status = 0;
+	if (bench_work_dir(work_dir, dir, "pack") == -1) {
+		return -1;
+	}
+	snprintf(zip_path, sizeof(zip_path), "%s/src.zip", work_dir);
+	snprintf(dst, sizeof(dst), "%s/dst", work_dir);
+	if ((content = malloc(file_size)) == NULL) {
+		perror("filerail_bench bench_pack malloc");
+		return -1;
+	}
+
+	// PACK_BENCH_FILES_PER_DIR files per directory, like a source tree or a sharded dataset
+	printf("creating %d files of %zu bytes in %s...\n", nfiles, file_size, work_dir);
+	start = bench_now();
+	snprintf(path, sizeof(path), "%s/src", work_dir);
+	if (filerail_mkdir(work_dir) == -1 || filerail_mkdir(path) == -1) {
+		exit_status = -1;
+		goto clean_up;
+	}
+	for (i = 0; i < nfiles; i++) {
+		if (i % PACK_BENCH_FILES_PER_DIR == 0) {
+			snprintf(path, sizeof(path), "%s/src/%06d", work_dir, i / PACK_BENCH_FILES_PER_DIR);
+			if (filerail_mkdir(path) == -1) {
+				exit_status = -1;
+				goto clean_up;
+			}
+		}
+		snprintf(path, sizeof(path), "%s/src/%06d/%06d.txt", work_dir, i / PACK_BENCH_FILES_PER_DIR, i);
+		bench_fill_text(content, file_size);
+		if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1 || write(fd, content, file_size) == -1) {
+			perror("filerail_bench bench_pack open/write");
+			exit_status = -1;
+			goto clean_up;
+		}
+		close(fd);
+	}
+	printf("created in %.1f seconds\n\n", bench_now() - start);
+
+	printf("%-10s %14s %14s %14s\n", "mode", "zip files/s", "unzip files/s", "archive bytes");
+	if (
+		bench_pack_round(work_dir, zip_path, dst, nfiles, false) == -1 ||
+		bench_pack_round(work_dir, zip_path, dst, nfiles, true) == -1
+	) {
+		exit_status = -1;
+	}
+
+	clean_up:
+	free(content);
+	filerail_rm(work_dir);
+	return exit_status;
+}
+
+// old style walk: recursion, full path lstat on every entry
+static int bench_walk_recursive(const char *path, size_t *count) {
+	DIR *dir;
+	struct dirent *de;
+	struct stat s;
+	char entry_path[MAX_PATH_LENGTH];
+
+	if ((dir = opendir(path)) == NULL) {
+		return -1;
+	}
+	while ((de = readdir(dir)) != NULL) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) {
+			continue;
+		}
+		snprintf(entry_path, sizeof(entry_path), "%s/%s", path, de->d_name);
+		if (lstat(entry_path, &s) == -1) {
+			closedir(dir);
+			return -1;
+		}
+		__sync_fetch_and_add(count, 1);
+		if (S_ISDIR(s.st_mode) && bench_walk_recursive(entry_path, count) == -1) {
+			closedir(dir);
+			return -1;
+		}
+	}
+	closedir(dir);
+	return 0;
+}
+
+static int bench_walk_count(filerail_walk_entry *entry, void *arg) {
+	__sync_fetch_and_add((size_t*)arg, 1);
+	return 0;
+}
+
+// time one walk, print entries/sec
+static int bench_walk_round(const char *label, const char *root, int flags, int nthreads) {
+	size_t count;
+	double start, elapsed;
+	int ret;
+
+	count = 0;
+	start = bench_now();
+	if (nthreads == 0) {
+		ret = bench_walk_recursive(root, &count);
+	} else {
+		ret = filerail_walk(root, flags, nthreads, bench_walk_count, NULL, &count);
+	}
+	elapsed = bench_now() - start;
+	if (ret == -1) {
+		perror("filerail_bench bench_walk_round");
+		return -1;
+	}
+	printf("%-28s %12zu %14.0f\n", label, count, count / elapsed);
+	return 0;
+}
+
+// entries/sec of walking and removing a tree of nentries (cold caches are not forced, run it twice to compare)
+static int bench_walk(const char *dir, int nentries) {
+	int i, fd, exit_status;
+	char root[MAX_PATH_LENGTH - BENCH_NAME_LENGTH], path[MAX_PATH_LENGTH], label[64];
+	double start;
+
+	exit_status = 0;
+	if (bench_work_dir(root, dir, "walk") == -1) {
+		return -1;
+	}
+	printf("creating %d entries in %s...\n", nentries, root);
+	start = bench_now();
+	if (filerail_mkdir(root) == -1) {
+		return -1;
+	}
+	// two levels: <root>/<a>/<b>/<file>, PACK_BENCH_FILES_PER_DIR entries per directory
+	for (i = 0; i < nentries; i++) {
+		if (i % (PACK_BENCH_FILES_PER_DIR * PACK_BENCH_FILES_PER_DIR) == 0) {
+			snprintf(path, sizeof(path), "%s/%03d", root, i / (PACK_BENCH_FILES_PER_DIR * PACK_BENCH_FILES_PER_DIR));
+			filerail_mkdir(path);
+		}
+		if (i % PACK_BENCH_FILES_PER_DIR == 0) {
+			snprintf(path, sizeof(path), "%s/%03d/%03d", root, i / (PACK_BENCH_FILES_PER_DIR * PACK_BENCH_FILES_PER_DIR),
+				(i / PACK_BENCH_FILES_PER_DIR) % PACK_BENCH_FILES_PER_DIR);
+			if (filerail_mkdir(path) == -1) {
+				exit_status = -1;
+				goto clean_up;
+			}
+		}
+		snprintf(path, sizeof(path), "%s/%03d/%03d/%06d", root, i / (PACK_BENCH_FILES_PER_DIR * PACK_BENCH_FILES_PER_DIR),
+			(i / PACK_BENCH_FILES_PER_DIR) % PACK_BENCH_FILES_PER_DIR, i);
+		if ((fd = open(path, O_WRONLY | O_CREAT, 0644)) == -1) {
+			perror("filerail_bench bench_walk open");
+			exit_status = -1;
+			goto clean_up;
+		}
+		close(fd);
+	}
+	printf("created in %.1f seconds\n\n", bench_now() - start);
+
+	printf("%-28s %12s %14s\n", "walk", "entries", "entries/s");
+	snprintf(label, sizeof(label), "walker, %d threads", WALK_THREADS);
+	if (
+		bench_walk_round("recursive readdir + lstat", root, 0, 0) == -1 ||
+		bench_walk_round("walker, 1 thread", root, 0, 1) == -1 ||
+		bench_walk_round(label, root, 0, WALK_THREADS) == -1 ||
+		bench_walk_round("walker + fstatat, 1 thread", root, WALK_STAT, 1) == -1
+	) {
+		exit_status = -1;
+		goto clean_up;
+	}
+	snprintf(label, sizeof(label), "walker + fstatat, %d threads", WALK_THREADS);
+	if (bench_walk_round(label, root, WALK_STAT, WALK_THREADS) == -1) {
+		exit_status = -1;
+		goto clean_up;
+	}
+
+	start = bench_now();
+	if (filerail_rm(root) == -1) {
+		exit_status = -1;
+		goto clean_up;
+	}
+	printf("%-28s %12d %14.0f\n", "rm (walker)", nentries, nentries / (bench_now() - start));
+	return 0;
+
+	clean_up:
+	filerail_rm(root);
+	return exit_status;
+}
+
+// state shared by ping benchmark threads
+typedef struct _bench_ping_state {
+	char *ip;
+	char *port;
+	int nconns;
+	int next; // next connection to make
+	int failed;
+	double *latency; // accept to PONG of every connection, in seconds
+} bench_ping_state;
+
+static int bench_double_cmp(const void *a, const void *b) {
+	double x, y;
+
+	x = *(const double*)a;
+	y = *(const double*)b;
+	return x < y ? -1 : x > y;
+}
+
+// one PING session (connect, PING, PONG, close) after another
+static void *bench_ping_thread(void *arg) {
+	int i, fd;
+	double start;
+	bench_ping_state *state;
+	filerail_response_header response;
+
+	state = arg;
+	while ((i = __sync_fetch_and_add(&state->next, 1)) < state->nconns) {
+		start = bench_now();
+		if ((fd = filerail_connect_to_tcp_server(state->ip, state->port)) == -1) {
+			__sync_fetch_and_add(&state->failed, 1);
+			state->latency[i] = -1;
+			continue;
+		}
+		if (
+			filerail_send_command_header(fd, PING) == -1 ||
+			filerail_recv_response_header(fd, &response) == -1 ||
+			response.response_type != PONG
+		) {
+			__sync_fetch_and_add(&state->failed, 1);
+			state->latency[i] = -1;
+		} else {
+			state->latency[i] = bench_now() - start;
+		}
+		close(fd);
+	}
+	return NULL;
+}
+
+// connections/sec and connect to PONG latency of a running server, with concurrency clients
+static int bench_ping(char *ip, char *port, int nconns, int concurrency) {
+	int i, ok;
+	double start, elapsed;
+	pthread_t *threads;
+	bench_ping_state state;
+
+	memset(&state, 0, sizeof(state));
+	state.ip = ip;
+	state.port = port;
+	state.nconns = nconns;
+	if (
+		(state.latency = malloc(nconns * sizeof(double))) == NULL ||
+		(threads = malloc(concurrency * sizeof(pthread_t))) == NULL
+	) {
+		free(state.latency);
+		perror("filerail_bench bench_ping malloc");
+		return -1;
+	}
+
+	printf("%d PING sessions against %s:%s, %d at a time...\n", nconns, ip, port, concurrency);
+	start = bench_now();
+	for (i = 0; i < concurrency; i++) {
+		pthread_create(&threads[i], NULL, bench_ping_thread, &state);
+	}
+	for (i = 0; i < concurrency; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	elapsed = bench_now() - start;
+
+	// failed sessions sort first
+	qsort(state.latency, nconns, sizeof(double), bench_double_cmp);
+	ok = nconns - state.failed;
+	printf("%-16s %12.0f\n", "sessions/s", ok / elapsed);
+	printf("%-16s %12d\n", "failed", state.failed);
+	if (ok != 0) {
+		printf("%-16s %12.3f\n", "p50 (ms)", 1e3 * state.latency[state.failed + ok / 2]);
+		printf("%-16s %12.3f\n", "p99 (ms)", 1e3 * state.latency[state.failed + (int)(ok * 0.99)]);
+		printf("%-16s %12.3f\n", "max (ms)", 1e3 * state.latency[nconns - 1]);
+	}
+	free(state.latency);
+	free(threads);
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	// arguemet parsing variables
+	int opt;
+	extern char *optarg;
+	extern int optopt;
+	char *benchmark, *dir, *ip, *port;
+	size_t size;
+	int count, concurrency;
+
+	benchmark = NULL;
+	dir = "/tmp";
+	ip = "127.0.0.1";
+	port = NULL;
+	size = 0;
+	count = 0;
+	concurrency = PING_BENCH_CONCURRENCY;
+	while ((opt = getopt(argc, argv, "ub:s:n:d:i:p:c:")) != -1) {
+		switch(opt) {
+			case 'u' : {
+				printf(
+					"usage: [-b benchmark {dedup, pack, walk, ping}] [-s size in MB (dedup), in bytes (pack)]"
+					" [-n count] [-d work directory (dedup, pack, walk)] [-i server ip] [-p server port] [-c concurrency (ping)]\n");
+				return 0;
+			}
+			case 'd': {
+				dir = optarg;
+				break;
+			}
+			case 'b': {
+				benchmark = optarg;
+				break;
+			}
+			case 's': {
+				size = (size_t)atoi(optarg);
+				break;
+			}
+			case 'n': {
+				count = atoi(optarg);
+				break;
+			}
+			case 'i': {
+				ip = optarg;
+				break;
+			}
+			case 'p': {
+				port = optarg;
+				break;
+			}
+			case 'c': {
+				concurrency = atoi(optarg);
+				break;
+			}
+			case '?' : {
+				printf("-%c option is unknown or requires value\n", optopt);
+				return -1;
+			}
+		}
+	}
+
+	if (benchmark == NULL) {
+		printf("-b is a required option\n");
+		return -1;
+	}
+
+	// -s and -n mean different things to each benchmark
+	if (strcmp(benchmark, "dedup") == 0) {
+		return bench_dedup(dir, size != 0 ? size << 20 : DEDUP_BENCH_SIZE, count != 0 ? count : DEDUP_BENCH_VERSIONS);
+	}
+	if (strcmp(benchmark, "walk") == 0) {
+		return bench_walk(dir, count != 0 ? count : WALK_BENCH_ENTRIES);
+	}
+	if (strcmp(benchmark, "ping") == 0) {
+		if (port == NULL) {
+			printf("-p is a required option for ping\n");
+			return -1;
+		}
+		return bench_ping(ip, port, count != 0 ? count : PING_BENCH_CONNECTIONS, concurrency);
+	}
+	if (strcmp(benchmark, "pack") == 0) {
+		return bench_pack(dir, count != 0 ? count : PACK_BENCH_FILES, size != 0 ? size : PACK_BENCH_FILE_SIZE);
+	}
+	printf("Invalid benchmark\n");
+	return -1;
+}
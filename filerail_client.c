@@ -1,22 +1,431 @@
+// for SEEK_DATA/SEEK_HOLE and fallocate
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <stdlib.h>
 #include <stdbool.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
 
+// this program holds the definitions of the library (see global.h)
+#define FILERAIL_IMPLEMENTATION
 #include "filerail/global.h"
 #include "filerail/constants.h"
 #include "filerail/socket.h"
 #include "filerail/utils.h"
 #include "filerail/crypto.h"
 #include "filerail/operations.h"
+#include "filerail/client.h"
+
+// one line of a job file
+typedef struct _filerail_client_job {
+	unsigned int line;
+	char *operation;
+	char *res_path;
+	char *des_path;
+	filerail_transfer transfer; // multiplexed batch only
+	unsigned int queued; // last position in server's queue, multiplexed batch only
+} filerail_client_job;
+
+enum PREFETCH_STATE {
+	PREFETCH_NONE,
+	PREFETCH_RUNNING
+};
+
+// next PUT of a batch, zipped and hashed on a thread of it's own while the job before it transfers
+typedef struct _filerail_client_prefetch {
+	int state;
+	unsigned int job; // index of job being prepared
+	pthread_t thread;
+	filerail_session session; // of thread: no connection, prints nothing
+	char resource_name[MAX_RESOURCE_LENGTH];
+	char resource_dir[MAX_PATH_LENGTH];
+	struct stat stat_path;
+	const char *des_path;
+	filerail_put_archive archive;
+	int status;
+} filerail_client_prefetch;
+
+static int filerail_client_check(const char *operation, const char *res_path, const char *des_path);
+static int filerail_client_read_jobs(const char *job_path, filerail_client_job **jobs, unsigned int *njobs);
+static void filerail_client_free_jobs(filerail_client_job *jobs, unsigned int njobs);
+static int filerail_client_open_session(filerail_session *s, char *ip, char *port);
+static int filerail_client_batch(filerail_session *s, char *ip, char *port, filerail_retry *r,
+	filerail_client_job *jobs, unsigned int njobs, bool dedup);
+static int filerail_client_mux_batch(filerail_client_options *o, filerail_client_job *jobs, unsigned int njobs,
+	bool dedup, int policy, int priority);
+
+// OPERATION of command line operation, -1 (after telling user why) if it can't run
+static int filerail_client_check(const char *operation, const char *res_path, const char *des_path) {
+	int op;
+
+	if ((op = filerail_client_operation(operation)) == -1) {
+		printf("Invalid command\n");
+		return -1;
+	}
+	// res path and des path is necessary
+	if (op != OPERATION_PING && op != OPERATION_PROBE && (res_path == NULL || des_path == NULL)) {
+		printf("-r and -d are required options for \"%s\"\n", operation);
+		return -1;
+	}
+	return op;
+}
+
+/*
+	Job file has one job per line: "<operation> <resource path> <destination path>" (operation is put, get, sync,
+	mirror, or ping and probe without paths). Empty lines and lines starting with # are skipped.
+*/
+static int filerail_client_read_jobs(const char *job_path, filerail_client_job **jobs, unsigned int *njobs) {
+	int exit_status;
+	unsigned int nline, capacity;
+	char line[2 * MAX_PATH_LENGTH + 32], *operation, *res_path, *des_path, *save;
+	FILE *fp;
+	filerail_client_job *job, *tmp;
+
+	exit_status = 0;
+	*jobs = NULL;
+	*njobs = nline = capacity = 0;
+	if ((fp = fopen(job_path, "r")) == NULL) {
+		printf("Couldn't open job file %s\n", job_path);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		nline++;
+		if ((operation = strtok_r(line, " \t\r\n", &save)) == NULL || operation[0] == '#') {
+			continue;
+		}
+		res_path = strtok_r(NULL, " \t\r\n", &save);
+		des_path = strtok_r(NULL, " \t\r\n", &save);
+		if (*njobs == capacity) {
+			capacity = capacity == 0 ? 64 : 2 * capacity;
+			if ((tmp = realloc(*jobs, capacity * sizeof(filerail_client_job))) == NULL) {
+				LOG(LOG_USER | LOG_ERR, "filerail_client filerail_client_read_jobs realloc\n");
+				exit_status = -1;
+				goto clean_up;
+			}
+			*jobs = tmp;
+		}
+		job = &(*jobs)[(*njobs)++];
+		job->line = nline;
+		job->operation = strdup(operation);
+		job->res_path = res_path == NULL ? NULL : strdup(res_path);
+		job->des_path = des_path == NULL ? NULL : strdup(des_path);
+	}
+
+	clean_up:
+	fclose(fp);
+	return exit_status;
+}
+
+static void filerail_client_free_jobs(filerail_client_job *jobs, unsigned int njobs) {
+	unsigned int i;
+
+	for (i = 0; i < njobs; i++) {
+		free(jobs[i].operation);
+		free(jobs[i].res_path);
+		free(jobs[i].des_path);
+	}
+	free(jobs);
+}
+
+static void filerail_client_print_job(filerail_client_job *job, const char *status) {
+	printf(
+		"[%u] %s %s %s%s\n", job->line, job->operation, job->res_path == NULL ? "" : job->res_path,
+		job->des_path == NULL ? "" : job->des_path, status
+	);
+}
+
+// connect to server and open a SESSION on it, s->fd is -1 if it failed
+static int filerail_client_open_session(filerail_session *s, char *ip, char *port) {
+	filerail_response_header response;
+
+	if ((s->fd = filerail_connect_to_tcp_server(ip, port)) == -1) {
+		return -1;
+	}
+	if (
+		filerail_send_command_header(s->fd, SESSION) == -1 ||
+		filerail_recv_response_header(s->fd, &response) == -1
+	) {
+		goto clean_up;
+	}
+	if (response.response_type != OK) {
+		printf("PROTOCOL NOT FOLLOWED\n");
+		goto clean_up;
+	}
+	return 0;
+
+	clean_up:
+	filerail_close(s->fd);
+	s->fd = -1;
+	return -1;
+}
+
+static void* filerail_client_prefetch_run(void *arg) {
+	filerail_client_prefetch *p;
+
+	p = arg;
+	p->status = filerail_prepare_put(&p->session, p->resource_dir, p->resource_name, &p->stat_path, p->des_path,
+		&p->archive);
+	return NULL;
+}
+
+/*
+	Start preparing job i, if it is a PUT (without dedup) of a resource which passes the checks of
+	filerail_client_put, and nothing else is being prepared. Any other job runs as it is.
+*/
+static void filerail_client_prefetch_start(filerail_client_prefetch *p, filerail_session *s, filerail_client_job *jobs,
+	unsigned int i, bool dedup)
+{
+	filerail_client_job *job;
+
+	job = &jobs[i];
+	if (
+		p->state != PREFETCH_NONE || dedup ||
+		filerail_client_operation(job->operation) != OPERATION_PUT || job->res_path == NULL || job->des_path == NULL ||
+		!filerail_is_exists(job->res_path, &p->stat_path) || !filerail_is_readable(job->res_path) ||
+		!(filerail_is_file(&p->stat_path) || filerail_is_dir(&p->stat_path)) ||
+		!filerail_parse_resource_path(job->res_path, p->resource_name, p->resource_dir)
+	) {
+		return;
+	}
+	filerail_session_init(&p->session, -1, s->K, s->ckpt_path);
+	p->session.verbose = false;
+	p->session.pack_small_files = s->pack_small_files;
+	p->session.archive_level = s->archive_level;
+	p->des_path = job->des_path;
+	p->job = i;
+	if (pthread_create(&p->thread, NULL, filerail_client_prefetch_run, p) != 0) {
+		LOG(LOG_USER | LOG_ERR, "filerail_client filerail_client_prefetch_start pthread_create\n");
+		return;
+	}
+	p->state = PREFETCH_RUNNING;
+}
+
+/*
+	Wait for job being prepared, true if it's archive is ready (moved to archive, caller removes it). Server gets
+	heartbeats on session meanwhile, zipping may take longer than it waits for next command.
+*/
+static bool filerail_client_prefetch_wait(filerail_client_prefetch *p, filerail_session *s,
+	filerail_put_archive *archive)
+{
+	if (p->state != PREFETCH_RUNNING) {
+		return false;
+	}
+	filerail_session_busy(s, true);
+	pthread_join(p->thread, NULL);
+	filerail_session_busy(s, false);
+	p->state = PREFETCH_NONE;
+	if (p->status == -1) {
+		// job runs as it is, and tells why it fails
+		filerail_put_archive_clean(&p->archive);
+		return false;
+	}
+	*archive = p->archive;
+	return true;
+}
+
+/*
+	Batch: all jobs of a job file run one after another over a single connection, opened with SESSION and
+	closed with BYE, so a batch pays for one handshake, one server process and one key load instead of one per job.
+	While a job transfers, next PUT is zipped and hashed (see filerail_client_prefetch), so it's request follows
+	right away. Questions are answered by policy from the start (nobody answers them while jobs overlap): an
+	existing resource is overwritten only with -y, a checkpoint is always resumed (it is of the same archive).
+
+	A job refused by server (not found, no access, ...) doesn't stop the batch. If connection of a job fails, a new
+	session is opened (see filerail_client_backoff) and the job runs again, resuming from it's checkpoint. Batch
+	stops once reconnects of a job are used up, or on any other failure (it would fail the same way again).
+*/
+static int filerail_client_batch(filerail_session *s, char *ip, char *port, filerail_retry *r,
+	filerail_client_job *jobs, unsigned int njobs, bool dedup)
+{
+	int op, ret, exit_status;
+	unsigned int i, attempt;
+	bool prepared;
+	uint8_t outcome;
+	filerail_response_header response;
+	filerail_put_archive archive;
+	filerail_client_prefetch prefetch;
+
+	exit_status = -1;
+	prepared = false;
+	prefetch.state = PREFETCH_NONE;
+	if (s->on_duplicate == POLICY_ASK) {
+		s->on_duplicate = POLICY_NO;
+	}
+	if (s->on_resume == POLICY_ASK) {
+		s->on_resume = POLICY_YES;
+	}
+
+	attempt = 0;
+	for (i = 0; i < njobs; ) {
+		filerail_connection_clear();
+		if (s->fd == -1 && filerail_client_open_session(s, ip, port) == -1) {
+			goto failed;
+		}
+		if (attempt == 0) {
+			filerail_client_print_job(&jobs[i], "");
+		}
+		if (prefetch.state == PREFETCH_RUNNING && prefetch.job == i) {
+			prepared = filerail_client_prefetch_wait(&prefetch, s, &archive);
+		}
+		if (i + 1 < njobs) {
+			filerail_client_prefetch_start(&prefetch, s, jobs, i + 1, dedup);
+		}
+		if ((op = filerail_client_check(jobs[i].operation, jobs[i].res_path, jobs[i].des_path)) != -1) {
+			if (prepared) {
+				ret = filerail_client_put_archive(s, &archive, &outcome);
+			} else {
+				ret = filerail_client_run(s, op, jobs[i].res_path, jobs[i].des_path, dedup, &outcome);
+			}
+			if (ret == -1) {
+				// client and server may be out of step on the connection, prepared archive is sent again on a new one
+				filerail_close(s->fd);
+				s->fd = -1;
+				goto failed;
+			}
+		}
+		if (prepared) {
+			filerail_put_archive_clean(&archive);
+			prepared = false;
+		}
+		i++;
+		attempt = 0;
+		s->retried = false;
+		continue;
+
+		failed:
+		if (!filerail_connection_failed() || !filerail_client_backoff(s, r, attempt++)) {
+			printf("Job on line %u failed, stopping batch\n", jobs[i].line);
+			goto clean_up;
+		}
+	}
+
+	// close the session
+	if (s->fd == -1 && filerail_client_open_session(s, ip, port) == -1) {
+		goto clean_up;
+	}
+	if (
+		filerail_send_command_header(s->fd, BYE) == -1 ||
+		filerail_recv_response_header(s->fd, &response) == -1
+	) {
+		goto clean_up;
+	}
+	if (response.response_type != FINISH) {
+		printf("PROTOCOL NOT FOLLOWED\n");
+	}
+	printf("Finished %u jobs\n", njobs);
+	exit_status = 0;
+
+	clean_up:
+	if (prefetch.state == PREFETCH_RUNNING) {
+		pthread_join(prefetch.thread, NULL);
+		filerail_put_archive_clean(&prefetch.archive);
+	}
+	if (prepared) {
+		filerail_put_archive_clean(&archive);
+	}
+	return exit_status;
+}
+
+// position in server's queue (see admission.h), printed when it changes from last
+static void filerail_client_queued(void *arg, unsigned int position) {
+	unsigned int *last;
+
+	last = arg;
+	if (position != *last) {
+		printf("Queued by server, position %u\n", position);
+		*last = position;
+	}
+}
+
+// as filerail_client_queued, for a job of a multiplexed batch (on a worker thread of it's own)
+static void filerail_client_job_queued(void *arg, unsigned int position) {
+	char status[64];
+	filerail_client_job *job;
+
+	job = arg;
+	if (position != job->queued) {
+		snprintf(status, sizeof(status), " queued by server, position %u", position);
+		filerail_client_print_job(job, status);
+		job->queued = position;
+	}
+}
+
+static void filerail_client_job_done(filerail_transfer *t, void *arg) {
+	filerail_client_job *job;
+
+	job = arg;
+	if (t->status == -1) {
+		filerail_client_print_job(job, " FAILED");
+	} else if (t->outcome != OK) {
+		filerail_client_print_job(job, " refused");
+	} else {
+		filerail_client_print_job(job, " done");
+	}
+}
+
+/*
+	Multiplexed batch: jobs run concurrently, o->nworkers at a time, each on a stream of it's own over a single
+	connection (see mux.h), through the asynchronous client of client.h. A small job doesn't wait for a large one
+	started before it, and a failed job fails only it's own stream, so the batch goes on. Nobody can answer
+	prompts of concurrent jobs, policy answers them.
+*/
+static int filerail_client_mux_batch(filerail_client_options *o, filerail_client_job *jobs, unsigned int njobs,
+	bool dedup, int policy, int priority)
+{
+	int op, nfailed;
+	unsigned int i;
+	filerail_client client;
+	filerail_transfer *t;
+
+	if (filerail_client_init(&client, o) == -1) {
+		return -1;
+	}
+	for (i = 0; i < njobs; i++) {
+		if ((op = filerail_client_check(jobs[i].operation, jobs[i].res_path, jobs[i].des_path)) == -1) {
+			filerail_client_print_job(&jobs[i], " skipped");
+			continue;
+		}
+		t = &jobs[i].transfer;
+		memset(t, 0, sizeof(*t));
+		t->operation = op;
+		t->res_path = jobs[i].res_path;
+		t->des_path = jobs[i].des_path;
+		t->dedup = dedup;
+		t->on_duplicate = t->on_resume = policy;
+		t->priority = priority;
+		t->queued = filerail_client_job_queued;
+		t->done = filerail_client_job_done;
+		t->arg = &jobs[i];
+		jobs[i].queued = 0;
+		filerail_client_submit(&client, t);
+	}
+	nfailed = filerail_client_wait(&client);
+	filerail_client_destroy(&client);
+	if (nfailed != 0) {
+		printf("%d of %u jobs failed\n", nfailed, njobs);
+		return -1;
+	}
+	printf("Finished %u jobs\n", njobs);
+	return 0;
+}
 
 int main(int argc, char *argv[]) {
 	// arguemet parsing variables
 	int opt;
 	extern char *optarg;
 	extern int optopt;
-	char *ip, *port, *operation, *res_path, *des_path, *key_path, *ckpt_path;
-	bool should_resolve;
+	char *ip, *port, *operation, *res_path, *des_path, *key_path, *ckpt_path, *job_path;
+	bool should_resolve, dedup;
+	int op, policy, priority;
+	unsigned int nstreams, njobs, queued;
+	uint8_t outcome;
+	filerail_client_job *jobs;
+	filerail_client_options options;
+	filerail_retry retry;
 
 	// enable verbose mode
 	extern int verbose;
@@ -24,26 +433,37 @@ int main(int argc, char *argv[]) {
 	// socket file des, and exit status
 	int fd, exit_status;
 
-	// get/put related variables
-	char option, resource_name[MAX_RESOURCE_LENGTH], resource_dir[MAX_PATH_LENGTH], resource_path[MAX_PATH_LENGTH];
 	struct stat stat_path;
 	filerail_AES_keys K;
-	filerail_response_header response;
-	filerail_resource_header resource;
+	filerail_session session;
 
 	should_resolve = false;
+	dedup = false;
+	policy = POLICY_ASK;
+	priority = PRIORITY_NORMAL;
+	op = -1;
 	exit_status = 0;
+	fd = -1;
+	nstreams = 1;
+	jobs = NULL;
+	njobs = 0;
+	queued = 0;
+	filerail_retry_init(&retry);
 
 	// parse command line arguement
-	ip = port = operation = res_path = des_path = key_path = ckpt_path = NULL;
-	while ((opt = getopt(argc, argv, "uvi:p:o:r:d:k:c:n")) != -1) {
+	ip = port = operation = res_path = des_path = key_path = ckpt_path = job_path = NULL;
+	while ((opt = getopt(argc, argv, "uvi:p:o:r:d:k:c:nDb:j:yR:W:t:P:")) != -1) {
 		switch(opt) {
 			case 'u' : {
 				printf(
 					"usage: -v [-i ipv4 address] [-p port]"
 					" [-o operation] [-r resource path]"
 					" [-d destination path] [-k key file]"
-					" [-c checkpoint directory] [-n dns resolution]\n"
+					" [-c checkpoint directory] [-n dns resolution]"
+					" [-D dedup put] [-b job file] [-j concurrent streams for batch]"
+					" [-y overwrite and resume without asking]"
+					" [-R reconnects] [-W first reconnect delay in ms] [-t tcp tuning key=value]"
+					" [-P priority: bulk, normal or interactive]\n"
 				);
 				goto clean_up;
 			}
@@ -83,10 +503,49 @@ int main(int argc, char *argv[]) {
 				should_resolve = true;
 				break;
 			}
+			case 'D' : {
+				dedup = true;
+				break;
+			}
+			case 'b' : {
+				job_path = optarg;
+				break;
+			}
+			case 'j' : {
+				nstreams = strtoul(optarg, NULL, 10);
+				break;
+			}
+			case 'y' : {
+				policy = POLICY_YES;
+				break;
+			}
+			case 'R' : {
+				retry.attempts = strtoul(optarg, NULL, 10);
+				break;
+			}
+			case 'W' : {
+				retry.backoff = strtoul(optarg, NULL, 10);
+				break;
+			}
+			case 't' : {
+				if (filerail_tuning_set(optarg) == -1) {
+					printf("Invalid tuning %s\n", optarg);
+					goto clean_up;
+				}
+				break;
+			}
+			case 'P' : {
+				if ((priority = filerail_priority_parse(optarg)) == -1) {
+					printf("Invalid priority %s\n", optarg);
+					goto clean_up;
+				}
+				break;
+			}
 			case '?' : {
 				if (
 					optopt == 'i' || optopt == 'p' || optopt == 'o' || optopt == 'r' ||
-					optopt == 'd' || optopt == 'k' || optopt == 'c'
+					optopt == 'd' || optopt == 'k' || optopt == 'c' || optopt == 'b' || optopt == 'j' ||
+					optopt == 'R' || optopt == 'W' || optopt == 't' || optopt == 'P'
 					)
 				{
 					printf("-%c option requires value\n", optopt);
@@ -108,6 +567,18 @@ int main(int argc, char *argv[]) {
 		printf("-i, -p, -o, -k and -c are required options\n");
 		goto clean_up;
 	}
+	if (strcmp(operation, "batch") == 0) {
+		if (job_path == NULL) {
+			printf("-b is required option for \"batch\"\n");
+			goto clean_up;
+		}
+		if (filerail_client_read_jobs(job_path, &jobs, &njobs) == -1) {
+			exit_status = -1;
+			goto clean_up;
+		}
+	} else if ((op = filerail_client_check(operation, res_path, des_path)) == -1) {
+		goto clean_up;
+	}
 
 	// check if key file exists
 	if (!filerail_is_exists(key_path, &stat_path)) {
@@ -134,241 +605,43 @@ int main(int argc, char *argv[]) {
 		goto clean_up;
 	}
 
-	// connect to tcp server
-	if ((fd = filerail_connect_to_tcp_server(ip, port)) == -1) {
-		exit_status = -1;
+	// concurrent jobs, on client library
+	if (strcmp(operation, "batch") == 0 && nstreams > 1) {
+		options.ip = ip;
+		options.port = port;
+		options.key_path = key_path;
+		options.ckpt_path = ckpt_path;
+		options.nworkers = nstreams;
+		options.multiplex = true;
+		options.retry = retry;
+		exit_status = filerail_client_mux_batch(&options, jobs, njobs, dedup, policy == POLICY_ASK ? POLICY_NO : policy,
+			priority);
 		goto clean_up;
 	}
 
-	if (strcmp(operation, "ping") == 0) {
-		/*
-			Client: sends PING command
-			Server: sends PONG as response, if nothing went wrong at server end
-		*/
-		if (filerail_send_command_header(fd, PING) == -1) {
-			exit_status = -1;
-			goto clean_up;
-		}
-		if (filerail_recv_response_header(fd, &response) == -1) {
-			exit_status = -1;
-			goto clean_up;
-		}
-		if (response.response_type == PONG) {
-			printf("PONG\n");
-		} else {
-			printf("PROTOCOL NOT FOLLOWED\n");
-		}
-	} else if (strcmp(operation, "put") == 0) {
-		/*
-			Client wants to upload resource on server.
-			Client checks:
-			1. If resource exists on client side, only then it can upload
-			2. If it has read access to that resource
-			3. The resource is file or directory
-			4. If all checks passed, send PUT command.
-
-			If no error occurs while transmitting PUT, server will be ready for listening messages from client.
-			Client sends resource name (name of file/dir), destination directory on server side and size of resource
-			Server performs checks and sends:
-			1. NO_ACCESS: Server doesn't have write permission at destination directory
-			2. DUPLICATE_RESOURCE_NAME: There already exists a resource with same resource name in destination directory
-				 Client can send YES (remove previous resource)/NO(abort the process) option
-			3. NOT_FOUND: Destination directory not found on server side.
-			4. INSUFFICIENT_SPACE: self-explanatory
-
-			If server responds with OK or client responds with OVERWRITE for DUPLICATE_RESOURCE_NAME prompt
-			uploading starts.
-		*/
-
-		// res path and des path is necessary
-		if (res_path == NULL || des_path == NULL) {
-			printf("-r and -d are required options for \"%s\"\n", operation);
-			goto clean_up;
-		}
-		// check if resource exists
-		if (filerail_is_exists(res_path, &stat_path)) {
-			// check if resource is readable
-			if (filerail_is_readable(res_path)) {
-				// check if resource is file or directory
-				if (filerail_is_file(&stat_path) || filerail_is_dir(&stat_path)) {
-					// send the command
-					if (filerail_send_command_header(fd, PUT) == -1) {
-						exit_status = -1;
-						goto clean_up;
-					}
-					// parse resource path
-					if (filerail_parse_resource_path(res_path, resource_name, resource_dir)) {
-						// send resource name, destination dir (on server) and resource size (unzipped)
-						if (filerail_send_resource_header(fd, resource_name, des_path, stat_path.st_size) == -1) {
-							exit_status = -1;
-							goto clean_up;
-						}
-						// server performs checks, and sends response
-						if (filerail_recv_response_header(fd, &response) == -1) {
-							exit_status = -1;
-							goto clean_up;
-						}
-						if (response.response_type == NO_ACCESS) {
-							printf("You don't have write permission for %s on server\n", des_path);
-							goto clean_up;
-						} else if (response.response_type == DUPLICATE_RESOURCE_NAME) {
-							// if the resource with same name exists
-							// check if user wants to overwrite
-							printf("%s already exists at %s, do you wish to re-write[Y/N]: ", resource_name, des_path);
-							scanf("%c", &option);
-							getchar();
-							if (option == 'Y' || option == 'y') {
-								if (filerail_send_response_header(fd, OVERWRITE) == -1) {
-									exit_status = -1;
-									goto clean_up;
-								}
-								// if overwrite is ok, start the sending process
-								put_file:
-								printf("Starting transfer process...\n");
-								if (filerail_sendfile_handler(fd, resource_dir, resource_name, &stat_path, ckpt_path, &K) == -1) {
-									exit_status = -1;
-								}
-							} else {
-								// if sender doesn't want to overwrite, ABORT the process
-								if (filerail_send_response_header(fd, ABORT) == -1) {
-									exit_status = -1;
-								}
-							}
-						} else if (response.response_type == NOT_FOUND) {
-							printf("Unable to locate %s\n", des_path);
-						} else if (response.response_type == INSUFFICIENT_SPACE) {
-							printf("Insufficient space on server\n");
-						} else if (response.response_type == OK) {
-							goto put_file;
-						} else {
-							printf("PROTOCOL NOT FOLLOWED\n");
-						}
-					}
-					printf("Done\n");
-				} else {
-					printf("%s is neither file or directory\n", res_path);
-				}
-			} else {
-				printf("You don't have read permission for %s\n", res_path);
-			}
-		} else {
-			printf("%s doesn't exists\n", res_path);
-		}
-	} else if(strcmp(operation, "get") == 0) {
-		/*
-			Client wants to download resource from server.
-			Client checks:
-			1. If there is a another resource with same resource name at destination directory on client side.
-			2. Checks if client has write permission at destination directory.
-			3. If there is no duplicate resource, client checks if destination directory exists with write permission.
-			4. If all checks pass, send GET command.
-
-			If no error occurs while transmitting GET, server will be ready for listening messages from client.
-			Client sends the resource name and destination directory of resource on server side.
-			Server performs checks and if all checks on server side pass it will send OK, else ABORT.
-
-			If OK is received, server sends the meta data about resource.
-			Client checks if there is sufficient storage available on client side, and responds OK/ABORT.
-
-			If client sends OK, download process starts.
-		*/
-
-		// res path and des path is necessary
-		if (res_path == NULL || des_path == NULL) {
-			printf("-r and -d are required options for \"%s\"\n", operation);
-			goto clean_up;
-		}
-		// parse resource path
-		if (filerail_parse_resource_path(res_path, resource_name, resource_dir)) {
-			resource_path[0] = '\0';
-			strcpy(resource_path, des_path);
-			strcat(resource_path, "/");
-			strcat(resource_path, resource_name);
-			// check if resource name already exists in destination path on client side
-			if (filerail_is_exists(resource_path, &stat_path)) {
-				// ask if the user want to overwrite
-				printf("%s already exists at %s, do you wish to re-write[Y/N]: ", resource_name, resource_dir);
-				scanf("%c", &option);
-				getchar();
-				// if user wants to overwrite
-				if (option == 'Y' || option == 'y') {
-					// check if resource is writeable
-					if (filerail_is_writeable(resource_path)) {
-						// start the get process
-						get_file:
-						if (filerail_send_command_header(fd, GET) == -1) {
-							exit_status = -1;
-							goto clean_up;
-						}
-						// request the sender for resource
-						if (filerail_send_resource_header(fd, resource_name, resource_dir, 0) == -1) {
-							exit_status = -1;
-							goto clean_up;
-						}
-						// check if sender is ready to transfer
-						if (filerail_recv_response_header(fd, &response) == -1) {
-							exit_status = -1;
-							goto clean_up;
-						}
-						if (response.response_type == OK) {
-							// if sender is OK, get the resource size from sender
-							if (filerail_recv_resource_header(fd, &resource) == -1) {
-								exit_status = -1;
-								goto clean_up;
-							}
-							// check the storage size
-							if (filerail_check_storage_size(resource.resource_size)) {
-								// if feasible send OK
-								if (filerail_send_response_header(fd, OK) == -1) {
-									exit_status = -1;
-								}
-								// and start the file transfer process, the target resource name is always <resource_name>.zip
-								strcat(resource_path, ".zip");
-								if (filerail_recvfile_handler(fd, resource_name, des_path, resource_path, ckpt_path, &K) == -1) {
-									exit_status = -1;
-								}
-							} else {
-								printf("Insufficient storage\n");
-								if (filerail_send_response_header(fd, ABORT) == -1) {
-									exit_status = -1;
-								}
-							}
-						} else if (response.response_type == NOT_FOUND) {
-							printf("Resource not found\n");
-						} else if (response.response_type == NO_ACCESS) {
-							printf("Server doesn't have read permission for %s\n", resource_dir);
-						} else if (response.response_type == BAD_RESOURCE) {
-							printf("Resource is neither file or directory\n");
-						} else {
-							printf("PROTOCOL NOT FOLLOWED\n");
-						}
-					} else {
-						printf("You don't have write permission for %s\n", des_path);
-					}
-				}
-			} else {
-				// check if resource path is not valid, check if at least resource dir (destination dir) exists
-				if (stat(des_path, &stat_path) == -1) {
-					printf("%s is invalid directory\n", des_path);
-					exit_status = -1;
-				} else {
-					// if it exists check, if des path is writeable
-					if (filerail_is_writeable(des_path)) {
-						// start the file transfer process
-						goto get_file;
-					}	else {
-						printf("You don't have write permission for %s\n", des_path);
-					}
-				}
-			}
-			printf("Done\n");
-		}
+	// a lost connection fails with EPIPE (and is reconnected), instead of killing the process
+	signal(SIGPIPE, SIG_IGN);
+	filerail_session_init(&session, -1, &K, ckpt_path);
+	session.interactive = true;
+	session.on_duplicate = session.on_resume = policy;
+	session.priority = priority;
+	// a busy server tells where in it's queue an operation waits
+	session.queued = filerail_client_queued;
+	session.queued_arg = &queued;
+	filerail_client_autotune(ip, port, &K, ckpt_path);
+
+	if (strcmp(operation, "batch") == 0) {
+		exit_status = filerail_client_batch(&session, ip, port, &retry, jobs, njobs, dedup);
+		fd = session.fd;
 	} else {
-		printf("Invalid command\n");
+		exit_status = filerail_client_run_retry(&session, ip, port, &retry, op, res_path, des_path, dedup, &outcome);
 	}
 
 	clean_up:
-	filerail_close(fd);
+	if (fd != -1) {
+		filerail_close(fd);
+	}
+	filerail_client_free_jobs(jobs, njobs);
 	if (exit_status == -1) {
 		PRINT(printf("[❌ ] FAILED\n"));
 	}
@@ -1,3 +1,6 @@
+// for SEEK_DATA/SEEK_HOLE and fallocate
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
@@ -7,7 +10,10 @@
 #include <sys/types.h>
 #include <signal.h>
 #include <errno.h>
+#include <fcntl.h>
 
+// this program holds the definitions of the library (see global.h)
+#define FILERAIL_IMPLEMENTATION
 #include "filerail/global.h"
 #include "filerail/constants.h"
 #include "filerail/protocol.h"
@@ -15,6 +21,622 @@
 #include "filerail/utils.h"
 #include "filerail/crypto.h"
 #include "filerail/operations.h"
+#include "filerail/trash.h"
+#include "filerail/reactor.h"
+#include "filerail/master.h"
+#include "filerail/mux.h"
+#include "filerail/probe.h"
+#include "filerail/shaper.h"
+#include "filerail/admission.h"
+
+// what a session needs from server configuration
+typedef struct _filerail_server_ctx {
+	const char *ckpt_path;
+	const char *cache_path;
+	uint64_t cache_budget;
+	filerail_AES_keys *K;
+	int event_workers;
+} filerail_server_ctx;
+
+// serve one command of a session
+static int filerail_serve_command(filerail_session *session, filerail_command_header *command, filerail_server_ctx *ctx) {
+	int clifd, ret, phase, exit_status;
+	bool dedup;
+	filerail_resource_header resource;
+	filerail_response_header response;
+	filerail_request_header request;
+	filerail_request_response answer;
+	filerail_archive_job job;
+	struct stat stat_path;
+	char resource_path[MAX_PATH_LENGTH];
+	const char *cache_path;
+	uint64_t cache_budget;
+
+	clifd = session->fd;
+	cache_path = ctx->cache_path;
+	cache_budget = ctx->cache_budget;
+	exit_status = 0;
+
+	if (command->command_type == PUT || command->command_type == DEDUP_PUT) {
+		/*
+			Servers wait for meta data about resource which will be uploaded.
+			Server checks:
+			1. Check if there is sufficient stoarge
+			2. Duplicate condition (inform client about this and wait for response)
+			3. Check if resource is writeable
+			4. If there are no duplicates (resource with same resource name as sent by client), check if destination
+			   directory is present and writeable.
+
+			If 2. is responded with OVERWRITE or 4. passes, upload process starts
+			(DEDUP_PUT uploads only the chunks missing in chunk store)
+		*/
+		dedup = command->command_type == DEDUP_PUT;
+
+		// receive information about resource which is about to be sent by client
+		if (filerail_recv_resource_header(clifd, &resource) == -1) {
+			exit_status = -1;
+			goto clean_up;
+		}
+		// admission, shaping, disk and packets of resource follow it's class (see priority.h)
+		filerail_session_priority(session, resource.priority);
+		resource_path[0] = '\0';
+		strcpy(resource_path, resource.resource_dir);
+		strcat(resource_path, "/");
+		strcat(resource_path, resource.resource_name);
+		// check size feasibility
+		if (filerail_check_storage_size(resource.resource_size)) {
+			// check if resource already exists
+			if (filerail_is_exists(resource_path, &stat_path)) {
+				// check if it is writeable
+				if (filerail_is_writeable(resource_path)) {
+					// inform client about duplicate resource name, at resource dir
+					if (filerail_send_response_header(clifd, DUPLICATE_RESOURCE_NAME) == -1) {
+						exit_status = -1;
+						goto clean_up;
+					}
+					// receive command, client is asking it's user
+					phase = filerail_io_phase(PROMPT_TIME_OUT);
+					ret = filerail_recv_command_header(clifd, command);
+					filerail_io_phase(phase);
+					if (ret == -1) {
+						exit_status = -1;
+						goto clean_up;
+					}
+					if (command->command_type == OVERWRITE) {
+						// if overwrite, old resource stays in place until new one is published over it (see publish.h)
+						// start transfer processs
+						put_file:
+						strcat(resource_path, ".zip");
+						if (dedup) {
+							if (
+								filerail_dedup_recvfile_handler(
+										session,
+										resource.resource_name,
+										resource.resource_dir,
+										resource_path
+								) == -1) {
+								exit_status = -1;
+							}
+						} else if (
+							filerail_recvfile_handler(
+									session,
+									resource.resource_name,
+									resource.resource_dir,
+									resource_path,
+									true
+							) == -1) {
+							exit_status = -1;
+						}
+					} else if (command->command_type == ABORT) {
+						// do nothing wait for clean up
+					} else {
+						LOG(LOG_INFO | LOG_USER, "PROTOCOL NOT FOLLOWED\n");
+					}
+				} else {
+					if (filerail_send_response_header(clifd, NO_ACCESS) == -1) {
+						exit_status = -1;
+					}
+				}
+			} else {
+				// if file doesnt exist, check if dir is accessible
+				if (stat(resource.resource_dir, &stat_path) == -1) {
+					// answered, so session can go on
+					LOG(LOG_ERR | LOG_USER, "filerail_server main stat\n");
+					if (filerail_send_response_header(clifd, NOT_FOUND) == -1) {
+						exit_status = -1;
+					}
+				} else {
+					// if dir is accessible, check if dir is writeable
+					if (filerail_is_writeable(resource.resource_dir)) {
+						if (filerail_send_response_header(clifd, OK) == -1) {
+							exit_status = -1;
+							goto clean_up;
+						}
+						goto put_file;
+					} else {
+						if (filerail_send_response_header(clifd, NO_ACCESS) == -1) {
+							exit_status = -1;
+						}
+					}
+				}
+			}
+		} else {
+			if (filerail_send_response_header(clifd, INSUFFICIENT_SPACE) == -1) {
+				exit_status = -1;
+			}
+		}
+	} else if (command->command_type == SYNC || command->command_type == MIRROR) {
+		/*
+			Client wants to bring resource on server up to date.
+			Server checks:
+			1. Check if there is sufficient storage
+			2. If resource already exists, it is the target of sync (not a duplicate), check if it is writeable
+			3. Else check if destination directory is present and writeable
+
+			If all checks pass, server sends OK and receives manifest, diffs it with local resource
+			(MIRROR also removes files which are not in manifest) and asks client only for changed files.
+		*/
+		if (filerail_recv_resource_header(clifd, &resource) == -1) {
+			exit_status = -1;
+			goto clean_up;
+		}
+		// admission, shaping, disk and packets of resource follow it's class (see priority.h)
+		filerail_session_priority(session, resource.priority);
+		resource_path[0] = '\0';
+		strcpy(resource_path, resource.resource_dir);
+		strcat(resource_path, "/");
+		strcat(resource_path, resource.resource_name);
+		if (filerail_check_storage_size(resource.resource_size)) {
+			// existing resource is the target of sync, else resource is created inside destination directory
+			if (filerail_is_exists(resource_path, &stat_path) || stat(resource.resource_dir, &stat_path) == 0) {
+				if (filerail_is_writeable(access(resource_path, F_OK) == 0 ? resource_path : resource.resource_dir)) {
+					if (filerail_send_response_header(clifd, OK) == -1) {
+						exit_status = -1;
+						goto clean_up;
+					}
+					if (
+						filerail_sync_recvfile_handler(
+							session,
+							resource.resource_name,
+							resource.resource_dir,
+							command->command_type == MIRROR
+						) == -1) {
+						exit_status = -1;
+					}
+				} else {
+					if (filerail_send_response_header(clifd, NO_ACCESS) == -1) {
+						exit_status = -1;
+					}
+				}
+			} else {
+				LOG(LOG_ERR | LOG_USER, "filerail_server main stat\n");
+				if (filerail_send_response_header(clifd, NOT_FOUND) == -1) {
+					exit_status = -1;
+				}
+			}
+		} else {
+			if (filerail_send_response_header(clifd, INSUFFICIENT_SPACE) == -1) {
+				exit_status = -1;
+			}
+		}
+	} else if (command->command_type == PING) {
+		/*
+			Server responds with PONG, so that client can check connectivity.
+		*/
+		if (filerail_send_response_header(clifd, PONG) == -1) {
+			exit_status = -1;
+		}
+	} else if (command->command_type == PROBE) {
+		/*
+			Server answers round trips and bursts of client, and sends bursts of it's own (see probe.h).
+		*/
+		if (filerail_probe_handler(session) == -1) {
+			exit_status = -1;
+		}
+	} else if(command->command_type == GET) {
+		/*
+			Server receives meta data about the resource that client needs.
+			Server checks:
+			1. Check if resource requested exists
+			2. Check if resource requested is readable
+			3. Check if resource requested is file or directory
+
+			If all test passes server sends OK, so that client prepares to receive messages.
+
+			Server sends the size of file, and starts zipping in the background (see filerail_archive_job).
+			Client checks if file size is feasible, and sends ABORT/OK.
+
+			If client sends OK, download process starts as soon as archive is ready, ABORT kills zipping.
+		*/
+		// receive the resource request from client
+		if (filerail_recv_resource_header(clifd, &resource) == -1) {
+			exit_status = -1;
+			goto clean_up;
+		}
+		// admission, shaping, disk and packets of resource follow it's class (see priority.h)
+		filerail_session_priority(session, resource.priority);
+		resource_path[0] = '\0';
+		strcpy(resource_path, resource.resource_dir);
+		strcat(resource_path, "/");
+		strcat(resource_path, resource.resource_name);
+		// check if it exists
+		if (filerail_is_exists(resource_path, &stat_path)) {
+			// check if resource requested is readable
+			if (filerail_is_readable(resource_path)) {
+				// check if resource is file or dir
+				if (filerail_is_file(&stat_path) || filerail_is_dir(&stat_path)) {
+					// archive is prepared while client checks size (repeated GETs of unchanged resource come from cache)
+					if (
+						filerail_archive_job_start(
+							&job,
+							session,
+							resource.resource_dir,
+							resource.resource_name,
+							&stat_path,
+							cache_budget != 0 ? cache_path : NULL) == -1) {
+						// resource couldn't be read
+						filerail_archive_job_cancel(&job);
+						filerail_send_response_header(clifd, NO_ACCESS);
+						exit_status = -1;
+						goto clean_up;
+					}
+					// indicate server is ready, and advertize the resource size (unzipped)
+					if (
+						filerail_send_response_header(clifd, OK) == -1 ||
+						filerail_send_resource_header(clifd, "\0", "\0", stat_path.st_size, session->priority) == -1
+					) {
+						filerail_archive_job_cancel(&job);
+						exit_status = -1;
+						goto clean_up;
+					}
+					// wait for response from client (it may ask it's user)
+					phase = filerail_io_phase(PROMPT_TIME_OUT);
+					ret = filerail_recv_response_header(clifd, &response);
+					filerail_io_phase(phase);
+					if (ret == -1) {
+						filerail_archive_job_cancel(&job);
+						exit_status = -1;
+						goto clean_up;
+					}
+					if (response.response_type == OK) {
+						// start transfer process
+						if (filerail_archive_job_send(&job, session, cache_budget, NULL) == -1) {
+							exit_status = -1;
+						}
+					} else {
+						filerail_archive_job_cancel(&job);
+						if (response.response_type != ABORT) {
+							LOG(LOG_INFO | LOG_USER, "PROTOCOL NOT FOLLOWED\n");
+						}
+					}
+				} else {
+					if (filerail_send_response_header(clifd, BAD_RESOURCE) == -1) {
+						exit_status = -1;
+					}
+				}
+			} else {
+				if (filerail_send_response_header(clifd, NO_ACCESS) == -1) {
+					exit_status = -1;
+				}
+			}
+		} else {
+			if (filerail_send_response_header(clifd, NOT_FOUND) == -1) {
+				exit_status = -1;
+			}
+		}
+	} else if (command->command_type == PIPELINED_PUT) {
+		/*
+			Same checks as PUT, but everything server would ask is in the request (see protocol.h): an existing
+			resource is overwritten if request's on_duplicate is POLICY_YES, refused with DUPLICATE_RESOURCE_NAME
+			otherwise (POLICY_ASK: client asks the user, and sends OVERWRITE or ABORT).
+			One answer, OK with offset of checkpoint or why request is refused, then archive is received.
+		*/
+		if (filerail_recv_request_header(clifd, &request) == -1) {
+			exit_status = -1;
+			goto clean_up;
+		}
+		// admission, shaping, disk and packets of request follow it's class (see priority.h)
+		filerail_session_priority(session, request.priority);
+		memset(&answer, 0, sizeof(answer));
+		answer.response_type = OK;
+		// a path cut short (dir is peer's) would be checked instead of the one named, it's archive needs .zip too
+		if (
+			(size_t)snprintf(resource_path, sizeof(resource_path), "%s/%s", request.resource_dir,
+				request.resource_name) >= sizeof(resource_path) - strlen(".zip")
+		) {
+			answer.response_type = BAD_RESOURCE;
+		} else if (!filerail_check_storage_size(request.resource_size)) {
+			answer.response_type = INSUFFICIENT_SPACE;
+		} else if (filerail_is_exists(resource_path, &stat_path)) {
+			if (!filerail_is_writeable(resource_path)) {
+				answer.response_type = NO_ACCESS;
+			} else if (request.on_duplicate != POLICY_YES) {
+				answer.response_type = DUPLICATE_RESOURCE_NAME;
+				// a retried PUT may find it's own archive in place (see publish.h)
+				filerail_published_hash(resource_path, answer.hash);
+			}
+		} else if (stat(request.resource_dir, &stat_path) == -1) {
+			answer.response_type = NOT_FOUND;
+		} else if (!filerail_is_writeable(request.resource_dir)) {
+			answer.response_type = NO_ACCESS;
+		}
+		if (answer.response_type != OK) {
+			if (filerail_send_request_response(clifd, &answer) == -1) {
+				exit_status = -1;
+				goto clean_up;
+			}
+			if (answer.response_type != DUPLICATE_RESOURCE_NAME || request.on_duplicate != POLICY_ASK) {
+				goto clean_up;
+			}
+			// client is asking it's user
+			phase = filerail_io_phase(PROMPT_TIME_OUT);
+			ret = filerail_recv_command_header(clifd, command);
+			filerail_io_phase(phase);
+			if (ret == -1) {
+				exit_status = -1;
+				goto clean_up;
+			}
+			if (command->command_type != OVERWRITE) {
+				if (command->command_type != ABORT) {
+					LOG(LOG_INFO | LOG_USER, "PROTOCOL NOT FOLLOWED\n");
+					exit_status = -1;
+				}
+				goto clean_up;
+			}
+		}
+		// old resource stays in place until new one is published over it (see publish.h)
+		snprintf(resource_path + strlen(resource_path), sizeof(resource_path) - strlen(resource_path), ".zip");
+		if (filerail_pipelined_recvfile_handler(session, &request, resource_path) == -1) {
+			exit_status = -1;
+		}
+	} else if (command->command_type == PIPELINED_GET) {
+		/*
+			Same checks as GET, request also carries storage available on client and client's checkpoint.
+			Resource is zipped (or taken from archive cache) before answering, answer carries size, hash and offset
+			of archive, and archive follows right away.
+		*/
+		if (filerail_recv_request_header(clifd, &request) == -1) {
+			exit_status = -1;
+			goto clean_up;
+		}
+		// admission, shaping, disk and packets of request follow it's class (see priority.h)
+		filerail_session_priority(session, request.priority);
+		memset(&answer, 0, sizeof(answer));
+		answer.response_type = OK;
+		// as PIPELINED_PUT, archive of resource is named after it
+		if (
+			(size_t)snprintf(resource_path, sizeof(resource_path), "%s/%s", request.resource_dir,
+				request.resource_name) >= sizeof(resource_path) - strlen(".zip")
+		) {
+			answer.response_type = NOT_FOUND;
+		} else if (!filerail_is_exists(resource_path, &stat_path)) {
+			answer.response_type = NOT_FOUND;
+		} else if (!filerail_is_readable(resource_path)) {
+			answer.response_type = NO_ACCESS;
+		} else if (!filerail_is_file(&stat_path) && !filerail_is_dir(&stat_path)) {
+			answer.response_type = BAD_RESOURCE;
+		}
+		if (answer.response_type != OK) {
+			if (filerail_send_request_response(clifd, &answer) == -1) {
+				exit_status = -1;
+			}
+			goto clean_up;
+		}
+		if (cache_budget != 0) {
+			if (
+				filerail_cached_sendfile_handler(
+					session,
+					request.resource_dir,
+					request.resource_name,
+					&stat_path,
+					cache_path,
+					cache_budget,
+					&request) == -1) {
+				exit_status = -1;
+			}
+		} else if (
+			filerail_sendfile_handler(
+				session,
+				request.resource_dir,
+				request.resource_name,
+				&stat_path,
+				NULL,
+				&request) == -1) {
+			exit_status = -1;
+		}
+	} else {
+		LOG(LOG_ERR | LOG_USER, "PROTOCOL NOT FOLLOWED\n");
+	}
+
+	clean_up:
+	// next command (or connection, on a worker thread) starts as normal
+	if (session->priority != PRIORITY_NORMAL) {
+		filerail_session_priority(session, PRIORITY_NORMAL);
+	}
+	return exit_status;
+}
+
+static int filerail_serve(int clifd, filerail_command_header *command, void *arg);
+
+// serve a stream of a multiplexed connection like a connection of it's own
+static int filerail_serve_stream(int fd, void *arg) {
+	int ret, exit_status;
+	filerail_command_header command;
+
+	exit_status = -1;
+	// stream is opened ahead of the job it serves
+	filerail_io_phase(COMMAND_TIME_OUT);
+	ret = filerail_recv_command_header(fd, &command);
+	filerail_io_phase(MAX_IO_TIME_OUT);
+	if (ret != -1) {
+		if (command.command_type == MUX) {
+			LOG(LOG_INFO | LOG_USER, "PROTOCOL NOT FOLLOWED\n");
+		} else {
+			exit_status = filerail_serve(fd, &command, arg);
+		}
+	}
+	filerail_close(fd);
+	return exit_status;
+}
+
+// serve streams opened by client concurrently (a thread per stream), until client closes the connection
+static int filerail_serve_mux(int clifd, filerail_server_ctx *ctx) {
+	int exit_status;
+	filerail_mux mux;
+
+	if (filerail_send_response_header(clifd, OK) == -1) {
+		return -1;
+	}
+	if (filerail_mux_init(&mux, clifd, filerail_serve_stream, ctx) == -1) {
+		return -1;
+	}
+	exit_status = filerail_mux_run(&mux);
+	filerail_mux_free(&mux);
+	return exit_status;
+}
+
+/*
+	Serve one connection, command is the first command sent by client.
+	After SESSION, commands are served one after another on the same connection until client sends BYE
+	(answered with FINISH). A command which fails ends the session, connection may be out of step.
+	After MUX, every stream opened by client is served as a connection (see mux.h).
+*/
+static int filerail_serve(int clifd, filerail_command_header *command, void *arg) {
+	int ret;
+	filerail_server_ctx *ctx;
+	filerail_session session;
+
+	ctx = arg;
+	filerail_session_init(&session, clifd, ctx->K, ctx->ckpt_path);
+	// client's sends are shaped by it's IP (see shaper.h)
+	filerail_shaper_peer(clifd);
+	if (command->command_type == MUX) {
+		return filerail_serve_mux(clifd, ctx);
+	}
+	if (command->command_type != SESSION) {
+		return filerail_serve_command(&session, command, ctx);
+	}
+	if (filerail_send_response_header(clifd, OK) == -1) {
+		return -1;
+	}
+	while (true) {
+		// client may take it's time between jobs of a batch
+		filerail_io_phase(COMMAND_TIME_OUT);
+		ret = filerail_recv_command_header(clifd, command);
+		filerail_io_phase(MAX_IO_TIME_OUT);
+		if (ret == -1) {
+			return -1;
+		}
+		if (command->command_type == BYE) {
+			return filerail_send_response_header(clifd, FINISH);
+		}
+		if (command->command_type == SESSION || command->command_type == MUX) {
+			LOG(LOG_INFO | LOG_USER, "PROTOCOL NOT FOLLOWED\n");
+			return -1;
+		}
+		if (filerail_serve_command(&session, command, ctx) == -1) {
+			return -1;
+		}
+	}
+}
+
+/*
+	Serve one command handed over by reactor of event mode (see reactor.h), on a worker.
+	Reactor answers SESSION, PING and BYE by itself, and hands commands of a session over one at a time.
+	After MUX, the connection is served by a process of it's own.
+*/
+static int filerail_serve_event(int clifd, filerail_command_header *command, void *arg) {
+	filerail_server_ctx *ctx;
+	filerail_session session;
+
+	ctx = arg;
+	filerail_session_init(&session, clifd, ctx->K, ctx->ckpt_path);
+	filerail_shaper_peer(clifd);
+	if (command->command_type == MUX) {
+		return filerail_serve_mux(clifd, ctx);
+	}
+	return filerail_serve_command(&session, command, ctx);
+}
+
+// serve listening socket with a process per connection, until *stop is set
+static int filerail_accept_loop(int fd, volatile sig_atomic_t *stop, void *arg) {
+	int clifd, exit_status, flags;
+	pid_t pid;
+	socklen_t addrlen;
+	struct sockaddr_in cliaddr;
+	filerail_command_header command;
+
+	exit_status = 0;
+	while (true) {
+		if (*stop) {
+			// take what is already queued on socket, then stop listening
+			if ((flags = fcntl(fd, F_GETFL)) != -1) {
+				fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+			}
+		}
+		memset(&cliaddr, 0, sizeof(cliaddr));
+		addrlen = sizeof(cliaddr);
+		// accept client
+		clifd = accept(fd, (struct sockaddr*)&cliaddr, &addrlen);
+		if (clifd == -1) {
+			if (*stop && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				break;
+			}
+			// if interrupted don't exit
+			if (errno != EINTR && errno != ECONNABORTED) {
+				LOG(LOG_ERR | LOG_USER, "filerail_server accept\n");
+				exit_status = -1;
+				break;
+			}
+			continue;
+		}
+		// print about who joined
+		filerail_who(clifd, "joined");
+
+		// fork and serve child process
+		pid = fork();
+		if (pid == -1) {
+			LOG(LOG_ERR | LOG_USER, "filerail_server fork\n");
+			filerail_close(clifd);
+			continue;
+		} else if (pid == 0) {
+			close(fd);
+			filerail_tune_socket(clifd);
+			filerail_tune_buffers(clifd);
+			filerail_tune_report(clifd, "session");
+
+			// receive the command sent by client
+			if (filerail_recv_command_header(clifd, &command) == -1) {
+				exit_status = -1;
+			} else {
+				exit_status = filerail_serve(clifd, &command, arg);
+			}
+			filerail_close(clifd);
+			if (exit_status == -1) {
+				LOG(LOG_INFO | LOG_USER, "child process, FAILED\n");
+			} else {
+				LOG(LOG_INFO | LOG_USER, "child process, SUCCESS\n");
+			}
+			_exit(exit_status == -1 ? 1 : 0);
+		} else {
+			// parent doesn't need the client socket
+			filerail_close(clifd);
+		}
+	}
+	filerail_close(fd);
+	return exit_status;
+}
+
+// serve listening socket in configured mode: event mode (see reactor.h) or a process per connection
+static int filerail_listen_and_serve(int fd, volatile sig_atomic_t *stop, void *arg) {
+	filerail_server_ctx *ctx;
+
+	ctx = arg;
+	if (ctx->event_workers > 0) {
+		return filerail_reactor_run(fd, ctx->event_workers, filerail_serve_event, arg, stop);
+	}
+	return filerail_accept_loop(fd, stop, arg);
+}
 
 // read the exit status to prevent zombies
 static void handler(int signum) {
@@ -31,29 +653,31 @@ int main(int argc, char *argv[]) {
 	extern char *optarg;
 	extern int optopt;
 	bool should_resolve;
-	char *ip, *port, *key_path, *ckpt_path;
+	char *ip, *port, *key_path, *ckpt_path, *limits_path;
+	uint64_t cache_budget, delete_rate;
+	int event_workers, nworkers;
+	bool pin;
 
 	// logging related variables
 	extern int verbose;
 	extern int is_server;
 
 	// socket related variables and exit_status
-	int fd, clifd, exit_status;
+	int fd, exit_status;
 	pid_t pid, sid;
-	socklen_t addrlen;
-	struct sockaddr_in cliaddr;
+	ssize_t len;
+	char self_path[MAX_PATH_LENGTH];
 
 	// get/put related variables
-	filerail_command_header command;
-	filerail_resource_header resource;
-	filerail_response_header response;
 	filerail_AES_keys K;
+	filerail_server_ctx ctx;
 	struct stat stat_path;
-	char resource_path[MAX_PATH_LENGTH];
+	char cache_path[MAX_PATH_LENGTH], trash_path[MAX_PATH_LENGTH];
 
 	// signal related
 	struct sigaction act;
 
+	fd = -1;
 	// register for SIGCHLD
 	memset(&act, 0, sizeof(act));
 	act.sa_handler = &handler;
@@ -65,16 +689,27 @@ int main(int argc, char *argv[]) {
 	exit_status = 0;
 	should_resolve = false;
 	is_server = 1;
+	cache_budget = (uint64_t)ARCHIVE_CACHE_BUDGET << 20;
+	delete_rate = TRASH_DELETE_RATE;
+	event_workers = 0;
+	nworkers = -1;
+	pin = false;
 
 	// parse command line arguement
-	ip = port = key_path = ckpt_path = NULL;
-	while ((opt = getopt(argc, argv, "uvqi:p:k:m:c:n")) != -1) {
+	ip = port = key_path = ckpt_path = limits_path = NULL;
+	while ((opt = getopt(argc, argv, "uvqi:p:k:m:c:nC:S:T:e:w:at:L:A:")) != -1) {
 		switch(opt) {
 			case 'u' : {
 				printf(
 					"usage: -v [-i ipv4 address]"
 					" [-p port] [-k key file]"
-					" [-c checkpoint directory] [-n dns resolution]\n");
+					" [-c checkpoint directory] [-n dns resolution]"
+					" [-C archive cache budget in MB] [-S chunk store budget in MB]"
+					" [-T trash delete rate in entries/sec]"
+					" [-e event mode with n session workers]"
+					" [-w n acceptors, 0 is one per core] [-a pin acceptors to cores]"
+					" [-t tcp tuning key=value] [-L bandwidth limits file]"
+					" [-A admission limit phase=n]\n");
 				goto parent_clean_up;
 			}
 			case 'v': {
@@ -105,8 +740,53 @@ int main(int argc, char *argv[]) {
 				should_resolve = true;
 				break;
 			}
+			case 'C' : {
+				cache_budget = (uint64_t)strtoull(optarg, NULL, 10) << 20;
+				break;
+			}
+			case 'S' : {
+				chunkstore_budget = (uint64_t)strtoull(optarg, NULL, 10) << 20;
+				break;
+			}
+			case 'T' : {
+				delete_rate = strtoull(optarg, NULL, 10);
+				break;
+			}
+			case 'e' : {
+				event_workers = atoi(optarg);
+				break;
+			}
+			case 'w' : {
+				nworkers = atoi(optarg);
+				break;
+			}
+			case 'a' : {
+				pin = true;
+				break;
+			}
+			case 't' : {
+				if (filerail_tuning_set(optarg) == -1) {
+					printf("Invalid tuning %s\n", optarg);
+					goto parent_clean_up;
+				}
+				break;
+			}
+			case 'L' : {
+				limits_path = optarg;
+				break;
+			}
+			case 'A' : {
+				if (filerail_admission_set(optarg) == -1) {
+					printf("Invalid admission limit %s\n", optarg);
+					goto parent_clean_up;
+				}
+				break;
+			}
 			case '?' : {
-				if (optopt == 'i' || optopt == 'p' || optopt == 'k' || optopt == 'c') {
+				if (
+					optopt == 'i' || optopt == 'p' || optopt == 'k' || optopt == 'c' || optopt == 'C' || optopt == 'S' ||
+					optopt == 'T' || optopt == 'e' || optopt == 'w' || optopt == 't' || optopt == 'L' || optopt == 'A'
+				) {
 					printf("-%c option requires value\n", optopt);
 					goto parent_clean_up;
 				} else {
@@ -147,6 +827,47 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
+	// archive cache for GETs (budget 0 disables it)
+	if (cache_budget != 0 && filerail_cache_init(ckpt_path, cache_path) == -1) {
+		printf("Failed to create archive cache at %s/%s\n", ckpt_path, ARCHIVE_CACHE_DIR);
+		exit_status = -1;
+		goto parent_clean_up;
+	}
+
+	// overwritten resources are moved here, and removed in background
+	if (filerail_trash_init(ckpt_path, trash_path) == -1) {
+		printf("Failed to create trash at %s/%s\n", ckpt_path, TRASH_DIR);
+		exit_status = -1;
+		goto parent_clean_up;
+	}
+
+	// bandwidth limits, shared by every process serving clients (see shaper.h)
+	if (limits_path != NULL && filerail_shaper_init(limits_path) == -1) {
+		printf("Invalid limits file %s\n", limits_path);
+		exit_status = -1;
+		goto parent_clean_up;
+	}
+
+	// queues of heavy phases, shared by every process serving clients (see admission.h)
+	if (filerail_admission_init() == -1) {
+		exit_status = -1;
+		goto parent_clean_up;
+	}
+
+	ctx.ckpt_path = ckpt_path;
+	ctx.cache_path = cache_path;
+	ctx.cache_budget = cache_budget;
+	ctx.K = &K;
+	ctx.event_workers = event_workers;
+
+	// graceful restart executes the binary again, it may be replaced by then
+	if ((len = readlink("/proc/self/exe", self_path, sizeof(self_path) - 1)) == -1) {
+		LOG(LOG_ERR | LOG_USER, "filerail_server readlink\n");
+		exit_status = -1;
+		goto parent_clean_up;
+	}
+	self_path[len] = '\0';
+
 	// dns resolution if option provided
 	if (should_resolve && (filerail_dns_resolve(ip) == -1)) {
 		goto parent_clean_up;
@@ -183,243 +904,40 @@ int main(int argc, char *argv[]) {
 	close(STDOUT_FILENO);
 	close(STDERR_FILENO);
 
-	// start the server
-	if ((fd = filerail_create_tcp_server(ip, port)) == -1) {
+	// start emptying trash (also picks up whatever a previous run left)
+	if (filerail_trash_start(trash_path, delete_rate) == -1) {
 		exit_status = -1;
 		goto parent_clean_up;
 	}
 
-	while (true) {
-		memset(&cliaddr, 0, sizeof(cliaddr));
-		// accept client
-		clifd = filerail_accept(fd, (struct sockaddr*)&cliaddr, &addrlen);
-		if (clifd == -1) {
-			// if interrupted don't exit
-			if (errno != EINTR) {
-				exit_status = -1;
-				goto parent_clean_up;
-			}
-			continue;
-		}
-		// print about who joined
-		if (filerail_who(clifd, "joined") == -1) {
-			exit_status = -1;
-			goto parent_clean_up;
-		}
-
-		// fork and serve child process
-		pid = fork();
-		if (pid == -1) {
-			LOG(LOG_ERR | LOG_USER, "filerail_server fork\n");
-			exit_status = -1;
-			goto parent_clean_up;
-		} else if (pid == 0) {
-			close(fd);
-
-			// receive the command sent by client
-			if (filerail_recv_command_header(clifd, &command) == -1) {
-				exit_status = -1;
-				goto child_clean_up;
-			}
-
-			if (command.command_type == PUT) {
-				/*
-					Servers wait for meta data about resource which will be uploaded.
-					Server checks:
-					1. Check if there is sufficient stoarge
-					2. Duplicate condition (inform client about this and wait for response)
-					3. Check if resource is writeable
-					4. If there are no duplicates (resource with same resource name as sent by client), check if destination
-					   directory is present and writeable.
+	// multi worker mode: n acceptors on their own SO_REUSEPORT listeners, SIGHUP restarts gracefully (see master.h)
+	if (nworkers >= 0) {
+		exit_status = filerail_master_run(ip, port, nworkers, pin, filerail_listen_and_serve, &ctx, self_path, argv);
+		goto parent_clean_up;
+	}
 
-					If 2. is responded with OVERWRITE or 4. passes, upload process starts
-				*/
+	// start the server
+	if ((fd = filerail_create_tcp_server(ip, port)) == -1) {
+		exit_status = -1;
+		goto parent_clean_up;
+	}
+	filerail_master_ready();
 
-				// receive information about resource which is about to be sent by client
-				if (filerail_recv_resource_header(clifd, &resource) == -1) {
-					exit_status = -1;
-					goto child_clean_up;
-				}
-				resource_path[0] = '\0';
-				strcpy(resource_path, resource.resource_dir);
-				strcat(resource_path, "/");
-				strcat(resource_path, resource.resource_name);
-				// check size feasibility
-				if (filerail_check_storage_size(resource.resource_size)) {
-					// check if resource already exists
-					if (filerail_is_exists(resource_path, &stat_path)) {
-						// check if it is writeable
-						if (filerail_is_writeable(resource_path)) {
-							// inform client about duplicate resource name, at resource dir
-							if (filerail_send_response_header(clifd, DUPLICATE_RESOURCE_NAME) == -1) {
-								exit_status = -1;
-								goto child_clean_up;
-							}
-							// receive command
-							if (filerail_recv_command_header(clifd, &command) == -1) {
-								exit_status = -1;
-								goto child_clean_up;
-							}
-							if (command.command_type == OVERWRITE) {
-								// if overwrite (remove old resource)
-								if (filerail_rm(resource_path) == -1) {
-									exit_status = -1;
-									goto child_clean_up;
-								}
-								// start transfer processs
-								put_file:
-								strcat(resource_path, ".zip");
-								if (
-									filerail_recvfile_handler(
-											clifd,
-											resource.resource_name,
-											resource.resource_dir,
-											resource_path,
-											ckpt_path,
-											&K
-									) == -1) {
-									exit_status = -1;
-								}
-							} else if (command.command_type == ABORT) {
-								// do nothing wait for clean up
-							} else {
-								LOG(LOG_INFO | LOG_USER, "PROTOCOL NOT FOLLOWED\n");
-							}
-						} else {
-							if (filerail_send_response_header(clifd, NO_ACCESS) == -1) {
-								exit_status = -1;
-							}
-						}
-					} else {
-						// if file doesnt exist, check if dir is accessible
-						if (stat(resource.resource_dir, &stat_path) == -1) {
-							exit_status = -1;
-							LOG(LOG_ERR | LOG_USER, "filerail_server main stat\n");
-							if (filerail_send_response_header(clifd, NOT_FOUND) == -1) {
-								exit_status = -1;
-							}
-						} else {
-							// if dir is accessible, check if dir is writeable
-							if (filerail_is_writeable(resource.resource_dir)) {
-								if (filerail_send_response_header(clifd, OK) == -1) {
-									exit_status = -1;
-									goto child_clean_up;
-								}
-								goto put_file;
-							} else {
-								if (filerail_send_response_header(clifd, NO_ACCESS) == -1) {
-									exit_status = -1;
-								}
-							}
-						}
-					}
-				} else {
-					if (filerail_send_response_header(clifd, INSUFFICIENT_SPACE) == -1) {
-						exit_status = -1;
-					}
-				}
-			} else if (command.command_type == PING) {
-				/*
-					Server responds with PONG, so that client can check connectivity.
-				*/
-				if (filerail_send_response_header(clifd, PONG) == -1) {
-					exit_status = -1;
-				}
-			} else if(command.command_type == GET) {
-				/*
-					Server receives meta data about the resource that client needs.
-					Server checks:
-					1. Check if resource requested exists
-					2. Check if resource requested is readable
-					3. Check if resource requested is file or directory
-
-					If all test passes server sends OK, so that client prepares to receive messages.
-
-					Server sends the size of file.
-					Client checks if file size is feasible, and sends ABORT/OK.
-
-					If client sends OK, download process starts.
-				*/
-				// receive the resource request from client
-				if (filerail_recv_resource_header(clifd, &resource) == -1) {
-					exit_status = -1;
-					goto child_clean_up;
-				}
-				resource_path[0] = '\0';
-				strcpy(resource_path, resource.resource_dir);
-				strcat(resource_path, "/");
-				strcat(resource_path, resource.resource_name);
-				// check if it exists
-				if (filerail_is_exists(resource_path, &stat_path)) {
-					// check if resource requested is readable
-					if (filerail_is_readable(resource_path)) {
-						// check if resource is file or dir
-						if (filerail_is_file(&stat_path) || filerail_is_dir(&stat_path)) {
-							// indicate server is ready
-							if (filerail_send_response_header(clifd, OK) == -1) {
-								exit_status = -1;
-							}
-							// advertize the resource size (unzipped)
-							if (filerail_send_resource_header(clifd, "\0", "\0", stat_path.st_size) == -1) {
-								exit_status = -1;
-								goto child_clean_up;
-							}
-							// wait for response from client
-							if (filerail_recv_response_header(clifd, &response) == -1) {
-								exit_status = -1;
-								goto child_clean_up;
-							}
-							if (response.response_type == ABORT) {
-								// do nothing wait for clean up
-							} else if (response.response_type == OK) {
-								// start transfer process
-								if (
-									filerail_sendfile_handler(
-										clifd,
-										resource.resource_dir,
-										resource.resource_name,
-										&stat_path,
-										ckpt_path,
-										&K) == -1) {
-									exit_status = -1;
-								}
-							} else {
-								LOG(LOG_INFO | LOG_USER, "PROTOCOL NOT FOLLOWED\n");
-							}
-						} else {
-							if (filerail_send_response_header(clifd, BAD_RESOURCE) == -1) {
-								exit_status = -1;
-							}
-						}
-					} else {
-						if (filerail_send_response_header(clifd, NO_ACCESS) == -1) {
-							exit_status = -1;
-						}
-					}
-				} else {
-					if (filerail_send_response_header(clifd, NOT_FOUND) == -1) {
-						exit_status = -1;
-					}
-				}
-			} else {
-				LOG(LOG_ERR | LOG_USER, "PROTOCOL NOT FOLLOWED\n");
-			}
-			child_clean_up:
-			filerail_close(clifd);
-			if (exit_status == -1) {
-				LOG(LOG_INFO | LOG_USER, "child process, FAILED\n");
-			} else {
-				LOG(LOG_INFO | LOG_USER, "child process, SUCCESS\n");
-			}
-			return exit_status;
-		} else {
-			// parent doesn't need the client socket
-			filerail_close(clifd);
-		}
+	// SIGTERM stops accepting, sessions in flight complete
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = &filerail_master_signal;
+	if (sigaction(SIGTERM, &act, NULL) < 0) {
+		LOG(LOG_ERR | LOG_USER, "sigaction");
+		exit_status = -1;
+		goto parent_clean_up;
 	}
+	exit_status = filerail_listen_and_serve(fd, &filerail_master_stop, &ctx);
+	fd = -1;
 
 	parent_clean_up:
-	filerail_close(fd);
+	if (fd != -1) {
+		filerail_close(fd);
+	}
 	if (exit_status == -1) {
 		LOG(LOG_INFO | LOG_USER, "parent process, FAILED\n");
 	} else {